@@ -12,6 +12,7 @@
 #include "util.h"
 #include "hash.h"
 #include "translate.h"
+#include "profile.h"
 
 #include <cstdlib>
 #include <fstream>
@@ -35,7 +36,7 @@ using namespace std;
 /* Adjust and run make_cmd to build a kernel module. */
 static int
 run_make_cmd(systemtap_session& s, vector<string>& make_cmd,
-             bool null_out=false, bool null_err=false)
+             const string& what, bool null_out=false, bool null_err=false)
 {
   assert_no_interrupts();
 
@@ -58,10 +59,15 @@ run_make_cmd(systemtap_session& s, vector<string>& make_cmd,
       make_cmd.push_back("--no-print-directory");
     }
 
-  // Exploit SMP parallelism, if available.
-  long smp = sysconf(_SC_NPROCESSORS_ONLN);
-  if (smp >= 1)
-    make_cmd.push_back("-j" + lex_cast(smp+1));
+  // Exploit SMP parallelism, if available, or as many jobs as requested.
+  if (s.build_jobs > 0)
+    make_cmd.push_back("-j" + lex_cast(s.build_jobs));
+  else
+    {
+      long smp = sysconf(_SC_NPROCESSORS_ONLN);
+      if (smp >= 1)
+        make_cmd.push_back("-j" + lex_cast(smp+1));
+    }
 
   if (strverscmp (s.kernel_base_release.c_str(), "2.6.29") < 0)
     {
@@ -71,7 +77,9 @@ run_make_cmd(systemtap_session& s, vector<string>& make_cmd,
       null_out = true;
     }
 
+  profile_timer pt (s.profile, "make", what);
   int rc = stap_system (s.verbose, "kbuild", make_cmd, null_out, null_err);
+  pt.stop ();
   if (rc != 0)
     s.set_try_server ();
   return rc;
@@ -300,6 +308,7 @@ compile_pass (systemtap_session& s)
   output_autoconf(s, o, "autoconf-x86-uniregs.c", "STAPCONF_X86_UNIREGS", NULL);
   output_autoconf(s, o, "autoconf-nameidata.c", "STAPCONF_NAMEIDATA_CLEANUP", NULL);
   output_dual_exportconf(s, o, "unregister_kprobes", "unregister_kretprobes", "STAPCONF_UNREGISTER_KPROBES");
+  output_dual_exportconf(s, o, "register_kprobes", "register_kretprobes", "STAPCONF_REGISTER_KPROBES");
   output_autoconf(s, o, "autoconf-kprobe-symbol-name.c", "STAPCONF_KPROBE_SYMBOL_NAME", NULL);
   output_autoconf(s, o, "autoconf-real-parent.c", "STAPCONF_REAL_PARENT", NULL);
   output_autoconf(s, o, "autoconf-uaccess.c", "STAPCONF_LINUX_UACCESS_H", NULL);
@@ -476,7 +485,7 @@ compile_pass (systemtap_session& s)
 
   // Run make
   vector<string> make_cmd = make_make_cmd(s, s.tmpdir);
-  rc = run_make_cmd(s, make_cmd);
+  rc = run_make_cmd(s, make_cmd, "module");
   if (rc)
     s.set_try_server ();
   return rc;
@@ -542,7 +551,7 @@ make_uprobes (systemtap_session& s)
 
   // make the module
   vector<string> make_cmd = make_make_cmd(s, dir);
-  int rc = run_make_cmd(s, make_cmd);
+  int rc = run_make_cmd(s, make_cmd, "uprobes");
   if (!rc && !copy_file(dir + "/Module.symvers",
                         s.tmpdir + "/Module.symvers"))
     rc = -1;
@@ -679,6 +688,15 @@ make_run_command (systemtap_session& s, const string& remotedir,
   if (s.suppress_warnings)
     staprun_cmd.push_back("-w");
 
+  if (s.lazy_symbols)
+    staprun_cmd.push_back("-y");
+
+  if (!s.hist_format.empty())
+    {
+      staprun_cmd.push_back("-H");
+      staprun_cmd.push_back(s.hist_format);
+    }
+
   if (!s.output_file.empty())
     {
       staprun_cmd.push_back("-o");
@@ -727,6 +745,8 @@ make_run_command (systemtap_session& s, const string& remotedir,
     {
       staprun_cmd.push_back("-S");
       staprun_cmd.push_back(s.size_option);
+      if (s.output_segments)
+        staprun_cmd.push_back("-P");
     }
 
   staprun_cmd.push_back((remotedir.empty() ? s.tmpdir : remotedir)
@@ -799,7 +819,7 @@ make_tracequeries(systemtap_session& s, const map<string,string>& contents)
   vector<string> make_cmd = make_make_objs_cmd(s, dir);
   make_cmd.push_back ("-i"); // ignore errors, give rc 0 even in case of tracepoint header nits
   bool quiet = (s.verbose < 4);
-  int rc = run_make_cmd(s, make_cmd, quiet, quiet);
+  int rc = run_make_cmd(s, make_cmd, "tracequery", quiet, quiet);
   if (rc)
     s.set_try_server ();
 
@@ -862,7 +882,7 @@ make_typequery_kmod(systemtap_session& s, const vector<string>& headers, string&
   // make the module
   vector<string> make_cmd = make_make_cmd(s, dir);
   bool quiet = (s.verbose < 4);
-  int rc = run_make_cmd(s, make_cmd, quiet, quiet);
+  int rc = run_make_cmd(s, make_cmd, "typequery", quiet, quiet);
   if (rc)
     s.set_try_server ();
   return rc;
@@ -36,6 +36,7 @@ struct option stap_long_options[] = {
   { "all-modules", 0, NULL, LONG_OPT_ALL_MODULES },
   { "remote", 1, NULL, LONG_OPT_REMOTE },
   { "remote-prefix", 0, NULL, LONG_OPT_REMOTE_PREFIX },
+  { "remote-compress", 0, NULL, LONG_OPT_REMOTE_COMPRESS },
   { "check-version", 0, NULL, LONG_OPT_CHECK_VERSION },
   { "version", 0, NULL, LONG_OPT_VERSION },
   { "tmpdir", 1, NULL, LONG_OPT_TMPDIR },
@@ -54,5 +55,12 @@ struct option stap_long_options[] = {
   { "suppress-time-limits", 0, NULL, LONG_OPT_SUPPRESS_TIME_LIMITS },
   { "runtime", 1, NULL, LONG_OPT_RUNTIME },
   { "dyninst", 0, NULL, LONG_OPT_RUNTIME_DYNINST },
+  { "build-jobs", 1, NULL, LONG_OPT_BUILD_JOBS },
+  { "lazy-symbols", 0, NULL, LONG_OPT_LAZY_SYMBOLS },
+  { "hist-format", 1, NULL, LONG_OPT_HIST_FORMAT },
+  { "profile", 2, NULL, LONG_OPT_PROFILE },
+  { "server-worker", 1, NULL, LONG_OPT_SERVER_WORKER },
+  { "index-threads", 1, NULL, LONG_OPT_INDEX_THREADS },
+  { "output-segments", 0, NULL, LONG_OPT_OUTPUT_SEGMENTS },
   { NULL, 0, NULL, 0 }
 };
@@ -53,6 +53,14 @@ enum {
   LONG_OPT_SUPPRESS_TIME_LIMITS,
   LONG_OPT_RUNTIME,
   LONG_OPT_RUNTIME_DYNINST,
+  LONG_OPT_REMOTE_COMPRESS,
+  LONG_OPT_BUILD_JOBS,
+  LONG_OPT_LAZY_SYMBOLS,
+  LONG_OPT_HIST_FORMAT,
+  LONG_OPT_PROFILE,
+  LONG_OPT_SERVER_WORKER,
+  LONG_OPT_INDEX_THREADS,
+  LONG_OPT_OUTPUT_SEGMENTS,
 };
 
 // NB: when adding new options, consider very carefully whether they
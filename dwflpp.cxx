@@ -23,6 +23,7 @@
 #include "hash.h"
 #include "rpm_finder.h"
 #include "setupdwfl.h"
+#include "profile.h"
 
 #include <cstdlib>
 #include <algorithm>
@@ -50,6 +51,8 @@ extern "C" {
 #include <fnmatch.h>
 #include <stdio.h>
 #include <sys/types.h>
+#include <sys/time.h>
+#include <pthread.h>
 
 #include "loc2c.h"
 #define __STDC_FORMAT_MACROS
@@ -106,6 +109,7 @@ dwflpp::~dwflpp()
   delete_map(module_cu_cache);
   delete_map(cu_function_cache);
   delete_map(mod_function_cache);
+  delete_map(mod_function_index);
   delete_map(cu_inl_function_cache);
   delete_map(global_alias_cache);
   delete_map(cu_die_parent_cache);
@@ -413,6 +417,8 @@ dwflpp::iterate_over_cus (int (*callback)(Dwarf_Die * die, void * arg),
   Dwarf *dw = module_dwarf;
   if (!dw) return;
 
+  profile_timer pt (sess.profile, "dwflpp", module_name);
+
   vector<Dwarf_Die>* v = module_cu_cache[dw];
   if (v == 0)
     {
@@ -858,51 +864,62 @@ dwflpp::global_alias_caching_callback(Dwarf_Die *die, bool has_inner_types,
   return DWARF_CB_OK;
 }
 
-int
-dwflpp::global_alias_caching_callback_cus(Dwarf_Die *die, void *arg)
+cu_type_cache_t *
+dwflpp::get_global_alias_cache(Dwarf_Die *cu)
 {
-  mod_cu_type_cache_t *global_alias_cache;
-  global_alias_cache = &static_cast<dwflpp *>(arg)->global_alias_cache;
+  cu_type_cache_t *v = global_alias_cache[cu->addr];
+  if (sess.profile)
+    sess.profile->cache_lookup ("dwflpp", module_name,
+                                "global_alias_cache", v != 0);
+  if (v == 0) // need to build the cache, just once per encountered module/cu
+    {
+      v = new cu_type_cache_t;
+      global_alias_cache[cu->addr] = v;
+      iterate_over_globals(cu, global_alias_caching_callback, v);
+      if (sess.verbose > 4)
+        clog << _F("global alias cache %s:%s size %zu", module_name.c_str(),
+                   (dwarf_diename(cu) ?: "<unknown source>"), v->size()) << endl;
+    }
+  return v;
+}
 
-  cu_type_cache_t *v = (*global_alias_cache)[die->addr];
-  if (v != 0)
+int
+dwflpp::global_alias_searching_callback_cus(Dwarf_Die *die, void *arg)
+{
+  global_alias_search *search = static_cast<global_alias_search *>(arg);
+  cu_type_cache_t *v = search->dw->get_global_alias_cache(die);
+  cu_type_cache_t::iterator it = v->find(*search->name);
+  if (it == v->end())
     return DWARF_CB_OK;
 
-  v = new cu_type_cache_t;
-  (*global_alias_cache)[die->addr] = v;
-  iterate_over_globals(die, global_alias_caching_callback, v);
-
-  return DWARF_CB_OK;
+  search->found = &it->second;
+  return DWARF_CB_ABORT;
 }
 
 Dwarf_Die *
 dwflpp::declaration_resolve_other_cus(const string& name)
 {
-  iterate_over_cus(global_alias_caching_callback_cus, this, true);
+  // Try the CUs already cached before reading any more of them.
   for (mod_cu_type_cache_t::iterator i = global_alias_cache.begin();
          i != global_alias_cache.end(); ++i)
     {
       cu_type_cache_t *v = (*i).second;
-      if (v->find(name) != v->end())
-        return & ((*v)[name]);
+      cu_type_cache_t::iterator it = v->find(name);
+      if (it != v->end())
+        return &it->second;
     }
 
-  return NULL;
+  // Then cache the rest in order, but only as far as the first one
+  // that defines the name.
+  global_alias_search search = { this, &name, NULL };
+  iterate_over_cus(global_alias_searching_callback_cus, &search, true);
+  return search.found;
 }
 
 Dwarf_Die *
 dwflpp::declaration_resolve(const string& name)
 {
-  cu_type_cache_t *v = global_alias_cache[cu->addr];
-  if (v == 0) // need to build the cache, just once per encountered module/cu
-    {
-      v = new cu_type_cache_t;
-      global_alias_cache[cu->addr] = v;
-      iterate_over_globals(cu, global_alias_caching_callback, v);
-      if (sess.verbose > 4)
-        clog << _F("global alias cache %s:%s size %zu", module_name.c_str(),
-                   cu_name().c_str(), v->size()) << endl;
-    }
+  cu_type_cache_t *v = get_global_alias_cache(cu);
 
   // XXX: it may be desirable to search other modules' declarations
   // too, in case a module/shared-library processes a
@@ -948,15 +965,13 @@ dwflpp::mod_function_caching_callback (Dwarf_Die* cu, void *arg)
 }
 
 
-int
-dwflpp::iterate_over_functions (int (* callback)(Dwarf_Die * func, base_query * q),
-                                base_query * q, const string& function)
+cu_function_cache_t*
+dwflpp::get_cu_function_cache (Dwarf_Die* cu)
 {
-  int rc = DWARF_CB_OK;
-  assert (module);
-  assert (cu);
-
   cu_function_cache_t *v = cu_function_cache[cu->addr];
+  if (sess.profile)
+    sess.profile->cache_lookup ("dwflpp", module_name,
+                                "cu_function_cache", v != 0);
   if (v == 0)
     {
       v = new cu_function_cache_t;
@@ -964,9 +979,135 @@ dwflpp::iterate_over_functions (int (* callback)(Dwarf_Die * func, base_query *
       dwarf_getfuncs (cu, cu_function_caching_callback, v, 0);
       if (sess.verbose > 4)
         clog << _F("function cache %s:%s size %zu", module_name.c_str(),
-                   cu_name().c_str(), v->size()) << endl;
+                   (dwarf_diename(cu) ?: "<unknown source>"), v->size()) << endl;
       mod_info->update_symtab(v);
     }
+  return v;
+}
+
+
+int
+dwflpp::function_index_callback (Dwarf_Die* cu, void *arg)
+{
+  dwflpp *dw = static_cast<dwflpp*>(arg);
+  function_name_index *index = dw->mod_function_index[dw->module_dwarf];
+  cu_function_cache_t *v = dw->get_cu_function_cache(cu);
+
+  for (cu_function_cache_t::iterator it = v->begin(); it != v->end(); ++it)
+    {
+      if (pending_interrupts) return DWARF_CB_ABORT;
+      function_index_entry entry;
+      entry.name = it->first;
+      entry.cu = cu->addr;
+      entry.die = it->second;
+      index->names.push_back(entry);
+
+      // Read each linkage name just once, rather than again for every
+      // CU and every "_Z" pattern.
+      const char *linkage_name = dwarf_linkage_name (&entry.die);
+      if (linkage_name)
+        {
+          entry.name = linkage_name;
+          index->linkage_names.push_back(entry);
+        }
+    }
+  return DWARF_CB_OK;
+}
+
+
+function_name_index*
+dwflpp::get_function_index ()
+{
+  assert (module_dwarf);
+  function_name_index *index = mod_function_index[module_dwarf];
+  if (index)
+    return index;
+
+  struct timeval tv_before, tv_after;
+  gettimeofday (&tv_before, NULL);
+
+  index = new function_name_index;
+  mod_function_index[module_dwarf] = index;
+  iterate_over_cus (function_index_callback, this, false);
+  assert_no_interrupts();
+  sort (index->names.begin(), index->names.end());
+  sort (index->linkage_names.begin(), index->linkage_names.end());
+
+  gettimeofday (&tv_after, NULL);
+  if (sess.verbose > 0)
+    clog << _F("function index %s: %zu names, %zu linkage names in %ld ms",
+               module_name.c_str(), index->names.size(), index->linkage_names.size(),
+               (long) ((tv_after.tv_sec - tv_before.tv_sec) * 1000 +
+                       ((long)tv_after.tv_usec - (long)tv_before.tv_usec) / 1000))
+         << endl;
+  return index;
+}
+
+
+// The function index only pays for itself once a second CU of the module
+// looks for a wildcard or "_Z" pattern.  A query confined to one CU, like
+// function("*@fs/open.c"), is better off walking just that CU.  Setting
+// SYSTEMTAP_NO_FUNCTION_INDEX always walks the CUs, for comparison.
+bool
+dwflpp::use_function_index ()
+{
+  static bool disabled = getenv ("SYSTEMTAP_NO_FUNCTION_INDEX") != NULL;
+  if (disabled)
+    return false;
+
+  mod_function_index_t::const_iterator index = mod_function_index.find(module_dwarf);
+  if (index != mod_function_index.end() && index->second)
+    return true;
+
+  pair<map<Dwarf*, void*>::iterator, bool> first =
+    mod_function_index_first_cu.insert(make_pair(module_dwarf, cu->addr));
+  return !first.second && first.first->second != cu->addr;
+}
+
+
+const vector<Dwarf_Die>*
+dwflpp::function_index_matches (const string& pattern, bool linkage)
+{
+  function_name_index *index = get_function_index();
+  map<string, cu_function_matches_t>::iterator found = index->matches.find(pattern);
+  if (found == index->matches.end())
+    {
+      // Only names starting with the pattern's literal prefix can match,
+      // and those are all next to each other in the sorted index.
+      string prefix = pattern.substr(0, pattern.find_first_of("*?[\\"));
+      const vector<function_index_entry>& names =
+        linkage ? index->linkage_names : index->names;
+      function_index_entry key;
+      key.name = prefix;
+
+      cu_function_matches_t& matches = index->matches[pattern];
+      for (vector<function_index_entry>::const_iterator it =
+             lower_bound(names.begin(), names.end(), key);
+           it != names.end() && startswith(it->name, prefix.c_str()); ++it)
+        {
+          assert_no_interrupts();
+          if (function_name_matches_pattern (it->name, pattern))
+            matches[it->cu].push_back(it->die);
+        }
+      found = index->matches.find(pattern);
+    }
+
+  cu_function_matches_t::const_iterator cu_matches = found->second.find(cu->addr);
+  if (cu_matches == found->second.end())
+    return NULL;
+  return &cu_matches->second;
+}
+
+
+int
+dwflpp::iterate_over_functions (int (* callback)(Dwarf_Die * func, base_query * q),
+                                base_query * q, const string& function)
+{
+  int rc = DWARF_CB_OK;
+  assert (module);
+  assert (cu);
+
+  cu_function_cache_t *v = get_cu_function_cache(cu);
 
   cu_function_cache_t::iterator it;
   cu_function_cache_range_t range = v->equal_range(function);
@@ -982,43 +1123,51 @@ dwflpp::iterate_over_functions (int (* callback)(Dwarf_Die * func, base_query *
           if (rc != DWARF_CB_OK) break;
         }
     }
-  else if (startswith(function, "_Z"))
+  else if (startswith(function, "_Z") || name_has_wildcard (function))
     {
       // C++ names are mangled starting with a "_Z" prefix.  Most of the time
       // we can discover the mangled name from a die's MIPS_linkage_name
-      // attribute, so we read that to match against the user's function
-      // pattern.  Note that this isn't perfect, as not all will have that
-      // attribute (notably ctors and dtors), but we do what we can...
-      for (it = v->begin(); it != v->end(); ++it)
+      // attribute, so we match that against the user's function pattern.
+      // Note that this isn't perfect, as not all will have that attribute
+      // (notably ctors and dtors), but we do what we can...
+      //
+      // Once the module's index is built, each pattern is matched once
+      // against it, and the results kept per CU, so the other CUs just
+      // look theirs up.  Until then, the CU's own functions are walked.
+      bool linkage = startswith(function, "_Z");
+      if (!use_function_index ())
         {
-          if (pending_interrupts) return DWARF_CB_ABORT;
-          Dwarf_Die& die = it->second;
-          const char* linkage_name = NULL;
-          if ((linkage_name = dwarf_linkage_name (&die))
-              && function_name_matches_pattern (linkage_name, function))
+          for (it = v->begin(); it != v->end(); ++it)
             {
-              if (sess.verbose > 4)
-                clog << _F("function cache %s:%s match %s vs %s", module_name.c_str(),
-                           cu_name().c_str(), linkage_name, function.c_str()) << endl;
+              if (pending_interrupts) return DWARF_CB_ABORT;
+              Dwarf_Die& die = it->second;
+              const char* name = linkage ? dwarf_linkage_name (&die)
+                                         : it->first.c_str();
+              if (name && function_name_matches_pattern (name, function))
+                {
+                  if (sess.verbose > 4)
+                    clog << _F("function cache %s:%s match %s vs %s", module_name.c_str(),
+                               cu_name().c_str(), name, function.c_str()) << endl;
 
-              rc = (*callback)(& die, q);
-              if (rc != DWARF_CB_OK) break;
+                  rc = (*callback)(& die, q);
+                  if (rc != DWARF_CB_OK) break;
+                }
             }
+          return rc;
         }
-    }
-  else if (name_has_wildcard (function))
-    {
-      for (it = v->begin(); it != v->end(); ++it)
+
+      const vector<Dwarf_Die>* matches = function_index_matches (function, linkage);
+      if (matches)
         {
-          if (pending_interrupts) return DWARF_CB_ABORT;
-          const string& func_name = it->first;
-          Dwarf_Die& die = it->second;
-          if (function_name_matches_pattern (func_name, function))
+          for (vector<Dwarf_Die>::const_iterator i = matches->begin();
+               i != matches->end(); ++i)
             {
+              if (pending_interrupts) return DWARF_CB_ABORT;
               if (sess.verbose > 4)
-                clog << _F("function cache %s:%s match %s vs %s", module_name.c_str(),
-                           cu_name().c_str(), func_name.c_str(), function.c_str()) << endl;
+                clog << _F("function cache %s:%s match %s", module_name.c_str(),
+                           cu_name().c_str(), function.c_str()) << endl;
 
+              Dwarf_Die die = *i;
               rc = (*callback)(& die, q);
               if (rc != DWARF_CB_OK) break;
             }
@@ -1054,6 +1203,8 @@ dwflpp::iterate_single_function (int (* callback)(Dwarf_Die * func, base_query *
                    v->size()) << endl;
       mod_info->update_symtab(v);
     }
+  else if (mod_function_cache_unsymtabbed.erase(module_dwarf))
+    mod_info->update_symtab(v);
 
   cu_function_cache_t::iterator it;
   cu_function_cache_range_t range = v->equal_range(function);
@@ -1084,6 +1235,183 @@ dwflpp::iterate_single_function (int (* callback)(Dwarf_Die * func, base_query *
 }
 
 
+// The modules for cache_module_functions to index, and what it made of
+// them.  Each thread takes the next module, and builds its CU list and
+// function cache, which only reads that module's Dwarf.
+struct module_function_indexer
+{
+  vector<Dwarf*> modules;
+  vector<vector<Dwarf_Die>*> cus;
+  vector<cu_function_cache_t*> functions;
+  size_t next;
+  pthread_mutex_t lock;
+};
+
+
+void *
+dwflpp::index_module_functions (void *arg)
+{
+  module_function_indexer *indexer = static_cast<module_function_indexer*>(arg);
+  for (;;)
+    {
+      pthread_mutex_lock (&indexer->lock);
+      size_t i = indexer->next++;
+      pthread_mutex_unlock (&indexer->lock);
+      if (i >= indexer->modules.size() || pending_interrupts)
+        return NULL;
+
+      Dwarf *dw = indexer->modules[i];
+      vector<Dwarf_Die> *cus = new vector<Dwarf_Die>;
+      cu_function_cache_t *functions = new cu_function_cache_t;
+      Dwarf_Off off = 0;
+      size_t cuhl;
+      Dwarf_Off noff;
+      while (dwarf_nextcu (dw, off, &noff, &cuhl, NULL, NULL, NULL) == 0
+             && !pending_interrupts)
+        {
+          Dwarf_Die die_mem;
+          Dwarf_Die *die = dwarf_offdie (dw, off + cuhl, &die_mem);
+          /* Skip partial units. */
+          if (dwarf_tag (die) == DW_TAG_compile_unit)
+            {
+              cus->push_back (*die); /* copy */
+              dwarf_getfuncs (die, cu_function_caching_callback, functions, 0);
+            }
+          off = noff;
+        }
+      indexer->cus[i] = cus;
+      indexer->functions[i] = functions;
+    }
+}
+
+
+// Whether the Dwarf refers to a separate file shared with others, as
+// made by dwz.  libdw reads that file's units and abbreviations into
+// its own Dwarf as it follows references into it, unlocked.
+static bool
+dwarf_has_altlink (Dwarf *dw)
+{
+  Elf *elf = dwarf_getelf (dw);
+  size_t shstrndx;
+  if (elf == NULL || elf_getshdrstrndx (elf, &shstrndx) != 0)
+    return true; // can't tell, so assume the worst
+
+  Elf_Scn *scn = NULL;
+  while ((scn = elf_nextscn (elf, scn)) != NULL)
+    {
+      GElf_Shdr shdr_mem;
+      GElf_Shdr *shdr = gelf_getshdr (scn, &shdr_mem);
+      const char *name = shdr ? elf_strptr (elf, shstrndx, shdr->sh_name) : NULL;
+      if (name && strcmp (name, ".gnu_debugaltlink") == 0)
+        return true;
+    }
+  return false;
+}
+
+
+static int
+collect_module (Dwfl_Module *mod, void **, const char *name,
+                Dwarf_Addr, void *arg)
+{
+  pair<const string*, vector<Dwfl_Module*>*> *collect =
+    static_cast<pair<const string*, vector<Dwfl_Module*>*>*>(arg);
+  if (fnmatch (collect->first->c_str(), name, 0) == 0)
+    collect->second->push_back (mod);
+  return DWARF_CB_OK;
+}
+
+
+/* Ahead of a query that will look up one function by name in every
+ * module matching the pattern, builds those modules' function caches
+ * with --index-threads threads, rather than one module after another
+ * as the query reaches each.  libdwfl itself is not thread-safe, so
+ * the modules' debuginfo is opened here first; the threads then only
+ * read their own module's Dwarf.  Modules that share an alternate
+ * debuginfo file, as made by dwz, would have the threads update it all
+ * at once, so then the modules are left to the query after all. */
+void
+dwflpp::cache_module_functions (const string& module_pattern)
+{
+  if (sess.index_threads < 2)
+    return;
+
+  vector<Dwfl_Module*> matched;
+  pair<const string*, vector<Dwfl_Module*>*> collect (&module_pattern, &matched);
+  iterate_over_modules (collect_module, &collect);
+
+  module_function_indexer indexer;
+  for (size_t i = 0; i < matched.size(); ++i)
+    {
+      Dwarf_Addr bias;
+      Dwarf *dw = dwfl_module_getdwarf (matched[i], &bias);
+      if (dw && mod_function_cache.find (dw) == mod_function_cache.end())
+        {
+          if (dwarf_has_altlink (dw))
+            {
+              if (sess.verbose > 0)
+                clog << _F("not indexing functions in threads, since %s "
+                           "has an alternate debuginfo file",
+                           dwfl_module_info (matched[i], NULL, NULL, NULL,
+                                             NULL, NULL, NULL, NULL))
+                     << endl;
+              return;
+            }
+          indexer.modules.push_back (dw);
+        }
+    }
+  if (indexer.modules.size() < 2)
+    return;
+
+  profile_timer pt (sess.profile, "dwflpp", "index threads");
+  struct timeval tv_before, tv_after;
+  gettimeofday (&tv_before, NULL);
+
+  indexer.cus.resize (indexer.modules.size(), NULL);
+  indexer.functions.resize (indexer.modules.size(), NULL);
+  indexer.next = 0;
+  pthread_mutex_init (&indexer.lock, NULL);
+
+  vector<pthread_t> threads;
+  size_t nthreads = min ((size_t) sess.index_threads, indexer.modules.size());
+  for (size_t i = 0; i < nthreads; ++i)
+    {
+      pthread_t thread;
+      if (pthread_create (&thread, NULL, index_module_functions, &indexer) != 0)
+        break;
+      threads.push_back (thread);
+    }
+  if (threads.empty())
+    index_module_functions (&indexer); // no threads to be had; do it here
+  for (size_t i = 0; i < threads.size(); ++i)
+    pthread_join (threads[i], NULL);
+  pthread_mutex_destroy (&indexer.lock);
+
+  // The symbol tables are only updated when each module is queried,
+  // since that needs its module_info.
+  for (size_t i = 0; i < indexer.modules.size(); ++i)
+    {
+      Dwarf *dw = indexer.modules[i];
+      if (!indexer.functions[i])
+        continue; // interrupted
+      if (module_cu_cache[dw] == 0)
+        module_cu_cache[dw] = indexer.cus[i];
+      else
+        delete indexer.cus[i];
+      mod_function_cache[dw] = indexer.functions[i];
+      mod_function_cache_unsymtabbed.insert (dw);
+    }
+  assert_no_interrupts();
+
+  gettimeofday (&tv_after, NULL);
+  if (sess.verbose > 0)
+    clog << _F("indexed functions of %zu modules with %zu threads in %ld ms",
+               indexer.modules.size(), max (threads.size(), (size_t) 1),
+               (long) ((tv_after.tv_sec - tv_before.tv_sec) * 1000 +
+                       ((long)tv_after.tv_usec - (long)tv_before.tv_usec) / 1000))
+         << endl;
+}
+
+
 /* This basically only goes one level down from the compile unit so it
  * only picks up top level stuff (i.e. nothing in a lower scope) */
 int
@@ -65,6 +65,32 @@ typedef unordered_map<void*, cu_function_cache_t*> mod_cu_function_cache_t;
 // module -> (function -> die)
 typedef unordered_map<Dwarf*, cu_function_cache_t*> mod_function_cache_t;
 
+// a function or linkage name, with its die and the cu die it came from
+struct function_index_entry
+{
+  std::string name;
+  void *cu;
+  Dwarf_Die die;
+  bool operator< (const function_index_entry& other) const
+    { return name < other.name; }
+};
+
+// cu die -> function dies matching some pattern
+typedef unordered_map<void*, std::vector<Dwarf_Die> > cu_function_matches_t;
+
+// All the function and linkage names of a module, sorted so that patterns
+// with a literal prefix only need to scan a range, and the matches of each
+// pattern looked up so far.
+struct function_name_index
+{
+  std::vector<function_index_entry> names;
+  std::vector<function_index_entry> linkage_names;
+  std::map<std::string, cu_function_matches_t> matches;
+};
+
+// module -> function index
+typedef unordered_map<Dwarf*, function_name_index*> mod_function_index_t;
+
 // inline function die -> instance die[]
 typedef unordered_map<void*, std::vector<Dwarf_Die>*> cu_inl_function_cache_t;
 
@@ -83,6 +109,20 @@ func_info_map_t *get_filtered_functions(dwarf_query *q);
 inline_instance_map_t *get_filtered_inlines(dwarf_query *q);
 
 
+// a probe from a module's .note.stapsdt section, as recorded in the note;
+// pc and semaphore still need adjusting for prelink by the difference
+// between the .stapsdt.base address and base_ref
+struct sdt_note_entry
+{
+  std::string provider;
+  std::string name;
+  std::string args;
+  Dwarf_Addr pc;
+  Dwarf_Addr base_ref;
+  Dwarf_Addr semaphore;
+};
+
+
 struct
 module_info
 {
@@ -94,6 +134,7 @@ module_info
   symbol_table *sym_table;
   info_status dwarf_status;     // module has dwarf info?
   info_status symtab_status;    // symbol table cached?
+  std::vector<sdt_note_entry> *sdt_notes; // SDT notes, once indexed
 
   void get_symtab(dwarf_query *q);
   void update_symtab(cu_function_cache_t *funcs);
@@ -105,7 +146,8 @@ module_info
     bias(0),
     sym_table(NULL),
     dwarf_status(info_unknown),
-    symtab_status(info_unknown)
+    symtab_status(info_unknown),
+    sdt_notes(NULL)
   {}
 
   ~module_info();
@@ -228,6 +270,8 @@ struct dwflpp
   int iterate_single_function (int (* callback)(Dwarf_Die * func, base_query * q),
                                base_query * q, const std::string& function);
 
+  void cache_module_functions (const std::string& module_pattern);
+
   void iterate_over_srcfile_lines (char const * srcfile,
                                    int lines[2],
                                    bool need_single_match,
@@ -338,6 +382,9 @@ private:
   module_tus_read_t module_tus_read;
   mod_cu_function_cache_t cu_function_cache;
   mod_function_cache_t mod_function_cache;
+  std::set<Dwarf*> mod_function_cache_unsymtabbed; // built by cache_module_functions
+  mod_function_index_t mod_function_index;
+  std::map<Dwarf*, void*> mod_function_index_first_cu; // first CU to want it
 
   std::set<void*> cu_inl_function_cache_done; // CUs that are already cached
   cu_inl_function_cache_t cu_inl_function_cache;
@@ -360,7 +407,14 @@ private:
   mod_cu_type_cache_t global_alias_cache;
   static int global_alias_caching_callback(Dwarf_Die *die, bool has_inner_types,
                                            const std::string& prefix, void *arg);
-  static int global_alias_caching_callback_cus(Dwarf_Die *die, void *arg);
+  cu_type_cache_t *get_global_alias_cache(Dwarf_Die *cu);
+  struct global_alias_search
+  {
+    dwflpp *dw;
+    const std::string *name;
+    Dwarf_Die *found;
+  };
+  static int global_alias_searching_callback_cus(Dwarf_Die *die, void *arg);
   static int iterate_over_globals (Dwarf_Die *,
                                    int (* callback)(Dwarf_Die *, bool,
                                                     const std::string&, void *),
@@ -372,6 +426,13 @@ private:
 
   static int mod_function_caching_callback (Dwarf_Die* func, void *arg);
   static int cu_function_caching_callback (Dwarf_Die* func, void *arg);
+  static int function_index_callback (Dwarf_Die* cu, void *arg);
+  static void *index_module_functions (void *arg);
+  cu_function_cache_t* get_cu_function_cache (Dwarf_Die* cu);
+  function_name_index* get_function_index ();
+  bool use_function_index ();
+  const std::vector<Dwarf_Die>* function_index_matches (const std::string& pattern,
+                                                        bool linkage);
 
   bool has_single_line_record (dwarf_query * q, char const * srcfile, int lineno);
 
@@ -15,11 +15,13 @@
 #include "session.h"
 #include "util.h"
 #include "task_finder.h"
+#include "profile.h"
 
 #include "re2c-migrate/stapregex.h"
 
 extern "C" {
 #include <sys/utsname.h>
+#include <sys/time.h>
 #include <fnmatch.h>
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>
@@ -34,6 +36,8 @@ extern "C" {
 #include <algorithm>
 #include <iterator>
 #include <climits>
+#include <typeinfo>
+#include <cxxabi.h>
 
 
 using namespace std;
@@ -421,6 +425,19 @@ match_node::bind_privilege(privilege_t p)
   return this;
 }
 
+// The builder's class, to name it in the --profile report.
+static string
+builder_name (derived_probe_builder* b)
+{
+  const char* mangled = typeid (*b).name();
+  int status;
+  char* demangled = abi::__cxa_demangle (mangled, NULL, NULL, &status);
+  string name = demangled ? demangled : mangled;
+  free (demangled);
+  size_t colons = name.rfind ("::");
+  return colons == string::npos ? name : name.substr (colons + 2);
+}
+
 void
 match_node::find_and_build (systemtap_session& s,
                             probe* p, probe_point *loc, unsigned pos,
@@ -456,6 +473,9 @@ match_node::find_and_build (systemtap_session& s,
       for (unsigned k=0; k<ends.size(); k++) 
         {
           derived_probe_builder *b = ends[k];
+          profile_timer pt (s.profile);
+          if (s.profile)
+            pt.start ("builder", builder_name (b));
           b->build (s, p, loc, param_map, results);
         }
     }
@@ -690,6 +710,9 @@ match_node::try_suffix_expansion (systemtap_session& s,
       for (unsigned k=0; k < ends.size(); k++)
         {
           derived_probe_builder *b = ends[k];
+          profile_timer pt (s.profile);
+          if (s.profile)
+            pt.start ("builder", builder_name (b));
           try 
             {
               b->build_with_suffix (s, p, loc, param_map, results, suffix);
@@ -1408,6 +1431,7 @@ semantic_pass_conditions (systemtap_session & sess)
 // This is only for pragmas that don't have any other side-effect than
 // needing some initialization at module init time. Currently handles
 // /* pragma:vma */ /* pragma:unwind */ /* pragma:symbol */
+// /* pragma:symbol_strings */
 
 // /* pragma:uprobes */ is handled during the typeresolution_info pass.
 // /* pure */, /* unprivileged */. /* myproc-unprivileged */ and /* guru */
@@ -1449,6 +1473,16 @@ public:
 		    current_function->name.c_str()) << endl;
 	session.need_symbols = true;
       }
+
+    // Lazy symbols are only rendered by stapio as the output is written,
+    // so they can't go into strings the script keeps.
+    if (session.lazy_symbols
+	&& c->code.find("/* pragma:symbol_strings */") != string::npos)
+      {
+	session.print_warning(_F("--lazy-symbols ignored, since %s returns user-space symbols as strings",
+				 current_function->name.c_str()));
+	session.lazy_symbols = false;
+      }
   }
 };
 
@@ -2285,28 +2319,318 @@ symresolution_info::find_function (const string& name, unsigned arity)
 // optimization
 
 
-// Do away with functiondecls that are never (transitively) called
-// from probes.
-void semantic_pass_opt1 (systemtap_session& s, bool& relaxed_p)
+// The variables one probe or function body reads and writes, and the
+// functions it calls, not counting those of the functions it calls.
+struct body_varuse
 {
-  functioncall_traversing_visitor ftv;
-  for (unsigned i=0; i<s.probes.size(); i++)
+  set<vardecl*> read;
+  set<vardecl*> written;
+  set<functiondecl*> callees;
+};
+
+
+struct shallow_varuse_visitor: public varuse_collecting_visitor
+{
+  set<functiondecl*> callees;
+  shallow_varuse_visitor (systemtap_session& s): varuse_collecting_visitor (s) {}
+  void visit_functioncall (functioncall* e)
+  {
+    traversing_visitor::visit_functioncall (e); // just the arguments
+    callees.insert (e->referent);
+  }
+};
+
+
+// The bodies that semantic_pass_optimize1 still needs to look at.  The
+// first iteration visits every probe and function; later ones only
+// those changed in the previous iteration, plus those a change may
+// have affected: the callers of a changed function, which may now be
+// side-effect-free, and the writers of a variable that is no longer
+// read anywhere, whose assignments may now be dead.  The variable use
+// of each body is kept, and only walked again once the body changes.
+struct optimize_worklist
+{
+  systemtap_session& session;
+
+  set<derived_probe*> probes; // to visit in this iteration
+  set<functiondecl*> functions;
+  set<derived_probe*> changed_probes; // changed in this iteration
+  set<functiondecl*> changed_functions;
+  set<derived_probe*> stale_probes; // changed since update_varuse
+  set<functiondecl*> stale_functions;
+
+  map<derived_probe*, body_varuse> probe_varuse;
+  map<functiondecl*, body_varuse> function_varuse;
+  set<functiondecl*> reachable; // from the probes, per update_varuse
+  set<vardecl*> read;           // by the reachable bodies
+  set<vardecl*> written;
+
+  // Statistics for -v, per pass.
+  vector<string> pass_names;
+  map<string, unsigned> pass_changes;
+  map<string, unsigned> pass_visits;
+  map<string, unsigned long> pass_usecs;
+  string current_pass;
+  struct timeval pass_start;
+  profile_timer pass_timer; // for --profile
+  unsigned initial_bodies;
+  unsigned total_bodies; // visits per pass without the worklist
+
+  optimize_worklist (systemtap_session& s);
+
+  bool todo (derived_probe* p) { return probes.count (p) != 0; }
+  bool todo (functiondecl* f) { return functions.count (f) != 0; }
+  void visited () { pass_visits[current_pass] ++; }
+  void changed () { pass_changes[current_pass] ++; }
+  void done (derived_probe* p, bool& body_relaxed, bool& relaxed_p);
+  void done (functiondecl* f, bool& body_relaxed, bool& relaxed_p);
+
+  void begin_pass (const string& name);
+  void end_pass ();
+  void update_varuse ();
+  void next_iteration ();
+  void print_stats (unsigned iterations);
+  void record_profile ();
+};
+
+
+optimize_worklist::optimize_worklist (systemtap_session& s):
+  session (s), pass_timer (s.profile), total_bodies (0)
+{
+  initial_bodies = s.probes.size() + s.functions.size();
+  probes.insert (s.probes.begin(), s.probes.end());
+  for (map<string,functiondecl*>::iterator it = s.functions.begin(); it != s.functions.end(); it++)
+    functions.insert (it->second);
+}
+
+
+// Note the outcome of a pass over one body, readying body_relaxed for
+// the next body.
+void
+optimize_worklist::done (derived_probe* p, bool& body_relaxed, bool& relaxed_p)
+{
+  visited ();
+  if (!body_relaxed)
     {
-      s.probes[i]->body->visit (& ftv);
-      if (s.probes[i]->sole_location()->condition)
-        s.probes[i]->sole_location()->condition->visit (& ftv);
+      changed ();
+      changed_probes.insert (p);
+      relaxed_p = false;
+      body_relaxed = true;
+    }
+}
+
+
+void
+optimize_worklist::done (functiondecl* f, bool& body_relaxed, bool& relaxed_p)
+{
+  visited ();
+  if (!body_relaxed)
+    {
+      changed ();
+      changed_functions.insert (f);
+      relaxed_p = false;
+      body_relaxed = true;
+    }
+}
+
+
+void
+optimize_worklist::begin_pass (const string& name)
+{
+  end_pass ();
+  if (pass_usecs.count (name) == 0)
+    pass_names.push_back (name);
+  current_pass = name;
+  gettimeofday (&pass_start, NULL);
+  pass_timer.start ("optimize", name);
+}
+
+
+void
+optimize_worklist::end_pass ()
+{
+  if (current_pass.empty())
+    return;
+  pass_timer.stop ();
+  struct timeval now;
+  gettimeofday (&now, NULL);
+  pass_usecs[current_pass] += (now.tv_sec - pass_start.tv_sec) * 1000000UL
+                              + now.tv_usec - pass_start.tv_usec;
+  current_pass.clear();
+}
+
+
+// Bring the variable use up to date with the changed bodies, finding
+// the functions still reachable from the probes, and what they all read
+// and write.  Writers of variables that are no longer read join the
+// worklist.
+void
+optimize_worklist::update_varuse ()
+{
+  for (unsigned i=0; i<session.probes.size(); i++)
+    {
+      derived_probe* p = session.probes[i];
+      if (probe_varuse.count (p) && !stale_probes.count (p))
+        continue;
+      shallow_varuse_visitor vut (session);
+      p->body->visit (& vut);
+      if (p->sole_location()->condition)
+        p->sole_location()->condition->visit (& vut);
+      body_varuse& u = probe_varuse[p];
+      u.read.swap (vut.read);
+      u.written.swap (vut.written);
+      u.callees.swap (vut.callees);
+      visited ();
+    }
+
+  // Only the functions reachable from the probes are walked, just as a
+  // functioncall_traversing_visitor would, since unreachable ones are
+  // about to be elided, and so mustn't be objected to.
+  reachable.clear();
+  vector<functiondecl*> pending;
+  for (map<derived_probe*, body_varuse>::iterator it = probe_varuse.begin(); it != probe_varuse.end(); it++)
+    pending.insert (pending.end(), it->second.callees.begin(), it->second.callees.end());
+  while (!pending.empty())
+    {
+      functiondecl* f = pending.back();
+      pending.pop_back();
+      if (!reachable.insert (f).second)
+        continue;
+      if (!function_varuse.count (f) || stale_functions.count (f))
+        {
+          shallow_varuse_visitor vut (session);
+          vut.current_function = f;
+          f->body->visit (& vut);
+          body_varuse& u = function_varuse[f];
+          u.read.swap (vut.read);
+          u.written.swap (vut.written);
+          u.callees.swap (vut.callees);
+          visited ();
+        }
+      body_varuse& u = function_varuse[f];
+      pending.insert (pending.end(), u.callees.begin(), u.callees.end());
+    }
+
+  stale_probes.clear();
+  stale_functions.clear();
+
+  set<vardecl*> old_read;
+  old_read.swap (read);
+  written.clear();
+  for (map<derived_probe*, body_varuse>::iterator it = probe_varuse.begin(); it != probe_varuse.end(); it++)
+    {
+      read.insert (it->second.read.begin(), it->second.read.end());
+      written.insert (it->second.written.begin(), it->second.written.end());
+    }
+  for (set<functiondecl*>::iterator it = reachable.begin(); it != reachable.end(); it++)
+    {
+      read.insert (function_varuse[*it].read.begin(), function_varuse[*it].read.end());
+      written.insert (function_varuse[*it].written.begin(), function_varuse[*it].written.end());
+    }
+
+  set<vardecl*> unread;
+  set_difference (old_read.begin(), old_read.end(), read.begin(), read.end(),
+                  inserter (unread, unread.begin()));
+  if (unread.empty())
+    return;
+  for (map<derived_probe*, body_varuse>::iterator it = probe_varuse.begin(); it != probe_varuse.end(); it++)
+    for (set<vardecl*>::iterator v = unread.begin(); v != unread.end(); v++)
+      if (it->second.written.count (*v))
+        {
+          probes.insert (it->first);
+          break;
+        }
+  for (set<functiondecl*>::iterator it = reachable.begin(); it != reachable.end(); it++)
+    for (set<vardecl*>::iterator v = unread.begin(); v != unread.end(); v++)
+      if (function_varuse[*it].written.count (*v))
+        {
+          functions.insert (*it);
+          break;
+        }
+}
+
+
+// Ready the worklist for the next iteration, from the changes in this.
+void
+optimize_worklist::next_iteration ()
+{
+  end_pass ();
+  total_bodies += session.probes.size() + session.functions.size();
+
+  stale_probes.insert (changed_probes.begin(), changed_probes.end());
+  stale_functions.insert (changed_functions.begin(), changed_functions.end());
+  probes.swap (changed_probes);
+  functions.swap (changed_functions);
+  changed_probes.clear();
+  changed_functions.clear();
+
+  // The callers of a changed function, transitively, as the change may
+  // have made their calls elidable.  NB: the call sets of the changed
+  // bodies are stale, but calls are only ever removed, not added.
+  vector<functiondecl*> pending (functions.begin(), functions.end());
+  while (!pending.empty())
+    {
+      functiondecl* f = pending.back();
+      pending.pop_back();
+      for (map<functiondecl*, body_varuse>::iterator it = function_varuse.begin(); it != function_varuse.end(); it++)
+        if (it->second.callees.count (f) && functions.insert (it->first).second)
+          pending.push_back (it->first);
+      for (map<derived_probe*, body_varuse>::iterator it = probe_varuse.begin(); it != probe_varuse.end(); it++)
+        if (it->second.callees.count (f))
+          probes.insert (it->first);
+    }
+}
+
+
+void
+optimize_worklist::print_stats (unsigned iterations)
+{
+  end_pass ();
+  clog << _F("Pass 2 optimization: %u iterations over %u probes and functions",
+             iterations, initial_bodies) << endl;
+  for (unsigned i=0; i<pass_names.size(); i++)
+    {
+      const string& n = pass_names[i];
+      clog << _F("  %s: %u changes, %u of %u bodies visited, %lu usecs",
+                 n.c_str(), pass_changes[n], pass_visits[n], total_bodies,
+                 pass_usecs[n]) << endl;
+    }
+}
+
+
+// Add the changes and visits to the --profile timings of each pass.
+void
+optimize_worklist::record_profile ()
+{
+  end_pass ();
+  for (unsigned i=0; i<pass_names.size(); i++)
+    {
+      const string& n = pass_names[i];
+      session.profile->count ("optimize", n, "changes", pass_changes[n]);
+      session.profile->count ("optimize", n, "visits", pass_visits[n]);
     }
+}
+
+
+// Do away with functiondecls that are never (transitively) called
+// from probes.
+void semantic_pass_opt1 (systemtap_session& s, bool& relaxed_p,
+                         optimize_worklist& w)
+{
+  w.update_varuse ();
+
   vector<functiondecl*> new_unused_functions;
   for (map<string,functiondecl*>::iterator it = s.functions.begin(); it != s.functions.end(); it++)
     {
       functiondecl* fd = it->second;
-      if (ftv.traversed.find(fd) == ftv.traversed.end())
+      if (w.reachable.find(fd) == w.reachable.end())
         {
           if (fd->tok->location.file->name == s.user_file->name && ! fd->synthetic)// !tapset
             s.print_warning (_F("Eliding unused function '%s'", fd->name.c_str()), fd->tok);
           // s.functions.erase (it); // NB: can't, since we're already iterating upon it
           new_unused_functions.push_back (fd);
           relaxed_p = false;
+          w.changed ();
         }
     }
   for (unsigned i=0; i<new_unused_functions.size(); i++)
@@ -2314,6 +2638,7 @@ void semantic_pass_opt1 (systemtap_session& s, bool& relaxed_p)
       map<string,functiondecl*>::iterator where = s.functions.find (new_unused_functions[i]->name);
       assert (where != s.functions.end());
       s.functions.erase (where);
+      w.function_varuse.erase (new_unused_functions[i]);
       if (s.tapset_compile_coverage)
         s.unused_functions.push_back (new_unused_functions[i]);
     }
@@ -2324,25 +2649,13 @@ void semantic_pass_opt1 (systemtap_session& s, bool& relaxed_p)
 
 // Do away with local & global variables that are never
 // written nor read.
-void semantic_pass_opt2 (systemtap_session& s, bool& relaxed_p, unsigned iterations)
+void semantic_pass_opt2 (systemtap_session& s, bool& relaxed_p, unsigned iterations,
+                         optimize_worklist& w)
 {
-  varuse_collecting_visitor vut(s);
-
-  for (unsigned i=0; i<s.probes.size(); i++)
-    {
-      s.probes[i]->body->visit (& vut);
-
-      if (s.probes[i]->sole_location()->condition)
-        s.probes[i]->sole_location()->condition->visit (& vut);
-    }
-
-  // NB: Since varuse_collecting_visitor also traverses down
-  // actually called functions, we don't need to explicitly
-  // iterate over them.  Uncalled ones should have been pruned
-  // in _opt1 above.
-  //
-  // for (unsigned i=0; i<s.functions.size(); i++)
-  //   s.functions[i]->body->visit (& vut);
+  // NB: The worklist's varuse, brought up to date by _opt1 above,
+  // covers the probes and their conditions, and the functions they
+  // (transitively) call.  Uncalled ones have been pruned by _opt1.
+  const optimize_worklist& vut = w;
 
   // Now in vut.read/written, we have a mixture of all locals, globals
 
@@ -2365,6 +2678,7 @@ void semantic_pass_opt2 (systemtap_session& s, bool& relaxed_p, unsigned iterati
 	    }
             s.probes[i]->locals.erase(s.probes[i]->locals.begin() + j);
             relaxed_p = false;
+            w.changed ();
             // don't increment j
           }
         else
@@ -2405,6 +2719,7 @@ void semantic_pass_opt2 (systemtap_session& s, bool& relaxed_p, unsigned iterati
               }
               fd->locals.erase(fd->locals.begin() + j);
               relaxed_p = false;
+              w.changed ();
               // don't increment j
             }
           else
@@ -2447,6 +2762,7 @@ void semantic_pass_opt2 (systemtap_session& s, bool& relaxed_p, unsigned iterati
 	  }
 	  s.globals.erase(s.globals.begin() + i);
 	  relaxed_p = false;
+	  w.changed ();
 	  // don't increment i
         }
       else
@@ -2476,10 +2792,10 @@ struct dead_assignment_remover: public update_visitor
 {
   systemtap_session& session;
   bool& relaxed_p;
-  const varuse_collecting_visitor& vut;
+  const optimize_worklist& vut;
 
   dead_assignment_remover(systemtap_session& s, bool& r,
-                          const varuse_collecting_visitor& v):
+                          const optimize_worklist& v):
     session(s), relaxed_p(r), vut(v) {}
 
   void visit_assignment (assignment* e);
@@ -2563,23 +2879,28 @@ dead_assignment_remover::visit_try_block (try_block *s)
 // rewrite "(foo = expr)" as "(expr)".  This makes foo a candidate to
 // be optimized away as an unused variable, and expr a candidate to be
 // removed as a side-effect-free statement expression.  Wahoo!
-void semantic_pass_opt3 (systemtap_session& s, bool& relaxed_p)
+void semantic_pass_opt3 (systemtap_session& s, bool& relaxed_p,
+                         optimize_worklist& w)
 {
-  // Recompute the varuse data, which will probably match the opt2
-  // copy of the computation, except for those totally unused
-  // variables that opt2 removed.
-  varuse_collecting_visitor vut(s);
-  for (unsigned i=0; i<s.probes.size(); i++)
-    s.probes[i]->body->visit (& vut); // includes reachable functions too
-
-  dead_assignment_remover dar (s, relaxed_p, vut);
+  // The varuse data of the worklist matches what _opt2 used, except
+  // for those totally unused variables that opt2 removed.
+  bool body_relaxed = true;
+  dead_assignment_remover dar (s, body_relaxed, w);
   // This instance may be reused for multiple probe/function body trims.
 
   for (unsigned i=0; i<s.probes.size(); i++)
-    dar.replace (s.probes[i]->body);
+    if (w.todo (s.probes[i]))
+      {
+        dar.replace (s.probes[i]->body);
+        w.done (s.probes[i], body_relaxed, relaxed_p);
+      }
   for (map<string,functiondecl*>::iterator it = s.functions.begin();
        it != s.functions.end(); it++)
-    dar.replace (it->second->body);
+    if (w.todo (it->second))
+      {
+        dar.replace (it->second->body);
+        w.done (it->second, body_relaxed, relaxed_p);
+      }
   // The rewrite operation is performed within the visitor.
 
   // XXX: we could also zap write-only globals here
@@ -2814,13 +3135,15 @@ dead_stmtexpr_remover::visit_expr_statement (expr_statement *s)
 }
 
 
-void semantic_pass_opt4 (systemtap_session& s, bool& relaxed_p)
+void semantic_pass_opt4 (systemtap_session& s, bool& relaxed_p,
+                         optimize_worklist& w)
 {
   // Finally, let's remove some statement-expressions that have no
   // side-effect.  These should be exactly those whose private varuse
   // visitors come back with an empty "written" and "embedded" lists.
 
-  dead_stmtexpr_remover duv (s, relaxed_p);
+  bool body_relaxed = true;
+  dead_stmtexpr_remover duv (s, body_relaxed);
   // This instance may be reused for multiple probe/function body trims.
 
   for (unsigned i=0; i<s.probes.size(); i++)
@@ -2828,6 +3151,8 @@ void semantic_pass_opt4 (systemtap_session& s, bool& relaxed_p)
       assert_no_interrupts();
 
       derived_probe* p = s.probes[i];
+      if (!w.todo (p))
+        continue;
 
       duv.focal_vars.clear ();
       duv.focal_vars.insert (s.globals.begin(),
@@ -2845,12 +3170,15 @@ void semantic_pass_opt4 (systemtap_session& s, bool& relaxed_p)
 
           // XXX: possible duplicate warnings; see below
         }
+      w.done (p, body_relaxed, relaxed_p);
     }
   for (map<string,functiondecl*>::iterator it = s.functions.begin(); it != s.functions.end(); it++)
     {
       assert_no_interrupts();
 
       functiondecl* fn = it->second;
+      if (!w.todo (fn))
+        continue;
       duv.focal_vars.clear ();
       duv.focal_vars.insert (fn->locals.begin(),
                              fn->locals.end());
@@ -2872,6 +3200,7 @@ void semantic_pass_opt4 (systemtap_session& s, bool& relaxed_p)
           // only after the relaxation iterations.
           // XXX: or else see bug #6469.
         }
+      w.done (fn, body_relaxed, relaxed_p);
     }
 }
 
@@ -3300,20 +3629,30 @@ void_statement_reducer::visit_defined_op (defined_op* e)
 
 
 
-void semantic_pass_opt5 (systemtap_session& s, bool& relaxed_p)
+void semantic_pass_opt5 (systemtap_session& s, bool& relaxed_p,
+                         optimize_worklist& w)
 {
   // Let's simplify statements with unused computed values.
 
-  void_statement_reducer vuv (s, relaxed_p);
+  bool body_relaxed = true;
+  void_statement_reducer vuv (s, body_relaxed);
   // This instance may be reused for multiple probe/function body trims.
 
   vuv.focal_vars.insert (s.globals.begin(), s.globals.end());
 
   for (unsigned i=0; i<s.probes.size(); i++)
-    vuv.replace (s.probes[i]->body);
+    if (w.todo (s.probes[i]))
+      {
+        vuv.replace (s.probes[i]->body);
+        w.done (s.probes[i], body_relaxed, relaxed_p);
+      }
   for (map<string,functiondecl*>::iterator it = s.functions.begin();
        it != s.functions.end(); it++)
-    vuv.replace (it->second->body);
+    if (w.todo (it->second))
+      {
+        vuv.replace (it->second->body);
+        w.done (it->second, body_relaxed, relaxed_p);
+      }
 }
 
 
@@ -3846,18 +4185,28 @@ const_folder::visit_target_symbol (target_symbol* e)
     update_visitor::visit_target_symbol (e);
 }
 
-static void semantic_pass_const_fold (systemtap_session& s, bool& relaxed_p)
+static void semantic_pass_const_fold (systemtap_session& s, bool& relaxed_p,
+                                      optimize_worklist& w)
 {
   // Let's simplify statements with constant values.
 
-  const_folder cf (s, relaxed_p);
+  bool body_relaxed = true;
+  const_folder cf (s, body_relaxed);
   // This instance may be reused for multiple probe/function body trims.
 
   for (unsigned i=0; i<s.probes.size(); i++)
-    cf.replace (s.probes[i]->body);
+    if (w.todo (s.probes[i]))
+      {
+        cf.replace (s.probes[i]->body);
+        w.done (s.probes[i], body_relaxed, relaxed_p);
+      }
   for (map<string,functiondecl*>::iterator it = s.functions.begin();
        it != s.functions.end(); it++)
-    cf.replace (it->second->body);
+    if (w.todo (it->second))
+      {
+        cf.replace (it->second->body);
+        w.done (it->second, body_relaxed, relaxed_p);
+      }
 }
 
 
@@ -3959,6 +4308,167 @@ void semantic_pass_opt6 (systemtap_session& s, bool& relaxed_p)
 }
 
 
+// ------------------------------------------------------------------------
+
+// A deep copy of an expression that keeps its referents, as needed
+// after symbol resolution, and that substitutes the given expressions
+// for symbols of the given variables.
+struct inlining_copier: public deep_copy_visitor
+{
+  map<vardecl*, expression*>& subst;
+  inlining_copier (map<vardecl*, expression*>& s): subst (s) {}
+
+  void visit_symbol (symbol* e)
+  {
+    if (subst.count (e->referent))
+      {
+        map<vardecl*, expression*> none;
+        inlining_copier ic (none);
+        provide (ic.require (subst[e->referent]));
+      }
+    else
+      update_visitor::visit_symbol (new symbol (*e));
+  }
+
+  void visit_functioncall (functioncall* e)
+  {
+    update_visitor::visit_functioncall (new functioncall (*e));
+  }
+};
+
+
+// Count the uses of each variable in an expression.
+struct varuse_counter: public traversing_visitor
+{
+  map<vardecl*, unsigned> uses;
+  void visit_symbol (symbol* e) { uses[e->referent] ++; }
+};
+
+
+// Replace calls to small script functions, those whose body is just
+// "return EXPR" of a side-effect-free EXPR, with EXPR itself, saving
+// the argument copies and call of each.
+struct function_inliner: public update_visitor
+{
+  systemtap_session& session;
+  bool& relaxed_p;
+  map<functiondecl*, expression*> inlinable; // the EXPR, or 0 if not
+
+  function_inliner (systemtap_session& s, bool& r): session (s), relaxed_p (r) {}
+
+  expression* inline_body (functiondecl* fd);
+  void visit_functioncall (functioncall* e);
+};
+
+
+expression*
+function_inliner::inline_body (functiondecl* fd)
+{
+  if (inlinable.count (fd))
+    return inlinable[fd];
+  inlinable[fd] = 0;
+
+  block* b = dynamic_cast<block*> (fd->body);
+  if (!b || b->statements.size() != 1 || !fd->locals.empty())
+    return 0;
+  return_statement* rs = dynamic_cast<return_statement*> (b->statements[0]);
+  if (!rs || !rs->value)
+    return 0;
+
+  // NB: this also rules out recursion, since the walk follows calls.
+  varuse_collecting_visitor vut (session);
+  rs->value->visit (& vut);
+  if (!vut.side_effect_free () || vut.traversed.count (fd))
+    return 0;
+
+  return inlinable[fd] = rs->value;
+}
+
+
+void
+function_inliner::visit_functioncall (functioncall* e)
+{
+  for (unsigned i = 0; i < e->args.size(); ++i)
+    replace (e->args[i]);
+
+  expression* value = inline_body (e->referent);
+  if (!value)
+    {
+      provide (e);
+      return;
+    }
+
+  varuse_counter vc;
+  value->visit (& vc);
+
+  // Literals and variables may be substituted wherever the argument
+  // is used.  Anything else must be side-effect-free, and used at
+  // most once, so that it isn't evaluated more often than before.
+  map<vardecl*, expression*> subst;
+  for (unsigned i = 0; i < e->args.size(); ++i)
+    {
+      expression* arg = e->args[i];
+      vardecl* formal = e->referent->formal_args[i];
+      if (!dynamic_cast<literal*> (arg) && !dynamic_cast<symbol*> (arg))
+        {
+          varuse_collecting_visitor vut (session);
+          arg->visit (& vut);
+          if (!vut.side_effect_free () || vc.uses[formal] > 1)
+            {
+              provide (e);
+              return;
+            }
+        }
+      subst[formal] = arg;
+    }
+
+  if (session.verbose>2)
+    clog << _F("Inlining function '%s' ", e->referent->name.c_str())
+         << *e->tok << endl;
+
+  inlining_copier ic (subst);
+  expression* n = ic.require (value);
+  n->tok = e->tok;
+  provide (n);
+  relaxed_p = false;
+}
+
+
+void semantic_pass_opt7 (systemtap_session& s, bool& relaxed_p)
+{
+  // Inline small functions, then drop those that are no longer called.
+  // This runs after type inference, so that a function called with
+  // conflicting argument types is still reported as such.
+
+  function_inliner fi (s, relaxed_p);
+  for (unsigned i=0; i<s.probes.size(); i++)
+    fi.replace (s.probes[i]->body);
+  for (map<string,functiondecl*>::iterator it = s.functions.begin();
+       it != s.functions.end(); it++)
+    fi.replace (it->second->body);
+
+  functioncall_traversing_visitor ftv;
+  for (unsigned i=0; i<s.probes.size(); i++)
+    {
+      s.probes[i]->body->visit (& ftv);
+      if (s.probes[i]->sole_location()->condition)
+        s.probes[i]->sole_location()->condition->visit (& ftv);
+    }
+  vector<functiondecl*> inlined_functions;
+  for (map<string,functiondecl*>::iterator it = s.functions.begin(); it != s.functions.end(); it++)
+    if (ftv.traversed.find(it->second) == ftv.traversed.end())
+      inlined_functions.push_back (it->second);
+  for (unsigned i=0; i<inlined_functions.size(); i++)
+    {
+      if (s.verbose>2)
+        clog << _F("Eliding inlined function '%s'", inlined_functions[i]->name.c_str()) << endl;
+      s.functions.erase (inlined_functions[i]->name);
+      if (s.tapset_compile_coverage)
+        s.unused_functions.push_back (inlined_functions[i]);
+    }
+}
+
+
 static int
 semantic_pass_optimize1 (systemtap_session& s)
 {
@@ -3966,7 +4476,9 @@ semantic_pass_optimize1 (systemtap_session& s)
   // eliminate some blatantly unnecessary code.  This is run before
   // type inference, but after symbol resolution and derived_probe
   // creation.  We run an outer "relaxation" loop that repeats the
-  // optimizations until none of them find anything to remove.
+  // optimizations until none of them find anything to remove.  After
+  // the first iteration, each only revisits the probes and functions
+  // that the last one's changes may have affected; see optimize_worklist.
 
   int rc = 0;
 
@@ -3974,6 +4486,7 @@ semantic_pass_optimize1 (systemtap_session& s)
   // it below.
   save_and_restore<bool> suppress_warnings(& s.suppress_warnings);
 
+  optimize_worklist w (s);
   bool relaxed_p = false;
   unsigned iterations = 0;
   while (! relaxed_p)
@@ -3991,22 +4504,34 @@ semantic_pass_optimize1 (systemtap_session& s)
 
       if (!s.unoptimized)
         {
-          semantic_pass_opt1 (s, relaxed_p);
-          semantic_pass_opt2 (s, relaxed_p, iterations); // produce some warnings only on iteration=0
-          semantic_pass_opt3 (s, relaxed_p);
-          semantic_pass_opt4 (s, relaxed_p);
-          semantic_pass_opt5 (s, relaxed_p);
+          w.begin_pass ("unused functions");
+          semantic_pass_opt1 (s, relaxed_p, w);
+          w.begin_pass ("unused variables");
+          semantic_pass_opt2 (s, relaxed_p, iterations, w); // produce some warnings only on iteration=0
+          w.begin_pass ("dead assignments");
+          semantic_pass_opt3 (s, relaxed_p, w);
+          w.begin_pass ("dead statements");
+          semantic_pass_opt4 (s, relaxed_p, w);
+          w.begin_pass ("void statements");
+          semantic_pass_opt5 (s, relaxed_p, w);
         }
 
       // For listing mode, we need const-folding regardless of optimization so
       // that @defined expressions can be properly resolved.  PR11360
       // We also want it in case variables are used in if/case expressions,
       // so enable always.  PR11366
-      semantic_pass_const_fold (s, relaxed_p);
+      w.begin_pass ("constant folding");
+      semantic_pass_const_fold (s, relaxed_p, w);
 
+      w.next_iteration ();
       iterations ++;
     }
 
+  if (s.verbose > 0)
+    w.print_stats (iterations);
+  if (s.profile)
+    w.record_profile ();
+
   return rc;
 }
 
@@ -4039,7 +4564,10 @@ semantic_pass_optimize2 (systemtap_session& s)
         s.suppress_warnings = true;
 
       if (!s.unoptimized)
-        semantic_pass_opt6 (s, relaxed_p);
+        {
+          semantic_pass_opt6 (s, relaxed_p);
+          semantic_pass_opt7 (s, relaxed_p);
+        }
 
       iterations++;
     }
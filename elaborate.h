@@ -192,6 +192,10 @@ public:
   virtual bool needs_global_locks () { return true; }
   // by default, probes need locks around global variables
 
+  virtual bool prefilter_p () { return false; }
+  // whether the probe runs in the context of the task it's about, so its
+  // prologue may filter hits on that task; see prefilter_condition()
+
   // Location of semaphores to activate sdt probes
   Dwarf_Addr sdt_semaphore_addr;
 
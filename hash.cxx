@@ -54,6 +54,7 @@ public:
   void add(const std:: string& d, const std::string& s) { add(d, (const unsigned char *)s.c_str(), s.length()); }
 
   void add_path(const std::string& description, const std::string& path);
+  void add_contents(const std::string& contents);
 
   void result(std::string& r);
   std::string get_parms() { return parm_stream.str(); }
@@ -98,6 +99,15 @@ stap_hash::add_path(const std::string& description, const std::string& path)
 }
 
 
+void
+stap_hash::add_contents(const std::string& contents)
+{
+  // NB: unlike add(), don't log the (possibly binary) data itself
+  parm_stream << "Contents: " << contents.size() << " bytes" << endl;
+  mdfour_update(&md4, (const unsigned char *)contents.data(), contents.size());
+}
+
+
 void
 stap_hash::result(string& r)
 {
@@ -331,6 +341,61 @@ find_tracequery_hash (systemtap_session& s, const string& header)
 }
 
 
+string
+find_tracequery_index_hash (systemtap_session& s, const vector<string>& headers,
+                            const string& build_id)
+{
+  stap_hash h(get_base_hash(s));
+
+  // The kernel's build-id, where known, pins the index to the very kernel
+  // the tracepoints were extracted for.
+  h.add("Kernel Build ID: ", build_id);
+
+  // Add all the tracepoint headers the index was made from
+  for (unsigned i = 0; i < headers.size(); i++)
+    h.add_path("Header ", headers[i]);
+
+  // Add any custom kbuild flags
+  for (unsigned i = 0; i < s.kbuildflags.size(); i++)
+    h.add("Kbuildflags: ", s.kbuildflags[i]);
+
+  // Get the directory path to store our cached index
+  string result, hashdir;
+  h.result(result);
+  if (!create_hashdir(s, result, hashdir))
+    return "";
+
+  create_hash_log(string("tracequery_index_hash"), h.get_parms(), result,
+                  hashdir + "/tracequery_index_" + result + "_hash.log");
+  return hashdir + "/tracequery_index_" + result + ".txt";
+}
+
+
+string
+find_sdt_index_hash (systemtap_session& s, const string& path,
+                     const string& build_id)
+{
+  stap_hash h(get_base_hash(s));
+
+  // A binary is known by its build-id, wherever it is installed; without
+  // one, fall back on its path, size and timestamp.
+  if (!build_id.empty())
+    h.add("Build ID: ", build_id);
+  else
+    h.add_path("Binary ", path);
+
+  // Get the directory path to store our cached index
+  string result, hashdir;
+  h.result(result);
+  if (!create_hashdir(s, result, hashdir))
+    return "";
+
+  create_hash_log(string("sdt_index_hash"), h.get_parms(), result,
+                  hashdir + "/sdt_index_" + result + "_hash.log");
+  return hashdir + "/sdt_index_" + result + ".txt";
+}
+
+
 string
 find_typequery_hash (systemtap_session& s, const string& name)
 {
@@ -385,4 +450,17 @@ find_uprobes_hash (systemtap_session& s)
   return hashdir + "/uprobes_" + result;
 }
 
+
+// Name file contents by their hash, e.g. for the stapsh remote cache.
+string
+find_contents_hash (const string& contents)
+{
+  stap_hash h;
+  h.add_contents(contents);
+
+  string result;
+  h.result(result);
+  return result;
+}
+
 /* vim: set sw=2 ts=8 cino=>4,n-2,{2,^-2,t0,(0,u0,w1,M1 : */
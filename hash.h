@@ -8,7 +8,13 @@ void find_script_hash (systemtap_session& s, const std::string& script);
 void find_stapconf_hash (systemtap_session& s);
 std::string find_tracequery_hash (systemtap_session& s,
                                   const std::string& header);
+std::string find_tracequery_index_hash (systemtap_session& s,
+                                        const std::vector<std::string>& headers,
+                                        const std::string& build_id);
 std::string find_typequery_hash (systemtap_session& s, const std::string& name);
+std::string find_sdt_index_hash (systemtap_session& s, const std::string& path,
+                                 const std::string& build_id);
 std::string find_uprobes_hash (systemtap_session& s);
+std::string find_contents_hash (const std::string& contents);
 
 /* vim: set sw=2 ts=8 cino=>4,n-2,{2,^-2,t0,(0,u0,w1,M1 : */
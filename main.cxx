@@ -25,6 +25,7 @@
 #include "remote.h"
 #include "tapsets.h"
 #include "setupdwfl.h"
+#include "profile.h"
 
 #ifdef HAVE_LIBINTL_H
 #include <libintl.h>
@@ -49,6 +50,8 @@ extern "C" {
 #include <time.h>
 #include <unistd.h>
 #include <wordexp.h>
+#include <fcntl.h>
+#include <sys/wait.h>
 }
 
 using namespace std;
@@ -259,7 +262,7 @@ printscript(systemtap_session& s, ostream& o)
 }
 
 
-int pending_interrupts;
+volatile sig_atomic_t pending_interrupts;
 
 extern "C"
 void handle_interrupt (int sig)
@@ -310,107 +313,14 @@ setup_signals (sighandler_t handler)
 }
 
 
-// Compilation passes 0 through 4
+// Parse the library macro (.stpm) and script files on the include path,
+// checking that none of them is the user's script.
 static int
-passes_0_4 (systemtap_session &s)
+parse_library_files (systemtap_session& s, int user_file_stat_rc,
+                     const struct stat& user_file_stat)
 {
   int rc = 0;
 
-  // If we don't know the release, there's no hope either locally or on a server.
-  if (s.kernel_release.empty())
-    {
-      if (s.kernel_build_tree.empty())
-        cerr << _("ERROR: kernel release isn't specified") << endl;
-      else
-        cerr << _F("ERROR: kernel release isn't found in \"%s\"",
-                   s.kernel_build_tree.c_str()) << endl;
-      return 1;
-    }
-
-  // Perform passes 0 through 4 using a compile server?
-  if (! s.specified_servers.empty ())
-    {
-#if HAVE_NSS
-      compile_server_client client (s);
-      int rc = client.passes_0_4 ();
-      // Need to give a user a better diagnostic, if she didn't
-      // even ask for a server
-      if (rc && s.automatic_server_mode) {
-        cerr << _("Note: --use-server --unprivileged was selected because of stapusr membership.") << endl;
-      }
-      return rc;
-#else
-      s.print_warning("Without NSS, using a compile-server is not supported by this version of systemtap");
-      // This cannot be an attempt to use a server after a local compile failed
-      // since --use-server-on-error is locked to 'no' if we don't have
-      // NSS.
-      assert (! s.try_server ());
-#endif
-    }
-
-  // PASS 0: setting up
-  s.verbose = s.perpass_verbose[0];
-  PROBE1(stap, pass0__start, &s);
-
-  // For PR1477, we used to override $PATH and $LC_ALL and other stuff
-  // here.  We seem to use complete pathnames in
-  // buildrun.cxx/tapsets.cxx now, so this is not necessary.  Further,
-  // it interferes with util.cxx:find_executable(), used for $PATH
-  // resolution.
-
-  s.kernel_base_release.assign(s.kernel_release, 0, s.kernel_release.find('-'));
-
-  // Update various paths to include the sysroot, if provided.
-  if (!s.sysroot.empty())
-    {
-      if (s.update_release_sysroot && !s.sysroot.empty())
-        s.kernel_build_tree = s.sysroot + s.kernel_build_tree;
-      debuginfo_path_insert_sysroot(s.sysroot);
-    }
-
-  // Now that no further changes to s.kernel_build_tree can occur, let's use it.
-  if ((rc = s.parse_kernel_config ()) != 0
-      || (rc = s.parse_kernel_exports ()) != 0
-      || (rc = s.parse_kernel_functions ()) != 0)
-    {
-      // Try again with a server
-      s.set_try_server ();
-      return rc;
-    }
-
-  // Create the name of the C source file within the temporary
-  // directory.  Note the _src prefix, explained in
-  // buildrun.cxx:compile_pass()
-  s.translated_source = string(s.tmpdir) + "/" + s.module_name + "_src.c";
-
-  PROBE1(stap, pass0__end, &s);
-
-  struct tms tms_before;
-  times (& tms_before);
-  struct timeval tv_before;
-  gettimeofday (&tv_before, NULL);
-
-  // PASS 1a: PARSING LIBRARY SCRIPTS
-  PROBE1(stap, pass1a__start, &s);
-
-  // We need to handle the library scripts first because this pass
-  // gathers information on .stpm files that might be needed to
-  // parse the user script.
-
-  // We need to first ascertain the status of the user script, though.
-  struct stat user_file_stat;
-  int user_file_stat_rc = -1;
-
-  if (s.script_file == "-")
-    {
-      user_file_stat_rc = fstat (STDIN_FILENO, & user_file_stat);
-    }
-  else if (s.script_file != "")
-    {
-      user_file_stat_rc = stat (s.script_file.c_str(), & user_file_stat);
-    }
-  // otherwise, rc is 0 for a command line script
-
   vector<string> version_suffixes;
   if (s.runtime_mode == systemtap_session::kernel_runtime)
     {
@@ -629,6 +539,288 @@ passes_0_4 (systemtap_session &s)
           globfree (& globbuf);
         }
     }
+
+  return rc;
+}
+
+
+// A stap --server-worker parses the tapsets and loads the kernel's
+// debuginfo once, then forks a translator for each of stap-serverd's
+// requests, which starts from that copy rather than from scratch.  A
+// request's session borrows only what was parsed with the settings it
+// would have parsed it with itself; the rest it does as usual.
+
+struct warm_tapsets
+{
+  privilege_t privilege;
+  vector<stapfile*> library_files;
+  map<string, macrodecl*> library_macros;
+  set<pair<dev_t, ino_t> > inodes;
+};
+
+static systemtap_session* warm_session;
+static vector<warm_tapsets> warm_tapset_sets;
+static bool warm_kernel_data;
+static string warm_debuginfo_path; // $SYSTEMTAP_DEBUGINFO_PATH at warm-up
+
+
+static bool
+warm_settings_match (systemtap_session& s)
+{
+  const systemtap_session& w = *warm_session;
+  const char *debuginfo_path = getenv ("SYSTEMTAP_DEBUGINFO_PATH");
+  return ((debuginfo_path ?: "") == warm_debuginfo_path
+          && s.include_path == w.include_path
+          && s.kernel_release == w.kernel_release
+          && s.kernel_build_tree == w.kernel_build_tree
+          && s.architecture == w.architecture
+          && s.runtime_mode == w.runtime_mode
+          && s.compatible == w.compatible
+          && s.sysroot == w.sysroot);
+}
+
+
+// The borrowing is done in the forked translator, whose copy of the
+// warm session is otherwise unused, so it can take it by swapping.
+static bool
+borrow_warm_kernel_data (systemtap_session& s)
+{
+  if (!warm_session || !warm_kernel_data || !warm_settings_match (s))
+    return false;
+
+  s.kernel_config.swap (warm_session->kernel_config);
+  s.kernel_exports.swap (warm_session->kernel_exports);
+  s.kernel_functions.swap (warm_session->kernel_functions);
+  warm_kernel_data = false;
+  return true;
+}
+
+
+static bool
+borrow_warm_tapsets (systemtap_session& s, int user_file_stat_rc,
+                     const struct stat& user_file_stat)
+{
+  if (!warm_session || !warm_settings_match (s))
+    return false;
+
+  for (vector<warm_tapsets>::iterator it = warm_tapset_sets.begin();
+       it != warm_tapset_sets.end(); ++it)
+    {
+      if (it->privilege != s.privilege)
+        continue;
+
+      // Leave the complaint about running a tapset file to the full parse.
+      if (user_file_stat_rc == 0
+          && it->inodes.count (make_pair (user_file_stat.st_dev,
+                                          user_file_stat.st_ino)))
+        return false;
+
+      s.library_files.swap (it->library_files);
+      s.library_macros.swap (it->library_macros);
+      warm_tapset_sets.erase (it);
+      if (s.verbose > 1)
+        clog << _F("Using %zu tapset files parsed by the server worker",
+                   s.library_files.size()) << endl;
+      return true;
+    }
+  return false;
+}
+
+
+static int
+load_module_dwarf (Dwfl_Module *mod, void **, const char *, Dwarf_Addr, void *)
+{
+  Dwarf_Addr bias;
+  (void) dwfl_module_getdwarf (mod, &bias);
+  return DWARF_CB_OK;
+}
+
+
+// Parse the tapsets as each privilege level would see them, and load
+// the kernel's debuginfo, before taking requests.  A parse that drew
+// errors or warnings is dropped, for the requests to repeat and report.
+static void
+warm_up (systemtap_session& s)
+{
+  if (!s.sysroot.empty())
+    return;
+
+  s.kernel_base_release.assign(s.kernel_release, 0, s.kernel_release.find('-'));
+  if (s.parse_kernel_config () != 0
+      || s.parse_kernel_exports () != 0
+      || s.parse_kernel_functions () != 0)
+    return;
+  warm_kernel_data = true;
+  warm_session = &s;
+  warm_debuginfo_path = getenv ("SYSTEMTAP_DEBUGINFO_PATH") ?: "";
+
+  static const privilege_t levels[] = { pr_stapdev, pr_stapsys, pr_stapusr };
+  privilege_t saved_privilege = s.privilege;
+  for (unsigned i = 0; i < sizeof (levels) / sizeof (levels[0]); i++)
+    {
+      size_t errors = s.seen_errors.size();
+      size_t warnings = s.seen_warnings.size();
+      struct stat no_user_file;
+
+      s.privilege = levels[i];
+      int rc = parse_library_files (s, -1, no_user_file);
+
+      warm_tapsets w;
+      w.privilege = levels[i];
+      w.library_files.swap (s.library_files);
+      w.library_macros.swap (s.library_macros);
+      if (rc || s.seen_errors.size() != errors
+          || s.seen_warnings.size() != warnings)
+        continue;
+
+      for (unsigned j = 0; j < w.library_files.size(); j++)
+        {
+          struct stat st;
+          if (stat (w.library_files[j]->name.c_str(), &st) == 0)
+            w.inodes.insert (make_pair (st.st_dev, st.st_ino));
+        }
+      warm_tapset_sets.push_back (w);
+    }
+  s.privilege = saved_privilege;
+
+  // Reporting the kernel leaves its Dwfl cached in setupdwfl.cxx, for
+  // the translators' own setup_dwfl_kernel ("kernel") to find.
+  try
+    {
+      unsigned found;
+      DwflPtr dwfl = setup_dwfl_kernel ("kernel", &found, s);
+      dwfl_getmodules (dwfl->dwfl, load_module_dwarf, NULL, 0);
+    }
+  catch (const semantic_error& e)
+    {
+      if (s.verbose > 1)
+        clog << e.what() << endl;
+    }
+
+  if (s.verbose > 1)
+    clog << _F("Server worker parsed tapsets for %zu privilege levels",
+               warm_tapset_sets.size()) << endl;
+}
+
+
+// Compilation passes 0 through 4
+static int
+passes_0_4 (systemtap_session &s)
+{
+  int rc = 0;
+
+  // If we don't know the release, there's no hope either locally or on a server.
+  if (s.kernel_release.empty())
+    {
+      if (s.kernel_build_tree.empty())
+        cerr << _("ERROR: kernel release isn't specified") << endl;
+      else
+        cerr << _F("ERROR: kernel release isn't found in \"%s\"",
+                   s.kernel_build_tree.c_str()) << endl;
+      return 1;
+    }
+
+  // Perform passes 0 through 4 using a compile server?
+  if (! s.specified_servers.empty ())
+    {
+#if HAVE_NSS
+      compile_server_client client (s);
+      int rc = client.passes_0_4 ();
+      // Need to give a user a better diagnostic, if she didn't
+      // even ask for a server
+      if (rc && s.automatic_server_mode) {
+        cerr << _("Note: --use-server --unprivileged was selected because of stapusr membership.") << endl;
+      }
+      return rc;
+#else
+      s.print_warning("Without NSS, using a compile-server is not supported by this version of systemtap");
+      // This cannot be an attempt to use a server after a local compile failed
+      // since --use-server-on-error is locked to 'no' if we don't have
+      // NSS.
+      assert (! s.try_server ());
+#endif
+    }
+
+  // PASS 0: setting up
+  s.verbose = s.perpass_verbose[0];
+  PROBE1(stap, pass0__start, &s);
+  profile_timer pass_timer (s.profile, "pass", "0");
+
+  // For PR1477, we used to override $PATH and $LC_ALL and other stuff
+  // here.  We seem to use complete pathnames in
+  // buildrun.cxx/tapsets.cxx now, so this is not necessary.  Further,
+  // it interferes with util.cxx:find_executable(), used for $PATH
+  // resolution.
+
+  s.kernel_base_release.assign(s.kernel_release, 0, s.kernel_release.find('-'));
+
+  // A translator forked by a server worker for a request with other
+  // settings than the worker's mustn't reuse the kernel Dwfl it cached,
+  // which is only known by its module names.  Nor any of the rest.
+  if (warm_session && !warm_settings_match (s))
+    {
+      if (s.verbose > 1)
+        clog << _("Request differs from the server worker's settings, not using its cache") << endl;
+      reset_setup_dwfl ();
+      warm_session = NULL;
+    }
+
+  // Update various paths to include the sysroot, if provided.
+  if (!s.sysroot.empty())
+    {
+      if (s.update_release_sysroot && !s.sysroot.empty())
+        s.kernel_build_tree = s.sysroot + s.kernel_build_tree;
+      debuginfo_path_insert_sysroot(s.sysroot);
+    }
+
+  // Now that no further changes to s.kernel_build_tree can occur, let's use it.
+  if (!borrow_warm_kernel_data (s)
+      && ((rc = s.parse_kernel_config ()) != 0
+          || (rc = s.parse_kernel_exports ()) != 0
+          || (rc = s.parse_kernel_functions ()) != 0))
+    {
+      // Try again with a server
+      s.set_try_server ();
+      return rc;
+    }
+
+  // Create the name of the C source file within the temporary
+  // directory.  Note the _src prefix, explained in
+  // buildrun.cxx:compile_pass()
+  s.translated_source = string(s.tmpdir) + "/" + s.module_name + "_src.c";
+
+  pass_timer.stop ();
+  PROBE1(stap, pass0__end, &s);
+
+  struct tms tms_before;
+  times (& tms_before);
+  struct timeval tv_before;
+  gettimeofday (&tv_before, NULL);
+
+  // PASS 1a: PARSING LIBRARY SCRIPTS
+  PROBE1(stap, pass1a__start, &s);
+  pass_timer.start ("pass", "1");
+
+  // We need to handle the library scripts first because this pass
+  // gathers information on .stpm files that might be needed to
+  // parse the user script.
+
+  // We need to first ascertain the status of the user script, though.
+  struct stat user_file_stat;
+  int user_file_stat_rc = -1;
+
+  if (s.script_file == "-")
+    {
+      user_file_stat_rc = fstat (STDIN_FILENO, & user_file_stat);
+    }
+  else if (s.script_file != "")
+    {
+      user_file_stat_rc = stat (s.script_file.c_str(), & user_file_stat);
+    }
+  // otherwise, rc is 0 for a command line script
+
+  if (!borrow_warm_tapsets (s, user_file_stat_rc, user_file_stat))
+    rc = parse_library_files (s, user_file_stat_rc, user_file_stat);
   if (s.num_errors())
     rc ++;
 
@@ -696,6 +888,7 @@ passes_0_4 (systemtap_session &s)
   if (rc && !s.listing_mode)
     cerr << _("Pass 1: parse failed.  [man error::pass1]") << endl;
 
+  pass_timer.stop ();
   PROBE1(stap, pass1__end, &s);
 
   assert_no_interrupts();
@@ -707,6 +900,7 @@ passes_0_4 (systemtap_session &s)
   // PASS 2: ELABORATION
   s.verbose = s.perpass_verbose[1];
   PROBE1(stap, pass2__start, &s);
+  pass_timer.start ("pass", "2");
   rc = semantic_pass (s);
 
   // Dump a list of known probe point types, if requested.
@@ -731,6 +925,7 @@ passes_0_4 (systemtap_session &s)
   if (rc && !s.listing_mode && !s.try_server ())
     cerr << _("Pass 2: analysis failed.  [man error::pass2]") << endl;
 
+  pass_timer.stop ();
   PROBE1(stap, pass2__end, &s);
 
   assert_no_interrupts();
@@ -781,6 +976,7 @@ passes_0_4 (systemtap_session &s)
   times (& tms_before);
   gettimeofday (&tv_before, NULL);
   PROBE1(stap, pass3__start, &s);
+  pass_timer.start ("pass", "3");
 
   rc = translate_pass (s);
   if (! rc && s.last_pass == 3)
@@ -803,6 +999,7 @@ passes_0_4 (systemtap_session &s)
   if (rc && ! s.try_server ())
     cerr << _("Pass 3: translation failed.  [man error::pass3]") << endl;
 
+  pass_timer.stop ();
   PROBE1(stap, pass3__end, &s);
 
   assert_no_interrupts();
@@ -813,6 +1010,7 @@ passes_0_4 (systemtap_session &s)
   times (& tms_before);
   gettimeofday (&tv_before, NULL);
   PROBE1(stap, pass4__start, &s);
+  pass_timer.start ("pass", "4");
 
   if (s.use_cache)
     {
@@ -860,6 +1058,7 @@ passes_0_4 (systemtap_session &s)
 	}
     }
 
+  pass_timer.stop ();
   PROBE1(stap, pass4__end, &s);
 
   return rc;
@@ -878,6 +1077,7 @@ pass_5 (systemtap_session &s, vector<remote*> targets)
   // a "hello, I'm starting" message, but then the others aren't interactive
   // and don't take an indefinite amount of time.
   PROBE1(stap, pass5__start, &s);
+  profile_timer pass_timer (s.profile, "pass", "5");
   if (s.verbose) clog << _("Pass 5: starting run.") << endl;
   int rc = remote::run(targets);
   struct tms tms_after;
@@ -895,6 +1095,7 @@ pass_5 (systemtap_session &s, vector<remote*> targets)
     // Interrupting pass-5 to quit is normal, so we want an EXIT_SUCCESS below.
     pending_interrupts = 0;
 
+  pass_timer.stop ();
   PROBE1(stap, pass5__end, &s);
 
   return rc;
@@ -905,6 +1106,7 @@ cleanup (systemtap_session &s, int rc)
 {
   // PASS 6: cleaning up
   PROBE1(stap, pass6__start, &s);
+  profile_timer pass_timer (s.profile, "pass", "6");
 
   for (systemtap_session::session_map_t::iterator it = s.subsessions.begin();
        it != s.subsessions.end(); ++it)
@@ -919,6 +1121,7 @@ cleanup (systemtap_session &s, int rc)
 #endif
   }
 
+  pass_timer.stop ();
   PROBE1(stap, pass6__end, &s);
 }
 
@@ -943,12 +1146,142 @@ passes_0_4_again_with_server (systemtap_session &s)
   return rc;
 }
 
+static int stap_main (int argc, char * const argv []);
+
+static pid_t worker_child;
+
+static void
+handle_worker_interrupt (int sig)
+{
+  if (worker_child > 0)
+    kill (worker_child, SIGTERM);
+  handle_interrupt (sig);
+}
+
+
+// Run one request in the forked translator: the working directory, the
+// files for stdin, stdout and stderr, the number of environment
+// variables, those variables, and stap's command line.
+static int
+run_worker_request (const vector<string>& req, size_t nenv)
+{
+  static const int flags[3] = { O_RDONLY, O_WRONLY|O_CREAT,
+                                O_WRONLY|O_APPEND|O_CREAT };
+
+  if (chdir (req[0].c_str()) != 0)
+    return EXIT_FAILURE;
+  for (int i = 0; i < 3; i++)
+    {
+      int fd = open (req[1 + i].c_str(), flags[i], 0600);
+      if (fd < 0 || dup2 (fd, i) < 0)
+        return EXIT_FAILURE;
+      if (fd != i)
+        close (fd);
+    }
+
+  // As with posix_spawn, a given environment replaces ours.
+  if (nenv > 0)
+    {
+      clearenv ();
+      for (size_t i = 0; i < nenv; i++)
+        putenv (strdup (req[5 + i].c_str()));
+    }
+
+  vector<char*> argv;
+  for (size_t i = 5 + nenv; i < req.size(); i++)
+    argv.push_back (const_cast<char*> (req[i].c_str()));
+  argv.push_back (NULL);
+
+  optind = 0; // have getopt_long start over
+  int rc = stap_main (argv.size() - 1, &argv[0]);
+  cout.flush ();
+  cerr.flush ();
+  clog.flush ();
+  fflush (NULL);
+  return rc;
+}
+
+
+// Serve stap-serverd's requests on s.server_worker_fd until it closes
+// it, which is how it recycles us.  The reply to each is the exit code
+// of the translator that ran it.
+static int
+server_worker (systemtap_session& s)
+{
+  int fd = s.server_worker_fd;
+
+  warm_up (s);
+  setup_signals (&handle_worker_interrupt);
+
+  vector<string> req;
+  while (!pending_interrupts && read_string_vector (fd, req))
+    {
+      if (req.size() < 6)
+        break;
+      size_t nenv = strtoul (req[4].c_str(), NULL, 10);
+      if (req.size() < 6 + nenv)
+        break;
+
+      cout.flush ();
+      cerr.flush ();
+      clog.flush ();
+      fflush (NULL);
+      pid_t pid = fork ();
+      if (pid < 0)
+        break;
+      if (pid == 0)
+        {
+          close (fd);
+          _exit (run_worker_request (req, nenv));
+        }
+
+      worker_child = pid;
+      int status;
+      int rc = waitpid (pid, &status, 0);
+      worker_child = 0;
+      if (rc != pid)
+        break;
+      rc = WIFEXITED (status) ? WEXITSTATUS (status) : 128 + WTERMSIG (status);
+
+      if (!write_string_vector (fd, vector<string> (1, lex_cast (rc))))
+        break;
+    }
+  return EXIT_SUCCESS;
+}
+
+
 int
 main (int argc, char * const argv [])
+{
+  return stap_main (argc, argv);
+}
+
+
+// Writes out and frees the --profile report of a session when it goes out
+// of scope, so that runs ended by an error or an interrupt are reported too.
+struct profile_writer
+{
+  systemtap_session& s;
+  profile_writer (systemtap_session& s): s(s) {}
+  ~profile_writer ()
+    {
+      if (s.profile)
+        {
+          s.profile->write ();
+          delete s.profile;
+          s.profile = NULL;
+        }
+    }
+};
+
+
+static int
+stap_main (int argc, char * const argv [])
 {
   // Initialize defaults.
   try {
     systemtap_session s;
+    profile_writer write_profile (s);
 
     setlocale (LC_ALL, "");
     bindtextdomain (PACKAGE, LOCALEDIR);
@@ -993,6 +1326,13 @@ main (int argc, char * const argv [])
     if (rc != 0)
       return rc;
 
+    if (s.server_worker_fd >= 0)
+      {
+        wordfree (& words);
+        free (extended_argv);
+        return server_worker (s);
+      }
+
     if (words.we_wordc > 0 && s.verbose > 1)
       clog << _F("Extra options in %s: %d\n", rc_file.c_str(), (int)words.we_wordc);
 
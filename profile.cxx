@@ -0,0 +1,145 @@
+// systemtap translator profiling
+// Copyright (C) 2013 Red Hat Inc.
+//
+// This file is part of systemtap, and is free software.  You can
+// redistribute it and/or modify it under the terms of the GNU General
+// Public License (GPL); either version 2, or (at your option) any
+// later version.
+
+#include "config.h"
+#include "profile.h"
+#include "util.h"
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+
+using namespace std;
+
+
+static unsigned long long
+usecs (const struct timeval& tv)
+{
+  return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+
+static unsigned long long
+cpu_usecs (const struct rusage& ru)
+{
+  return usecs (ru.ru_utime) + usecs (ru.ru_stime);
+}
+
+
+void
+profile_timer::start (const string& kind, const string& name)
+{
+  stop ();
+  if (!profile)
+    return;
+
+  entry = &profile->get (kind, name);
+  entry->count ++;
+  if (entry->active++ > 0)
+    return;
+  gettimeofday (&wall, NULL);
+  getrusage (RUSAGE_SELF, &self);
+  getrusage (RUSAGE_CHILDREN, &children);
+}
+
+
+void
+profile_timer::stop ()
+{
+  if (!entry)
+    return;
+
+  profile_entry* e = entry;
+  entry = 0;
+  if (--e->active > 0)
+    return;
+
+  struct timeval now;
+  struct rusage self_now, children_now;
+  gettimeofday (&now, NULL);
+  getrusage (RUSAGE_SELF, &self_now);
+  getrusage (RUSAGE_CHILDREN, &children_now);
+
+  e->wall_us += usecs (now) - usecs (wall);
+  e->cpu_us += cpu_usecs (self_now) - cpu_usecs (self);
+  e->child_cpu_us += cpu_usecs (children_now) - cpu_usecs (children);
+  e->maxrss_kb = self_now.ru_maxrss;
+  e->maxrss_growth_kb += self_now.ru_maxrss - self.ru_maxrss;
+  // ru_maxrss of the children is the largest of them, not a sum, so it
+  // only says something if it grew while this entry ran.
+  if (children_now.ru_maxrss > children.ru_maxrss
+      && children_now.ru_maxrss > e->child_maxrss_kb)
+    e->child_maxrss_kb = children_now.ru_maxrss;
+}
+
+
+static string
+json_string (const string& s)
+{
+  string out = "\"";
+  for (size_t i = 0; i < s.size(); ++i)
+    {
+      unsigned char c = s[i];
+      if (c == '"' || c == '\\')
+        out += '\\', out += c;
+      else if (c == '\n')
+        out += "\\n";
+      else if (c == '\t')
+        out += "\\t";
+      else if (c < 0x20)
+        {
+          char buf[8];
+          snprintf (buf, sizeof (buf), "\\u%04x", c);
+          out += buf;
+        }
+      else
+        out += c;
+    }
+  return out + "\"";
+}
+
+
+bool
+translator_profile::write ()
+{
+  ofstream file;
+  if (!filename.empty())
+    {
+      file.open (filename.c_str());
+      if (!file)
+        {
+          cerr << _F("WARNING: couldn't write profile to %s",
+                     filename.c_str()) << endl;
+          return false;
+        }
+    }
+  ostream& o = filename.empty() ? cerr : file;
+
+  o << "{\"kind\":\"version\",\"name\":" << json_string (VERSION) << "}" << endl;
+  for (map<pair<string, string>, profile_entry>::const_iterator it = entries.begin();
+       it != entries.end(); ++it)
+    {
+      const profile_entry& e = it->second;
+      o << "{\"kind\":" << json_string (it->first.first)
+        << ",\"name\":" << json_string (it->first.second)
+        << ",\"count\":" << e.count
+        << ",\"wall_us\":" << e.wall_us
+        << ",\"cpu_us\":" << e.cpu_us
+        << ",\"child_cpu_us\":" << e.child_cpu_us
+        << ",\"maxrss_kb\":" << e.maxrss_kb
+        << ",\"maxrss_growth_kb\":" << e.maxrss_growth_kb
+        << ",\"child_maxrss_kb\":" << e.child_maxrss_kb;
+      for (map<string, unsigned long>::const_iterator c = e.counters.begin();
+           c != e.counters.end(); ++c)
+        o << "," << json_string (c->first) << ":" << c->second;
+      o << "}" << endl;
+    }
+  return !o.fail();
+}
+
+/* vim: set sw=2 ts=8 cino=>4,n-2,{2,^-2,t0,(0,u0,w1,M1 : */
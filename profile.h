@@ -0,0 +1,85 @@
+// systemtap translator profiling
+// Copyright (C) 2013 Red Hat Inc.
+//
+// This file is part of systemtap, and is free software.  You can
+// redistribute it and/or modify it under the terms of the GNU General
+// Public License (GPL); either version 2, or (at your option) any
+// later version.
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <map>
+#include <string>
+#include <utility>
+
+extern "C" {
+#include <sys/time.h>
+#include <sys/resource.h>
+}
+
+// What --profile has seen of one pass or subsystem, summed over each
+// time it was entered.
+struct profile_entry
+{
+  unsigned long count;               // times entered
+  unsigned long long wall_us;
+  unsigned long long cpu_us;         // user + system, of stap itself
+  unsigned long long child_cpu_us;   // of the children it waited for
+  long maxrss_kb;                    // stap's peak rss when it was left
+  long maxrss_growth_kb;             // how much of that peak it added
+  long child_maxrss_kb;              // largest child waited for
+  unsigned active;                   // timers running, to skip nested ones
+  std::map<std::string, unsigned long> counters;
+
+  profile_entry ():
+    count (0), wall_us (0), cpu_us (0), child_cpu_us (0),
+    maxrss_kb (0), maxrss_growth_kb (0), child_maxrss_kb (0), active (0) {}
+};
+
+// The --profile report: an entry per kind of thing measured, and its
+// name, such as ("pass", "2"), ("builder", "dwarf_builder"),
+// ("dwflpp", "kernel"), ("optimize", "dead statements") or ("make", ...).
+struct translator_profile
+{
+  std::string filename; // or empty, for stderr
+  std::map<std::pair<std::string, std::string>, profile_entry> entries;
+
+  profile_entry& get (const std::string& kind, const std::string& name)
+    { return entries[std::make_pair (kind, name)]; }
+  void count (const std::string& kind, const std::string& name,
+              const std::string& counter, unsigned long n = 1)
+    { get (kind, name).counters[counter] += n; }
+  void cache_lookup (const std::string& kind, const std::string& name,
+                     const std::string& cache, bool hit)
+    { count (kind, name, cache + (hit ? "_hits" : "_misses")); }
+
+  // One line of JSON per entry.
+  bool write ();
+};
+
+// Charges the time and memory used between start() and stop() to an
+// entry of the profile.  A timer started while another is running for
+// the same entry, say by a recursive call, only counts the entry.  With
+// no profile, the timer does nothing, so it costs little to leave in.
+class profile_timer
+{
+  translator_profile* profile;
+  profile_entry* entry;
+  struct timeval wall;
+  struct rusage self, children;
+
+public:
+  profile_timer (translator_profile* p): profile (p), entry (0) {}
+  profile_timer (translator_profile* p, const std::string& kind,
+                 const std::string& name):
+    profile (p), entry (0) { start (kind, name); }
+  ~profile_timer () { stop (); }
+
+  void start (const std::string& kind, const std::string& name);
+  void stop ();
+};
+
+#endif // PROFILE_H
+
+/* vim: set sw=2 ts=8 cino=>4,n-2,{2,^-2,t0,(0,u0,w1,M1 : */
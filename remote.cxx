@@ -18,8 +18,11 @@ extern "C" {
 #include <sys/un.h>
 }
 
+#include <algorithm>
 #include <cstdio>
+#include <fstream>
 #include <iomanip>
+#include <map>
 #include <memory>
 #include <stdexcept>
 #include <sstream>
@@ -27,6 +30,7 @@ extern "C" {
 #include <vector>
 
 #include "buildrun.h"
+#include "hash.h"
 #include "remote.h"
 #include "util.h"
 
@@ -120,12 +124,84 @@ class direct : public remote {
 };
 
 
+// The files we send to stapsh remotes, read once and shared by all of
+// them.  The hash names the uncompressed contents in the remote's cache.
+struct stapsh_file {
+  string hash;
+  string data;
+  bool compressed;
+};
+
+static const stapsh_file*
+load_stapsh_file(systemtap_session& s, const string& path, bool compress)
+{
+  static map<pair<string, bool>, stapsh_file> files;
+
+  pair<string, bool> key = make_pair(path, compress);
+  map<pair<string, bool>, stapsh_file>::iterator it = files.find(key);
+  if (it != files.end())
+    return &it->second;
+
+  ifstream in(path.c_str(), ios::in | ios::binary);
+  ostringstream contents;
+  if (!in || !(contents << in.rdbuf()))
+    return NULL;
+
+  stapsh_file& f = files[key];
+  f.data = contents.str();
+  f.hash = find_contents_hash(f.data);
+  f.compressed = false;
+
+  if (compress)
+    {
+      vector<string> cmd;
+      cmd.push_back("gzip");
+      cmd.push_back("-c");
+      cmd.push_back("-n");
+      cmd.push_back("--");
+      cmd.push_back(path);
+
+      // Only bother if gzip works and actually helps.
+      ostringstream zdata;
+      if (stap_system_read(s.verbose, cmd, zdata) == 0 &&
+          zdata.str().size() < f.data.size())
+        {
+          f.data = zdata.str();
+          f.compressed = true;
+        }
+    }
+
+  return &f;
+}
+
+
 class stapsh : public remote {
   private:
     int interrupts_sent;
     int fdin, fdout;
     FILE *IN, *OUT;
     string remote_version;
+    bool remote_cache; // the remote said it knows "have" and "zfile"
+
+    // Files still to be sent by prepare_upload_poll/handle_upload_poll
+    struct upload {
+      string dest;
+      const stapsh_file* file;
+      bool cached; // the remote already had it
+    };
+    vector<upload> uploads;
+    unsigned upload_index;
+    string upload_buf;
+    size_t upload_sent;
+    enum { UPLOAD_QUERY, UPLOAD_SEND, UPLOAD_REPLY, UPLOAD_DONE } upload_state;
+
+    // An older stapsh silently drops commands it doesn't know, and never
+    // replies, so "have", "zfile", and hashes for "file" are only used if
+    // it agreed to them in the hello.
+    bool remote_has_cache()
+      {
+        return remote_cache;
+      }
 
     virtual void prepare_poll(vector<pollfd>& fds)
       {
@@ -228,63 +304,159 @@ class stapsh : public remote {
         return 0;
       }
 
-    int send_file(const string& filename, const string& dest)
+    bool check_reply(const string& what)
       {
-        int rc = 0;
-        FILE* f = fopen(filename.c_str(), "r");
-        if (!f)
-          return 1;
+        string reply = get_reply();
+        if (reply == "OK\n")
+          return true;
 
-        struct stat fs;
-        rc = fstat(fileno(f), &fs);
-        if (!rc)
+        if (s->verbose > 0)
           {
-            ostringstream cmd;
-            cmd << "file " << fs.st_size << " " << dest << "\n";
-            rc = send_command(cmd.str());
+            if (reply.empty())
+              clog << _F("stapsh %s ERROR: no reply", what.c_str()) << endl;
+            else
+              clog << _F("stapsh %s replied %s", what.c_str(), reply.c_str());
           }
+        return false;
+      }
 
-        off_t i = 0;
-        while (!rc && i < fs.st_size)
+    int add_upload(const string& filename, const string& dest)
+      {
+        bool cache = remote_has_cache();
+        upload u;
+        u.dest = dest;
+        u.file = load_stapsh_file(*s, filename, cache && s->use_remote_compress);
+        u.cached = false;
+        if (!u.file)
+          return 1;
+        uploads.push_back(u);
+        return 0;
+      }
+
+    // Move on to the next file the remote doesn't have yet.
+    void next_upload()
+      {
+        while (upload_index < uploads.size() && uploads[upload_index].cached)
+          ++upload_index;
+
+        if (upload_index >= uploads.size())
           {
-            char buf[4096];
-            size_t r = sizeof(buf);
-            if (fs.st_size - i < (off_t)r)
-              r = fs.st_size - i;
-            r = fread(buf, 1, r, f);
-            if (r == 0)
-              rc = 1;
-            else
-              {
-                size_t w = fwrite(buf, 1, r, IN);
-                if (w != r)
-                  rc = 1;
-                else
-                  i += w;
-              }
+            upload_state = UPLOAD_DONE;
+            return;
           }
-        if (!rc)
-          rc = fflush(IN);
 
-        fclose(f);
+        const upload& u = uploads[upload_index];
+        ostringstream cmd;
+        cmd << (u.file->compressed ? "zfile " : "file ")
+            << u.file->data.size() << " " << u.dest;
+        if (remote_has_cache())
+          cmd << " " << u.file->hash;
+        cmd << "\n";
 
-        if (!rc)
+        upload_buf = cmd.str();
+        upload_sent = 0;
+        upload_state = UPLOAD_SEND;
+
+        // Write without blocking, so other remotes can be fed meanwhile.
+        set_upload_nonblock(true);
+      }
+
+    void set_upload_nonblock(bool nonblock)
+      {
+        long flags = fcntl(fdin, F_GETFL);
+        if (nonblock)
+          flags |= O_NONBLOCK;
+        else
+          flags &= ~O_NONBLOCK;
+        fcntl(fdin, F_SETFL, flags);
+      }
+
+    // Give up on the uploads, leaving fdin blocking again for whatever
+    // else is still said to stapsh, like "quit".
+    int fail_upload()
+      {
+        if (upload_state == UPLOAD_SEND && fdin >= 0)
+          set_upload_nonblock(false);
+        upload_state = UPLOAD_DONE;
+        return 1;
+      }
+
+    virtual void prepare_upload_poll(vector<pollfd>& fds)
+      {
+        if (!IN || !OUT || upload_state == UPLOAD_DONE)
+          return;
+
+        pollfd p = { fdout, POLLIN, 0 };
+        if (upload_state == UPLOAD_SEND)
           {
-            string reply = get_reply();
-            if (reply != "OK\n")
-              {
-                rc = 1;
-                if (s->verbose > 0)
-                  {
-                    if (reply.empty())
-                      clog << _("stapsh file ERROR: no reply") << endl;
-                    else
-                      clog << _F("stapsh file replied %s", reply.c_str());
-                  }
-              }
+            p.fd = fdin;
+            p.events = POLLOUT;
           }
+        fds.push_back(p);
+      }
 
-        return rc;
+    virtual int handle_upload_poll(vector<pollfd>& fds)
+      {
+        for (unsigned i=0; i < fds.size(); ++i)
+          if (IN && OUT && upload_state != UPLOAD_DONE &&
+              (fds[i].fd == fdin || fds[i].fd == fdout))
+            {
+              if (fds[i].revents & ~(POLLIN|POLLOUT))
+                return fail_upload();
+
+              if (upload_state == UPLOAD_QUERY && (fds[i].revents & POLLIN))
+                {
+                  // The replies to all "have" queries are queued up at
+                  // once, and stdio may buffer several of them, so take
+                  // them all now.
+                  for (unsigned j = 0; j < uploads.size(); ++j)
+                    {
+                      string reply = get_reply();
+                      if (reply.empty())
+                        return fail_upload();
+                      uploads[j].cached = (reply == "OK\n");
+                      if (uploads[j].cached && s->verbose > 1)
+                        clog << _F("stapsh already has %s",
+                                   uploads[j].dest.c_str()) << endl;
+                    }
+                  next_upload();
+                }
+
+              else if (upload_state == UPLOAD_SEND && (fds[i].revents & POLLOUT))
+                {
+                  const upload& u = uploads[upload_index];
+                  const string& buf = (upload_sent < upload_buf.size())
+                    ? upload_buf : u.file->data;
+                  size_t off = (upload_sent < upload_buf.size())
+                    ? upload_sent : upload_sent - upload_buf.size();
+
+                  ssize_t w = write(fdin, buf.data() + off, buf.size() - off);
+                  if (w < 0 && errno != EAGAIN && errno != EINTR)
+                    return fail_upload();
+                  if (w > 0)
+                    upload_sent += w;
+
+                  if (upload_sent == upload_buf.size() + u.file->data.size())
+                    {
+                      set_upload_nonblock(false);
+                      upload_state = UPLOAD_REPLY;
+                    }
+                }
+
+              else if (upload_state == UPLOAD_REPLY && (fds[i].revents & POLLIN))
+                {
+                  const upload& u = uploads[upload_index];
+                  if (!check_reply(u.file->compressed ? "zfile" : "file"))
+                    return fail_upload();
+                  if (s->verbose > 1)
+                    clog << _F("stapsh sent %s (%zu bytes%s)", u.dest.c_str(),
+                               u.file->data.size(),
+                               u.file->compressed ? ", compressed" : "") << endl;
+                  ++upload_index;
+                  next_upload();
+                }
+            }
+        return 0;
       }
 
     static string qpencode(const string& str)
@@ -302,33 +474,51 @@ class stapsh : public remote {
   protected:
     stapsh(systemtap_session& s)
       : remote(s), interrupts_sent(0),
-        fdin(-1), fdout(-1), IN(0), OUT(0)
+        fdin(-1), fdout(-1), IN(0), OUT(0), remote_cache(false),
+        upload_index(0), upload_sent(0), upload_state(UPLOAD_DONE)
       {}
 
     virtual int prepare()
       {
         int rc = 0;
 
+        uploads.clear();
+        upload_index = 0;
+        upload_state = UPLOAD_DONE;
+
         string localmodule = s->tmpdir + "/" + s->module_name + ".ko";
         string remotemodule = s->module_name + ".ko";
-        if ((rc = send_file(localmodule, remotemodule)))
+        if ((rc = add_upload(localmodule, remotemodule)))
           return rc;
 
         if (file_exists(localmodule + ".sgn") &&
-            (rc = send_file(localmodule + ".sgn", remotemodule + ".sgn")))
+            (rc = add_upload(localmodule + ".sgn", remotemodule + ".sgn")))
           return rc;
 
         if (!s->uprobes_path.empty())
           {
             string remoteuprobes = basename(s->uprobes_path.c_str());
-            if ((rc = send_file(s->uprobes_path, remoteuprobes)))
+            if ((rc = add_upload(s->uprobes_path, remoteuprobes)))
               return rc;
 
             if (file_exists(s->uprobes_path + ".sgn") &&
-                (rc = send_file(s->uprobes_path + ".sgn", remoteuprobes + ".sgn")))
+                (rc = add_upload(s->uprobes_path + ".sgn", remoteuprobes + ".sgn")))
               return rc;
           }
 
+        if (!remote_has_cache())
+          {
+            next_upload();
+            return 0;
+          }
+
+        // Ask about every file up front; the actual sending waits for the
+        // answers in handle_upload_poll, alongside all the other remotes.
+        for (unsigned i = 0; i < uploads.size() && !rc; ++i)
+          rc = send_command("have " + uploads[i].file->hash + " "
+                            + uploads[i].dest + "\n");
+        if (!rc)
+          upload_state = UPLOAD_QUERY;
         return rc;
       }
 
@@ -353,21 +543,8 @@ class stapsh : public remote {
 
         int rc = send_command(run.str());
 
-        if (!rc)
-          {
-            string reply = get_reply();
-            if (reply != "OK\n")
-              {
-                rc = 1;
-                if (s->verbose > 0)
-                  {
-                    if (reply.empty())
-                      clog << _("stapsh run ERROR: no reply") << endl;
-                    else
-                      clog << _F("stapsh run replied %s", reply.c_str());
-                  }
-              }
-          }
+        if (!rc && !check_reply("run"))
+          rc = 1;
 
         if (!rc)
           {
@@ -408,18 +585,19 @@ class stapsh : public remote {
         if (!IN || !OUT)
           throw runtime_error(_("invalid file descriptors for stapsh"));
 
-        if (send_command("stap " VERSION "\n"))
+        if (send_command("stap " VERSION " cache\n"))
           throw runtime_error(_("error sending hello to stapsh"));
 
         string reply = get_reply();
         if (reply.empty())
           throw runtime_error(_("error receiving hello from stapsh"));
 
-        // stapsh VERSION MACHINE RELEASE
+        // stapsh VERSION MACHINE RELEASE [cache]
         vector<string> uname;
         tokenize(reply, uname, " \t\r\n");
-        if (uname.size() != 4 || uname[0] != "stapsh")
+        if (uname.size() < 4 || uname[0] != "stapsh")
           throw runtime_error(_("failed to get uname from stapsh"));
+        this->remote_cache = find(uname.begin() + 4, uname.end(), "cache") != uname.end();
 
         // We assume that later versions will know how to talk to us.
         // Looking backward, we use this for make_run_command().
@@ -964,6 +1142,32 @@ remote::run(const vector<remote*>& remotes)
         return rc;
     }
 
+  // Send the files to all remotes at once, so slow targets don't hold
+  // up the others.
+  {
+    stap_sigmasker masked;
+
+    while (!pending_interrupts)
+      {
+        vector<pollfd> fds;
+        for (unsigned i = 0; i < remotes.size(); ++i)
+          remotes[i]->prepare_upload_poll (fds);
+        if (fds.empty())
+          break;
+
+        rc = ppoll (&fds[0], fds.size(), NULL, &masked.old);
+        if (rc < 0 && errno != EINTR)
+          return 1;
+
+        for (unsigned i = 0; i < remotes.size(); ++i)
+          {
+            rc = remotes[i]->handle_upload_poll (fds);
+            if (rc)
+              return rc;
+          }
+      }
+  }
+
   for (unsigned i = 0; i < remotes.size() && !pending_interrupts; ++i)
     {
       rc = remotes[i]->start();
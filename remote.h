@@ -24,6 +24,9 @@ class remote {
     virtual int start() = 0;
     virtual int finish() = 0;
 
+    virtual void prepare_upload_poll(std::vector<pollfd>&) {}
+    virtual int handle_upload_poll(std::vector<pollfd>&) { return 0; }
+
     virtual void prepare_poll(std::vector<pollfd>&) {}
     virtual void handle_poll(std::vector<pollfd>&) {}
 
@@ -56,10 +56,13 @@ int actionremaining;
 
 /* The current nesting of a function. Needed to determine which "level" of
    locals to use. See the recursion_info traversing_visitor for how the
-   maximum is calculated.  Locals of a function are stored at
-   c->locals[c->nesting], see c_unparser::emit_function ().  */
+   maximum is calculated.  */
 int nesting;
 
+/* Where in locals the next function's frame goes: just past the frame of
+   the function currently running, see c_unparser::emit_function ().  */
+char *next_frame;
+
 /* A place to format error messages into if some error occurs, last_error
    will then be pointed here.  */
 string_t error_buffer;
@@ -116,6 +119,9 @@ union {
 
   /* State for procfs probes, see tapset-procfs.cxx.  */
   void *procfs_data;
+
+  /* State for perf probes, see tapset-perfmon.cxx.  */
+  const struct stap_perf_sample *perf_sample;
 } ips;
 
 
@@ -120,6 +120,11 @@ static void _stp_pmap_del(PMAP pmap)
 }
 
 
+/* Maps in shared memory are always fully preallocated.  */
+#define _stp_map_borrow(m)		0
+#define _stp_map_return_borrowed(m)	do {} while (0)
+
+
 static int
 _stp_map_init(MAP m, unsigned max_entries, int wrap, int node_size)
 {
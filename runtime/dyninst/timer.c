@@ -1,6 +1,6 @@
-/* -*- linux-c -*- 
+/* -*- linux-c -*-
  * Dyninst Timer Functions
- * Copyright (C) 2012 Red Hat Inc.
+ * Copyright (C) 2012-2013 Red Hat Inc.
  *
  * This file is part of systemtap, and is free software.  You can
  * redistribute it and/or modify it under the terms of the GNU General
@@ -11,95 +11,151 @@
 #ifndef _STAPDYN_TIMER_C_
 #define _STAPDYN_TIMER_C_
 
-#include <signal.h>
+#include <poll.h>
 #include <time.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 
 #ifndef NSEC_PER_SEC
 #define NSEC_PER_SEC 1000000000L
 #endif
 
-struct stap_hrtimer_probe {
-	struct sigevent sigev;
-	timer_t timer_id;
-	struct itimerspec its;
-	const struct stap_probe * const probe;
-	int64_t intrv;
-	int64_t rnd;
-};
+static unsigned long stap_hrtimer_resolution = 0;
+
+/* All the timer probes are run from one thread, woken by one timerfd.
+ * The eventfd tells the thread to stop.  */
+static pthread_t _stp_hrtimer_thread;
+static int _stp_hrtimer_fd = -1;
+static int _stp_hrtimer_stop_fd = -1;
 
 
 static void _stp_hrtimer_init(void)
 {
-	return;
+	struct timespec res;
+	if (clock_getres(CLOCK_MONOTONIC, &res) == 0)
+		stap_hrtimer_resolution = res.tv_sec * NSEC_PER_SEC + res.tv_nsec;
+}
+
+
+static inline int64_t _stp_hrtimer_get_interval(struct stap_hrtimer_probe *shp)
+{
+	int64_t i = shp->intrv;
+
+	if (shp->rnd != 0)
+		i += _stp_random_u(shp->rnd);
+	return i;
+}
+
+
+static inline int64_t _stp_hrtimer_now(void)
+{
+	struct timespec now;
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+
+/* Set the timerfd to go off at an absolute expiry, in ns.  */
+static int _stp_hrtimer_arm(int64_t expires)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = expires / NSEC_PER_SEC;
+	its.it_value.tv_nsec = expires % NSEC_PER_SEC;
+	return timerfd_settime(_stp_hrtimer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+
+static void *_stp_hrtimer_thread_fn(void *arg)
+{
+	struct pollfd fds[2];
+
+	(void)arg;
+	fds[0].fd = _stp_hrtimer_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = _stp_hrtimer_stop_fd;
+	fds[1].events = POLLIN;
+
+	for (;;) {
+		uint64_t expirations;
+		int64_t next;
+
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (fds[1].revents)
+			break;
+		if (!(fds[0].revents & POLLIN)
+		    || read(_stp_hrtimer_fd, &expirations,
+			    sizeof(expirations)) != sizeof(expirations))
+			continue;
+
+		next = _stp_hrtimer_dispatch(_stp_hrtimer_now());
+
+		if ((atomic_read (session_state()) != STAP_SESSION_STARTING) &&
+		    (atomic_read (session_state()) != STAP_SESSION_RUNNING))
+			break;
+		if (_stp_hrtimer_arm(next) != 0)
+			break;
+	}
+	return NULL;
 }
 
 
+/* Arm the timer for the earliest of the queued probes, and start the
+ * thread that runs them.  */
 static int
-_stp_hrtimer_create(struct stap_hrtimer_probe *shp, void (*function)(sigval_t))
+_stp_hrtimer_start(void (*fire)(struct stap_hrtimer_probe *))
 {
 	int rc;
 
-	/* Create the timer. */
-	shp->sigev.sigev_notify = SIGEV_THREAD;
-	shp->sigev.sigev_value.sival_ptr = shp;
-	shp->sigev.sigev_notify_function = function;
-	shp->sigev.sigev_notify_attributes = NULL;
-	rc = timer_create(CLOCK_MONOTONIC, &shp->sigev, &shp->timer_id);
-	if (rc) {
-		return rc;
+	_stp_hrtimer_fire = fire;
+	_stp_hrtimer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (_stp_hrtimer_fd < 0)
+		return -errno;
+	_stp_hrtimer_stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (_stp_hrtimer_stop_fd < 0) {
+		rc = -errno;
+		goto err_timerfd;
 	}
 
-	/* Specify a timer with the correct initial value (possibly
-	 * randomized a bit).
-	 *
-	 * If this isn't a randomized timer probe, go ahead and set
-	 * up the repeating interval values.
-	 *
-	 * The probe's interval is in nanoseconds,
-	 * but in a int64_t. So, break it down into seconds and
-	 * (leftover) nanoseconds so it will fit in a 'struct
-	 * timespec'.
-	 */
-
-	if (shp->rnd == 0) {
-		shp->its.it_value.tv_sec = (shp->its.it_interval.tv_sec	\
-					    = shp->intrv / NSEC_PER_SEC);
-		shp->its.it_value.tv_nsec = (shp->its.it_interval.tv_nsec \
-					     = shp->intrv % NSEC_PER_SEC);
+	if (_stp_hrtimer_arm(_stp_hrtimer_queue[0]->expires) != 0) {
+		rc = -errno;
+		goto err_eventfd;
 	}
-	else {
-		int64_t i = shp->intrv + _stp_random_u(shp->rnd);
-		shp->its.it_value.tv_sec = i / NSEC_PER_SEC;
-		shp->its.it_value.tv_nsec = i % NSEC_PER_SEC;
+	rc = pthread_create(&_stp_hrtimer_thread, NULL,
+			    _stp_hrtimer_thread_fn, NULL);
+	if (rc) {
+		rc = -rc;
+		goto err_eventfd;
 	}
-	rc = timer_settime(shp->timer_id, 0, &shp->its, NULL);
+	return 0;
+
+err_eventfd:
+	close(_stp_hrtimer_stop_fd);
+	_stp_hrtimer_stop_fd = -1;
+err_timerfd:
+	close(_stp_hrtimer_fd);
+	_stp_hrtimer_fd = -1;
 	return rc;
 }
 
 
-static void _stp_hrtimer_update(struct stap_hrtimer_probe *shp)
+static void _stp_hrtimer_stop(void)
 {
-	int64_t i = shp->intrv;
+	uint64_t one = 1;
 
-	/* The timer only needs updating if this is a randomized timer
-	 * probe */
-	if (shp->rnd == 0)
+	if (_stp_hrtimer_fd < 0)
 		return;
 
-	/* The probe's interval is in nanoseconds, but in a
-	 * int64_t. So, break it down into seconds and (leftover)
-	 * nanoseconds.
-	 */
-	i += _stp_random_u(shp->rnd);
-	shp->its.it_value.tv_sec = i / NSEC_PER_SEC;
-	shp->its.it_value.tv_nsec = i % NSEC_PER_SEC;
-	timer_settime(shp->timer_id, 0, &shp->its, NULL);
-}
-
-
-static void _stp_hrtimer_cancel(struct stap_hrtimer_probe *shp)
-{
-	(void) timer_delete(shp->timer_id);
+	if (write(_stp_hrtimer_stop_fd, &one, sizeof(one)) == sizeof(one))
+		(void)pthread_join(_stp_hrtimer_thread, NULL);
+	close(_stp_hrtimer_stop_fd);
+	close(_stp_hrtimer_fd);
+	_stp_hrtimer_stop_fd = _stp_hrtimer_fd = -1;
 }
 
 #endif /* _STAPDYN_TIMER_C_ */
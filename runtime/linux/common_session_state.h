@@ -43,6 +43,253 @@ static inline Stat probe_timing(size_t index)
 #endif
 
 
+#ifdef STP_PREFILTER
+// Hits of each probe rejected by its pre-handler filter.
+static atomic_t g_probe_prefiltered[STP_PROBE_COUNT];
+static inline atomic_t *probe_prefiltered(size_t index)
+{
+	// Do some simple bounds-checking.  Translator-generated code
+	// should never get this wrong, but better to be safe.
+	index = clamp_t(size_t, index, 0, STP_PROBE_COUNT - 1);
+	return &g_probe_prefiltered[index];
+}
+#endif
+
+
+#if defined(STP_OVERLOAD) && defined(STP_OVERLOAD_SAMPLE)
+// Sampling state for the overload policy; see runtime_defines.h.  Only
+// each probe's rate is shared between cpus.  The hits and cycles are
+// counted per cpu, by the cpu the probe runs on, so the hot path needs
+// no atomics; a count lost to a nested probe only nudges the sampling.
+static atomic_t g_probe_sample_shift[STP_PROBE_COUNT]; // run 1 in (1 << shift) hits
+
+struct stp_probe_sample {
+	unsigned long hits;		// hits seen while sampling
+	unsigned long sampled_out;	// hits dropped by sampling
+	unsigned long long cycles;	// cycles spent in the interval below
+	unsigned long interval;		// this cpu's interval they belong to
+	int hot;			// in the hot list of that interval
+};
+
+// Each cpu keeps a list of the probes that took the most cycles of its
+// current interval, updated as they are charged, so that the end of an
+// interval only looks at those rather than at every probe.  The cycles
+// of the other probes are reset lazily, when a new interval charges them.
+struct stp_probe_sample_cpu {
+	unsigned long interval;
+	unsigned nhot;
+	size_t hot[STP_OVERLOAD_SAMPLE_HOT];
+	struct stp_probe_sample probes[STP_PROBE_COUNT];
+};
+static struct stp_probe_sample_cpu *g_probe_sample[NR_CPUS];
+
+static inline atomic_t *probe_sample_shift(size_t index)
+{
+	// Do some simple bounds-checking.  Translator-generated code
+	// should never get this wrong, but better to be safe.
+	index = clamp_t(size_t, index, 0, STP_PROBE_COUNT - 1);
+	return &g_probe_sample_shift[index];
+}
+
+// Returns nonzero if this hit should be dropped rather than run.
+static inline int _stp_probe_sample_skip(size_t index)
+{
+	struct stp_probe_sample_cpu *psc;
+	struct stp_probe_sample *ps;
+	int shift = atomic_read(probe_sample_shift(index));
+	if (likely(shift == 0))
+		return 0;
+	psc = g_probe_sample[smp_processor_id()];
+	if (unlikely(!psc))
+		return 0;
+	ps = &psc->probes[clamp_t(size_t, index, 0, STP_PROBE_COUNT - 1)];
+	if ((++ps->hits & ((1UL << shift) - 1)) == 0)
+		return 0;
+	ps->sampled_out++;
+	return 1;
+}
+
+// Charge the cycles of a hit to its probe, on this cpu, and keep the
+// hot list of the interval up to date: a probe not in it yet replaces
+// the coolest one once it has taken more cycles.
+static inline void _stp_probe_sample_charge(size_t index, int32_t cycles)
+{
+	struct stp_probe_sample_cpu *psc = g_probe_sample[smp_processor_id()];
+	struct stp_probe_sample *ps;
+	unsigned i, coolest = 0;
+
+	if (unlikely(!psc))
+		return;
+	index = clamp_t(size_t, index, 0, STP_PROBE_COUNT - 1);
+	ps = &psc->probes[index];
+	if (ps->interval != psc->interval) {
+		ps->interval = psc->interval;
+		ps->cycles = 0;
+		ps->hot = 0;
+	}
+	ps->cycles += cycles;
+	if (ps->hot)
+		return;
+	if (psc->nhot < STP_OVERLOAD_SAMPLE_HOT) {
+		psc->hot[psc->nhot++] = index;
+		ps->hot = 1;
+		return;
+	}
+	for (i = 1; i < STP_OVERLOAD_SAMPLE_HOT; ++i)
+		if (psc->probes[psc->hot[i]].cycles
+		    < psc->probes[psc->hot[coolest]].cycles)
+			coolest = i;
+	if (psc->probes[psc->hot[coolest]].cycles < ps->cycles) {
+		psc->probes[psc->hot[coolest]].hot = 0;
+		psc->hot[coolest] = index;
+		ps->hot = 1;
+	}
+}
+
+// Called when an interval of this cpu ends overloaded, after cycles_sum
+// cycles in its probes.  Halves the rate of the hot probes that used the
+// most of them, until that should bring the cpu under the threshold.
+// Returns zero if none of them could be throttled any further, so the
+// caller should give up instead.
+static int _stp_probe_sample_overload(unsigned long long cycles_sum)
+{
+	struct stp_probe_sample_cpu *psc = g_probe_sample[smp_processor_id()];
+	int throttled = 0;
+	unsigned i;
+
+	if (unlikely(!psc))
+		return 0;
+	while (cycles_sum > STP_OVERLOAD_THRESHOLD) {
+		unsigned long long most = 0;
+		size_t top = 0;
+		int shift;
+
+		for (i = 0; i < psc->nhot; ++i)
+			if (psc->probes[psc->hot[i]].cycles > most) {
+				most = psc->probes[psc->hot[i]].cycles;
+				top = psc->hot[i];
+			}
+		if (most == 0)
+			break;
+		psc->probes[top].cycles = 0;
+		shift = atomic_read(&g_probe_sample_shift[top]);
+		if (shift >= STP_OVERLOAD_SAMPLE_MAXSHIFT)
+			continue;
+		// NB: racing cpus may both bump the shift; that's fine, it
+		// just throttles a bit faster and is undone by _quiet.
+		atomic_cmpxchg(&g_probe_sample_shift[top], shift, shift + 1);
+		throttled = 1;
+		cycles_sum -= min(cycles_sum, most / 2);
+	}
+	return throttled;
+}
+
+// Called when an interval of this cpu ends with its load subsided:
+// doubles the rate again of the hot probes that ran in it.
+static void _stp_probe_sample_quiet(void)
+{
+	struct stp_probe_sample_cpu *psc = g_probe_sample[smp_processor_id()];
+	unsigned i;
+
+	if (unlikely(!psc))
+		return;
+	for (i = 0; i < psc->nhot; ++i) {
+		size_t index = psc->hot[i];
+		int shift = atomic_read(&g_probe_sample_shift[index]);
+		if (shift > 0)
+			atomic_cmpxchg(&g_probe_sample_shift[index], shift, shift - 1);
+	}
+}
+
+// Called at the end of every interval of this cpu, after the above.
+static inline void _stp_probe_sample_next(void)
+{
+	struct stp_probe_sample_cpu *psc = g_probe_sample[smp_processor_id()];
+
+	if (unlikely(!psc))
+		return;
+	psc->interval++;
+	psc->nhot = 0;
+}
+
+// The hits of a probe sampled out, over all cpus.
+static unsigned long _stp_probe_sample_sampled_out(size_t index)
+{
+	unsigned long sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		if (g_probe_sample[cpu])
+			sum += g_probe_sample[cpu]->probes[index].sampled_out;
+	return sum;
+}
+
+static void _stp_probe_sample_exit(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		if (g_probe_sample[cpu] != NULL) {
+			_stp_kfree(g_probe_sample[cpu]);
+			g_probe_sample[cpu] = NULL;
+		}
+	}
+}
+
+static int _stp_probe_sample_init(void)
+{
+	size_t size = sizeof(struct stp_probe_sample_cpu);
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		/* Module init, so in user context, safe to use
+		 * "sleeping" allocation. */
+		g_probe_sample[cpu] = _stp_kzalloc_node_gfp(size, cpu_to_node(cpu),
+							    STP_ALLOC_SLEEP_FLAGS);
+		if (g_probe_sample[cpu] == NULL) {
+			_stp_error ("probe sampling (size %lu) allocation failed",
+				    (unsigned long) size);
+			_stp_probe_sample_exit();
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+#endif
+
+
+#ifdef STP_PROBE_PROFILE
+// Each cpu's hits of each probe, and the cycles they took, summed and by
+// log2; see probe_profile.c, which reads them.  Only the cpu a probe runs
+// on writes its counters, with the context held, so they need no atomics.
+#define STP_PROBE_PROFILE_BUCKETS 32
+struct stp_probe_profile {
+	unsigned long hits;
+	unsigned long long cycles;
+	unsigned int log2_cycles[STP_PROBE_PROFILE_BUCKETS];
+};
+
+static struct stp_probe_profile *g_probe_profile[NR_CPUS];
+
+static inline void _stp_probe_profile_add(size_t index, int32_t cycles)
+{
+	struct stp_probe_profile *pp = g_probe_profile[smp_processor_id()];
+	if (unlikely (!pp))
+		return;
+	pp += clamp_t(size_t, index, 0, STP_PROBE_COUNT - 1);
+	pp->hits++;
+	pp->cycles += cycles;
+	pp->log2_cycles[cycles > 1 ? ilog2(cycles) : 0]++;
+}
+
+// The translator lists each global's lock skip counter in one of these.
+struct stp_global_lock_skip {
+	const char *name;
+	atomic_t *skipped;
+};
+#endif
+
+
 // Globals are declared and initialized in the translator.
 static struct stp_globals stp_global;
 
@@ -50,7 +297,7 @@ static struct stp_globals stp_global;
 #define global_set(name, val)	(global(name) = (val))
 #define global_lock(name)	(&global(name ## _lock))
 #define global_lock_init(name)	rwlock_init(global_lock(name))
-#ifdef STP_TIMING
+#if defined(STP_TIMING) || defined(STP_PROBE_PROFILE)
 #define global_skipped(name)	(&global(name ## _lock_skip_count))
 #endif
 
@@ -67,6 +314,17 @@ static int stp_session_init(void)
 		atomic_set(probe_alibi(i), 0);
 #endif
 
+#ifdef STP_PREFILTER
+	for (i = 0; i < STP_PROBE_COUNT; ++i)
+		atomic_set(probe_prefiltered(i), 0);
+#endif
+
+#if defined(STP_OVERLOAD) && defined(STP_OVERLOAD_SAMPLE)
+	// Every probe starts out running at full rate
+	for (i = 0; i < STP_PROBE_COUNT; ++i)
+		atomic_set(probe_sample_shift(i), 0);
+#endif
+
 #ifdef STP_TIMING
 	// Initialize each Stat used for timing information
 	for (i = 0; i < STP_PROBE_COUNT; ++i)
@@ -44,7 +44,48 @@ static int _stp_map_initialize_lock(MAP m)
 
 #define _stp_map_destroy_lock(m)	do {} while (0)
 
+/* Map nodes are allocated in chunks of up to STP_MAP_CHUNK_SIZE bytes.
+ * That is much faster than allocating every node on its own, while still
+ * small enough to not depend on large contiguous allocations.  */
+#ifndef STP_MAP_CHUNK_SIZE
+#define STP_MAP_CHUNK_SIZE (8 * PAGE_SIZE)
+#endif
+
+/* By default, every per-cpu map of a pmap preallocates max_entries nodes,
+ * on its cpu's NUMA node.  With STP_PMAP_NODE_FACTOR=N, a pmap instead
+ * gets a budget of max_entries times the number of cpus, but at most
+ * times N.  Half of that is spread over the cpus, and the rest is a
+ * reserve shared by the cpus that run out, STP_MAP_BORROW_BATCH nodes at
+ * a time.  A per-cpu map still never holds more than max_entries, but
+ * the cpus together can't hold more than the budget, so this is only for
+ * maps that are known not to fill up on many cpus at once.  */
+#ifndef STP_PMAP_NODE_FACTOR
+#define STP_PMAP_NODE_FACTOR 0
+#endif
+#ifndef STP_MAP_BORROW_BATCH
+#define STP_MAP_BORROW_BATCH 16
+#endif
+
+#ifdef STP_TIMING
+/* Memory and time spent on map nodes at startup, see emit_module_init. */
+static size_t _stp_map_init_bytes = 0;
+static unsigned long _stp_map_init_jiffies = 0;
+#endif
+
+union map_node_chunk {
+	union map_node_chunk *next;
+	int64_t align;	/* for the nodes that follow */
+};
+
+struct map_node_reserve {
+	spinlock_t lock;
+	struct mlist_head pool;
+	unsigned avail;
+	void *chunks;
+};
+
 struct pmap {
+	struct map_node_reserve reserve; /* nodes shared by the per-cpu maps */
 	MAP agg;	/* aggregation map */
 	MAP map[];	/* per-cpu maps */
 };
@@ -74,6 +115,18 @@ static inline void _stp_pmap_set_map(PMAP p, MAP m, unsigned cpu)
 }
 
 
+static void _stp_map_free_chunks(void *chunks)
+{
+	union map_node_chunk *chunk = chunks;
+
+	while (chunk) {
+		union map_node_chunk *next = chunk->next;
+		_stp_kfree(chunk);
+		chunk = next;
+	}
+}
+
+
 /** Deletes a map.
  * Deletes a map, freeing all memory in all elements.
  * Normally done only when the module exits.
@@ -82,22 +135,12 @@ static inline void _stp_pmap_set_map(PMAP p, MAP m, unsigned cpu)
 
 static void _stp_map_del(MAP map)
 {
-	struct mlist_head *p, *tmp;
-
 	if (map == NULL)
 		return;
 
-	/* free unused pool */
-	mlist_for_each_safe(p, tmp, &map->pool) {
-		mlist_del(p);
-		_stp_kfree(p);
-	}
-
-	/* free used list */
-	mlist_for_each_safe(p, tmp, &map->head) {
-		mlist_del(p);
-		_stp_kfree(p);
-	}
+	/* Nodes may sit on either list, or have been borrowed from a
+	 * reserve, so free by chunk rather than by walking the lists.  */
+	_stp_map_free_chunks(map->chunks);
 
 	_stp_map_destroy_lock(map);
 
@@ -119,6 +162,9 @@ static void _stp_pmap_del(PMAP pmap)
 	/* free agg map elements */
 	_stp_map_del(_stp_pmap_get_agg(pmap));
 
+	/* free the shared reserve */
+	_stp_map_free_chunks(pmap->reserve.chunks);
+
 	_stp_kfree(pmap);
 }
 
@@ -134,8 +180,99 @@ _stp_map_kzalloc(size_t size, int cpu)
 }
 
 
+/* Add num new nodes to a pool, allocated in chunks that are linked onto
+ * *chunks for freeing.  */
 static int
-_stp_map_init(MAP m, unsigned max_entries, int wrap, int node_size, int cpu)
+_stp_map_alloc_nodes(struct mlist_head *pool, void **chunks,
+		     unsigned num, int node_size, int cpu)
+{
+	unsigned per_chunk = (STP_MAP_CHUNK_SIZE - sizeof(union map_node_chunk))
+			     / node_size;
+	if (per_chunk == 0)
+		per_chunk = 1;
+
+	while (num > 0) {
+		union map_node_chunk *chunk;
+		unsigned i, n = min(num, per_chunk);
+		char *p;
+
+		/* If memory is too fragmented for a full chunk, settle
+		 * for smaller ones.  */
+		while ((chunk = _stp_map_kzalloc(sizeof(*chunk) + n * node_size,
+						 cpu)) == NULL) {
+			if (n == 1)
+				return -1;
+			per_chunk = n = n / 2;
+		}
+		chunk->next = *chunks;
+		*chunks = chunk;
+#ifdef STP_TIMING
+		_stp_map_init_bytes += sizeof(*chunk) + n * node_size;
+#endif
+
+		p = (char *)(chunk + 1);
+		for (i = 0; i < n; i++, p += node_size) {
+			struct map_node *node = (struct map_node *)p;
+			mlist_add(&node->lnode, pool);
+			INIT_MHLIST_NODE(&node->hnode);
+		}
+		num -= n;
+	}
+	return 0;
+}
+
+
+/* Borrow nodes from the pmap reserve, for a per-cpu map whose own pool
+ * ran out.  Called with the map locked.  Returns the number borrowed.  */
+static unsigned _stp_map_borrow(MAP m)
+{
+	struct map_node_reserve *r = m->reserve;
+	unsigned long flags;
+	unsigned n = 0;
+
+	if (r == NULL || m->num >= m->maxnum)
+		return 0;
+
+	spin_lock_irqsave(&r->lock, flags);
+	while (n < STP_MAP_BORROW_BATCH && m->num + n < m->maxnum
+	       && !mlist_empty(&r->pool)) {
+		struct mlist_head *node = mlist_next(&r->pool);
+		mlist_del(node);
+		mlist_add(node, &m->pool);
+		n++;
+	}
+	r->avail -= n;
+	m->borrowed += n;
+	spin_unlock_irqrestore(&r->lock, flags);
+	return n;
+}
+
+
+/* Give borrowed nodes back to the pmap reserve, once a per-cpu map has
+ * been cleared.  Called with the map locked.  */
+static void _stp_map_return_borrowed(MAP m)
+{
+	struct map_node_reserve *r = m->reserve;
+	unsigned long flags;
+
+	if (r == NULL || m->borrowed == 0)
+		return;
+
+	spin_lock_irqsave(&r->lock, flags);
+	while (m->borrowed > 0 && !mlist_empty(&m->pool)) {
+		struct mlist_head *node = mlist_next(&m->pool);
+		mlist_del(node);
+		mlist_add(node, &r->pool);
+		m->borrowed--;
+		r->avail++;
+	}
+	spin_unlock_irqrestore(&r->lock, flags);
+}
+
+
+static int
+_stp_map_init(MAP m, unsigned max_entries, unsigned prealloc,
+	      int wrap, int node_size, int cpu)
 {
 	unsigned i;
 
@@ -147,17 +284,9 @@ _stp_map_init(MAP m, unsigned max_entries, int wrap, int node_size, int cpu)
 	m->maxnum = max_entries;
 	m->wrap = wrap;
 
-	/* It would be nice to allocate the nodes in one big chunk, but
-	 * sometimes they're big, and there may be a lot of them, so memory
-	 * fragmentation may cause us to fail allocation.  */
-	for (i = 0; i < max_entries; i++) {
-		struct map_node *node = _stp_map_kzalloc(node_size, cpu);
-		if (node == NULL)
-			return -1;
-
-		mlist_add(&node->lnode, &m->pool);
-		INIT_MHLIST_NODE(&node->hnode);
-	}
+	if (_stp_map_alloc_nodes(&m->pool, &m->chunks, prealloc,
+				 node_size, cpu) != 0)
+		return -1;
 
 	if (_stp_map_initialize_lock(m) != 0)
 		return -1;
@@ -166,17 +295,9 @@ _stp_map_init(MAP m, unsigned max_entries, int wrap, int node_size, int cpu)
 }
 
 
-/** Create a new map.
- * Maps must be created at module initialization time.
- * @param max_entries The maximum number of entries allowed. Currently that
- * number will be preallocated.If more entries are required, the oldest ones
- * will be deleted. This makes it effectively a circular buffer.
- * @return A MAP on success or NULL on failure.
- * @ingroup map_create
- */
-
 static MAP
-_stp_map_new(unsigned max_entries, int wrap, int node_size, int cpu)
+__stp_map_new(unsigned max_entries, unsigned prealloc,
+	      int wrap, int node_size, int cpu)
 {
 	MAP m;
 
@@ -184,29 +305,64 @@ _stp_map_new(unsigned max_entries, int wrap, int node_size, int cpu)
 	if (m == NULL)
 		return NULL;
 
-	if (_stp_map_init(m, max_entries, wrap, node_size, cpu)) {
+	if (_stp_map_init(m, max_entries, prealloc, wrap, node_size, cpu)) {
 		_stp_map_del(m);
 		return NULL;
 	}
 	return m;
 }
 
+
+/** Create a new map.
+ * Maps must be created at module initialization time.
+ * @param max_entries The maximum number of entries allowed. Currently that
+ * number will be preallocated.If more entries are required, the oldest ones
+ * will be deleted. This makes it effectively a circular buffer.
+ * @return A MAP on success or NULL on failure.
+ * @ingroup map_create
+ */
+
+static MAP
+_stp_map_new(unsigned max_entries, int wrap, int node_size, int cpu)
+{
+	return __stp_map_new(max_entries, max_entries, wrap, node_size, cpu);
+}
+
 static PMAP
 _stp_pmap_new(unsigned max_entries, int wrap, int node_size)
 {
 	int i;
 	MAP m;
+	unsigned ncpus = num_possible_cpus();
+	unsigned cpu_entries = max_entries, reserve_entries = 0;
 
 	PMAP pmap = _stp_map_kzalloc(sizeof(struct pmap)
 			             + NR_CPUS * sizeof(MAP), -1);
 	if (pmap == NULL)
 		return NULL;
 
+	/* Split the node budget between the cpus and the reserve.  */
+	if (STP_PMAP_NODE_FACTOR > 0 && ncpus > 1) {
+		unsigned long budget = (unsigned long) max_entries
+			* min_t(unsigned, ncpus, STP_PMAP_NODE_FACTOR);
+		cpu_entries = clamp_t(unsigned long, budget / 2 / ncpus,
+				      1, max_entries);
+		reserve_entries = budget - (unsigned long) cpu_entries * ncpus;
+	}
+
+	spin_lock_init(&pmap->reserve.lock);
+	INIT_MLIST_HEAD(&pmap->reserve.pool);
+	if (_stp_map_alloc_nodes(&pmap->reserve.pool, &pmap->reserve.chunks,
+				 reserve_entries, node_size, -1) != 0)
+		goto err;
+	pmap->reserve.avail = reserve_entries;
+
 	/* Allocate the per-cpu maps.  */
 	for_each_possible_cpu(i) {
-		m = _stp_map_new(max_entries, wrap, node_size, i);
+		m = __stp_map_new(max_entries, cpu_entries, wrap, node_size, i);
 		if (m == NULL)
 			goto err1;
+		m->reserve = reserve_entries ? &pmap->reserve : NULL;
                 _stp_pmap_set_map(pmap, m, i);
 	}
 
@@ -224,6 +380,7 @@ err1:
 		_stp_map_del(m);
 	}
 err:
+	_stp_map_free_chunks(pmap->reserve.chunks);
 	_stp_kfree(pmap);
 	return NULL;
 }
@@ -19,6 +19,189 @@
  * @brief Implements performance monitoring hardware support
  */
 
+#ifdef STP_PERF_BATCH
+
+/* Batched perf probes.  The overflow handler only appends the sample to
+ * a per-cpu ring, and a timer drains the rings every
+ * STP_PERF_BATCH_INTERVAL ms, running the script handler on each sample
+ * outside of NMI context.  Each tick runs at most STP_PERF_BATCH_DRAIN
+ * handlers, taking the cpus in turn, and comes back on the next jiffy
+ * if that left samples behind.  Samples arriving while a ring is full
+ * are dropped, and counted.
+ *
+ * Each ring has a single producer, the handlers on its own cpu, and a
+ * single consumer, the drain timer.  */
+
+#ifndef STP_PERF_BATCH_SIZE
+#define STP_PERF_BATCH_SIZE 256		/* samples per cpu, a power of 2 */
+#endif
+#ifndef STP_PERF_BATCH_INTERVAL
+#define STP_PERF_BATCH_INTERVAL 10	/* ms */
+#endif
+#ifndef STP_PERF_BATCH_DRAIN
+#define STP_PERF_BATCH_DRAIN STP_PERF_BATCH_SIZE /* handlers per tick */
+#endif
+
+#if STP_PERF_BATCH_SIZE & (STP_PERF_BATCH_SIZE - 1)
+#error "STP_PERF_BATCH_SIZE must be a power of 2"
+#endif
+
+struct stap_perf_batch_record {
+	struct stap_perf_sample sample;
+	unsigned probe;
+};
+
+struct stap_perf_batch {
+	unsigned head;		/* next record to fill, by the handlers */
+	unsigned tail;		/* next record to run, by the drain */
+	unsigned busy;		/* a handler is filling a record */
+	struct stap_perf_batch_record records[STP_PERF_BATCH_SIZE];
+};
+
+static struct stap_perf_batch *_stp_perf_batches = NULL;
+static struct timer_list _stp_perf_batch_timer;
+static atomic_t _stp_perf_batch_dropped = ATOMIC_INIT(0);
+static int _stp_perf_batch_cpu = 0;	/* where the next drain starts */
+
+
+/* Describe the sample an overflow handler was called for.  This may be
+ * in NMI context, so it only looks at the registers and current.  */
+static inline void _stp_perf_sample_fill (struct stap_perf_sample *sample,
+					  struct pt_regs *regs)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
+	sample->time = local_clock();
+#else
+	sample->time = sched_clock();
+#endif
+	sample->ip = instruction_pointer(regs);
+	sample->pid = current->tgid;
+	sample->tid = current->pid;
+	sample->cpu = smp_processor_id();
+	sample->user_mode = user_mode(regs) ? 1 : 0;
+}
+
+
+static void _stp_perf_batch_add (unsigned i, struct pt_regs *regs)
+{
+	struct stap_perf_batch *b = per_cpu_ptr (_stp_perf_batches,
+						 smp_processor_id());
+	struct stap_perf_batch_record *r;
+	unsigned head;
+
+	/* A software event handler may be interrupted by an NMI for a
+	 * hardware one, which must then leave this cpu's ring alone.
+	 * Only once that is settled is head ours to read.  */
+	if (b->busy++) {
+		atomic_inc (&_stp_perf_batch_dropped);
+		goto out;
+	}
+	barrier();
+	head = b->head;
+	if (head - ACCESS_ONCE(b->tail) >= STP_PERF_BATCH_SIZE) {
+		atomic_inc (&_stp_perf_batch_dropped);
+		goto out;
+	}
+
+	r = &b->records[head & (STP_PERF_BATCH_SIZE - 1)];
+	r->probe = i;
+	_stp_perf_sample_fill (&r->sample, regs);
+
+	/* Publish the record only once it is complete.  */
+	smp_wmb();
+	b->head = head + 1;
+out:
+	barrier();
+	b->busy--;
+}
+
+
+static void _stp_perf_batch_drain (unsigned long data)
+{
+	unsigned budget = STP_PERF_BATCH_DRAIN;
+	unsigned long delay = msecs_to_jiffies(STP_PERF_BATCH_INTERVAL);
+	int pass, cpu;
+
+	/* Start from the cpu the last tick stopped at, then wrap.  */
+	for (pass = 0; pass < 2; pass++) {
+		for_each_possible_cpu(cpu) {
+			struct stap_perf_batch *b;
+			unsigned head;
+
+			if ((cpu >= _stp_perf_batch_cpu) != (pass == 0))
+				continue;
+			b = per_cpu_ptr (_stp_perf_batches, cpu);
+			head = ACCESS_ONCE(b->head);
+			smp_rmb();
+			while (b->tail != head && budget) {
+				struct stap_perf_batch_record *r =
+					&b->records[b->tail & (STP_PERF_BATCH_SIZE - 1)];
+				handle_perf_sample (r->probe, &r->sample);
+				budget--;
+
+				/* Done with the record before handing it back.  */
+				smp_mb();
+				b->tail++;
+			}
+			if (b->tail != head) {
+				_stp_perf_batch_cpu = cpu;
+				delay = 1;
+				goto out;
+			}
+		}
+	}
+out:
+	if ((atomic_read (session_state()) == STAP_SESSION_STARTING) ||
+	    (atomic_read (session_state()) == STAP_SESSION_RUNNING))
+		mod_timer (&_stp_perf_batch_timer, jiffies + delay);
+}
+
+
+static int _stp_perf_batch_init (void)
+{
+	int cpu;
+
+	_stp_perf_batches = _stp_alloc_percpu (sizeof(struct stap_perf_batch));
+	if (_stp_perf_batches == NULL)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		struct stap_perf_batch *b = per_cpu_ptr (_stp_perf_batches, cpu);
+		b->head = b->tail = b->busy = 0;
+	}
+	_stp_perf_batch_cpu = 0;
+
+	init_timer (&_stp_perf_batch_timer);
+	_stp_perf_batch_timer.function = &_stp_perf_batch_drain;
+	_stp_perf_batch_timer.data = 0;
+	_stp_perf_batch_timer.expires =
+		jiffies + msecs_to_jiffies(STP_PERF_BATCH_INTERVAL);
+	add_timer (&_stp_perf_batch_timer);
+	return 0;
+}
+
+
+/* Call only once the perf events are gone.  Samples still queued then
+ * are dropped, as the session is no longer running anyway.  */
+static void _stp_perf_batch_exit (void)
+{
+	int dropped;
+
+	if (_stp_perf_batches == NULL)
+		return;
+
+	del_timer_sync (&_stp_perf_batch_timer);
+	_stp_free_percpu (_stp_perf_batches);
+	_stp_perf_batches = NULL;
+
+	dropped = atomic_read (&_stp_perf_batch_dropped);
+	if (dropped)
+		_stp_warn ("%d batched perf samples dropped, "
+			   "consider a larger -DSTP_PERF_BATCH_SIZE\n", dropped);
+}
+
+#endif /* STP_PERF_BATCH */
+
+
 /** Initialize performance sampling
  * Call this during probe initialization to set up performance event sampling
  * for all online cpus.  Returns non-zero on error.
@@ -37,4 +37,10 @@ static long _stp_perf_init (struct stap_perf_probe *stp, struct task_struct* tas
 
 static void _stp_perf_del (struct stap_perf_probe *stp);
 
+#ifdef STP_PERF_BATCH
+static inline void _stp_perf_sample_fill (struct stap_perf_sample *sample,
+					  struct pt_regs *regs);
+static void _stp_perf_batch_add (unsigned i, struct pt_regs *regs);
+#endif
+
 #endif /* _PERF_H_ */
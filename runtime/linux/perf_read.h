@@ -15,6 +15,17 @@
  * @brief Header file for performance monitoring hardware support
  */
 
+/* A perf event sample, as seen by the perf_sample_*() tapset functions.
+ * Batched perf probes queue these in the overflow handler, and run the
+ * script handler on them later.  */
+struct stap_perf_sample {
+	unsigned long long time;	/* local_clock() ns */
+	unsigned long ip;
+	int pid, tid;
+	int cpu;
+	int user_mode;
+};
+
 #ifdef _HAVE_PERF_
 // perf counter probes call _stp_perf_read
 struct task_struct;
@@ -18,7 +18,7 @@
 #endif
 
 struct stp_probe_lock {
-	#ifdef STP_TIMING
+	#if defined(STP_TIMING) || defined(STP_PROBE_PROFILE)
 	atomic_t *skipped;
 	#endif
 	rwlock_t *lock;
@@ -65,7 +65,7 @@ stp_lock_probe(const struct stp_probe_lock *locks, unsigned num_locks)
 
 skip:
 	atomic_inc(skipped_count());
-#ifdef STP_TIMING
+#if defined(STP_TIMING) || defined(STP_PROBE_PROFILE)
 	atomic_inc(locks[i].skipped);
 #endif
 	stp_unlock_probe(locks, i);
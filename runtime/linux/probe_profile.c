@@ -0,0 +1,156 @@
+/* -*- linux-c -*-
+ * Live probe profile, for -DSTP_PROBE_PROFILE
+ * Copyright (C) 2013 Red Hat Inc.
+ *
+ * This file is part of systemtap, and is free software.  You can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License (GPL); either version 2, or (at your option) any
+ * later version.
+ */
+
+#ifndef _STAPLINUX_PROBE_PROFILE_C_
+#define _STAPLINUX_PROBE_PROFILE_C_
+
+/* Included by the generated module after stap_probes[] and
+ * stp_global_lock_skips[].  The probe epilogues fill in the per-cpu
+ * counters of common_session_state.h; this sums them across cpus
+ * whenever [debugfs]/systemtap/MODULE/probe_profile is read, with a
+ * line per probe hit so far:
+ *
+ *   PP, hits: N, cycles: SUM, index: I, log2 cycles: B:N B:N ...
+ *
+ * and a line per global whose lock has made probes skip:
+ *
+ *   global NAME, lock skips: N
+ *
+ * The counters are read while the probes keep updating them, so a line
+ * may be a hit or so behind itself, but no probe ever waits on a reader.
+ */
+
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+static struct dentry *_stp_probe_profile_file = NULL;
+
+/* Keeps readers off the counters while they are freed. */
+static DEFINE_MUTEX(_stp_probe_profile_mutex);
+
+
+static int _stp_probe_profile_show(struct seq_file *m, void *v)
+{
+	static unsigned long log2_cycles[STP_PROBE_PROFILE_BUCKETS];
+	size_t i;
+	int cpu, b;
+
+	mutex_lock(&_stp_probe_profile_mutex);
+	for (i = 0; i < ARRAY_SIZE(stap_probes); ++i) {
+		unsigned long hits = 0;
+		unsigned long long cycles = 0;
+
+		memset(log2_cycles, 0, sizeof(log2_cycles));
+		for_each_possible_cpu(cpu) {
+			struct stp_probe_profile *pp = g_probe_profile[cpu];
+			if (pp == NULL)
+				continue;
+			pp += i;
+			hits += pp->hits;
+			cycles += pp->cycles;
+			for (b = 0; b < STP_PROBE_PROFILE_BUCKETS; ++b)
+				log2_cycles[b] += pp->log2_cycles[b];
+		}
+		if (hits == 0)
+			continue;
+
+		seq_printf(m, "%s, hits: %lu, cycles: %llu, index: %lu, log2 cycles:",
+			   stap_probes[i].pp, hits, cycles, (unsigned long) i);
+		for (b = 0; b < STP_PROBE_PROFILE_BUCKETS; ++b)
+			if (log2_cycles[b])
+				seq_printf(m, " %d:%lu", b, log2_cycles[b]);
+		seq_putc(m, '\n');
+	}
+
+	for (i = 0; i < ARRAY_SIZE(stp_global_lock_skips); ++i) {
+		int skipped = atomic_read(stp_global_lock_skips[i].skipped);
+		if (skipped)
+			seq_printf(m, "global %s, lock skips: %d\n",
+				   stp_global_lock_skips[i].name, skipped);
+	}
+	mutex_unlock(&_stp_probe_profile_mutex);
+	return 0;
+}
+
+
+static int _stp_probe_profile_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, _stp_probe_profile_show, NULL);
+}
+
+
+static struct file_operations _stp_probe_profile_fops = {
+	.owner =	THIS_MODULE,
+	.open =		_stp_probe_profile_open,
+	.read =		seq_read,
+	.llseek =	seq_lseek,
+	.release =	single_release,
+};
+
+
+static void _stp_probe_profile_exit(void)
+{
+	int cpu;
+
+	if (_stp_probe_profile_file) {
+		debugfs_remove(_stp_probe_profile_file);
+		_stp_probe_profile_file = NULL;
+	}
+
+	mutex_lock(&_stp_probe_profile_mutex);
+	for_each_possible_cpu(cpu) {
+		if (g_probe_profile[cpu] != NULL) {
+			_stp_kfree(g_probe_profile[cpu]);
+			g_probe_profile[cpu] = NULL;
+		}
+	}
+	mutex_unlock(&_stp_probe_profile_mutex);
+}
+
+
+static int _stp_probe_profile_init(void)
+{
+	size_t size = sizeof(struct stp_probe_profile) * STP_PROBE_COUNT;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		/* Module init, so in user context, safe to use
+		 * "sleeping" allocation. */
+		g_probe_profile[cpu] = _stp_kzalloc_node_gfp(size, cpu_to_node(cpu),
+							     STP_ALLOC_SLEEP_FLAGS);
+		if (g_probe_profile[cpu] == NULL) {
+			_stp_error ("probe profile (size %lu) allocation failed",
+				    (unsigned long) size);
+			_stp_probe_profile_exit();
+			return -ENOMEM;
+		}
+	}
+
+#if STP_TRANSPORT_VERSION == 1
+	/* No debugfs module directory to put the file in. */
+	_stp_warn ("probe profile needs a debugfs transport, and won't be shown");
+#else
+	_stp_probe_profile_file
+		= debugfs_create_file("probe_profile", 0400, _stp_get_module_dir(),
+				      NULL, &_stp_probe_profile_fops);
+	if (IS_ERR(_stp_probe_profile_file))
+		_stp_probe_profile_file = NULL;
+	if (_stp_probe_profile_file == NULL) {
+		_stp_error ("couldn't create the probe profile file");
+		_stp_probe_profile_exit();
+		return -EIO;
+	}
+	_stp_probe_profile_file->d_inode->i_uid = _stp_uid;
+	_stp_probe_profile_file->d_inode->i_gid = _stp_gid;
+#endif
+	return 0;
+}
+
+#endif /* _STAPLINUX_PROBE_PROFILE_C_ */
@@ -1,6 +1,6 @@
 /* -*- linux-c -*- 
- * Dyninst Timer Functions
- * Copyright (C) 2012 Red Hat Inc.
+ * Kernel Timer Functions
+ * Copyright (C) 2012-2013 Red Hat Inc.
  *
  * This file is part of systemtap, and is free software.  You can
  * redistribute it and/or modify it under the terms of the GNU General
@@ -16,12 +16,8 @@
 
 static unsigned long stap_hrtimer_resolution = 0;
 
-struct stap_hrtimer_probe {
-	struct hrtimer hrtimer;
-	const struct stap_probe * const probe;
-	int64_t intrv;
-	int64_t rnd;
-};
+/* The one hrtimer all the timer probes are multiplexed onto.  */
+static struct hrtimer _stp_hrtimer;
 
 // The function signature changed in 2.6.21.
 #ifdef STAPCONF_HRTIMER_REL
@@ -40,6 +36,7 @@ typedef enum hrtimer_restart hrtimer_return_t;
 // autoconf: adapt to HRTIMER_REL -> HRTIMER_MODE_REL renaming near 2.6.21
 #ifdef STAPCONF_HRTIMER_REL
 #define HRTIMER_MODE_REL HRTIMER_REL
+#define HRTIMER_MODE_ABS HRTIMER_ABS
 #endif
 
 
@@ -51,10 +48,9 @@ static void _stp_hrtimer_init(void)
 }
 
 
-static inline ktime_t _stp_hrtimer_get_interval(struct stap_hrtimer_probe *stp)
+static inline int64_t _stp_hrtimer_get_interval(struct stap_hrtimer_probe *stp)
 {
-	unsigned long nsecs;
-	uint64_t i = stp->intrv;
+	int64_t i = stp->intrv;
 
 	if (stp->rnd != 0) {
 #if 1
@@ -71,39 +67,49 @@ static inline ktime_t _stp_hrtimer_get_interval(struct stap_hrtimer_probe *stp)
 		i += _stp_random_pm(stp->rnd);
 #endif
 	}
-	if (unlikely(i < stap_hrtimer_resolution))
+	if (unlikely(i < (int64_t)stap_hrtimer_resolution))
 		i = stap_hrtimer_resolution;
-	nsecs = do_div(i, NSEC_PER_SEC);
-	return ktime_set(i, nsecs);
+	return i;
 }
 
 
-static inline void _stp_hrtimer_update(struct stap_hrtimer_probe *stp)
+static inline int64_t _stp_hrtimer_now(void)
 {
-	ktime_t time;
+	return ktime_to_ns(ktime_get());
+}
+
 
-	time = ktime_add(hrtimer_get_expires(&stp->hrtimer),
-			 _stp_hrtimer_get_interval(stp));
-	hrtimer_set_expires(&stp->hrtimer, time);
+static hrtimer_return_t _stp_hrtimer_notify_function(struct hrtimer *timer)
+{
+	int64_t next = _stp_hrtimer_dispatch(_stp_hrtimer_now());
+
+	if ((atomic_read (session_state()) == STAP_SESSION_STARTING) ||
+	    (atomic_read (session_state()) == STAP_SESSION_RUNNING)) {
+		hrtimer_set_expires(timer, ns_to_ktime(next));
+		return HRTIMER_RESTART;
+	}
+	return HRTIMER_NORESTART;
 }
 
 
+/* Arm the timer for the earliest of the queued probes.  */
 static int
-_stp_hrtimer_create(struct stap_hrtimer_probe *stp,
-		    hrtimer_return_t (*function)(struct hrtimer *))
+_stp_hrtimer_start(void (*fire)(struct stap_hrtimer_probe *))
 {
-	hrtimer_init(&stp->hrtimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
-	stp->hrtimer.function = function;
-	(void)hrtimer_start(&stp->hrtimer, _stp_hrtimer_get_interval(stp),
-			    HRTIMER_MODE_REL);
+	_stp_hrtimer_fire = fire;
+	hrtimer_init(&_stp_hrtimer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	_stp_hrtimer.function = _stp_hrtimer_notify_function;
+	(void)hrtimer_start(&_stp_hrtimer,
+			    ns_to_ktime(_stp_hrtimer_queue[0]->expires),
+			    HRTIMER_MODE_ABS);
 	return 0;
 }
 
 
 static void
-_stp_hrtimer_cancel(struct stap_hrtimer_probe *stp)
+_stp_hrtimer_stop(void)
 {
-	hrtimer_cancel(&stp->hrtimer);
+	hrtimer_cancel(&_stp_hrtimer);
 }
 
 #else  /* kernel version < 2.6.17 */
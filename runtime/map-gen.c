@@ -617,7 +617,7 @@ static unsigned int KEYSYM(hash) (ALLKEYSD(key))
 #endif
 #endif
 #endif
-	return (unsigned int) (hash % HASH_TABLE_SIZE);
+	return hash;
 }
 
 
@@ -686,10 +686,10 @@ static int KEYSYM(__stp_map_set) (MAP map, ALLKEYSD(key), VSTYPE val, int add)
 		return -2;
 
 	hv = KEYSYM(hash) (ALLKEYS(key));
-	head = &map->hashes[hv];
+	head = &map->hashes[MAP_HASH_BUCKET(hv)];
 
 	mhlist_for_each_entry(n, e, head, node.hnode) {
-		if (KEY_EQ_P(n)) {
+		if (n->node.hash == hv && KEY_EQ_P(n)) {
 			return MAP_SET_VAL(map, n, val, add);
 		}
 	}
@@ -697,6 +697,7 @@ static int KEYSYM(__stp_map_set) (MAP map, ALLKEYSD(key), VSTYPE val, int add)
 	n = KEYSYM(get_map_node)(_new_map_create (map, head));
 	if (n == NULL)
 		return -1;
+	n->node.hash = hv;
 	KEYCPY(n);
 	return MAP_SET_VAL(map, n, val, 0);
 }
@@ -723,10 +724,10 @@ static VALTYPE KEYSYM(_stp_map_get) (MAP map, ALLKEYSD(key))
 		return NULLRET;
 
 	hv = KEYSYM(hash) (ALLKEYS(key));
-	head = &map->hashes[hv];
+	head = &map->hashes[MAP_HASH_BUCKET(hv)];
 
 	mhlist_for_each_entry(n, e, head, node.hnode) {
-		if (KEY_EQ_P(n)) {
+		if (n->node.hash == hv && KEY_EQ_P(n)) {
 			return MAP_GET_VAL(n);
 		}
 	}
@@ -748,10 +749,10 @@ static int KEYSYM(_stp_map_del) (MAP map, ALLKEYSD(key))
 		return -1;
 
 	hv = KEYSYM(hash) (ALLKEYS(key));
-	head = &map->hashes[hv];
+	head = &map->hashes[MAP_HASH_BUCKET(hv)];
 
 	mhlist_for_each_entry(n, e, head, node.hnode) {
-		if (KEY_EQ_P(n)) {
+		if (n->node.hash == hv && KEY_EQ_P(n)) {
 			_new_map_del_node(map, &n->node);
 			return 0;
 		}
@@ -771,10 +772,10 @@ static int KEYSYM(_stp_map_exists) (MAP map, ALLKEYSD(key))
 		return 0;
 
 	hv = KEYSYM(hash) (ALLKEYS(key));
-	head = &map->hashes[hv];
+	head = &map->hashes[MAP_HASH_BUCKET(hv)];
 
 	mhlist_for_each_entry(n, e, head, node.hnode) {
-		if (KEY_EQ_P(n)) {
+		if (n->node.hash == hv && KEY_EQ_P(n)) {
 			return 1;
 		}
 	}
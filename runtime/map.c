@@ -20,7 +20,7 @@
 
 static unsigned int int64_hash (const int64_t v)
 {
-	return (unsigned int)hash_long (((unsigned long)v) ^ stap_hash_seed, HASH_TABLE_BITS);
+	return (unsigned int)hash_long (((unsigned long)v) ^ stap_hash_seed, 32);
 }
 
 static int int64_eq_p (int64_t key1, int64_t key2)
@@ -59,7 +59,7 @@ static unsigned int str_hash(const char *key1)
 	char *v1 = (char *)key1;
 	while (*v1 && count++ < MAP_STRING_LENGTH)
 		hash = partial_str_hash(*v1++, hash);
-	return (unsigned int)hash_long(hash^stap_hash_seed, HASH_TABLE_BITS);
+	return (unsigned int)hash_long(hash^stap_hash_seed, 32);
 }
 
 /** @addtogroup maps 
@@ -149,6 +149,7 @@ static void _stp_pmap_clear(PMAP pmap)
 
 		MAP_LOCK(m);
 		_stp_map_clear(m);
+		_stp_map_return_borrowed(m);
 		MAP_UNLOCK(m);
 	}
 	_stp_map_clear(_stp_pmap_get_agg(pmap));
@@ -345,6 +346,7 @@ static struct map_node *_stp_new_agg(MAP agg, struct mhlist_head *ahead,
 	aptr = _new_map_create(agg, ahead);
 	if (aptr == NULL)
 		return NULL;
+	aptr->hash = ptr->hash;
 	(*update)(agg, aptr, ptr, 0);
 	return aptr;
 }
@@ -383,7 +385,8 @@ static MAP _stp_pmap_agg (PMAP pmap, map_update_fn update, map_cmp_fn cmp)
 			mhlist_for_each_entry(ptr, e, head, hnode) {
 				int match = 0;
 				mhlist_for_each_entry(aptr, f, ahead, hnode) {
-					if ((*cmp)(ptr, aptr)) {
+					if (ptr->hash == aptr->hash
+					    && (*cmp)(ptr, aptr)) {
 						match = 1;
 						break;
 					}
@@ -411,7 +414,7 @@ out:
 static struct map_node *_new_map_create (MAP map, struct mhlist_head *head)
 {
 	struct map_node *m;
-	if (mlist_empty(&map->pool)) {
+	if (mlist_empty(&map->pool) && !_stp_map_borrow(map)) {
 		if (!map->wrap) {
 			/* ERROR. no space left */
 			return NULL;
@@ -35,6 +35,9 @@
 #define HASH_TABLE_SIZE (1<<HASH_TABLE_BITS)
 #endif
 
+/* The hash chain for a node's 32-bit key hash. */
+#define MAP_HASH_BUCKET(hash) ((hash) >> (32 - HASH_TABLE_BITS))
+
 /** Maximum length of strings in maps. This sets the amount of space
     reserved for each string.  This should match MAXSTRINGLEN.  If
     MAP_STRING_LENGTH is less than MAXSTRINGLEN, a user could get
@@ -67,6 +70,9 @@ struct map_node {
 
 	/* list of nodes with the same hash value */
 	struct mhlist_node hnode;
+
+	/* hash of the keys, compared before the keys themselves */
+	unsigned int hash;
 };
 
 #define mlist_map_node(head) mlist_entry((head), struct map_node, lnode)
@@ -98,6 +104,16 @@ struct map_root {
 #endif
 #endif
 
+#ifdef __KERNEL__
+	/* chunks of node memory owned by this map */
+	void *chunks;
+
+	/* for per-cpu maps, the pmap's shared reserve of extra nodes,
+	 * and how many of them this map has borrowed */
+	struct map_node_reserve *reserve;
+	unsigned borrowed;
+#endif
+
 	/* the hash table for this array */
 	struct mhlist_head hashes[HASH_TABLE_SIZE];
 
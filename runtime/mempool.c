@@ -1,6 +1,6 @@
 /*  -*- linux-c -*-
  * Preallocated memory pools
- * Copyright (C) 2008-2009 Red Hat Inc.
+ * Copyright (C) 2008-2013 Red Hat Inc.
  *
  * This file is part of systemtap, and is free software.  You can
  * redistribute it and/or modify it under the terms of the GNU General
@@ -11,29 +11,46 @@
 #ifndef _STP_MEMPOOL_C_
 #define _STP_MEMPOOL_C_
 
+/* The free buffers are kept on a lock-free stack, so that probes
+ * sending control messages on many cpus don't serialize on a pool
+ * lock.  The stack head packs the index of the top buffer in the low
+ * 16 bits, with a tag in the high bits that changes on every push and
+ * pop, so that a cmpxchg racing with a pop and push of the same buffer
+ * (ABA) fails and retries.  That limits a pool to 0xfffe buffers.  */
+#define _STP_MEMPOOL_NIL 0xffffU
+
 /* An opaque struct identifying the memory pool. */
 typedef struct {
-	struct list_head free_list;
+	atomic_t head;
 	unsigned num;
 	unsigned size;
-	spinlock_t lock;
+	struct _stp_mem_buffer **bufs;
 } _stp_mempool_t;
 
 /* for internal use only */
 struct _stp_mem_buffer {
-	struct list_head list;
+	unsigned next;		/* index of the next free buffer */
+	unsigned index;
 	_stp_mempool_t *pool;
 	void *buf;
 };
 
+/* The new stack head with the given top, with the tag moved on.  */
+static inline int _stp_mempool_head(int old, unsigned index)
+{
+	return (int)((((unsigned)old & ~_STP_MEMPOOL_NIL) + (_STP_MEMPOOL_NIL + 1))
+		     | index);
+}
+
 /* Delete a memory pool */
 static void _stp_mempool_destroy(_stp_mempool_t *pool)
 {
-	struct list_head *p, *tmp;
+	unsigned i;
 	if (pool) {
-		list_for_each_safe(p, tmp, &pool->free_list) {
-			list_del(p);
-			_stp_kfree(p);
+		if (pool->bufs) {
+			for (i = 0; i < pool->num; i++)
+				_stp_kfree(pool->bufs[i]);
+			_stp_kfree(pool->bufs);
 		}
 		_stp_kfree(pool);
 	}
@@ -42,17 +59,27 @@ static void _stp_mempool_destroy(_stp_mempool_t *pool)
 /* Create a new memory pool */
 static _stp_mempool_t *_stp_mempool_init(size_t size, size_t num)
 {
-	int i, alloc_size;
+	int alloc_size;
+	unsigned i;
 	struct _stp_mem_buffer *m;
 
-	_stp_mempool_t *pool = (_stp_mempool_t *)_stp_kmalloc(sizeof(_stp_mempool_t));
+	_stp_mempool_t *pool;
+
+	if (unlikely(num >= _STP_MEMPOOL_NIL)) {
+		errk("Memory pool of %lu buffers is too large.\n",
+		     (unsigned long)num);
+		return NULL;
+	}
+
+	pool = (_stp_mempool_t *)_stp_kzalloc(sizeof(_stp_mempool_t));
 	if (unlikely(pool == NULL)) {
 		errk("Memory allocation failed.\n");
 		return NULL;
 	}
 
-	INIT_LIST_HEAD(&pool->free_list);
-	spin_lock_init(&pool->lock);
+	pool->bufs = _stp_kzalloc(num * sizeof(struct _stp_mem_buffer *));
+	if (unlikely(pool->bufs == NULL))
+		goto err;
 
 	alloc_size = size + sizeof(struct _stp_mem_buffer) - sizeof(void *);
 
@@ -61,9 +88,12 @@ static _stp_mempool_t *_stp_mempool_init(size_t size, size_t num)
 		if (unlikely(m == NULL))
 			goto err;
 		m->pool = pool;
-		list_add((struct list_head *)m, &pool->free_list);
+		m->index = i;
+		m->next = (i + 1 < num) ? i + 1 : _STP_MEMPOOL_NIL;
+		pool->bufs[i] = m;
+		pool->num = i + 1;
 	}
-	pool->num = num;
+	atomic_set(&pool->head, num ? 0 : (int)_STP_MEMPOOL_NIL);
 	pool->size = alloc_size;
 	return pool;
 
@@ -75,30 +105,34 @@ err:
 /* allocate a buffer from a memory pool */
 static void *_stp_mempool_alloc(_stp_mempool_t *pool)
 {
-	unsigned long flags;
-	struct _stp_mem_buffer *ptr = NULL;
+	int old, new;
+	struct _stp_mem_buffer *m;
         /* PR14804: tolerate accidental early call, before pool is
          actually initialized. */
         if (pool == NULL)
                 return NULL;
-	spin_lock_irqsave(&pool->lock, flags);
-	if (likely(!list_empty(&pool->free_list))) {
-		ptr = (struct _stp_mem_buffer *)pool->free_list.next;
-		list_del_init(&ptr->list);
-		spin_unlock_irqrestore(&pool->lock, flags);
-		return &ptr->buf;
-	}
-	spin_unlock_irqrestore(&pool->lock, flags);
-	return NULL;
+	do {
+		old = atomic_read(&pool->head);
+		if (unlikely(((unsigned)old & _STP_MEMPOOL_NIL) == _STP_MEMPOOL_NIL))
+			return NULL;
+		/* Once popped, m->next may be rewritten under us; then
+		   the tag has moved on too and the cmpxchg fails.  */
+		m = pool->bufs[(unsigned)old & _STP_MEMPOOL_NIL];
+		new = _stp_mempool_head(old, ACCESS_ONCE(m->next));
+	} while (atomic_cmpxchg(&pool->head, old, new) != old);
+	return &m->buf;
 }
 
 /* return a buffer to its memory pool */
 static void _stp_mempool_free(void *buf)
 {
-	unsigned long flags;
+	int old, new;
 	struct _stp_mem_buffer *m = container_of(buf, struct _stp_mem_buffer, buf);
-	spin_lock_irqsave(&m->pool->lock, flags);
-	list_add(&m->list, &m->pool->free_list);
-	spin_unlock_irqrestore(&m->pool->lock, flags);
+	_stp_mempool_t *pool = m->pool;
+	do {
+		old = atomic_read(&pool->head);
+		m->next = (unsigned)old & _STP_MEMPOOL_NIL;
+		new = _stp_mempool_head(old, m->index);
+	} while (atomic_cmpxchg(&pool->head, old, new) != old);
 }
 #endif /* _STP_MEMPOOL_C_ */
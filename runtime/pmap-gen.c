@@ -241,9 +241,9 @@ static VALTYPE KEYSYM(_stp_pmap_get_cpu) (PMAP pmap, ALLKEYSD(key))
 #endif
 
 	hv = KEYSYM(hash) (ALLKEYS(key));
-	head = &map->hashes[hv];
+	head = &map->hashes[MAP_HASH_BUCKET(hv)];
 	mhlist_for_each_entry(n, e, head, node.hnode) {
-		if (KEY_EQ_P(n)) {
+		if (n->node.hash == hv && KEY_EQ_P(n)) {
 			res = MAP_GET_VAL(n);
 			MAP_UNLOCK(map);
 			MAP_PUT_CPU();
@@ -273,9 +273,9 @@ static VALTYPE KEYSYM(_stp_pmap_get) (PMAP pmap, ALLKEYSD(key))
 
 	/* first look it up in the aggregation map */
 	agg = _stp_pmap_get_agg(pmap);
-	ahead = &agg->hashes[hv];
+	ahead = &agg->hashes[MAP_HASH_BUCKET(hv)];
 	mhlist_for_each_entry(n, e, ahead, node.hnode) {
-		if (KEY_EQ_P(n)) {
+		if (n->node.hash == hv && KEY_EQ_P(n)) {
 			anode = &n->node;
 			clear_agg = 1;
 			break;
@@ -290,9 +290,9 @@ static VALTYPE KEYSYM(_stp_pmap_get) (PMAP pmap, ALLKEYSD(key))
 			return NULLRET;
 #endif
 
-		head = &map->hashes[hv];
+		head = &map->hashes[MAP_HASH_BUCKET(hv)];
 		mhlist_for_each_entry(n, e, head, node.hnode) {
-			if (KEY_EQ_P(n)) {
+			if (n->node.hash == hv && KEY_EQ_P(n)) {
 				if (anode == NULL) {
 					anode = _stp_new_agg(agg, ahead, &n->node,
 							     KEYSYM(pmap_update_node));
@@ -71,6 +71,36 @@ typedef char string_t[MAXSTRINGLEN];
 #define STP_OVERLOAD
 #endif
 
+/* Instead of exiting on overload, the user may ask for hot probes to be
+   progressively sampled (1 in 2^N hits run) by running:
+   stap -DSTP_OVERLOAD_SAMPLE {other options}.  Of the
+   STP_OVERLOAD_SAMPLE_HOT probes that used the most cycles of an
+   overloaded interval on a cpu, the hottest are throttled; once all of
+   them are sampled at 1 in 2^STP_OVERLOAD_SAMPLE_MAXSHIFT and the cpu
+   still overloads, the usual exit is triggered.  When a cpu's probe load
+   falls below STP_OVERLOAD_SAMPLE_RESTORE cycles per interval, the
+   sampling rate of those probes that ran there is doubled again, back
+   to full rate.  */
+#ifdef STP_OVERLOAD_SAMPLE
+#ifndef STP_OVERLOAD_SAMPLE_MAXSHIFT
+#define STP_OVERLOAD_SAMPLE_MAXSHIFT 10
+#endif
+#ifndef STP_OVERLOAD_SAMPLE_HOT
+#define STP_OVERLOAD_SAMPLE_HOT 8
+#endif
+#ifndef STP_OVERLOAD_SAMPLE_RESTORE
+#define STP_OVERLOAD_SAMPLE_RESTORE (STP_OVERLOAD_THRESHOLD / 2)
+#endif
+#endif
+
+/* A cheap per-cpu profile of each probe's hits and cycles, and of the
+   hits skipped for each global's lock, that can be read while the module
+   runs from [debugfs]/systemtap/MODULE/probe_profile, is kept by running:
+   stap -DSTP_PROBE_PROFILE {other options}.  Only for the kernel runtime.  */
+#if defined(STP_PROBE_PROFILE) && !defined(__KERNEL__)
+#undef STP_PROBE_PROFILE
+#endif
+
 /* Used for CONTEXT probe_type. */
 enum stp_probe_type {
 /* begin, end or never probe, triggered by stap module itself. */
@@ -0,0 +1,320 @@
+/* -*- linux-c -*-
+ * Speculative output buffers
+ * Copyright (C) 2013 Red Hat Inc.
+ *
+ * This file is part of systemtap, and is free software.  You can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License (GPL); either version 2, or (at your option) any
+ * later version.
+ */
+
+#ifndef _STP_SPECULATIVE_C_
+#define _STP_SPECULATIVE_C_
+
+/** @file speculative.c
+ * @brief Speculative output buffers for tapset/linux/speculative.stp.
+ *
+ * Each speculation id owns a chain of fixed-size chunks holding the
+ * output speculated so far.  Committing prints just that chain, and
+ * discarding returns just that chain to the free list, so both cost
+ * O(size of that buffer) regardless of how many other speculations
+ * are live.  All memory is preallocated in the module, so it is
+ * bounded by STP_SPECULATIONS slots and STP_SPECULATION_BUFSIZE bytes.
+ *
+ * As with the script implementation, an id stays usable after it is
+ * committed or discarded.  Its slot is only taken back when
+ * speculation() runs out of never-used slots, oldest finished first;
+ * an id whose slot was taken back is ignored from then on.
+ */
+
+#ifndef STP_SPECULATIONS
+#define STP_SPECULATIONS MAXMAPENTRIES
+#endif
+#ifndef STP_SPECULATION_CHUNK
+#define STP_SPECULATION_CHUNK 128
+#endif
+#ifndef STP_SPECULATION_BUFSIZE
+#define STP_SPECULATION_BUFSIZE (STP_SPECULATIONS * STP_SPECULATION_CHUNK)
+#endif
+
+#define STP_SPECULATION_NCHUNKS \
+	(STP_SPECULATION_BUFSIZE / STP_SPECULATION_CHUNK)
+
+#if STP_SPECULATION_CHUNK > STP_BUFFER_SIZE
+#error "STP_SPECULATION_CHUNK must not exceed STP_BUFFER_SIZE"
+#endif
+
+/* Chunks and slots are linked by index, with -1 ending a list. */
+struct _stp_spec_chunk {
+	int next;
+	int len;
+	char data[STP_SPECULATION_CHUNK];
+};
+
+struct _stp_spec_slot {
+	spinlock_t lock;
+	int64_t id;		/* 0 when the slot is free */
+	int head, tail;		/* chunk chain, in speculation order */
+	int next_free;		/* finished list link */
+	int finished;		/* on the finished list */
+};
+
+static struct _stp_spec_chunk _stp_spec_chunks[STP_SPECULATION_NCHUNKS];
+static struct _stp_spec_slot _stp_spec_slots[STP_SPECULATIONS];
+
+/* Protects the free lists and high-water marks below.  Chunks and slots
+ * past the high-water mark have never been used, which saves walking
+ * the whole pool to set up the free lists at module load.  Slots whose
+ * id has been committed or discarded queue on the finished list, in
+ * the order they finished, until speculation() takes them back.  */
+static DEFINE_SPINLOCK(_stp_spec_lock);
+static int _stp_spec_free_chunk = -1, _stp_spec_used_chunks = 0;
+static int _stp_spec_used_slots = 0;
+static int _stp_spec_finished_head = -1, _stp_spec_finished_tail = -1;
+static int64_t _stp_spec_generation = 0;
+
+
+/* Take a free chunk, or -1 if the buffer space is exhausted. */
+static int _stp_spec_chunk_alloc(void)
+{
+	unsigned long flags;
+	int c = -1;
+
+	spin_lock_irqsave(&_stp_spec_lock, flags);
+	if (_stp_spec_free_chunk >= 0) {
+		c = _stp_spec_free_chunk;
+		_stp_spec_free_chunk = _stp_spec_chunks[c].next;
+	} else if (_stp_spec_used_chunks < STP_SPECULATION_NCHUNKS) {
+		c = _stp_spec_used_chunks++;
+	}
+	spin_unlock_irqrestore(&_stp_spec_lock, flags);
+
+	if (c >= 0) {
+		_stp_spec_chunks[c].next = -1;
+		_stp_spec_chunks[c].len = 0;
+	}
+	return c;
+}
+
+
+/* Return a detached chunk chain to the free list, and queue its slot on
+ * the finished list if the detach asked for that.  */
+static void _stp_spec_release(int slot, int head, int tail, int queue)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&_stp_spec_lock, flags);
+	if (head >= 0) {
+		_stp_spec_chunks[tail].next = _stp_spec_free_chunk;
+		_stp_spec_free_chunk = head;
+	}
+	if (queue) {
+		_stp_spec_slots[slot].next_free = -1;
+		if (_stp_spec_finished_tail < 0)
+			_stp_spec_finished_head = slot;
+		else
+			_stp_spec_slots[_stp_spec_finished_tail].next_free = slot;
+		_stp_spec_finished_tail = slot;
+	}
+	spin_unlock_irqrestore(&_stp_spec_lock, flags);
+}
+
+
+/* Take back the oldest finished slot that hasn't been speculated into
+ * since, or -1 if there is none.  Called with _stp_spec_lock held; the
+ * slot lock nests inside it here only with a trylock, since speculate
+ * takes them the other way around, and a slot in use goes to the back
+ * of the list.  A slot busy again is dropped from the list, and its
+ * next commit or discard queues it anew.  */
+static int _stp_spec_reclaim(void)
+{
+	int tries = 0;
+
+	while (_stp_spec_finished_head >= 0) {
+		int slot = _stp_spec_finished_head;
+		struct _stp_spec_slot *s = &_stp_spec_slots[slot];
+		int idle;
+
+		_stp_spec_finished_head = s->next_free;
+		if (_stp_spec_finished_head < 0)
+			_stp_spec_finished_tail = -1;
+		if (!spin_trylock(&s->lock)) {
+			if (++tries > 8)
+				return -1;
+			s->next_free = -1;
+			if (_stp_spec_finished_tail < 0)
+				_stp_spec_finished_head = slot;
+			else
+				_stp_spec_slots[_stp_spec_finished_tail].next_free = slot;
+			_stp_spec_finished_tail = slot;
+			continue;
+		}
+		s->finished = 0;
+		idle = (s->head < 0);
+		if (idle)
+			s->id = 0;
+		spin_unlock(&s->lock);
+		if (idle)
+			return slot;
+	}
+	return -1;
+}
+
+
+/* Map an id back to its slot, or -1 if it is stale or bogus.  */
+static inline int _stp_spec_slot_of(int64_t id)
+{
+	int64_t slot;
+
+	if (id <= 0)
+		return -1;
+	slot = _stp_mod64(NULL, id - 1, STP_SPECULATIONS);
+	/* Slots past the high-water mark were never handed out.  */
+	if (slot >= _stp_spec_used_slots)
+		return -1;
+	return slot;
+}
+
+
+/** Allocate a new speculation id.
+ * @return the id, or 0 if all STP_SPECULATIONS slots hold output that
+ * hasn't been committed or discarded yet.
+ */
+static int64_t _stp_speculation(void)
+{
+	unsigned long flags;
+	int slot = -1;
+	int64_t id = 0;
+
+	spin_lock_irqsave(&_stp_spec_lock, flags);
+	if (_stp_spec_used_slots < STP_SPECULATIONS) {
+		slot = _stp_spec_used_slots++;
+		spin_lock_init(&_stp_spec_slots[slot].lock);
+		_stp_spec_slots[slot].finished = 0;
+	} else {
+		slot = _stp_spec_reclaim();
+	}
+	if (slot >= 0) {
+		/* The generation makes ids unique across slot reuse, so
+		 * stale ids from a reclaimed slot are ignored.  */
+		id = ++_stp_spec_generation * STP_SPECULATIONS + slot + 1;
+		_stp_spec_slots[slot].id = id;
+		_stp_spec_slots[slot].head = -1;
+		_stp_spec_slots[slot].tail = -1;
+	}
+	spin_unlock_irqrestore(&_stp_spec_lock, flags);
+	return id;
+}
+
+
+/** Append a string to the buffer of a speculation id.
+ * @return 0 on success or for a stale id, or -ENOMEM if
+ * the buffer space ran out, in which case the output is truncated.
+ */
+static int _stp_speculate(int64_t id, const char *str)
+{
+	struct _stp_spec_slot *s;
+	unsigned long flags;
+	int slot = _stp_spec_slot_of(id);
+	int rc = 0;
+	size_t len = strlen(str);
+
+	if (slot < 0)
+		return 0;
+	s = &_stp_spec_slots[slot];
+
+	spin_lock_irqsave(&s->lock, flags);
+	if (s->id != id)
+		goto out;
+
+	while (len > 0) {
+		struct _stp_spec_chunk *c;
+		size_t n;
+
+		if (s->tail < 0
+		    || _stp_spec_chunks[s->tail].len == STP_SPECULATION_CHUNK) {
+			int nc = _stp_spec_chunk_alloc();
+			if (nc < 0) {
+				rc = -ENOMEM;
+				break;
+			}
+			if (s->tail < 0)
+				s->head = nc;
+			else
+				_stp_spec_chunks[s->tail].next = nc;
+			s->tail = nc;
+		}
+
+		c = &_stp_spec_chunks[s->tail];
+		n = min_t(size_t, len, STP_SPECULATION_CHUNK - c->len);
+		memcpy(c->data + c->len, str, n);
+		c->len += n;
+		str += n;
+		len -= n;
+	}
+out:
+	spin_unlock_irqrestore(&s->lock, flags);
+	return rc;
+}
+
+
+/* Detach the whole chain of an id, which stays live for more
+ * speculation.  Returns the slot, or -1 if the id is stale; *queue is
+ * set if the slot must go on the finished list.  */
+static int _stp_spec_detach(int64_t id, int *head, int *tail, int *queue)
+{
+	struct _stp_spec_slot *s;
+	unsigned long flags;
+	int slot = _stp_spec_slot_of(id);
+
+	if (slot < 0)
+		return -1;
+	s = &_stp_spec_slots[slot];
+
+	spin_lock_irqsave(&s->lock, flags);
+	if (s->id != id) {
+		slot = -1;
+	} else {
+		*head = s->head;
+		*tail = s->tail;
+		s->head = s->tail = -1;
+		*queue = !s->finished;
+		s->finished = 1;
+	}
+	spin_unlock_irqrestore(&s->lock, flags);
+	return slot;
+}
+
+
+/** Write out all the output of a speculation id so far. */
+static void _stp_commit(int64_t id)
+{
+	int head, tail, queue, c;
+	int slot = _stp_spec_detach(id, &head, &tail, &queue);
+
+	if (slot < 0)
+		return;
+
+	/* The chain is ours now, so print it without holding any lock. */
+	for (c = head; c >= 0; c = _stp_spec_chunks[c].next) {
+		struct _stp_spec_chunk *chunk = &_stp_spec_chunks[c];
+		char *buf = _stp_reserve_bytes(chunk->len);
+		if (likely(buf != NULL))
+			memcpy(buf, chunk->data, chunk->len);
+	}
+
+	_stp_spec_release(slot, head, tail, queue);
+}
+
+
+/** Throw away all the output of a speculation id so far. */
+static void _stp_discard(int64_t id)
+{
+	int head, tail, queue;
+	int slot = _stp_spec_detach(id, &head, &tail, &queue);
+
+	if (slot >= 0)
+		_stp_spec_release(slot, head, tail, queue);
+}
+
+#endif /* _STP_SPECULATIVE_C_ */
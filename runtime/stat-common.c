@@ -282,8 +282,50 @@ static void _stp_stat_print_histogram_buf(char *buf, size_t size, Hist st,
 #undef HIST_PRINTF
 }
 
+#if defined(STP_HIST_EXPORT) && defined(__KERNEL__) && !defined(STP_BULKMODE)
+/* With --hist-format, copy the histogram into the output for stapio
+   to render, rather than formatting it here.  See staprun/histogram.c
+   for the other side.  Returns 0 if it doesn't fit in the print
+   buffer, to be printed as text after all.  */
+static int _stp_stat_export_histogram(Hist st, stat_data *sd)
+{
+	struct _stp_hist_export h;
+	size_t blen = st->buckets * sizeof(int64_t);
+	char *p = _stp_reserve_bytes(STP_HIST_PREFIX_LEN + sizeof(h) + blen);
+
+	if (p == NULL)
+		return 0;
+
+	h.len = sizeof(h) + blen;
+	h.type = st->type;
+	h.start = st->start;
+	h.stop = st->stop;
+	h.interval = st->interval;
+	h.buckets = st->buckets;
+	h.width = HIST_WIDTH;
+	h.elision = HIST_ELISION;
+	h.count = sd->count;
+	h.sum = sd->sum;
+	h.min = sd->min;
+	h.max = sd->max;
+
+	memcpy(p, STP_HIST_PREFIX, STP_HIST_PREFIX_LEN);
+	memcpy(p + STP_HIST_PREFIX_LEN, &h, sizeof(h));
+	memcpy(p + STP_HIST_PREFIX_LEN + sizeof(h), sd->histogram, blen);
+	return 1;
+}
+#endif
+
 static void _stp_stat_print_histogram(Hist st, stat_data *sd)
 {
+#if defined(STP_HIST_EXPORT) && defined(__KERNEL__) && !defined(STP_BULKMODE)
+	if (st->type != HIST_LOG && st->type != HIST_LINEAR)
+		return;
+	if (_stp_stat_export_histogram(st, sd)) {
+		_stp_print_flush();
+		return;
+	}
+#endif
 	_stp_stat_print_histogram_buf(NULL, 0, st, sd);
 	_stp_print_flush();
 }
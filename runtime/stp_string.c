@@ -50,6 +50,24 @@ static int _stp_vscnprintf(char *buf, size_t size, const char *fmt, va_list args
 }
 
 
+/** Append to a string of known length.
+ * Copies src after the first len characters of dst, truncating at
+ * MAXSTRINGLEN as strlcat() would.  Unlike strlcat(), this doesn't
+ * rescan dst for its end, so a chain of concatenations costs just one
+ * pass over each piece.
+ *
+ * @param dst Destination string, a MAXSTRINGLEN buffer
+ * @param len Length of the string already in dst, less than MAXSTRINGLEN
+ * @param src String to append
+ * @returns the length of the string now in dst
+ */
+static size_t _stp_strlcat_at(char *dst, size_t len, const char *src)
+{
+	size_t n = strlcpy(dst + len, src, MAXSTRINGLEN - len);
+	return min_t(size_t, len + n, MAXSTRINGLEN - 1);
+}
+
+
 /** Return a printable text string.
  *
  * Takes a string, and any ASCII characters that are not printable are
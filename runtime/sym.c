@@ -210,6 +210,8 @@ static const char *_stp_kallsyms_lookup(unsigned long addr,
         /* NB: relativize the address to the section. */
         addr = rel_addr;
 	end = sec->num_symbols;
+	if (end == 0)
+	  return NULL;
 
 	/* binary search for symbols within the module */
 	do {
@@ -437,6 +439,41 @@ static int _stp_usermodule_check(struct task_struct *tsk, const char *path_name,
  * @param task The address to lookup (if NULL lookup kernel/module address).
  * @note Symbolic lookups should not normally be done within
  * a probe because it is too time-consuming. Use at module exit time. */
+#ifdef STP_LAZY_SYMBOLS
+/* With --lazy-symbols, the module carries no symbols of user-space
+   binaries, just their sections.  Returns the user module the address
+   falls in if it is one of those, with the address relative to its
+   section, for stapio to look up the symbol in the binary itself.  */
+static struct _stp_module *_stp_lazy_umod_lookup(unsigned long addr,
+						 struct task_struct *task,
+						 const char **name,
+						 unsigned long *rel_addr,
+						 unsigned long *offset,
+						 unsigned long *size)
+{
+  struct _stp_module *m;
+  unsigned long vm_start = 0, vm_end = 0;
+
+#ifdef CONFIG_COMPAT
+  if (test_tsk_thread_flag(task, TIF_32BIT))
+    addr &= ((compat_ulong_t) ~0);
+#endif
+  m = _stp_umod_lookup(addr, task, name, &vm_start, &vm_end);
+  if (m == NULL || m->num_sections == 0 || m->sections[0].num_symbols != 0)
+    return NULL;
+
+  if (*name == NULL)
+    *name = m->path;
+  if (strcmp(".dynamic", m->sections[0].name) == 0)
+    *rel_addr = addr - vm_start;
+  else
+    *rel_addr = addr;
+  *offset = addr - vm_start;
+  *size = vm_end - vm_start;
+  return m;
+}
+#endif
+
 static int _stp_snprint_addr(char *str, size_t len, unsigned long address,
 			     int flags, struct task_struct *task)
 {
@@ -455,6 +492,25 @@ static int _stp_snprint_addr(char *str, size_t len, unsigned long address,
   else
     poststr = "";
 
+#ifdef STP_LAZY_SYMBOLS
+  /* Leave a token for stapio to render, just as below, once it has
+     found the symbol: the flags, address, section-relative address,
+     offset and size in the module, and the length and path of the
+     module, which may hold any character.  Only when printing; a string
+     for the script gets what the module knows.  */
+  if (str == NULL && task && (flags & _STP_SYM_SYMBOL)) {
+    unsigned long rel_addr, offset, size;
+    if (_stp_lazy_umod_lookup(address, task, &modname,
+			      &rel_addr, &offset, &size))
+      return _stp_snprintf(str, len, "%s<stapsym %x %lx %lx %lx %lx %u:%s>%s",
+			   prestr, flags & ~(_STP_SYM_PRE_SPACE
+					     | _STP_SYM_POST_SPACE
+					     | _STP_SYM_NEWLINE),
+			   address, rel_addr, offset, size,
+			   (unsigned) strlen(modname), modname, poststr);
+  }
+#endif
+
   if (flags & (_STP_SYM_SYMBOL | _STP_SYM_MODULE)) {
     name = _stp_kallsyms_lookup(address, &size, &offset, &modname, task);
     if (name && name[0] == '.')
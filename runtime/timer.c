@@ -1,6 +1,6 @@
-/* -*- linux-c -*- 
+/* -*- linux-c -*-
  * Timer Functions
- * Copyright (C) 2012 Red Hat Inc.
+ * Copyright (C) 2012-2013 Red Hat Inc.
  *
  * This file is part of systemtap, and is free software.  You can
  * redistribute it and/or modify it under the terms of the GNU General
@@ -11,6 +11,79 @@
 #ifndef _TIMER_C_
 #define _TIMER_C_
 
+/** @file timer.c
+ * @brief Multiplexed timers for timer.ms()/us()/ns()/hz() probes.
+ *
+ * Rather than one hrtimer (or POSIX timer) per probe, all the timer
+ * probes are kept in a queue ordered by their next expiry, and a single
+ * hrtimer (or timerfd thread, in dyninst) is armed for the earliest
+ * one.  Each time it fires, every probe due within the timer resolution
+ * is run in the same expiry, so probes due at the same tick are
+ * coalesced into one interrupt or wakeup.
+ *
+ * The queue is only touched from that one timer, and at module init
+ * and exit while the timer isn't armed, so it needs no locking.
+ * STP_HRTIMER_NPROBES must be defined to the number of timer probes.
+ */
+
+struct stap_hrtimer_probe {
+	const struct stap_probe * const probe;
+	int64_t intrv;
+	int64_t rnd;
+	int64_t expires;	/* in ns of CLOCK_MONOTONIC */
+};
+
+/* A binary min-heap of the probes, by expiry.  */
+static struct stap_hrtimer_probe *_stp_hrtimer_queue[STP_HRTIMER_NPROBES];
+static unsigned _stp_hrtimer_queued = 0;
+
+/* Probes being run in the current expiry.  */
+static struct stap_hrtimer_probe *_stp_hrtimer_due[STP_HRTIMER_NPROBES];
+
+static void (*_stp_hrtimer_fire)(struct stap_hrtimer_probe *);
+
+
+static void _stp_hrtimer_queue_push(struct stap_hrtimer_probe *stp)
+{
+	unsigned i = _stp_hrtimer_queued++;
+
+	while (i > 0 && stp->expires < _stp_hrtimer_queue[(i - 1) / 2]->expires) {
+		_stp_hrtimer_queue[i] = _stp_hrtimer_queue[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	_stp_hrtimer_queue[i] = stp;
+}
+
+
+static struct stap_hrtimer_probe *_stp_hrtimer_queue_pop(void)
+{
+	struct stap_hrtimer_probe *top = _stp_hrtimer_queue[0];
+	struct stap_hrtimer_probe *stp;
+	unsigned i = 0;
+
+	if (--_stp_hrtimer_queued == 0)
+		return top;
+
+	stp = _stp_hrtimer_queue[_stp_hrtimer_queued];
+	for (;;) {
+		unsigned c = 2 * i + 1;
+		if (c >= _stp_hrtimer_queued)
+			break;
+		if (c + 1 < _stp_hrtimer_queued
+		    && _stp_hrtimer_queue[c + 1]->expires < _stp_hrtimer_queue[c]->expires)
+			c++;
+		if (stp->expires <= _stp_hrtimer_queue[c]->expires)
+			break;
+		_stp_hrtimer_queue[i] = _stp_hrtimer_queue[c];
+		i = c;
+	}
+	_stp_hrtimer_queue[i] = stp;
+	return top;
+}
+
+
+static int64_t _stp_hrtimer_dispatch(int64_t now);
+
 
 #if defined(__KERNEL__)
 
@@ -23,4 +96,38 @@
 #endif
 
 
+/* Queue a probe for its first expiry.  All the probes are timed from
+ * the same start, so those with commensurate intervals stay in step. */
+static void _stp_hrtimer_add(struct stap_hrtimer_probe *stp, int64_t start)
+{
+	stp->expires = start + _stp_hrtimer_get_interval(stp);
+	_stp_hrtimer_queue_push(stp);
+}
+
+
+/* Run every probe due by now, and requeue each for its next expiry.
+ * Returns the earliest expiry left.  */
+static int64_t _stp_hrtimer_dispatch(int64_t now)
+{
+	unsigned i, ndue = 0;
+
+	while (_stp_hrtimer_queued > 0
+	       && _stp_hrtimer_queue[0]->expires <= now + (int64_t)stap_hrtimer_resolution)
+		_stp_hrtimer_due[ndue++] = _stp_hrtimer_queue_pop();
+
+	/* Requeue before running, so a probe running late can't starve
+	 * the others by coming due again within this same expiry.  */
+	for (i = 0; i < ndue; i++) {
+		struct stap_hrtimer_probe *stp = _stp_hrtimer_due[i];
+		stp->expires += _stp_hrtimer_get_interval(stp);
+		_stp_hrtimer_queue_push(stp);
+	}
+
+	for (i = 0; i < ndue; i++)
+		(*_stp_hrtimer_fire)(_stp_hrtimer_due[i]);
+
+	return _stp_hrtimer_queue[0]->expires;
+}
+
+
 #endif /* _TIMER_C_ */
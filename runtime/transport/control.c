@@ -20,6 +20,13 @@ static struct list_head _stp_ctl_ready_q;
 static DEFINE_SPINLOCK(_stp_ctl_ready_lock);
 static DEFINE_SPINLOCK(_stp_ctl_special_msg_lock);
 
+/* Set when stapio asks for batched reads with STP_BATCH.  */
+static int _stp_ctl_batch = 0;
+
+/* Number of warning, system() and realtime messages lost for want
+   of a free buffer, reported at exit.  */
+static atomic_t _stp_ctl_dropped = ATOMIC_INIT(0);
+
 static void _stp_cleanup_and_exit(int send_exit);
 static void _stp_handle_tzinfo (struct _stp_msg_tzinfo* tzi);
 static void _stp_handle_privilege_credentials (struct _stp_msg_privilege_credentials* pc);
@@ -134,6 +141,10 @@ static ssize_t _stp_ctl_write_cmd(struct file *file, const char __user *buf, siz
 	case STP_READY:
 		break;
 
+	case STP_BATCH:
+		_stp_ctl_batch = 1;
+		break;
+
 	default:
 #ifdef DEBUG_TRANS
 		dbug_trans2("invalid command type %d\n", type);
@@ -312,6 +323,11 @@ static struct _stp_buffer *_stp_ctl_get_buffer(int type, void *data,
 		memcpy(bptr->buf, data, len);
 		bptr->len = len;
 	} else {
+		if (type == STP_OOB_DATA
+		    || type == STP_SYSTEM
+		    || type == STP_REALTIME_DATA)
+			atomic_inc(&_stp_ctl_dropped);
+
 		/* "special" type, or no more dynamic buffers.
 		   We must be careful to lock to avoid races between
 		   marking as used/free.  There can be only one.  */
@@ -476,9 +492,87 @@ static int _stp_ctl_send_notify(int type, void *data, unsigned len)
 	return ret;
 }
 
+/* Size of a message in a batched read, header and padding included.  */
+static inline size_t _stp_ctl_batch_len(int len)
+{
+	return ALIGN(sizeof(struct _stp_msg_batch) + len, STP_BATCH_ALIGN);
+}
+
+/* Wait for a nonempty ready queue.  Returns with _stp_ctl_ready_lock
+   held on success, or unlocked with a negative errno.  */
+static int _stp_ctl_wait_ready(struct file *file, unsigned long *flags)
+{
+	spin_lock_irqsave(&_stp_ctl_ready_lock, *flags);
+	while (list_empty(&_stp_ctl_ready_q)) {
+		spin_unlock_irqrestore(&_stp_ctl_ready_lock, *flags);
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(_stp_ctl_wq, !list_empty(&_stp_ctl_ready_q)))
+			return -ERESTARTSYS;
+		spin_lock_irqsave(&_stp_ctl_ready_lock, *flags);
+	}
+	return 0;
+}
+
+/* Batched read for STP_BATCH: takes as many messages off the
+   _stp_ctl_ready_q as fit in the reader's buffer, under one hold of
+   _stp_ctl_ready_lock, and copies each out behind a struct
+   _stp_msg_batch header.  */
+static ssize_t _stp_ctl_read_batch(struct file *file, char __user *buf,
+				   size_t count)
+{
+	struct _stp_buffer *bptr, *tmp;
+	struct _stp_msg_batch hdr;
+	struct list_head batch;
+	unsigned long flags;
+	size_t len = 0;
+	int rc;
+
+	rc = _stp_ctl_wait_ready(file, &flags);
+	if (rc)
+		return rc;
+
+	INIT_LIST_HEAD(&batch);
+	list_for_each_entry_safe(bptr, tmp, &_stp_ctl_ready_q, list) {
+		if (len + _stp_ctl_batch_len(bptr->len) > count)
+			break;
+		len += _stp_ctl_batch_len(bptr->len);
+		list_move_tail(&bptr->list, &batch);
+	}
+	spin_unlock_irqrestore(&_stp_ctl_ready_lock, flags);
+
+	/* Unlike the single message read, nothing was taken off the
+	   queue, so nothing is lost.  */
+	if (list_empty(&batch)) {
+		errk("Supplied buffer too small. count:%d\n", (int)count);
+		return -EINVAL;
+	}
+
+	len = 0;
+	list_for_each_entry_safe(bptr, tmp, &batch, list) {
+		hdr.type = bptr->type;
+		hdr.len = bptr->len;
+		if (rc == 0
+		    && (copy_to_user(buf + len, &hdr, sizeof(hdr))
+			|| copy_to_user(buf + len + sizeof(hdr), bptr->buf,
+					bptr->len))) {
+			/* As below, the messages are lost.  */
+			errk("Failed to copy %d bytes of messages.\n",
+			     (int)len);
+			rc = -EFAULT;
+		}
+		len += _stp_ctl_batch_len(bptr->len);
+		list_del(&bptr->list);
+		_stp_ctl_free_buffer(bptr);
+	}
+
+	return rc ? rc : len;
+}
+
 /** Called when someone tries to read from our .cmd file.
     Will take _stp_ctl_ready_lock and pick off the next _stp_buffer
-    from the _stp_ctl_ready_q, will wait_event on _stp_ctl_wq.  */
+    from the _stp_ctl_ready_q, will wait_event on _stp_ctl_wq.
+    After STP_BATCH, picks off as many as fit instead.  */
 static ssize_t _stp_ctl_read_cmd(struct file *file, char __user *buf,
 				 size_t count, loff_t *ppos)
 {
@@ -486,16 +580,13 @@ static ssize_t _stp_ctl_read_cmd(struct file *file, char __user *buf,
 	int len;
 	unsigned long flags;
 
+	if (_stp_ctl_batch)
+		return _stp_ctl_read_batch(file, buf, count);
+
 	/* wait for nonempty ready queue */
-	spin_lock_irqsave(&_stp_ctl_ready_lock, flags);
-	while (list_empty(&_stp_ctl_ready_q)) {
-		spin_unlock_irqrestore(&_stp_ctl_ready_lock, flags);
-		if (file->f_flags & O_NONBLOCK)
-			return -EAGAIN;
-		if (wait_event_interruptible(_stp_ctl_wq, !list_empty(&_stp_ctl_ready_q)))
-			return -ERESTARTSYS;
-		spin_lock_irqsave(&_stp_ctl_ready_lock, flags);
-	}
+	len = _stp_ctl_wait_ready(file, &flags);
+	if (len)
+		return len;
 
 	/* get the next buffer off the ready list */
 	bptr = (struct _stp_buffer *)_stp_ctl_ready_q.next;
@@ -527,6 +618,7 @@ static int _stp_ctl_open_cmd(struct inode *inode, struct file *file)
                 atomic_dec (&_stp_ctl_attached);
 		return -EBUSY;
         }
+	_stp_ctl_batch = 0;
 	_stp_attach();
 	return 0;
 }
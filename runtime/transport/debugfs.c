@@ -14,9 +14,13 @@
 
 /* Defines the number of buffers allocated in control.c (which #includes
    this file) for the _stp_pool_q.  This is the number of .cmd messages
-   the module can store before they have to be read by stapio.
-   40 is somewhat arbitrary, 8 pre-allocated messages, 32 dynamic.  */
-#define STP_DEFAULT_BUFFERS 40
+   the module can store before they have to be read by stapio:
+   8 pre-allocated messages, the rest dynamic.  The pool is lock-free,
+   so this can be raised (-DSTP_DEFAULT_BUFFERS=N) for scripts that
+   send bursts of warnings or system() calls.  */
+#ifndef STP_DEFAULT_BUFFERS
+#define STP_DEFAULT_BUFFERS 256
+#endif
 
 /* Always returns zero, we just push all messages on the _stp_ctl_ready_q.  */
 inline static int _stp_ctl_write_fs(int type, void *data, unsigned len)
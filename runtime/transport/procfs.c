@@ -11,7 +11,9 @@
 
 #include "../procfs.c"		   // for _stp_mkdir_proc_module()
 
+#ifndef STP_DEFAULT_BUFFERS
 #define STP_DEFAULT_BUFFERS 256
+#endif
 
 #ifdef STP_BULKMODE
 /* handle the per-cpu subbuf info read for relayfs */
@@ -209,6 +209,10 @@ static void _stp_cleanup_and_exit(int send_exit)
 		if (failures)
 			_stp_warn("There were %d transport failures.\n", failures);
 
+		failures = atomic_read(&_stp_ctl_dropped);
+		if (failures)
+			_stp_warn("There were %d dropped control messages.\n", failures);
+
 		dbug_trans(1, "*** calling _stp_transport_data_fs_stop ***\n");
 		_stp_transport_data_fs_stop();
 
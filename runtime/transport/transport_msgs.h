@@ -83,6 +83,12 @@ enum
 	/** Send by staprun to notify module of remote identity, if any.
             Only send once at startup.  */
         STP_REMOTE_ID,
+	/** Send by staprun at startup to ask for batched reads of the
+	    control channel: each read() then returns as many queued
+	    messages as fit, each framed by a struct _stp_msg_batch.
+	    Older modules return -EINVAL and keep to one message per
+	    read().  */
+	STP_BATCH,
 	/** Max number of message types, sanity check only.  */
 	STP_MAX_CMD
 };
@@ -106,6 +112,7 @@ static const char *_stp_command_name[] = {
 	"STP_TZINFO",
 	"STP_PRIVILEGE_CREDENTIALS",
 	"STP_REMOTE_ID",
+	"STP_BATCH",
 };
 #endif /* DEBUG_TRANS */
 
@@ -175,3 +182,29 @@ struct _stp_msg_remote_id
         int32_t remote_id;
         char remote_uri[STP_REMOTE_URI_LEN];
 };
+
+/* Header of each message in a batched read. module->stapio
+   The payload follows, padded to STP_BATCH_ALIGN bytes.  */
+struct _stp_msg_batch
+{
+	uint32_t type;
+	uint32_t len;
+};
+
+#define STP_BATCH_ALIGN 8
+
+/* A histogram printed with --hist-format, copied into the output
+   stream for stapio to render.  module->stapio
+   The record is STP_HIST_PREFIX, this header, and then the buckets'
+   int64_t counts, unaligned.  */
+#define STP_HIST_PREFIX "<staphist>"
+#define STP_HIST_PREFIX_LEN (sizeof(STP_HIST_PREFIX) - 1)
+
+struct _stp_hist_export
+{
+	uint32_t len;		/* of the header and buckets */
+	int32_t type;		/* enum histtype */
+	int32_t start, stop, interval, buckets;
+	int32_t width, elision;	/* HIST_WIDTH, HIST_ELISION */
+	int64_t count, sum, min, max;
+};
@@ -0,0 +1,45 @@
+#!/bin/bash
+# Measure stap-merge on synthetic bulk mode output, and check the result.
+#
+# example use:
+# ./bench.sh -merge /foo/stap/install/bin/stap-merge -cpus 256 -records 10000000
+#
+# -wrap starts the sequence numbers just short of 2^32, to check that
+# the merge copes with them wrapping around.
+
+MERGE=stap-merge
+CPUS=64
+RECORDS=1000000
+FIRSTSEQ=1
+TMP=${TMPDIR:-/tmp}/merge_perf.$$
+
+while [ $# -gt 0 ]; do
+  case "$1" in
+    -merge) MERGE="$2"; shift ;;
+    -cpus) CPUS="$2"; shift ;;
+    -records) RECORDS="$2"; shift ;;
+    -wrap) FIRSTSEQ=0xfffff000 ;;
+    *) echo "usage: $0 [-merge PATH] [-cpus N] [-records N] [-wrap]"; exit 1 ;;
+  esac
+  shift
+done
+
+mkdir -p $TMP || exit 1
+trap 'rm -rf $TMP' EXIT
+
+cc -O2 -o $TMP/gen_bulk $(dirname $0)/gen_bulk.c || exit 1
+$TMP/gen_bulk $TMP/bulk $CPUS $RECORDS 200 $FIRSTSEQ || exit 1
+echo "input: $CPUS files, $RECORDS records, $(cat $TMP/bulk_* | wc -c) bytes"
+
+# Put the files in cpu order, as stapio names them.
+FILES=$(i=0; while [ $i -lt $CPUS ]; do echo $TMP/bulk_$i; i=$((i+1)); done)
+
+echo "merge:"
+time $MERGE -o $TMP/merged $FILES || exit 1
+
+if cmp -s $TMP/merged $TMP/bulk.expected; then
+  echo "output: ok"
+else
+  echo "output: MISMATCH"
+  exit 1
+fi
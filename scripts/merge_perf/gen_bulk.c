@@ -0,0 +1,77 @@
+/* Write synthetic bulk mode per-cpu files for benchmarking stap-merge.
+ *
+ * usage: gen_bulk PREFIX NCPUS NRECORDS [MAXLEN [FIRSTSEQ]]
+ *
+ * Writes PREFIX_0 .. PREFIX_<NCPUS-1>, with NRECORDS records spread
+ * randomly over the cpus, and PREFIX.expected with what stap-merge
+ * should produce from them.  A FIRSTSEQ near 2^32 makes the sequence
+ * numbers wrap, like the runtime's do on long traces.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+int main(int argc, char *argv[])
+{
+	unsigned ncpus, i, maxlen = 200;
+	unsigned long long nrecords, r;
+	uint32_t seq = 0;
+	FILE **fp, *expected;
+	char name[4096];
+
+	if (argc < 4) {
+		fprintf(stderr, "usage: %s PREFIX NCPUS NRECORDS [MAXLEN [FIRSTSEQ]]\n",
+			argv[0]);
+		return 1;
+	}
+	ncpus = atoi(argv[2]);
+	nrecords = strtoull(argv[3], NULL, 0);
+	if (argc > 4)
+		maxlen = atoi(argv[4]);
+	if (argc > 5)
+		seq = strtoul(argv[5], NULL, 0) - 1;
+	if (ncpus == 0 || maxlen == 0)
+		return 1;
+
+	fp = calloc(ncpus, sizeof(*fp));
+	for (i = 0; i < ncpus; i++) {
+		snprintf(name, sizeof(name), "%s_%u", argv[1], i);
+		fp[i] = fopen(name, "w");
+		if (fp[i] == NULL) {
+			perror(name);
+			return 1;
+		}
+	}
+	snprintf(name, sizeof(name), "%s.expected", argv[1]);
+	expected = fopen(name, "w");
+	if (expected == NULL) {
+		perror(name);
+		return 1;
+	}
+
+	srand(42);
+	for (r = 0; r < nrecords; r++) {
+		char buf[64];
+		uint32_t hdr[2];
+		unsigned cpu = rand() % ncpus;
+		int len = snprintf(buf, sizeof(buf), "%llu cpu %u ", r, cpu);
+		unsigned pad = rand() % maxlen;
+
+		hdr[0] = ++seq;
+		hdr[1] = len + pad + 1;
+		fwrite(hdr, sizeof(hdr), 1, fp[cpu]);
+		fwrite(buf, len, 1, fp[cpu]);
+		fwrite(buf, len, 1, expected);
+		for (i = 0; i < pad; i++) {
+			fputc('a' + i % 26, fp[cpu]);
+			fputc('a' + i % 26, expected);
+		}
+		fputc('\n', fp[cpu]);
+		fputc('\n', expected);
+	}
+
+	for (i = 0; i < ncpus; i++)
+		fclose(fp[i]);
+	fclose(expected);
+	return 0;
+}
@@ -20,6 +20,7 @@
 #include "rpm_finder.h"
 #include "util.h"
 #include "cmdline.h"
+#include "profile.h"
 #include "git_version.h"
 #include "version.h"
 
@@ -144,12 +145,17 @@ systemtap_session::systemtap_session ():
   omit_werror = false;
   compatible = VERSION; // XXX: perhaps also process GIT_SHAID if available?
   unwindsym_ldd = false;
+  lazy_symbols = false;
+  hist_format = "";
+  profile = NULL;
+  server_worker_fd = -1;
   client_options = false;
   server_cache = NULL;
   automatic_server_mode = false;
   use_server_on_error = false;
   try_server_status = try_server_unset;
   use_remote_prefix = false;
+  use_remote_compress = false;
   systemtap_v_check = false;
   download_dbinfo = 0;
   suppress_handler_errors = false;
@@ -157,6 +163,9 @@ systemtap_session::systemtap_session ():
   sysroot = "";
   update_release_sysroot = false;
   suppress_time_limits = false;
+  build_jobs = 0;
+  index_threads = 0;
+  output_segments = false;
 
   // PR12443: put compiled-in / -I paths in front, to be preferred during 
   // tapset duplicate-file elimination
@@ -315,11 +324,16 @@ systemtap_session::systemtap_session (const systemtap_session& other,
   omit_werror = other.omit_werror;
   compatible = other.compatible;
   unwindsym_ldd = other.unwindsym_ldd;
+  lazy_symbols = other.lazy_symbols;
+  hist_format = other.hist_format;
+  profile = other.profile;
+  server_worker_fd = -1;
   client_options = other.client_options;
   server_cache = NULL;
   use_server_on_error = other.use_server_on_error;
   try_server_status = other.try_server_status;
   use_remote_prefix = other.use_remote_prefix;
+  use_remote_compress = other.use_remote_compress;
   systemtap_v_check = other.systemtap_v_check;
   download_dbinfo = other.download_dbinfo;
   suppress_handler_errors = other.suppress_handler_errors;
@@ -327,6 +341,9 @@ systemtap_session::systemtap_session (const systemtap_session& other,
   update_release_sysroot = other.update_release_sysroot;
   sysenv = other.sysenv;
   suppress_time_limits = other.suppress_time_limits;
+  build_jobs = other.build_jobs;
+  index_threads = other.index_threads;
+  output_segments = other.output_segments;
 
   include_path = other.include_path;
   runtime_path = other.runtime_path;
@@ -564,6 +581,8 @@ systemtap_session::usage (int exitcode)
     "              may be repeated for targeting multiple hosts.\n"
     "   --remote-prefix\n"
     "              prefix each line of remote output with a host index.\n"
+    "   --remote-compress\n"
+    "              compress the module with gzip when sending it to remotes.\n"
     "   --tmpdir=NAME\n"
     "              specify name of temporary directory to be used.\n"
     "   --download-debuginfo[=OPTION]\n"
@@ -580,6 +599,25 @@ systemtap_session::usage (int exitcode)
     "              relative to the sysroot.\n"
     "   --suppress-time-limits\n"
     "              disable -DSTP_NO_OVERLOAD -DMAXACTION and -DMAXTRYACTION limits\n"
+    "   --lazy-symbols\n"
+    "              leave the symbols of user-space modules out of the module,\n"
+    "              for stapio to look up when the output is written.\n"
+    "   --hist-format=FORMAT\n"
+    "              have stapio render printed histograms, as text or json,\n"
+    "              from a copy of their data.\n"
+    "   --profile[=FILE]\n"
+    "              record the time and memory used by each pass, probe builder,\n"
+    "              debuginfo module, optimization and make, as lines of json\n"
+    "              written to FILE, or to stderr.\n"
+    "   --build-jobs=NUM\n"
+    "              run up to NUM parallel jobs in kbuild, instead of one more\n"
+    "              than the number of cpus.\n"
+    "   --index-threads=NUM\n"
+    "              index the debuginfo of up to NUM modules at once, for probe\n"
+    "              points that look for a function in many modules.\n"
+    "   --output-segments\n"
+    "              with -S, have stapio preallocate each output file and write\n"
+    "              it in large aligned blocks, then report its throughput.\n"
     , compatible.c_str()) << endl
   ;
 
@@ -1118,6 +1156,15 @@ systemtap_session::parse_cmdline (int argc, char * const argv [])
 	  use_remote_prefix = true;
 	  break;
 
+	case LONG_OPT_REMOTE_COMPRESS:
+	  if (client_options) {
+	    cerr << _F("ERROR: %s is invalid with %s", "--remote-compress", "--client-options") << endl;
+	    return 1;
+	  }
+
+	  use_remote_compress = true;
+	  break;
+
 	case LONG_OPT_CHECK_VERSION:
 	  server_args.push_back ("--check-version");
 	  systemtap_v_check = true;
@@ -1259,6 +1306,97 @@ systemtap_session::parse_cmdline (int argc, char * const argv [])
             return 1;
           break;
 
+	case LONG_OPT_LAZY_SYMBOLS:
+	  lazy_symbols = true;
+	  server_args.push_back ("--lazy-symbols");
+	  break;
+
+	case LONG_OPT_HIST_FORMAT:
+	  if (strcmp (optarg, "text") != 0 && strcmp (optarg, "json") != 0)
+	    {
+	      cerr << _F("Invalid argument '%s' for --hist-format.", optarg) << endl;
+	      return 1;
+	    }
+	  hist_format = optarg;
+	  server_args.push_back (string ("--hist-format=") + optarg);
+	  // The module is the same for either format; only stapio differs.
+	  c_macros.push_back (string ("STP_HIST_EXPORT"));
+	  break;
+
+	case LONG_OPT_PROFILE:
+	  if (client_options)
+	    {
+	      cerr << _F("ERROR: %s is invalid with %s", "--profile", "--client-options") << endl;
+	      return 1;
+	    }
+	  if (!profile)
+	    profile = new translator_profile;
+	  profile->filename = optarg ? optarg : "";
+	  break;
+
+	case LONG_OPT_SERVER_WORKER:
+	  if (client_options)
+	    {
+	      cerr << _F("ERROR: %s is invalid with %s", "--server-worker", "--client-options") << endl;
+	      return 1;
+	    }
+	  {
+	    char *num_endptr;
+	    long fd = strtol (optarg, &num_endptr, 10);
+	    if (*optarg == '\0' || *num_endptr || fd < 0 || fd > INT_MAX)
+	      {
+	        cerr << _F("Invalid file descriptor '%s' for --server-worker.", optarg) << endl;
+	        return 1;
+	      }
+	    server_worker_fd = fd;
+	  }
+	  break;
+
+	case LONG_OPT_BUILD_JOBS:
+	  if (client_options)
+	    {
+	      cerr << _F("ERROR: %s is invalid with %s", "--build-jobs", "--client-options") << endl;
+	      return 1;
+	    }
+	  {
+	    char *num_endptr;
+	    long jobs = strtol (optarg, &num_endptr, 10);
+	    if (*optarg == '\0' || *num_endptr || jobs < 1 || jobs > 1024)
+	      {
+	        cerr << _F("Invalid build job count '%s'.", optarg) << endl;
+	        return 1;
+	      }
+	    build_jobs = jobs;
+	  }
+	  break;
+
+	case LONG_OPT_INDEX_THREADS:
+	  if (client_options)
+	    {
+	      cerr << _F("ERROR: %s is invalid with %s", "--index-threads", "--client-options") << endl;
+	      return 1;
+	    }
+	  {
+	    char *num_endptr;
+	    long threads = strtol (optarg, &num_endptr, 10);
+	    if (*optarg == '\0' || *num_endptr || threads < 1 || threads > 1024)
+	      {
+	        cerr << _F("Invalid index thread count '%s'.", optarg) << endl;
+	        return 1;
+	      }
+	    index_threads = threads;
+	  }
+	  break;
+
+	case LONG_OPT_OUTPUT_SEGMENTS:
+	  if (client_options)
+	    {
+	      cerr << _F("ERROR: %s is invalid with %s", "--output-segments", "--client-options") << endl;
+	      return 1;
+	    }
+	  output_segments = true;
+	  break;
+
 	case '?':
 	  // Invalid/unrecognized option given or argument required, but
 	  // not given. In both cases getopt_long() will have printed the
@@ -1274,6 +1412,35 @@ systemtap_session::parse_cmdline (int argc, char * const argv [])
         }
     }
 
+  // stapio only renders lazy symbols in stream mode; bulk mode's per-cpu
+  // files would be left holding the raw tokens.
+  if (lazy_symbols && bulk_mode)
+    {
+      cerr << _F("ERROR: %s is invalid with %s", "--lazy-symbols", "-b") << endl;
+      return 1;
+    }
+
+  // Segments are written by stapio's -S file switching, and its O_DIRECT
+  // writes bypass the lazy symbol and histogram rendering.
+  if (output_segments)
+    {
+      if (size_option.empty())
+        {
+          cerr << _("ERROR: --output-segments requires -S") << endl;
+          return 1;
+        }
+      if (lazy_symbols)
+        {
+          cerr << _F("ERROR: %s is invalid with %s", "--output-segments", "--lazy-symbols") << endl;
+          return 1;
+        }
+      if (!hist_format.empty())
+        {
+          cerr << _F("ERROR: %s is invalid with %s", "--output-segments", "--hist-format") << endl;
+          return 1;
+        }
+    }
+
   return 0;
 }
 
@@ -65,6 +65,7 @@ struct semantic_error;
 struct module_cache;
 struct update_visitor;
 struct compile_server_cache;
+struct translator_profile;
 
 // XXX: a generalized form of this descriptor could be associated with
 // a vardecl instead of out here at the systemtap_session level.
@@ -199,6 +200,9 @@ public:
   int download_dbinfo;
   bool suppress_handler_errors;
   bool suppress_time_limits;
+  int build_jobs;
+  int index_threads;
+  bool output_segments;
 
   enum { kernel_runtime, dyninst_runtime } runtime_mode;
   bool runtime_usermode_p() const { return runtime_mode == dyninst_runtime; }
@@ -242,6 +246,7 @@ public:
   // Remote execution
   std::vector<std::string> remote_uris;
   bool use_remote_prefix;
+  bool use_remote_compress;
   typedef std::map<std::pair<std::string, std::string>, systemtap_session*> session_map_t;
   session_map_t subsessions;
   systemtap_session* clone(const std::string& arch, const std::string& release);
@@ -342,6 +347,10 @@ public:
   // List of libdwfl module names to extract symbol/unwind data for.
   std::set<std::string> unwindsym_modules;
   bool unwindsym_ldd;
+  bool lazy_symbols;
+  std::string hist_format;
+  translator_profile* profile; // for --profile, shared with subsessions
+  int server_worker_fd; // for stap-serverd's --server-worker, or -1
   struct module_cache* module_cache;
   std::vector<std::string> build_ids;
 
@@ -377,8 +386,9 @@ struct exit_exception: public std::runtime_error
 };
 
 
-// global counter of SIGINT/SIGTERM's received
-extern int pending_interrupts;
+// global counter of SIGINT/SIGTERM's received; also read by the
+// --index-threads threads
+extern volatile sig_atomic_t pending_interrupts;
 
 // Interrupt exception subclass for catching
 // interrupts (i.e. ctrl-c).
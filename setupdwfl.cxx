@@ -104,6 +104,11 @@ static const bool setup_all_deps = true;
 // setup_mod_deps().
 static string elfutils_kernel_path;
 
+// Whether abrt failed to install debuginfo, in internal_find_debuginfo(),
+// and whether download_kernel_debuginfo() was already tried.
+static int install_dbinfo_failed;
+static int already_tried_downloading_kernel_debuginfo;
+
 static bool is_comma_dash(const char c) { return (c == ',' || c == '-'); }
 
 // The path to the abrt-action-install-debuginfo-to-abrt-cache program.
@@ -308,6 +313,28 @@ void debuginfo_path_insert_sysroot(string sysroot)
   debuginfo_usr_path = path_insert_sysroot(sysroot, debuginfo_usr_path);
 }
 
+// Forget the Dwfls cached for reuse, and everything else learned so far,
+// and take the debuginfo paths from the environment again.  For the
+// translator forked by a stap --server-worker, whose request may be for
+// another kernel than the one the worker set up.
+void reset_setup_dwfl()
+{
+  kernel_dwfl.reset();
+  user_dwfl.reset();
+  offline_search_modname = NULL;
+  offline_search_names.clear();
+  offline_modules_found = 0;
+  setup_dwfl_done = false;
+  user_modset.clear();
+  elfutils_kernel_path.clear();
+  install_dbinfo_failed = 0;
+  already_tried_downloading_kernel_debuginfo = 0;
+
+  debuginfo_env_arr = getenv("SYSTEMTAP_DEBUGINFO_PATH");
+  debuginfo_path = (char *)(debuginfo_env_arr ?: debuginfo_path_arr);
+  debuginfo_usr_path = (char *)(debuginfo_env_arr ?: debuginfo_usr_path_arr);
+}
+
 static DwflPtr
 setup_dwfl_kernel (unsigned *modules_found, systemtap_session &s)
 {
@@ -547,9 +574,6 @@ internal_find_debuginfo (Dwfl_Module *mod,
   int bits_length;
   string hex;
 
-  /* To Keep track of whether the abrt successfully installed the debuginfo */
-  static int install_dbinfo_failed = 0;
-
   /* Make sure the current session variable is not null */
   if(current_session_for_find_debuginfo == NULL)
     goto call_dwfl_standard_find_debuginfo;
@@ -803,7 +827,6 @@ int download_kernel_debuginfo (systemtap_session &s, string hex)
   // than just the stap process.
 
   // Don't try this again if we already did.
-  static int already_tried_downloading_kernel_debuginfo = 0;
   if(already_tried_downloading_kernel_debuginfo)
     return -1;
 
@@ -27,6 +27,7 @@
 #include <climits>
 #include <iostream>
 #include <map>
+#include <set>
 
 extern "C" {
 #include <unistd.h>
@@ -39,6 +40,9 @@ extern "C" {
 #include <sys/types.h>
 #include <pwd.h>
 #include <semaphore.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 
 #include <nspr.h>
 #include <ssl.h>
@@ -63,6 +67,8 @@ extern "C" {
 using namespace std;
 
 static void cleanup ();
+static void start_worker_pool ();
+static void stop_worker_pool ();
 static PRStatus spawn_and_wait (const vector<string> &argv,
                                 const char* fd0, const char* fd1, const char* fd2,
 				const char *pwd, const vector<string>& envVec = vector<string> ());
@@ -74,6 +80,8 @@ extern int optind;
 static bool use_db_password;
 static unsigned short port;
 static long max_threads;
+static long worker_pool;
+static long worker_requests;
 static string cert_db_path;
 static string stap_options;
 static string uname_r;
@@ -176,13 +184,17 @@ parse_options (int argc, char **argv)
 	LONG_OPT_PORT = 256,
 	LONG_OPT_SSL,
 	LONG_OPT_LOG,
-	LONG_OPT_MAXTHREADS
+	LONG_OPT_MAXTHREADS,
+	LONG_OPT_WORKER_POOL,
+	LONG_OPT_WORKER_REQUESTS
       };
       static struct option long_options[] = {
         { "port", 1, NULL, LONG_OPT_PORT },
         { "ssl", 1, NULL, LONG_OPT_SSL },
         { "log", 1, NULL, LONG_OPT_LOG },
         { "max-threads", 1, NULL, LONG_OPT_MAXTHREADS },
+        { "worker-pool", 1, NULL, LONG_OPT_WORKER_POOL },
+        { "worker-requests", 1, NULL, LONG_OPT_WORKER_REQUESTS },
         { NULL, 0, NULL, 0 }
       };
       int grc = getopt_long (argc, argv, "a:B:D:I:kPr:R:", long_options, NULL);
@@ -242,6 +254,22 @@ parse_options (int argc, char **argv)
 	    fatal (_F("%s: invalid entry: max threads must not be negative '--max-threads=%s'",
 		      argv[0], optarg));
 	  break;
+	case LONG_OPT_WORKER_POOL:
+	  worker_pool = strtol (optarg, &num_endptr, 0);
+	  if (*num_endptr != '\0')
+	    fatal (_F("%s: cannot parse number '--worker-pool=%s'", argv[0], optarg));
+	  else if (worker_pool < 0)
+	    fatal (_F("%s: invalid entry: worker pool must not be negative '--worker-pool=%s'",
+		      argv[0], optarg));
+	  break;
+	case LONG_OPT_WORKER_REQUESTS:
+	  worker_requests = strtol (optarg, &num_endptr, 0);
+	  if (*num_endptr != '\0')
+	    fatal (_F("%s: cannot parse number '--worker-requests=%s'", argv[0], optarg));
+	  else if (worker_requests < 0)
+	    fatal (_F("%s: invalid entry: worker requests must not be negative '--worker-requests=%s'",
+		      argv[0], optarg));
+	  break;
 	case '?':
 	  // Invalid/unrecognized option given. Message has already been issued.
 	  break;
@@ -590,6 +618,8 @@ initialize (int argc, char **argv) {
   use_db_password = false;
   port = 0;
   max_threads = sysconf( _SC_NPROCESSORS_ONLN ); // Default to number of processors
+  worker_pool = 0; // Spawn a fresh stap per request
+  worker_requests = 100;
   keep_temp = false;
   struct utsname utsname;
   uname (& utsname);
@@ -628,6 +658,7 @@ static void
 cleanup ()
 {
   unadvertise_presence ();
+  stop_worker_pool ();
   end_log ();
 }
 
@@ -1099,6 +1130,273 @@ getRequestedPrivilege (const vector<string> &stapargv)
   return privilege;
 }
 
+/* The translator, and the options we were given for it.  We use plain
+   wordexp(3), since these options are coming from the local trusted user,
+   so malicious content is not a concern. */
+static bool
+get_stap_base_argv (vector<string> &stapargv)
+{
+  wordexp_t words;
+
+  stapargv.push_back ((char *)(getenv ("SYSTEMTAP_STAP") ?: STAP_PREFIX "/bin/stap"));
+
+  // TODO: Use tokenize here.
+  int rc = wordexp (stap_options.c_str (), & words, WRDE_NOCMD|WRDE_UNDEF);
+  if (rc)
+    {
+      server_error (_("Cannot parse stap options"));
+      return false;
+    }
+  for (unsigned u=0; u<words.we_wordc; u++)
+    stapargv.push_back (words.we_wordv[u]);
+  wordfree (& words);
+  return true;
+}
+
+/* The warm worker pool.  With --worker-pool=N, up to N "stap --server-worker"
+   processes are kept, each of which has parsed the tapsets and loaded the
+   kernel debuginfo for our release, and forks a translator for each request
+   it is given over a socket, rather than have a fresh stap do all that again.
+   After --worker-requests requests, a worker is replaced by a fresh one, to
+   bound whatever its translators' parent may have accumulated. */
+struct server_worker
+{
+  pid_t pid;
+  int fd;             // our end of its socket
+  unsigned requests;  // served so far
+};
+
+static vector<server_worker *> idle_workers;
+static set<server_worker *> busy_workers;
+static long live_workers;
+static unsigned waiting_requests;
+static pthread_mutex_t worker_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t worker_cond = PTHREAD_COND_INITIALIZER;
+
+static long
+msecs_since (const struct timeval &start)
+{
+  struct timeval now;
+  gettimeofday (&now, NULL);
+  return (now.tv_sec - start.tv_sec) * 1000 + (now.tv_usec - start.tv_usec) / 1000;
+}
+
+static server_worker *
+start_worker ()
+{
+  vector<string> argv;
+  if (! get_stap_base_argv (argv))
+    return NULL;
+
+  // The worker's end of the socket is its fd 3.
+  int fds[2];
+  if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0)
+    {
+      server_error (_F("Unable to create a worker socket: %s", strerror (errno)));
+      return NULL;
+    }
+  argv.push_back ("--server-worker=3");
+
+  posix_spawn_file_actions_t actions;
+  pid_t pid = -1;
+  if (posix_spawn_file_actions_init (& actions) == 0)
+    {
+      if (posix_spawn_file_actions_addopen (& actions, 0, "/dev/null", O_RDONLY, 0600) == 0
+          && posix_spawn_file_actions_adddup2 (& actions, fds[1], 3) == 0)
+        pid = stap_spawn (0, argv, & actions);
+      posix_spawn_file_actions_destroy (& actions);
+    }
+  close (fds[1]);
+  if (pid == -1)
+    {
+      server_error (_F("Unable to start a worker: %s", strerror (errno)));
+      close (fds[0]);
+      return NULL;
+    }
+
+  log (_F("Started worker pid %d", pid));
+  server_worker *w = new server_worker;
+  w->pid = pid;
+  w->fd = fds[0];
+  w->requests = 0;
+  return w;
+}
+
+// Closing its socket tells the worker to exit.  One that stop_worker_pool
+// already reaped has no pid left.
+static void
+stop_worker (server_worker *w)
+{
+  close (w->fd);
+  if (w->pid > 0)
+    stap_waitpid (0, w->pid);
+  delete w;
+}
+
+static void
+start_worker_pool ()
+{
+  for (long i = 0; i < worker_pool; i++)
+    {
+      server_worker *w = start_worker ();
+      if (! w)
+        break;
+      pthread_mutex_lock (& worker_mutex);
+      idle_workers.push_back (w);
+      live_workers++;
+      pthread_mutex_unlock (& worker_mutex);
+    }
+}
+
+static void
+stop_worker_pool ()
+{
+  pthread_mutex_lock (& worker_mutex);
+  worker_pool = 0; // no more requests for the pool
+  for (unsigned i = 0; i < idle_workers.size (); i++)
+    {
+      stop_worker (idle_workers[i]);
+      live_workers--;
+    }
+  idle_workers.clear ();
+
+  // A busy worker is still owned by the thread handling its request, which
+  // frees it once the request fails.  Just make sure the worker, and the
+  // translator it forked, don't outlive us.
+  for (set<server_worker *>::iterator it = busy_workers.begin ();
+       it != busy_workers.end (); ++it)
+    {
+      server_worker *w = *it;
+      if (w->pid <= 0)
+        continue;
+      log (_F("Stopping busy worker pid %d", w->pid));
+      kill (w->pid, SIGTERM);
+      stap_waitpid (0, w->pid);
+      w->pid = 0;
+    }
+  pthread_cond_broadcast (& worker_cond);
+  pthread_mutex_unlock (& worker_mutex);
+}
+
+/* Take an idle worker, waiting for one if all are busy.  Returns NULL if
+   there is no pool, or no worker could be started. */
+static server_worker *
+acquire_worker ()
+{
+  if (worker_pool <= 0)
+    return NULL;
+
+  struct timeval start;
+  gettimeofday (&start, NULL);
+
+  server_worker *w = NULL;
+  bool start_one = false;
+  unsigned waiting;
+  pthread_mutex_lock (& worker_mutex);
+  waiting = ++waiting_requests;
+  while (idle_workers.empty () && live_workers >= worker_pool && ! pending_interrupts)
+    pthread_cond_wait (& worker_cond, & worker_mutex);
+  waiting_requests--;
+  if (! idle_workers.empty ())
+    {
+      w = idle_workers.back ();
+      idle_workers.pop_back ();
+      busy_workers.insert (w);
+    }
+  else if (! pending_interrupts && worker_pool > 0)
+    {
+      live_workers++;
+      start_one = true;
+    }
+  pthread_mutex_unlock (& worker_mutex);
+
+  if (start_one)
+    {
+      w = start_worker ();
+      pthread_mutex_lock (& worker_mutex);
+      if (w)
+        busy_workers.insert (w);
+      else
+        {
+          live_workers--;
+          pthread_cond_signal (& worker_cond);
+        }
+      pthread_mutex_unlock (& worker_mutex);
+    }
+
+  if (w)
+    log (_F("Request queued for %ld ms behind %u others for worker pid %d",
+            msecs_since (start), waiting - 1, w->pid));
+  return w;
+}
+
+/* Give a worker back to the pool, or replace it if it failed or has served
+   its --worker-requests. */
+static void
+release_worker (server_worker *w, bool ok)
+{
+  pthread_mutex_lock (& worker_mutex);
+  busy_workers.erase (w);
+  bool stopped = (w->pid <= 0 || worker_pool <= 0);
+  pthread_mutex_unlock (& worker_mutex);
+
+  if (! ok || stopped
+      || (worker_requests > 0 && w->requests >= (unsigned long) worker_requests))
+    {
+      if (stopped)
+        log (_F("Dropping worker after %u requests, the pool is stopped", w->requests));
+      else if (ok)
+        log (_F("Recycling worker pid %d after %u requests", w->pid, w->requests));
+      else
+        server_error (_F("Worker pid %d failed after %u requests", w->pid, w->requests));
+      stop_worker (w);
+      w = (pending_interrupts || stopped) ? NULL : start_worker ();
+    }
+
+  pthread_mutex_lock (& worker_mutex);
+  if (w)
+    idle_workers.push_back (w);
+  else
+    live_workers--;
+  log (_F("Worker pool: %zu idle of %ld, %u requests waiting",
+          idle_workers.size (), live_workers, waiting_requests));
+  pthread_cond_signal (& worker_cond);
+  pthread_mutex_unlock (& worker_mutex);
+}
+
+/* Have a worker run the translator, as spawn_and_wait would.  Returns
+   PR_SUCCESS if it did, and PR_FAILURE with *delivered false if the worker
+   never got the request, so it may still be run some other way. */
+static PRStatus
+run_in_worker (server_worker *w, const vector<string> &argv,
+               const char* fd0, const char* fd1, const char* fd2,
+               const char *pwd, const vector<string>& envVec, bool *delivered)
+{
+  vector<string> request;
+  request.push_back (pwd);
+  request.push_back (fd0);
+  request.push_back (fd1);
+  request.push_back (fd2);
+  request.push_back (lex_cast (envVec.size ()));
+  request.insert (request.end (), envVec.begin (), envVec.end ());
+  request.insert (request.end (), argv.begin (), argv.end ());
+
+  struct timeval start;
+  gettimeofday (&start, NULL);
+  *delivered = write_string_vector (w->fd, request);
+  if (! *delivered)
+    return PR_FAILURE;
+
+  vector<string> reply;
+  if (! read_string_vector (w->fd, reply) || reply.size () != 1)
+    return PR_FAILURE;
+
+  w->requests++;
+  log (_F("Worker pid %d ran request %u in %ld ms, rc %s",
+          w->pid, w->requests, msecs_since (start), reply[0].c_str ()));
+  return PR_SUCCESS;
+}
+
 /* Run the translator on the data in the request directory, and produce output
    in the given output directory. */
 static void
@@ -1107,8 +1405,6 @@ handleRequest (const string &requestDirName, const string &responseDirName, stri
   vector<string> stapargv;
   cs_protocol_version client_version = "1.0"; // Assumed until discovered otherwise
   int rc;
-  wordexp_t words;
-  unsigned u;
   unsigned i;
   FILE* f;
 
@@ -1130,22 +1426,9 @@ handleRequest (const string &requestDirName, const string &responseDirName, stri
     read_from_file (filename, client_version);
   log (_F("Client version is %s", client_version.v));
 
-  // The name of the translator executable.
-  stapargv.push_back ((char *)(getenv ("SYSTEMTAP_STAP") ?: STAP_PREFIX "/bin/stap"));
-
-  /* Transcribe stap_options.  We use plain wordexp(3), since these
-     options are coming from the local trusted user, so malicious
-     content is not a concern. */
-  // TODO: Use tokenize here.
-  rc = wordexp (stap_options.c_str (), & words, WRDE_NOCMD|WRDE_UNDEF);
-  if (rc)
-    {
-      server_error (_("Cannot parse stap options"));
-      return;
-    }
-
-  for (u=0; u<words.we_wordc; u++)
-    stapargv.push_back (words.we_wordv[u]);
+  // The name of the translator executable, and stap_options.
+  if (! get_stap_base_argv (stapargv))
+    return;
 
   /* Process the saved command line arguments.  Avoid quoting/unquoting errors by
      transcribing literally. */
@@ -1214,9 +1497,20 @@ handleRequest (const string &requestDirName, const string &responseDirName, stri
   vector<string> envVec;
   get_stap_locale (staplang, envVec, stapstderr, &client_version);
 
-  /* All ready, let's run the translator! */
-  rc = spawn_and_wait(stapargv, "/dev/null", stapstdout.c_str (), stapstderr.c_str (),
-		      requestDirName.c_str (), envVec);
+  /* All ready, let's run the translator!  In a warm worker if we have them,
+     or else in a fresh stap. */
+  bool delivered = false;
+  server_worker *worker = acquire_worker ();
+  if (worker)
+    {
+      rc = run_in_worker (worker, stapargv, "/dev/null", stapstdout.c_str (),
+                          stapstderr.c_str (), requestDirName.c_str (), envVec,
+                          & delivered);
+      release_worker (worker, rc == PR_SUCCESS);
+    }
+  if (! delivered)
+    rc = spawn_and_wait(stapargv, "/dev/null", stapstdout.c_str (), stapstderr.c_str (),
+                        requestDirName.c_str (), envVec);
 
   /* Save the RC */
   string staprc = responseDirName + "/rc";
@@ -1281,10 +1575,6 @@ handleRequest (const string &requestDirName, const string &responseDirName, stri
 
     }
 
-  /* Free up all the arg string copies.  Note that the first few were alloc'd
-     by wordexp(), which wordfree() frees; others were hand-set to literal strings. */
-  wordfree (& words);
-
   // Filter paths prefixed with the server's home directory from the stdout and stderr
   // files in the response.
   filter_response_file (stapstdout, responseDirName);
@@ -1899,6 +2189,13 @@ listen ()
   else
     log (_("Concurrency disabled"));
 
+  if (worker_pool > 0)
+    {
+      log (_F("Using a pool of %ld workers, each serving up to %ld requests",
+              worker_pool, worker_requests));
+      start_worker_pool ();
+    }
+
   // Listen for connection on the socket.  The second argument is the maximum size of the queue
   // for pending connections.
   prStatus = PR_Listen (listenSocket, 5);
@@ -39,6 +39,8 @@ int fnum_max;
 int remote_id;
 const char *remote_uri;
 int relay_basedir_fd;
+int symbolize_output;
+int segment_mode;
 
 /* module variables */
 char *modname = NULL;
@@ -134,8 +136,11 @@ void parse_args(int argc, char **argv)
         remote_id = -1;
         remote_uri = NULL;
         relay_basedir_fd = -1;
+	symbolize_output = 0;
+	hist_format = 0;
+	segment_mode = 0;
 
-	while ((c = getopt(argc, argv, "ALu::vb:t:dc:o:x:S:DwRr:VT:"
+	while ((c = getopt(argc, argv, "ALu::vb:t:dc:o:x:S:PDwRr:VT:yH:"
 #ifdef HAVE_OPENAT
                            "F:"
 #endif
@@ -185,6 +190,19 @@ void parse_args(int argc, char **argv)
 		case 'D':
 			daemon_mode = 1;
 			break;
+		case 'y':
+			symbolize_output = 1;
+			break;
+		case 'H':
+			if (strcmp(optarg, "text") == 0)
+				hist_format = HIST_FORMAT_TEXT;
+			else if (strcmp(optarg, "json") == 0)
+				hist_format = HIST_FORMAT_JSON;
+			else {
+				err(_("Invalid histogram format '%s' (should be text or json).\n"), optarg);
+				usage(argv[0]);
+			}
+			break;
 		case 'F':
 			relay_basedir_fd = atoi(optarg);
 			if (relay_basedir_fd < 0) {
@@ -202,6 +220,9 @@ void parse_args(int argc, char **argv)
 				usage(argv[0]);
 			}
 			break;
+		case 'P':
+			segment_mode = 1;
+			break;
 		case 'r':
 			/* parse ID:URL */
 			remote_id = strtoul(optarg, &s, 10);
@@ -295,12 +316,20 @@ void parse_args(int argc, char **argv)
 		err(_("You have to specify output FILE with '-S' option.\n"));
 		usage(argv[0]);
 	}
+	if (segment_mode && fsize_max == 0) {
+		err(_("You have to specify '-S size' with '-P' option.\n"));
+		usage(argv[0]);
+	}
+	if (segment_mode && (symbolize_output || hist_format)) {
+		err(_("You can't specify the '-P' option with '-y' or '-H'.\n"));
+		usage(argv[0]);
+	}
 }
 
 void usage(char *prog)
 {
 	err(_("\n%s [-v] [-w] [-V] [-u] [-c cmd ] [-x pid] [-u user] [-A|-L|-d]\n"
-                "\t[-b bufsize] [-R] [-r N:URI] [-o FILE [-D] [-S size[,N]]] MODULE [module-options]\n"), prog);
+                "\t[-b bufsize] [-R] [-r N:URI] [-y] [-H FORMAT] [-o FILE [-D] [-S size[,N] [-P]]] MODULE [module-options]\n"), prog);
 	err(_("-v              Increase verbosity.\n"
 	"-V              Print version number and exit.\n"
 	"-w              Suppress warnings.\n"
@@ -329,6 +358,10 @@ void usage(char *prog)
         "-R              (Module renaming is not available in this configuration.)\n"
 #endif
         "-r N:URI        Pass N:URI data to tapset functions remote_id()/remote_uri().\n"
+	"-y              Look up the user-space symbols that a module built\n"
+	"                with --lazy-symbols leaves out of its output.\n"
+	"-H FORMAT       Render the histograms that a module built with\n"
+	"                --hist-format copies into its output, as text or json.\n"
 	"-D              Run in background. This requires '-o' option.\n"
 	"-S size[,N]     Switches output file to next file when the size\n"
 	"                of file reaches the specified size. The value\n"
@@ -337,6 +370,9 @@ void usage(char *prog)
 	"                When the number of output files reaches N, it\n"
 	"                switches to the first output file. You can omit\n"
 	"                the second argument.\n"
+	"-P              Preallocate each output file of '-S' at its full\n"
+	"                size, write it in large aligned blocks, and report\n"
+	"                the throughput and transport drops at exit.\n"
         "-T timeout      Specifies upper limit on amount of time reader thread\n"
         "                will wait for new full trace buffer. Value should be an\n"
         "                integer >= 1, which is timeout value in ms. Default 200ms.\n\n"
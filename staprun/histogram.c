@@ -0,0 +1,303 @@
+/* -*- linux-c -*-
+ *
+ * histogram.c - stapio rendering of histograms for --hist-format
+ *
+ * This file is part of systemtap, and is free software.  You can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License (GPL); either version 2, or (at your option) any
+ * later version.
+ *
+ * Copyright (C) 2013 Red Hat Inc.
+ */
+
+/*
+ * A module built with --hist-format doesn't format printed histograms
+ * in the probe handler.  It copies the histogram's stat_data into the
+ * output stream as a record: STP_HIST_PREFIX, a struct _stp_hist_export
+ * header, and the bucket counts.  The records are found in the output
+ * by symbolize_write(), and rendered here, either as the same text the
+ * runtime's _stp_stat_print_histogram_buf() would have printed, or as
+ * a line of JSON.
+ */
+
+#include "staprun.h"
+#include <stdarg.h>
+
+/* Same as in runtime/stat.h. */
+#define HIST_LOG 1
+#define HIST_LINEAR 2
+#define HIST_LOG_BUCKET0 64
+
+int hist_format;
+
+/* A growable output buffer.  */
+struct hist_out {
+	char *buf;
+	size_t len, size;
+	int failed;
+};
+
+static void hist_printf(struct hist_out *o, const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+
+static void hist_printf(struct hist_out *o, const char *fmt, ...)
+{
+	va_list va;
+	int n;
+
+	if (o->failed)
+		return;
+	for (;;) {
+		va_start(va, fmt);
+		n = vsnprintf(o->buf + o->len, o->size - o->len, fmt, va);
+		va_end(va);
+		if (n < 0) {
+			o->failed = 1;
+			return;
+		}
+		if ((size_t)n < o->size - o->len)
+			break;
+		o->size = (o->size + n + 1) * 2;
+		o->buf = realloc(o->buf, o->size);
+		if (o->buf == NULL) {
+			o->failed = 1;
+			return;
+		}
+	}
+	o->len += n;
+}
+
+static int needed_space(int64_t v)
+{
+	int space = 0;
+	uint64_t tmp;
+
+	if (v == 0)
+		return 1;
+
+	if (v < 0) {
+		space++;
+		v = -v;
+	}
+	tmp = v;
+	while (tmp) {
+		tmp /= 10;
+		space++;
+	}
+	return space;
+}
+
+/* Given a bucket number for a log histogram, return the value. */
+static int64_t bucket_to_val(int num)
+{
+	if (num == HIST_LOG_BUCKET0)
+		return 0;
+	if (num < HIST_LOG_BUCKET0) {
+		int64_t val = 0x8000000000000000LL;
+		return  val >> num;
+	} else
+		return 1LL << (num - HIST_LOG_BUCKET0 - 1);
+}
+
+/* The value of bucket i, and its "<" or ">" prefix for the under and
+   overflow buckets of a linear histogram.  */
+static int64_t bucket_value(const struct _stp_hist_export *h, int i,
+			    const char **prefix)
+{
+	*prefix = "";
+	if (h->type != HIST_LINEAR)
+		return bucket_to_val(i);
+	if (i == 0) {
+		*prefix = "<";
+		return h->start;
+	}
+	if (i == h->buckets - 1) {
+		*prefix = ">";
+		return h->start + (int64_t)(i - 2) * h->interval;
+	}
+	return h->start + (int64_t)(i - 1) * h->interval;
+}
+
+/* The runtime's _stp_stat_print_histogram_buf(), from the copy.  */
+static void hist_render_text(struct hist_out *o,
+			     const struct _stp_hist_export *h,
+			     const int64_t *histogram)
+{
+	int i, j, val_space, cnt_space;
+	int low_bucket = -1, high_bucket = 0, over = 0, under = 0;
+	int64_t val, valmax = 0, scale;
+	uint64_t v;
+	int eliding = 0;
+
+	for (i = 0; i < h->buckets; i++) {
+		if (histogram[i] > 0 && low_bucket == -1)
+			low_bucket = i;
+		if (histogram[i] > 0)
+			high_bucket = i;
+		if (histogram[i] > valmax)
+			valmax = histogram[i];
+	}
+
+	for (i = 0; i < 2; i++) {
+		if (h->type == HIST_LOG) {
+			if (low_bucket != HIST_LOG_BUCKET0 && low_bucket > 0)
+				low_bucket--;
+		} else {
+			if (low_bucket > 0)
+				low_bucket--;
+		}
+		if (high_bucket < (h->buckets-1))
+			high_bucket++;
+	}
+	if (h->type == HIST_LINEAR) {
+		if (low_bucket == 0 && histogram[0] == 0)
+			low_bucket++;
+		if (high_bucket == h->buckets-1 && histogram[high_bucket] == 0)
+			high_bucket--;
+		if (low_bucket == 0)
+			under = 1;
+		if (high_bucket == h->buckets-1)
+			over = 1;
+	}
+
+	if (valmax <= h->width)
+		scale = 1;
+	else
+		scale = (valmax + h->width - 1) / h->width;
+
+	cnt_space = needed_space(valmax);
+
+	if (h->type == HIST_LINEAR) {
+		int a = needed_space(h->start) + under;
+		int b = needed_space(h->start + (int64_t)h->interval * high_bucket) + over;
+		val_space = a > b ? a : b;
+	} else {
+		int a = needed_space(bucket_to_val(high_bucket));
+		int b = needed_space(bucket_to_val(low_bucket));
+		val_space = a > b ? a : b;
+	}
+	if (val_space < 5 /* = sizeof("value") */)
+		val_space = 5;
+
+	hist_printf(o, "%*s |", val_space, "value");
+	for (j = 0; j < h->width; ++j)
+		hist_printf(o, "-");
+	hist_printf(o, " count\n");
+
+	for (i = low_bucket; i <= high_bucket; i++) {
+		const char *val_prefix;
+
+		if (h->elision >= 0) {
+			int k, elide = 1;
+			int max_elide = h->elision < h->buckets ? h->elision : h->buckets;
+			int min_bucket = low_bucket;
+			int max_bucket = high_bucket;
+
+			if (i - max_elide > min_bucket)
+				min_bucket = i - max_elide;
+			if (i + max_elide < max_bucket)
+				max_bucket = i + max_elide;
+			for (k = min_bucket; k <= max_bucket; k++) {
+				if (histogram[k] != 0)
+					elide = 0;
+			}
+			if (elide) {
+				eliding = 1;
+				continue;
+			}
+			if (eliding) {
+				hist_printf(o, "%*s ~\n", val_space, "");
+				eliding = 0;
+			}
+		}
+
+		val = bucket_value(h, i, &val_prefix);
+		hist_printf(o, "%*s%lld |", val_space - needed_space(val),
+			    val_prefix, (long long)val);
+
+		v = histogram[i] / scale;
+		for (j = 0; j < (int64_t)v; ++j)
+			hist_printf(o, "@");
+		hist_printf(o, "%*lld\n", (int)(h->width - v + 1 + cnt_space),
+			    (long long)histogram[i]);
+	}
+	hist_printf(o, "\n");
+}
+
+/* One line of JSON, with the nonzero buckets.  */
+static void hist_render_json(struct hist_out *o,
+			     const struct _stp_hist_export *h,
+			     const int64_t *histogram)
+{
+	const char *sep = "";
+	const char *prefix;
+	int i;
+
+	hist_printf(o, "{\"type\":\"%s\",\"count\":%lld,\"sum\":%lld,"
+		    "\"min\":%lld,\"max\":%lld",
+		    h->type == HIST_LINEAR ? "linear" : "log",
+		    (long long)h->count, (long long)h->sum,
+		    (long long)h->min, (long long)h->max);
+	if (h->type == HIST_LINEAR)
+		hist_printf(o, ",\"start\":%d,\"stop\":%d,\"interval\":%d",
+			    h->start, h->stop, h->interval);
+	hist_printf(o, ",\"buckets\":[");
+	for (i = 0; i < h->buckets; i++) {
+		int64_t val;
+
+		if (histogram[i] == 0)
+			continue;
+		val = bucket_value(h, i, &prefix);
+		hist_printf(o, "%s{\"value\":%lld,\"count\":%lld%s}", sep,
+			    (long long)val, (long long)histogram[i],
+			    *prefix == '<' ? ",\"underflow\":true"
+			    : *prefix == '>' ? ",\"overflow\":true" : "");
+		sep = ",";
+	}
+	hist_printf(o, "]}\n");
+}
+
+/* Render a record at buf[0..len) if it is a whole one.  Returns its
+   length, 0 if it may yet be completed by later output, or -1 if it
+   isn't a record after all.  The rendering is returned in *out, to be
+   freed by the caller.  */
+ssize_t hist_token(const char *buf, size_t len, char **out, size_t *nout)
+{
+	struct _stp_hist_export h;
+	int64_t *histogram;
+	struct hist_out o = { NULL, 0, 0, 0 };
+	size_t hlen = STP_HIST_PREFIX_LEN + sizeof(h);
+
+	if (len < hlen)
+		return 0;
+	memcpy(&h, buf + STP_HIST_PREFIX_LEN, sizeof(h));
+	if ((h.type != HIST_LOG && h.type != HIST_LINEAR)
+	    || h.buckets < 3
+	    || h.buckets > HIST_RECORD_MAX / (int)sizeof(int64_t)
+	    || h.width < 0
+	    || h.len != sizeof(h) + h.buckets * sizeof(int64_t)
+	    || STP_HIST_PREFIX_LEN + h.len > HIST_RECORD_MAX)
+		return -1;
+	if (len < STP_HIST_PREFIX_LEN + h.len)
+		return 0;
+
+	/* The buckets may not be aligned in the stream.  */
+	histogram = malloc(h.buckets * sizeof(int64_t));
+	if (histogram == NULL)
+		return -1;
+	memcpy(histogram, buf + hlen, h.buckets * sizeof(int64_t));
+
+	if (hist_format == HIST_FORMAT_JSON)
+		hist_render_json(&o, &h, histogram);
+	else
+		hist_render_text(&o, &h, histogram);
+	free(histogram);
+
+	if (o.failed) {
+		free(o.buf);
+		return -1;
+	}
+	*out = o.buf;
+	*nout = o.len;
+	return STP_HIST_PREFIX_LEN + h.len;
+}
@@ -388,6 +388,13 @@ int init_stapio(void)
     err(_("Failed to initialize control channel.\n"));
     return -1;
   }
+  /* The old relayfs transport is read by relay_old.c, which doesn't
+     render the output of --lazy-symbols and --hist-format.  */
+  if (use_old_transport && (symbolize_output || hist_format)) {
+    err(_("The '-y' and '-H' options need the version 2 transport.\n"));
+    close_ctl_channel();
+    return -1;
+  }
   read_buffer_info();
 
   if (attach_mod) {
@@ -548,6 +555,165 @@ void cleanup_and_exit(int detach, int rc)
 }
 
 
+/* Handle one message of nb bytes from the control channel.  */
+static void handle_ctl_msg(uint32_t type, char *data, ssize_t nb,
+                           int *error_detected)
+{
+  int rc;
+
+  PROBE3(staprun, recv__ctlmsg, type, data, nb);
+
+  switch (type) {
+#if STP_TRANSPORT_VERSION == 1
+  case STP_REALTIME_DATA:
+    if (write_realtime_data(data, nb)) {
+      _perr(_("write error (nb=%ld)"), (long)nb);
+      cleanup_and_exit(0, 1);
+    }
+    break;
+#endif
+  case STP_OOB_DATA:
+    /* Note that "WARNING:" should not be translated, since it is
+     * part of the module cmd protocol. */
+    if (strncmp(data, "WARNING:", 7) == 0) {
+            if (suppress_warnings) break;
+            if (verbose) { /* don't eliminate duplicates */
+                    eprintf("%.*s", (int) nb, data);
+                    break;
+#ifdef HAVE_SEARCH_H
+            } else { /* eliminate duplicates */
+                    static void *seen = 0;
+                    static unsigned seen_count = 0;
+                    char *dupstr = strndup (data, (int) nb);
+                    char *retval;
+
+                    if (! dupstr) {
+                            /* OOM, should not happen. */
+                            eprintf("%.*s", (int) nb, data);
+                            break;
+                    }
+
+                    retval = tfind (dupstr, & seen, (int (*)(const void*, const void*))strcmp);
+                    if (! retval) { /* new message */
+                            eprintf("%s", dupstr);
+
+                            /* We set a maximum for stored warning messages,
+                               to prevent a misbehaving script/environment
+                               from emitting countless _stp_warn()s, and
+                               overflow staprun's memory. */
+#define MAX_STORED_WARNINGS 1024
+                            if (seen_count++ == MAX_STORED_WARNINGS) {
+                                    eprintf(_("WARNING deduplication table full\n"));
+                                    free (dupstr);
+                            }
+                            else if (seen_count > MAX_STORED_WARNINGS) {
+                                    /* Be quiet in the future, but stop counting to
+                                       preclude overflow. */
+                                    free (dupstr);
+                                    seen_count = MAX_STORED_WARNINGS+1;
+                            }
+                            else if (seen_count < MAX_STORED_WARNINGS) {
+                                    /* NB: don't free dupstr; it's going into the tree. */
+                                    retval = tsearch (dupstr, & seen,
+                                                      (int (*)(const void*, const void*))strcmp);
+                                    if (retval == 0) {
+                                            /* OOM, should not happen */
+                                            /* Next time we should get the 'full' message. */
+                                            free (dupstr);
+                                            seen_count = MAX_STORED_WARNINGS;
+                                    }
+                            }
+                    } else { /* old message */
+                            free (dupstr);
+                    }
+#endif
+            } /* duplicate elimination */
+    /* Note that "ERROR:" should not be translated, since it is
+     * part of the module cmd protocol. */
+    } else if (strncmp(data, "ERROR:", 5) == 0) {
+            eprintf("%.*s", (int) nb, data);
+            *error_detected = 1;
+    } else { /* neither warning nor error */
+            eprintf("%.*s", (int) nb, data);
+    }
+    break;
+  case STP_EXIT:
+    {
+      /* module asks us to unload it and exit */
+      dbug(2, "got STP_EXIT\n");
+      cleanup_and_exit(0, *error_detected);
+      break;
+    }
+  case STP_REQUEST_EXIT:
+    {
+      /* module asks us to start exiting, so send STP_EXIT */
+      dbug(2, "got STP_REQUEST_EXIT\n");
+      int32_t rc, btype = STP_EXIT;
+      rc = write(control_channel, &btype, sizeof(btype));
+      (void) rc; /* XXX: notused */
+      break;
+    }
+  case STP_START:
+    {
+      struct _stp_msg_start *t = (struct _stp_msg_start *) data;
+      dbug(2, "systemtap_module_init() returned %d\n", t->res);
+      if (t->res < 0) {
+        if (target_cmd)
+          kill(target_pid, SIGKILL);
+        cleanup_and_exit(0, 1);
+      } else if (target_cmd) {
+        dbug(1, "detaching pid %d\n", target_pid);
+#if WORKAROUND_BZ467568
+        /* Let's just send our pet signal to the child
+           process that should be waiting for us, mid-pause(). */
+        kill (target_pid, SIGUSR1);
+#else
+        /* Were it not for PR6964, we'd like to do it this way: */
+        int rc = ptrace (PTRACE_DETACH, target_pid, 0, 0);
+        if (rc < 0)
+          {
+            perror (_("ptrace detach"));
+            if (target_cmd)
+              kill(target_pid, SIGKILL);
+            cleanup_and_exit(0, 1);
+          }
+#endif
+      }
+      break;
+    }
+  case STP_SYSTEM:
+    {
+      struct _stp_msg_cmd *c = (struct _stp_msg_cmd *) data;
+      dbug(2, "STP_SYSTEM: %s\n", c->cmd);
+      system_cmd(c->cmd);
+      break;
+    }
+  case STP_TRANSPORT:
+    {
+      struct _stp_msg_start ts;
+      if (use_old_transport) {
+        if (init_oldrelayfs() < 0)
+          cleanup_and_exit(0, 1);
+      } else {
+        if (init_relayfs() < 0)
+          cleanup_and_exit(0, 1);
+      }
+      ts.target = target_pid;
+      rc = send_request(STP_START, &ts, sizeof(ts));
+	if (rc != 0) {
+	  perror ("Unable to send STP_START");
+	  cleanup_and_exit (1, rc);
+	}
+      if (load_only)
+        cleanup_and_exit(1, 0);
+      break;
+    }
+  default:
+    err(_("WARNING: ignored message of type %d\n"), type);
+  }
+}
+
+
 /**
  *	stp_main_loop - loop forever reading data
  */
@@ -556,16 +722,14 @@ int stp_main_loop(void)
 {
   ssize_t nb;
   FILE *ofp = stdout;
-  struct
+  /* Room for a whole batch of messages, aligned for their payloads. */
+  union
   {
-    uint32_t type;
-    union
-    {
-      char data[8192];
-      struct _stp_msg_start start;
-      struct _stp_msg_cmd cmd;
-    } payload;
+    uint64_t align;
+    char data[64 * 1024];
   } recvbuf;
+  char *p;
+  int batch_supported;
   int error_detected = 0;
   int select_supported;
   int flags;
@@ -586,6 +750,11 @@ int stp_main_loop(void)
     cleanup_and_exit (1, rc);
   }
 
+  /* Ask for many messages per read.  Older modules don't know
+     STP_BATCH, and send one message per read as before.  */
+  batch_supported = (send_request(STP_BATCH, NULL, 0) == 0);
+  dbug(2, "batch_supported: %d\n", batch_supported);
+
   flags = fcntl(control_channel, F_GETFL);
 
   /* Make select return immediately.  We just check whether
@@ -633,7 +802,7 @@ int stp_main_loop(void)
     fcntl(control_channel, F_SETFL, flags);
 
     dbug(3, "nb=%ld\n", (long)nb);
-    if (nb < (ssize_t) sizeof(recvbuf.type)) {
+    if (nb < (ssize_t) sizeof(uint32_t)) {
       if (nb >= 0 || (errno != EINTR && errno != EAGAIN)) {
         _perr(_("Unexpected EOF in read (nb=%ld)"), (long)nb);
         cleanup_and_exit(0, 1);
@@ -655,156 +824,27 @@ int stp_main_loop(void)
       continue;
     }
 
-    nb -= sizeof(recvbuf.type);
-    PROBE3(staprun, recv__ctlmsg, recvbuf.type, recvbuf.payload.data, nb);
+    if (!batch_supported) {
+      uint32_t type;
+      memcpy(&type, recvbuf.data, sizeof(type));
+      handle_ctl_msg(type, recvbuf.data + sizeof(type),
+                     nb - sizeof(type), &error_detected);
+      continue;
+    }
 
-    switch (recvbuf.type) {
-#if STP_TRANSPORT_VERSION == 1
-    case STP_REALTIME_DATA:
-      if (write_realtime_data(recvbuf.payload.data, nb)) {
-        _perr(_("write error (nb=%ld)"), (long)nb);
-        cleanup_and_exit(0, 1);
-      }
-      break;
-#endif
-    case STP_OOB_DATA:
-      /* Note that "WARNING:" should not be translated, since it is
-       * part of the module cmd protocol. */
-      if (strncmp(recvbuf.payload.data, "WARNING:", 7) == 0) {
-              if (suppress_warnings) break;
-              if (verbose) { /* don't eliminate duplicates */
-                      eprintf("%.*s", (int) nb, recvbuf.payload.data);
-                      break;
-#ifdef HAVE_SEARCH_H
-              } else { /* eliminate duplicates */
-                      static void *seen = 0;
-                      static unsigned seen_count = 0;
-                      char *dupstr = strndup (recvbuf.payload.data, (int) nb);
-                      char *retval;
-
-                      if (! dupstr) {
-                              /* OOM, should not happen. */
-                              eprintf("%.*s", (int) nb, recvbuf.payload.data);
-                              break;
-                      }
-
-                      retval = tfind (dupstr, & seen, (int (*)(const void*, const void*))strcmp);
-                      if (! retval) { /* new message */
-                              eprintf("%s", dupstr);
-
-                              /* We set a maximum for stored warning messages,
-                                 to prevent a misbehaving script/environment
-                                 from emitting countless _stp_warn()s, and
-                                 overflow staprun's memory. */
-#define MAX_STORED_WARNINGS 1024
-                              if (seen_count++ == MAX_STORED_WARNINGS) {
-                                      eprintf(_("WARNING deduplication table full\n"));
-                                      free (dupstr);
-                              }
-                              else if (seen_count > MAX_STORED_WARNINGS) {
-                                      /* Be quiet in the future, but stop counting to
-                                         preclude overflow. */
-                                      free (dupstr);
-                                      seen_count = MAX_STORED_WARNINGS+1;
-                              }
-                              else if (seen_count < MAX_STORED_WARNINGS) {
-                                      /* NB: don't free dupstr; it's going into the tree. */
-                                      retval = tsearch (dupstr, & seen,
-                                                        (int (*)(const void*, const void*))strcmp);
-                                      if (retval == 0) {
-                                              /* OOM, should not happen */
-                                              /* Next time we should get the 'full' message. */
-                                              free (dupstr);
-                                              seen_count = MAX_STORED_WARNINGS;
-                                      }
-                              }
-                      } else { /* old message */
-                              free (dupstr);
-                      }
-#endif
-              } /* duplicate elimination */
-      /* Note that "ERROR:" should not be translated, since it is
-       * part of the module cmd protocol. */
-      } else if (strncmp(recvbuf.payload.data, "ERROR:", 5) == 0) {
-              eprintf("%.*s", (int) nb, recvbuf.payload.data);
-              error_detected = 1;
-      } else { /* neither warning nor error */
-              eprintf("%.*s", (int) nb, recvbuf.payload.data);
-      }
-      break;
-    case STP_EXIT:
-      {
-        /* module asks us to unload it and exit */
-        dbug(2, "got STP_EXIT\n");
-        cleanup_and_exit(0, error_detected);
-        break;
-      }
-    case STP_REQUEST_EXIT:
-      {
-        /* module asks us to start exiting, so send STP_EXIT */
-        dbug(2, "got STP_REQUEST_EXIT\n");
-        int32_t rc, btype = STP_EXIT;
-        rc = write(control_channel, &btype, sizeof(btype));
-        (void) rc; /* XXX: notused */
-        break;
-      }
-    case STP_START:
-      {
-        struct _stp_msg_start *t = &recvbuf.payload.start;
-        dbug(2, "systemtap_module_init() returned %d\n", t->res);
-        if (t->res < 0) {
-          if (target_cmd)
-            kill(target_pid, SIGKILL);
-          cleanup_and_exit(0, 1);
-        } else if (target_cmd) {
-          dbug(1, "detaching pid %d\n", target_pid);
-#if WORKAROUND_BZ467568
-          /* Let's just send our pet signal to the child
-             process that should be waiting for us, mid-pause(). */
-          kill (target_pid, SIGUSR1);
-#else
-          /* Were it not for PR6964, we'd like to do it this way: */
-          int rc = ptrace (PTRACE_DETACH, target_pid, 0, 0);
-          if (rc < 0)
-            {
-              perror (_("ptrace detach"));
-              if (target_cmd)
-                kill(target_pid, SIGKILL);
-              cleanup_and_exit(0, 1);
-            }
-#endif
-        }
-        break;
-      }
-    case STP_SYSTEM:
-      {
-        struct _stp_msg_cmd *c = &recvbuf.payload.cmd;
-        dbug(2, "STP_SYSTEM: %s\n", c->cmd);
-        system_cmd(c->cmd);
-        break;
-      }
-    case STP_TRANSPORT:
-      {
-        struct _stp_msg_start ts;
-        if (use_old_transport) {
-          if (init_oldrelayfs() < 0)
-            cleanup_and_exit(0, 1);
-        } else {
-          if (init_relayfs() < 0)
-            cleanup_and_exit(0, 1);
-        }
-        ts.target = target_pid;
-        rc = send_request(STP_START, &ts, sizeof(ts));
-	if (rc != 0) {
-	  perror ("Unable to send STP_START");
-	  cleanup_and_exit (1, rc);
-	}
-        if (load_only)
-          cleanup_and_exit(1, 0);
+    /* A batch of messages, each behind a struct _stp_msg_batch
+       and padded to STP_BATCH_ALIGN.  */
+    for (p = recvbuf.data; nb >= (ssize_t) sizeof(struct _stp_msg_batch); ) {
+      struct _stp_msg_batch *h = (struct _stp_msg_batch *) p;
+      ssize_t len = (sizeof(*h) + h->len + STP_BATCH_ALIGN - 1)
+                    & ~(STP_BATCH_ALIGN - 1);
+      if (h->len > nb - sizeof(*h)) {
+        err(_("WARNING: truncated message of type %d\n"), h->type);
         break;
       }
-    default:
-      err(_("WARNING: ignored message of type %d\n"), recvbuf.type);
+      handle_ctl_msg(h->type, p + sizeof(*h), h->len, &error_detected);
+      p += len;
+      nb -= len;
     }
   }
   fclose(ofp);
@@ -21,6 +21,33 @@ static volatile int stop_threads = 0;
 static time_t *time_backlog[NR_CPUS];
 static int backlog_order=0;
 #define BACKLOG_MASK ((1 << backlog_order) - 1)
+static char relay_filebase[PATH_MAX];
+static unsigned long long bytes_out[NR_CPUS];
+static struct timeval relay_start;
+
+/* Segment mode (-P): each output file of -S has its full size
+ * preallocated when it is opened, then is written a large aligned buffer
+ * at a time, with O_DIRECT where the filesystem takes it.  A long capture
+ * so neither fragments the disk nor churns the page cache, and switching
+ * files costs the readers one open and fallocate.  The preallocation
+ * keeps the file size at what has been written, so the file can be
+ * followed live and a killed stapio leaves no zero padding.  */
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01
+#endif
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE 0x02
+#endif
+#define SEGMENT_ALIGN 4096
+#define SEGMENT_BUFSIZE (4 << 20)
+
+struct segment {
+	char *buf;		/* SEGMENT_BUFSIZE, aligned for O_DIRECT */
+	size_t len;		/* bytes in buf not yet written */
+	off_t written;		/* bytes of the file written so far */
+	int direct;		/* out_fd is open with O_DIRECT */
+};
+static struct segment segment[NR_CPUS];
 
 #ifdef NEED_PPOLL
 int ppoll(struct pollfd *fds, nfds_t nfds,
@@ -67,6 +94,102 @@ time_t read_backlog(int cpu, int fnum)
 	return time_backlog[cpu][fnum & BACKLOG_MASK];
 }
 
+static int open_segment(int cpu, const char *name)
+{
+	struct segment *seg = &segment[cpu];
+	int fd;
+
+	if (seg->buf == NULL
+	    && posix_memalign((void **)&seg->buf, SEGMENT_ALIGN, SEGMENT_BUFSIZE)) {
+		seg->buf = NULL;
+		errno = ENOMEM;
+		return -1;
+	}
+	seg->len = 0;
+	seg->written = 0;
+	seg->direct = 1;
+	fd = open(name, O_CREAT|O_TRUNC|O_WRONLY|O_DIRECT, 0666);
+	if (fd < 0 && errno == EINVAL) {
+		/* e.g. tmpfs, which has no O_DIRECT */
+		dbug(2, "no O_DIRECT for %s\n", name);
+		seg->direct = 0;
+		fd = open(name, O_CREAT|O_TRUNC|O_WRONLY, 0666);
+	}
+	if (fd < 0)
+		return -1;
+	/* What the segment doesn't use is given back when it's closed. */
+	if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, fsize_max) < 0)
+		dbug(2, "couldn't preallocate %s: %s\n", name, strerror(errno));
+	return fd;
+}
+
+/* Writes out the buffered data of a segment, up to the last whole
+ * block, or all of it when the segment is being closed. */
+static int segment_flush(int cpu, int final)
+{
+	struct segment *seg = &segment[cpu];
+	size_t len = final ? seg->len : seg->len & ~(size_t)(SEGMENT_ALIGN - 1);
+	size_t done = 0;
+	ssize_t rc;
+
+	if (len % SEGMENT_ALIGN && seg->direct) {
+		/* O_DIRECT won't take a partial block. */
+		int flags = fcntl(out_fd[cpu], F_GETFL);
+		if (flags < 0 || fcntl(out_fd[cpu], F_SETFL, flags & ~O_DIRECT) < 0)
+			return -1;
+		seg->direct = 0;
+	}
+	while (done < len) {
+		rc = write(out_fd[cpu], seg->buf + done, len - done);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		done += rc;
+	}
+	seg->len -= len;
+	seg->written += len;
+	if (seg->len)
+		memmove(seg->buf, seg->buf + len, seg->len);
+	if (final && ftruncate(out_fd[cpu], seg->written) < 0)
+		return -1;
+	/* Give back the preallocated blocks past the end of the data. */
+	if (final && seg->written < fsize_max
+	    && fallocate(out_fd[cpu], FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+			 seg->written, fsize_max - seg->written) < 0)
+		dbug(2, "couldn't release the rest of segment %d: %s\n",
+		     cpu, strerror(errno));
+	return 0;
+}
+
+static ssize_t segment_write(int cpu, const char *data, size_t count)
+{
+	struct segment *seg = &segment[cpu];
+	size_t left = count, len;
+
+	while (left) {
+		len = SEGMENT_BUFSIZE - seg->len;
+		if (len > left)
+			len = left;
+		memcpy(seg->buf + seg->len, data, len);
+		seg->len += len;
+		data += len;
+		left -= len;
+		if (seg->len == SEGMENT_BUFSIZE && segment_flush(cpu, 0) < 0)
+			return -1;
+	}
+	return count;
+}
+
+static int close_segment(int cpu)
+{
+	int rc = segment_flush(cpu, 1);
+	close(out_fd[cpu]);
+	out_fd[cpu] = -1;
+	return rc;
+}
+
 static int open_outfile(int fnum, int cpu, int remove_file)
 {
 	char buf[PATH_MAX];
@@ -91,7 +214,10 @@ static int open_outfile(int fnum, int cpu, int remove_file)
 
 	if (make_outfile_name(buf, PATH_MAX, fnum, cpu, t, bulkmode) < 0)
 		return -1;
-	out_fd[cpu] = open (buf, O_CREAT|O_TRUNC|O_WRONLY, 0666);
+	if (segment_mode)
+		out_fd[cpu] = open_segment(cpu, buf);
+	else
+		out_fd[cpu] = open (buf, O_CREAT|O_TRUNC|O_WRONLY, 0666);
 	if (out_fd[cpu] < 0) {
 		perr("Couldn't open output file %s", buf);
 		return -1;
@@ -106,7 +232,13 @@ static int switch_outfile(int cpu, int *fnum)
 	int remove_file = 0;
 
 	dbug(3, "thread %d switching file\n", cpu);
-	close(out_fd[cpu]);
+	if (segment_mode) {
+		if (close_segment(cpu) < 0) {
+			perr("Couldn't write the end of the file for cpu %d, exiting.", cpu);
+			return -1;
+		}
+	} else
+		close(out_fd[cpu]);
 	*fnum += 1;
 	if (fnum_max && *fnum >= fnum_max)
 		remove_file = 1;
@@ -124,6 +256,7 @@ static void *reader_thread(void *data)
 {
         char buf[131072];
         int rc, cpu = (int)(long)data;
+	ssize_t wrc;
         struct pollfd pollfd;
 	struct timespec tim = {.tv_sec=0, .tv_nsec=200000000}, *timeout = &tim;
 	sigset_t sigs;
@@ -180,7 +313,22 @@ static void *reader_thread(void *data)
 				_perr("poll error");
 				goto error_out;
 			}
-                }
+                } else if (rc == 0 && segment_mode) {
+			/* Idle, so let what's buffered reach the file. */
+			if (segment_flush(cpu, 0) < 0) {
+				perr("Couldn't write to output %d for cpu %d, exiting.", out_fd[cpu], cpu);
+				goto error_out;
+			}
+		} else if (rc == 0 && (symbolize_output || hist_format)
+			   && !bulkmode) {
+			/* A probe's output arrives whole, so what was held
+			 * back as the start of a token won't be completed. */
+			if (symbolize_flush(out_fd[cpu]) < 0) {
+				if (errno != EPIPE)
+					perr("Couldn't write to output %d for cpu %d, exiting.", out_fd[cpu], cpu);
+				goto error_out;
+			}
+		}
 
 		while ((rc = read(relay_fd[cpu], buf, sizeof(buf))) > 0) {
 			/* Switching file */
@@ -191,18 +339,38 @@ static void *reader_thread(void *data)
 				switch_file[cpu] = 0;
 				wsize = 0;
 			}
-			if (write(out_fd[cpu], buf, rc) != rc) {
+			if ((symbolize_output || hist_format) && !bulkmode)
+				wrc = symbolize_write(out_fd[cpu], buf, rc);
+			else if (segment_mode)
+				wrc = segment_write(cpu, buf, rc);
+			else if ((wrc = write(out_fd[cpu], buf, rc)) != rc)
+				wrc = -1;
+			if (wrc < 0) {
 				if (errno != EPIPE)
 					perr("Couldn't write to output %d for cpu %d, exiting.", out_fd[cpu], cpu);
 				goto error_out;
 			}
-			wsize += rc;
+			wsize += wrc;
+			bytes_out[cpu] += wrc;
+		}
+		/* Bulk mode polls without a timeout, so it never goes idle;
+		 * write out each burst's whole blocks instead. */
+		if (segment_mode && bulkmode && segment_flush(cpu, 0) < 0) {
+			perr("Couldn't write to output %d for cpu %d, exiting.", out_fd[cpu], cpu);
+			goto error_out;
 		}
         } while (!stop_threads);
+	if ((symbolize_output || hist_format) && !bulkmode)
+		(void) symbolize_flush(out_fd[cpu]);
+	if (segment_mode && close_segment(cpu) < 0)
+		perr("Couldn't write the end of the file for cpu %d", cpu);
 	dbug(3, "exiting thread for cpu %d\n", cpu);
 	return(NULL);
 
 error_out:
+	/* Keep what is still buffered, if the file will take it. */
+	if (segment_mode && out_fd[cpu] >= 0)
+		(void) close_segment(cpu);
 	/* Signal the main thread that we need to quit */
 	kill(getpid(), SIGTERM);
 	dbug(2, "exiting thread for cpu %d after error\n", cpu);
@@ -238,7 +406,7 @@ int init_relayfs(void)
 	int i, len;
 	struct statfs st;
 	char rqbuf[128];
-	char buf[PATH_MAX], relay_filebase[PATH_MAX];
+	char buf[PATH_MAX];
         struct sigaction sa;
         
 	dbug(2, "initializing relayfs\n");
@@ -362,6 +530,7 @@ int init_relayfs(void)
         sigemptyset(&sa.sa_mask);
         sigaction(SIGUSR2, &sa, NULL);
         dbug(2, "starting threads\n");
+	gettimeofday(&relay_start, NULL);
         for (i = 0; i < ncpus; i++) {
                 if (pthread_create(&reader[i], NULL, reader_thread,
                                    (void *)(long)i) < 0) {
@@ -373,6 +542,55 @@ int init_relayfs(void)
 	return 0;
 }
 
+/* The count of the relay_v2 transport's "dropped" file, or -1. */
+static int read_drops(void)
+{
+	char buf[PATH_MAX];
+	int fd = -1, len;
+
+	if (sprintf_chk(buf, "%sdropped", relay_filebase))
+		return -1;
+#ifdef HAVE_OPENAT
+	if (relay_basedir_fd >= 0)
+		fd = openat(relay_basedir_fd, buf, O_RDONLY);
+#endif
+	if (fd < 0)
+		fd = open(buf, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return -1;
+	buf[len] = '\0';
+	return atoi(buf);
+}
+
+static void report_throughput(void)
+{
+	unsigned long long bytes = 0;
+	struct timeval now;
+	double secs, mb;
+	int i, drops;
+
+	gettimeofday(&now, NULL);
+	secs = (now.tv_sec - relay_start.tv_sec)
+		+ (now.tv_usec - relay_start.tv_usec) / 1000000.0;
+	for (i = 0; i < ncpus; i++) {
+		if (bulkmode)
+			dbug(1, "cpu %d wrote %llu bytes\n", i, bytes_out[i]);
+		bytes += bytes_out[i];
+	}
+	mb = bytes / 1048576.0;
+	drops = read_drops();
+	if (drops >= 0)
+		err(_("Wrote %.1f MB in %.1f s (%.1f MB/s), %d transport drops.\n"),
+		    mb, secs, secs > 0 ? mb / secs : 0.0, drops);
+	else
+		err(_("Wrote %.1f MB in %.1f s (%.1f MB/s).\n"),
+		    mb, secs, secs > 0 ? mb / secs : 0.0);
+}
+
 void close_relayfs(void)
 {
 	int i;
@@ -390,6 +608,8 @@ void close_relayfs(void)
 		else
 			break;
 	}
+	if (segment_mode && !load_only)
+		report_throughput();
 	for (i = 0; i < ncpus; i++) {
 		if (relay_fd[i] >= 0)
 			close(relay_fd[i]);
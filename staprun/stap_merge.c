@@ -14,42 +14,218 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  *
- * Copyright (C) Red Hat Inc, 2005-2007
+ * Copyright (C) Red Hat Inc, 2005-2013
  *
  */
 
+/*
+ * Bulk mode output is one file per cpu, each a series of records: a
+ * struct _stp_trace header (32-bit sequence number and length) followed
+ * by that many bytes of data.  The sequence numbers are global, so the
+ * records are merged back in order with a min-heap over the inputs.
+ *
+ * The sequence numbers on the wire are 32 bits and wrap on long traces,
+ * so each input's are extended to 64 bits relative to its previous one;
+ * within one input they always increase.  (The runtime's header stays
+ * 32-bit, for compatibility with existing readers of bulk files.)
+ *
+ * With -f, the inputs are followed as they grow, e.g. while stapio is
+ * still writing them.  A record is written as soon as it is known to be
+ * next: either it has the next sequence number, or every input has a
+ * record pending.  Otherwise it waits at most the -l lag for the missing
+ * record to show up, before counting it as dropped.  Following stops on
+ * SIGINT/SIGTERM, or once the -p process exits, after which the rest of
+ * the inputs is drained.
+ */
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
 
 static void usage (char *prog)
 {
-	fprintf(stderr, "%s [-v] [-o output_filename] input_files ...\n", prog);
+	fprintf(stderr, "%s [-v] [-f [-l lag_ms] [-p pid]] [-o output_filename] input_files ...\n", prog);
 	exit(-1);
 }
 
-#define TIMESTAMP_SIZE (sizeof(int))
-#define NR_CPUS 256
+#define READ_SIZE (64 * 1024)
+#define FOLLOW_POLL_US 10000
 
-int main (int argc, char *argv[])
+/* Same layout as the runtime's struct _stp_trace.  */
+struct trace_header {
+	uint32_t sequence;
+	uint32_t pdu_len;
+};
+
+struct input {
+	const char *name;
+	int fd;
+	char *buf;
+	size_t start, end, size;	/* unread data is buf[start..end) */
+	int started;			/* seen a record yet? */
+	enum { WAITING, PENDING, DONE } state;
+	uint64_t seq;			/* of the pending record */
+	uint32_t len;			/* payload length of the pending record */
+};
+
+static int verbose = 0;
+static uint64_t count = 0;	/* sequence number of the last merged record */
+static uint64_t records = 0;	/* number of merged records */
+static volatile sig_atomic_t stop_following = 0;
+
+static void handle_signal(int sig)
 {
-	char *buf, *outfile_name = NULL;
-	int c, i, j, rc, dropped=0;
-	long count=0, min, num[NR_CPUS];
-	FILE *ofp = NULL;
-	FILE *fp[NR_CPUS] = { 0 };
-	int ncpus, len, verbose = 0;
-	int bufsize = 65536;
+	(void) sig;
+	stop_following = 1;
+}
 
-	buf = malloc(bufsize);
-	if (buf == NULL) {
+static void *xrealloc(void *p, size_t size)
+{
+	p = realloc(p, size);
+	if (p == NULL) {
 		fprintf(stderr, "Memory allocation failed.\n");
 		exit(-2);
 	}
+	return p;
+}
+
+/* Make at least n bytes of input available.  Returns 1 if they are, or 0
+ * if the file (for now) ends sooner.  */
+static int input_fill(struct input *in, size_t n)
+{
+	while (in->end - in->start < n) {
+		ssize_t rc;
+
+		if (in->start > 0) {
+			memmove(in->buf, in->buf + in->start,
+				in->end - in->start);
+			in->end -= in->start;
+			in->start = 0;
+		}
+		if (n > in->size || in->size - in->end < READ_SIZE / 2) {
+			in->size = (n > in->size ? n : in->size) + READ_SIZE;
+			if (verbose)
+				fprintf(stderr, "reallocating %zu bytes for %s\n",
+					in->size, in->name);
+			in->buf = xrealloc(in->buf, in->size);
+		}
+
+		rc = read(in->fd, in->buf + in->end, in->size - in->end);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0) {
+			fprintf(stderr, "error reading %s: %s\n", in->name,
+				strerror(errno));
+			exit(-3);
+		}
+		if (rc == 0)
+			return 0;
+		in->end += rc;
+	}
+	return 1;
+}
+
+/* Read the header and payload of the next record.  Returns 1 if there is
+ * a whole one, or 0 if not (yet).  */
+static int input_next(struct input *in)
+{
+	struct trace_header h;
+
+	if (!input_fill(in, sizeof(h)))
+		return 0;
+	memcpy(&h, in->buf + in->start, sizeof(h));
+	if (!input_fill(in, sizeof(h) + h.pdu_len))
+		return 0;
+
+	/* An input's first record may come after a wrap, so place it
+	 * relative to where the merge is at.  */
+	if (!in->started && records == 0)
+		in->seq = h.sequence;
+	else if (!in->started)
+		in->seq = count + (int32_t)(h.sequence - (uint32_t)count);
+	else
+		in->seq += (uint32_t)(h.sequence - (uint32_t)in->seq);
+	in->started = 1;
+	in->len = h.pdu_len;
+	in->start += sizeof(h);
+	return 1;
+}
+
+/* Check that an input didn't stop halfway through a record.  */
+static void input_finish(struct input *in)
+{
+	if (in->end > in->start)
+		fprintf(stderr, "%s: ignoring %zu bytes of truncated data\n",
+			in->name, in->end - in->start);
+	in->state = DONE;
+}
+
+
+/* A binary min-heap of the inputs that have a record pending.  */
+static struct input **heap;
+static int heap_size = 0;
+
+static void heap_down(int i)
+{
+	struct input *in = heap[i];
+	for (;;) {
+		int c = 2 * i + 1;
+		if (c >= heap_size)
+			break;
+		if (c + 1 < heap_size && heap[c + 1]->seq < heap[c]->seq)
+			c++;
+		if (in->seq <= heap[c]->seq)
+			break;
+		heap[i] = heap[c];
+		i = c;
+	}
+	heap[i] = in;
+}
+
+static void heap_push(struct input *in)
+{
+	int i = heap_size++;
+	while (i > 0 && in->seq < heap[(i - 1) / 2]->seq) {
+		heap[i] = heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	heap[i] = in;
+}
+
+static void heap_pop(void)
+{
+	if (--heap_size > 0) {
+		heap[0] = heap[heap_size];
+		heap_down(0);
+	}
+}
 
-	while ((c = getopt (argc, argv, "vo:")) != EOF)  {
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int main (int argc, char *argv[])
+{
+	char *outfile_name = NULL;
+	int c, i, ninputs, follow = 0;
+	long lag_ms = 1000;
+	pid_t follow_pid = 0;
+	uint64_t dropped = 0, stall_start = 0;
+	FILE *ofp = NULL;
+	struct input *inputs;
+
+	while ((c = getopt (argc, argv, "vo:fl:p:")) != EOF)  {
 		switch (c) {
 		case 'v':
 			verbose = 1;
@@ -57,87 +233,152 @@ int main (int argc, char *argv[])
 		case 'o':
 			outfile_name = optarg;
 			break;
+		case 'f':
+			follow = 1;
+			break;
+		case 'l':
+			lag_ms = atol(optarg);
+			break;
+		case 'p':
+			follow_pid = atoi(optarg);
+			break;
 		default:
 			usage(argv[0]);
 		}
 	}
-	
+
 	if (optind == argc)
 		usage (argv[0]);
 
-	i = 0;
-	while (optind < argc) {
-		fp[i] = fopen(argv[optind++], "r");
-		if (!fp[i]) {
-			fprintf(stderr, "error opening file %s.\n", argv[optind - 1]);
+	ninputs = argc - optind;
+	inputs = calloc(ninputs, sizeof(*inputs));
+	heap = calloc(ninputs, sizeof(*heap));
+	if (inputs == NULL || heap == NULL) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(-2);
+	}
+
+	for (i = 0; i < ninputs; i++) {
+		struct input *in = &inputs[i];
+		in->name = argv[optind + i];
+		in->fd = open(in->name, O_RDONLY);
+		if (in->fd < 0) {
+			fprintf(stderr, "error opening file %s.\n", in->name);
 			return -1;
 		}
-		if (fread (buf, TIMESTAMP_SIZE, 1, fp[i]))
-			num[i] = *((int *)buf);
-		else
-			num[i] = 0;
-		i++;
 	}
-	ncpus = i;
 
 	if (!outfile_name)
 		ofp = stdout;
 	else {
-		ofp = fopen(outfile_name, "w");	
+		ofp = fopen(outfile_name, "w");
 		if (!ofp) {
-			fprintf(stderr, "ERROR: couldn't open output file %s: errcode = %s\n", 
+			fprintf(stderr, "ERROR: couldn't open output file %s: errcode = %s\n",
 				outfile_name, strerror(errno));
 			return -1;
 		}
 	}
-	
-	do {
-		min = num[0];
-		j = 0;
-		for (i = 1; i < ncpus; i++) {
-			if (min == 0 || (num[i] && num[i] < min)) {
-				min = num[i];
-				j = i;
+	setvbuf(ofp, NULL, _IOFBF, 16 * READ_SIZE);
+
+	if (follow) {
+		signal(SIGINT, handle_signal);
+		signal(SIGTERM, handle_signal);
+	}
+
+	for (;;) {
+		struct input *in;
+
+		/* Unless the next record is already at hand, see which of
+		 * the inputs waiting for data have some now.  */
+		if (heap_size == 0 || heap[0]->seq != count + 1) {
+			int waiting = 0;
+
+			for (i = 0; i < ninputs; i++) {
+				in = &inputs[i];
+				if (in->state != WAITING)
+					continue;
+				if (input_next(in)) {
+					in->state = PENDING;
+					heap_push(in);
+				} else if (!follow)
+					input_finish(in);
+				else
+					waiting++;
 			}
-		}
 
-		if (fread(&len, sizeof(int), 1, fp[j])) {
-			if (verbose)
-				fprintf(stdout, "[CPU:%d, seq=%ld, length=%d]\n", j, min, len);
-			if (len > bufsize) {
-				bufsize = len;
-				if (verbose) fprintf(stderr, "reallocating %d bytes\n", bufsize);
-				buf = realloc(buf, bufsize);
-				if (buf == NULL) {
-					fprintf(stderr, "Memory allocation failed.\n");	
-					exit(-2);
+			/* A gap in the sequence may yet be filled by one of
+			 * the waiting inputs, so give them up to lag_ms.  */
+			if (waiting && (heap_size == 0
+					|| heap[0]->seq != count + 1)) {
+				if (follow_pid && kill(follow_pid, 0) < 0
+				    && errno == ESRCH)
+					stop_following = 1;
+				if (stop_following) {
+					/* Drain whatever is left.  */
+					follow = 0;
+					continue;
+				}
+
+				if (heap_size > 0 && !stall_start)
+					stall_start = now_ms();
+				if (heap_size == 0
+				    || now_ms() - stall_start < (uint64_t) lag_ms) {
+					fflush(ofp);
+					usleep(FOLLOW_POLL_US);
+					continue;
 				}
 			}
-			if ((rc = fread(buf, len, 1, fp[j])) <= 0 ) {
-				fprintf(stderr, "fread error: got %d\n", rc);
-				exit(-3);
-			}
-			if ((rc = fwrite(buf, len, 1, ofp)) <= 0 ) {
-				fprintf(stderr, "fread error: got %d\n", rc);
-				exit(-3);
-			}
 		}
+		stall_start = 0;
+
+		if (heap_size == 0)
+			break;
+
+		in = heap[0];
+		if (verbose)
+			fprintf(stdout, "[CPU:%d, seq=%llu, length=%u]\n",
+				(int)(in - inputs), (unsigned long long) in->seq,
+				in->len);
+		if (in->len && fwrite(in->buf + in->start, in->len, 1, ofp) != 1) {
+			fprintf(stderr, "fwrite error: %s\n", strerror(errno));
+			exit(-3);
+		}
+		in->start += in->len;
 
-		if (min && ++count != min) {
-			fprintf(stderr, "got %ld. expected %ld\n", min, count);
-			dropped += min - count ;
-			count = min;
+		/* The first file of a rotated set needn't start at 1.  */
+		if (records++ == 0)
+			count = in->seq - 1;
+		if (++count != in->seq) {
+			if (in->seq > count) {
+				fprintf(stderr, "got %llu. expected %llu\n",
+					(unsigned long long) in->seq,
+					(unsigned long long) count);
+				dropped += in->seq - count;
+			}
+			count = in->seq;
 		}
 
-		if (fread (buf, TIMESTAMP_SIZE, 1, fp[j]))
-			num[j] = *((int *)buf);
-		else
-			num[j] = 0;
-	} while (min);
+		if (input_next(in))
+			heap_down(0);
+		else {
+			heap_pop();
+			if (follow)
+				in->state = WAITING;
+			else
+				input_finish(in);
+		}
+	}
 
-	for (i = 0; i < ncpus; i++)
-		fclose (fp[i]);
+	for (i = 0; i < ninputs; i++) {
+		close (inputs[i].fd);
+		free (inputs[i].buf);
+	}
+	free (inputs);
+	free (heap);
 	fclose (ofp);
-	printf ("sequence had %d drops\n", dropped);
+	if (verbose)
+		fprintf (stderr, "merged %llu records from %d files\n",
+			 (unsigned long long) records, ninputs);
+	printf ("sequence had %llu drops\n", (unsigned long long) dropped);
 	return 0;
 }
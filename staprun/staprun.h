@@ -36,6 +36,7 @@
 #include <linux/limits.h>
 #include <sys/wait.h>
 #include <sys/statfs.h>
+#include <sys/time.h>
 #include <syslog.h>
 
 /* Include config.h to pick up dependency for --prefix usage. */
@@ -161,6 +162,14 @@ int make_outfile_name(char *buf, int max, int fnum, int cpu,
 int init_backlog(int cpu);
 void write_backlog(int cpu, int fnum, time_t t);
 time_t read_backlog(int cpu, int fnum);
+/* symbolize.c */
+ssize_t symbolize_write(int fd, const char *buf, size_t len);
+int symbolize_flush(int fd);
+/* histogram.c */
+#define HIST_FORMAT_TEXT 1
+#define HIST_FORMAT_JSON 2
+#define HIST_RECORD_MAX 8192	/* the runtime's STP_BUFFER_SIZE */
+ssize_t hist_token(const char *buf, size_t len, char **out, size_t *nout);
 /* staprun_funcs.c */
 void setup_staprun_signals(void);
 const char *moderror(int err);
@@ -241,6 +250,9 @@ extern int fnum_max;
 extern int remote_id;
 extern const char *remote_uri;
 extern int relay_basedir_fd;
+extern int symbolize_output;
+extern int hist_format;
+extern int segment_mode;
 
 /* getopt variables */
 extern char *optarg;
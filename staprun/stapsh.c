@@ -12,18 +12,37 @@
 // not meant to be invoked directly by the user.  Commands are simply
 // whitespace-delimited strings, terminated by newlines.
 //
-//   command: stap VERSION
-//     reply: stapsh VERSION MACHINE RELEASE
+//   command: stap VERSION [cache]
+//     reply: stapsh VERSION MACHINE RELEASE [cache]
 //      desc: This is the initial handshake.  The VERSION exchange is intended
 //            to facilitate compatibility checks, in case the protocol needs to
 //            change.  MACHINE and RELEASE are reported as given by uname.
+//            A client that asks for "cache" gets it echoed back if this
+//            stapsh knows the "have" and "zfile" commands and file hashes;
+//            a stapsh that doesn't just leaves it out.
 //
-//   command: file SIZE NAME
+//   command: file SIZE NAME [HASH]
 //            DATA
 //     reply: OK / error message
 //      desc: Create a file of SIZE bytes, called NAME.  The NAME is a basename
 //            only, and limited to roughly "[a-z0-9][a-z0-9._]*".  The DATA is
-//            read as raw bytes following the command's newline.
+//            read as raw bytes following the command's newline.  If a HASH of
+//            the contents is given, the file is also kept in the stapsh cache
+//            for later "have" commands.  HASH is limited to "[0-9a-f_]+".
+//
+//   command: zfile SIZE NAME [HASH]
+//            DATA
+//     reply: OK / error message
+//      desc: Like "file", but the SIZE bytes of DATA are gzip-compressed, and
+//            are uncompressed into NAME.  The limit on SIZE applies to the
+//            uncompressed file as well.
+//
+//   command: have HASH NAME
+//     reply: OK / error message
+//      desc: Create NAME from the file with the given HASH in the stapsh
+//            cache, if there is one, saving the client from sending it again.
+//            The cache is $SYSTEMTAP_DIR/stapsh_cache (by default in
+//            ~/.systemtap), and holds at most STAPSH_CACHE_MAX_FILES files.
 //
 //   command: run ARG1 ARG2 ...
 //     reply: OK / error message
@@ -53,7 +72,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <utime.h>
 
+#include <dirent.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/utsname.h>
@@ -63,6 +84,7 @@
 #define STAPSH_TOK_DELIM " \t\r\n"
 #define STAPSH_MAX_FILE_SIZE 32000000 // XXX should be cumulative?
 #define STAPSH_MAX_ARGS 256
+#define STAPSH_CACHE_MAX_FILES 64
 
 
 struct stapsh_handler {
@@ -73,6 +95,8 @@ struct stapsh_handler {
 
 static int do_hello(void);
 static int do_file(void);
+static int do_zfile(void);
+static int do_have(void);
 static int do_run(void);
 static int do_quit(void);
 
@@ -83,12 +107,15 @@ static const int signals[] = {
 static const struct stapsh_handler commands[] = {
       { "stap", do_hello },
       { "file", do_file },
+      { "zfile", do_zfile },
+      { "have", do_have },
       { "run", do_run },
       { "quit", do_quit },
 };
 static const unsigned ncommands = sizeof(commands) / sizeof(*commands);
 
 static char tmpdir[FILENAME_MAX] = "";
+static char cachedir[FILENAME_MAX] = "";
 
 static pid_t staprun_pid = -1;
 
@@ -256,37 +283,157 @@ do_hello()
     return 1;
 
   // XXX check caller's version compatibility
+  const char* arg = strtok(NULL, STAPSH_TOK_DELIM);
+  int cache = 0;
+  if (arg)
+    while ((arg = strtok(NULL, STAPSH_TOK_DELIM)))
+      if (strcmp(arg, "cache") == 0)
+        cache = 1;
 
   struct utsname uts;
   if (uname(&uts))
     return 1;
 
-  reply ("stapsh %s %s %s\n", VERSION, uts.machine, uts.release);
+  reply ("stapsh %s %s %s%s\n", VERSION, uts.machine, uts.release,
+         cache ? " cache" : "");
   return 0;
 }
 
+// Check that a file NAME from the client is a plain basename
 static int
-do_file()
+check_name(const char* name)
 {
-  if (staprun_pid > 0)
-    return 1;
-
-  int ret = 0;
-  int size = -1;
-  const char* arg = strtok(NULL, STAPSH_TOK_DELIM);
-  if (arg)
-    size = atoi(arg);
-  if (size <= 0 || size > STAPSH_MAX_FILE_SIZE)
-    return reply ("ERROR: bad file size %d\n", size);
-
-  const char* name = strtok(NULL, STAPSH_TOK_DELIM);
+  const char* arg;
   if (!name)
     return reply ("ERROR: missing file name\n");
   for (arg = name; *arg; ++arg)
     if (!isalnum(*arg) &&
         !(arg > name && (*arg == '.' || *arg == '_')))
       return reply ("ERROR: bad character '%c' in file name\n", *arg);
+  return 0;
+}
+
+// Check that a file HASH from the client can't escape the cache directory
+static int
+valid_hash(const char* hash)
+{
+  const char* arg;
+  if (!hash || !*hash)
+    return 0;
+  for (arg = hash; *arg; ++arg)
+    if (!isxdigit(*arg) && *arg != '_')
+      return 0;
+  return 1;
+}
+
+// Copy a file, going through a temporary and a rename so that readers
+// never see a partial file.
+static int
+copy_file(const char* from, const char* to)
+{
+  char tmp[FILENAME_MAX];
+  char buf[4096];
+  size_t r;
+  int ret = 0;
+
+  if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", to) >= (int)sizeof(tmp))
+    return 1;
+
+  FILE* in = fopen(from, "r");
+  if (!in)
+    return 1;
+  int fd = mkstemp(tmp);
+  FILE* out = fd >= 0 ? fdopen(fd, "w") : NULL;
+  if (!out)
+    {
+      if (fd >= 0)
+        {
+          close(fd);
+          unlink(tmp);
+        }
+      fclose(in);
+      return 1;
+    }
+
+  while (ret == 0 && (r = fread(buf, 1, sizeof(buf), in)) > 0)
+    if (fwrite(buf, 1, r, out) != r)
+      ret = 1;
+  if (ferror(in))
+    ret = 1;
+  fclose(in);
+  if (fclose(out) != 0)
+    ret = 1;
+
+  if (ret == 0 && rename(tmp, to) != 0)
+    ret = 1;
+  if (ret)
+    unlink(tmp);
+  return ret;
+}
+
+// Keep the cache bounded, by dropping the least recently used files
+static void
+trim_cache(void)
+{
+  for (;;)
+    {
+      DIR* d = opendir(cachedir);
+      if (!d)
+        return;
+
+      unsigned count = 0;
+      time_t oldest_time = 0;
+      char oldest[FILENAME_MAX] = "";
+      struct dirent* e;
+      while ((e = readdir(d)))
+        {
+          char path[FILENAME_MAX];
+          struct stat st;
+          if (e->d_name[0] == '.')
+            continue;
+          if (snprintf(path, sizeof(path), "%s/%s", cachedir, e->d_name)
+              >= (int)sizeof(path))
+            continue;
+          if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+            continue;
+          ++count;
+          if (!oldest[0] || st.st_mtime < oldest_time)
+            {
+              oldest_time = st.st_mtime;
+              strcpy(oldest, path);
+            }
+        }
+      closedir(d);
+
+      if (count <= STAPSH_CACHE_MAX_FILES || !oldest[0])
+        return;
+      dbug(2, "trimming cached file %s\n", oldest);
+      if (unlink(oldest) != 0)
+        return;
+    }
+}
+
+// Keep a received file in the cache under its hash, if we can
+static void
+cache_file(const char* name, const char* hash)
+{
+  char path[FILENAME_MAX];
+  if (!cachedir[0] || !valid_hash(hash))
+    return;
+  if (snprintf(path, sizeof(path), "%s/%s", cachedir, hash) >= (int)sizeof(path))
+    return;
+  if (copy_file(name, path) == 0)
+    {
+      dbug(2, "cached %s as %s\n", name, path);
+      trim_cache();
+    }
+}
 
+// Read SIZE bytes of file data from the client into NAME
+static int
+receive_file(int size, const char* name)
+{
+  int ret = 0;
   FILE* f = fopen(name, "w");
   if (!f)
     return reply ("ERROR: can't open file \"%s\" for writing\n", name);
@@ -318,12 +465,180 @@ do_file()
         }
     }
   fclose(f);
+  return ret;
+}
+
+// Uncompress the gzip file ZNAME into NAME, which may be no larger than
+// STAPSH_MAX_FILE_SIZE either.  gzip writes to a pipe rather than to
+// NAME itself, so that a small file can't blow up into a huge one.
+static int
+gunzip_file(const char* zname, const char* name)
+{
+  int ret = 0, rc;
+  pid_t pid = -1;
+  int pipefd[2];
+  const char* argv[] = {"gzip", "-dc", "--", zname, NULL};
+  posix_spawn_file_actions_t fa;
+
+  FILE* f = fopen(name, "w");
+  if (!f)
+    return reply ("ERROR: can't open file \"%s\" for writing\n", name);
+  if (pipe(pipefd) != 0)
+    {
+      fclose(f);
+      return reply ("ERROR: can't create a pipe for gzip\n");
+    }
+  if (posix_spawn_file_actions_init(&fa) != 0)
+    {
+      fclose(f);
+      close(pipefd[0]);
+      close(pipefd[1]);
+      return reply ("ERROR: can't initialize posix_spawn actions\n");
+    }
+
+  // Our SIGCHLD handler is only meant for staprun, so keep gzip's
+  // exit from reaching it.
+  sigset_t mask, oldmask, pending;
+  sigemptyset (&mask);
+  sigaddset (&mask, SIGCHLD);
+  sigprocmask (SIG_BLOCK, &mask, &oldmask);
+
+  if (posix_spawn_file_actions_adddup2(&fa, pipefd[1], 1) != 0 ||
+      posix_spawn_file_actions_addclose(&fa, pipefd[0]) != 0 ||
+      posix_spawn_file_actions_addclose(&fa, pipefd[1]) != 0)
+    ret = reply ("ERROR: can't set posix_spawn actions\n");
+  else if (posix_spawnp(&pid, argv[0], &fa, NULL,
+                        (char* const*)argv, environ) != 0)
+    {
+      pid = -1;
+      ret = reply ("ERROR: can't launch gzip\n");
+    }
+  close(pipefd[1]);
+
+  size_t total = 0;
+  while (pid > 0 && ret == 0)
+    {
+      char buf[4096];
+      ssize_t r = read(pipefd[0], buf, sizeof(buf));
+      if (r < 0 && errno == EINTR)
+        continue;
+      if (r < 0)
+        ret = reply ("ERROR: unable to read uncompressed file data\n");
+      else if (r == 0)
+        break;
+      else if ((total += r) > STAPSH_MAX_FILE_SIZE)
+        ret = reply ("ERROR: uncompressed file is larger than %d bytes\n",
+                     STAPSH_MAX_FILE_SIZE);
+      else if (fwrite(buf, 1, r, f) != (size_t)r)
+        ret = reply ("ERROR: unable to write file data\n");
+    }
+  close(pipefd[0]);
+  if (fclose(f) != 0 && ret == 0)
+    ret = reply ("ERROR: unable to write file data\n");
+
+  if (pid > 0)
+    {
+      if (ret)
+        kill(pid, SIGKILL);
+      if ((waitpid(pid, &rc, 0) != pid || !WIFEXITED(rc) || WEXITSTATUS(rc))
+          && ret == 0)
+        ret = reply ("ERROR: unable to uncompress file data\n");
+    }
+  if (ret)
+    unlink(name);
+
+  sigpending (&pending);
+  if (sigismember (&pending, SIGCHLD))
+    sigwait (&mask, &rc);
+  sigprocmask (SIG_SETMASK, &oldmask, NULL);
+
+  posix_spawn_file_actions_destroy(&fa);
+  return ret;
+}
+
+static int
+do_file_common(int compressed)
+{
+  if (staprun_pid > 0)
+    return 1;
+
+  int ret = 0;
+  int size = -1;
+  const char* arg = strtok(NULL, STAPSH_TOK_DELIM);
+  if (arg)
+    size = atoi(arg);
+  if (size <= 0 || size > STAPSH_MAX_FILE_SIZE)
+    return reply ("ERROR: bad file size %d\n", size);
+
+  const char* name = strtok(NULL, STAPSH_TOK_DELIM);
+  if (check_name(name))
+    return 1;
+
+  const char* hash = strtok(NULL, STAPSH_TOK_DELIM);
+  if (hash && !valid_hash(hash))
+    return reply ("ERROR: bad file hash\n");
+
+  if (!compressed)
+    ret = receive_file(size, name);
+  else
+    {
+      char zname[FILENAME_MAX];
+      snprintf(zname, sizeof(zname), "%s.gz", name);
+      ret = receive_file(size, zname);
+      if (ret == 0)
+        ret = gunzip_file(zname, name);
+      unlink(zname);
+    }
+
+  if (ret == 0 && hash)
+    cache_file(name, hash);
 
   if (ret == 0)
     reply ("OK\n");
   return ret;
 }
 
+static int
+do_file()
+{
+  return do_file_common(0);
+}
+
+static int
+do_zfile()
+{
+  return do_file_common(1);
+}
+
+static int
+do_have()
+{
+  if (staprun_pid > 0)
+    return 1;
+
+  const char* hash = strtok(NULL, STAPSH_TOK_DELIM);
+  if (!valid_hash(hash))
+    return reply ("ERROR: bad file hash\n");
+
+  const char* name = strtok(NULL, STAPSH_TOK_DELIM);
+  if (check_name(name))
+    return 1;
+
+  char path[FILENAME_MAX];
+  if (!cachedir[0] ||
+      snprintf(path, sizeof(path), "%s/%s", cachedir, hash) >= (int)sizeof(path) ||
+      access(path, R_OK) != 0)
+    return reply ("ERROR: file not cached\n");
+
+  if (copy_file(path, name) != 0)
+    return reply ("ERROR: can't copy cached file\n");
+
+  // Refresh the timestamp, so the cache trimming sees it as recently used.
+  utime(path, NULL);
+
+  return reply ("OK\n");
+}
+
 static int
 do_run()
 {
@@ -388,6 +703,25 @@ main(int argc, char* const argv[])
   setup_signals();
 
   umask(0077);
+
+  // The cache is optional; without a home we just do without.
+  const char* s_d = getenv("SYSTEMTAP_DIR");
+  const char* home = getenv("HOME");
+  if (s_d && *s_d)
+    snprintf(cachedir, sizeof(cachedir), "%s/stapsh_cache", s_d);
+  else if (home && *home)
+    snprintf(cachedir, sizeof(cachedir), "%s/.systemtap/stapsh_cache", home);
+  if (cachedir[0])
+    {
+      char parent[FILENAME_MAX];
+      snprintf(parent, sizeof(parent), "%s", cachedir);
+      *strrchr(parent, '/') = '\0';
+      mkdir(parent, 0700);
+      if (mkdir(cachedir, 0700) != 0 && errno != EEXIST)
+        cachedir[0] = '\0';
+    }
+  dbug(2, "using cache directory \"%s\"\n", cachedir);
+
   snprintf(tmpdir, sizeof(tmpdir), "%s/stapsh.XXXXXX",
            getenv("TMPDIR") ?: "/tmp");
   if (!mkdtemp(tmpdir))
@@ -0,0 +1,615 @@
+/* -*- linux-c -*-
+ *
+ * symbolize.c - stapio lookup of user-space symbols for --lazy-symbols
+ *
+ * This file is part of systemtap, and is free software.  You can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License (GPL); either version 2, or (at your option) any
+ * later version.
+ *
+ * Copyright (C) 2013 Red Hat Inc.
+ */
+
+/*
+ * A module built with --lazy-symbols carries only the sections of the
+ * user-space binaries it may symbolize, not their symbol tables.  Where
+ * the runtime would have printed such a symbol, it prints a token
+ *
+ *	<stapsym FLAGS ADDR REL OFFSET SIZE LEN:PATH>
+ *
+ * with the _stp_snprint_addr() flags, the address, the address relative
+ * to the binary's load base, and the offset and size of the mapping, all
+ * in hex, then the length of the path in decimal, so that the path may
+ * hold spaces or '>'.  Here those tokens are replaced with the symbol looked up in
+ * the binary's own symbol table, or in its separate debuginfo found by
+ * build-id, formatted as the runtime would have.
+ *
+ * Histogram records of --hist-format are found in the output in the
+ * same pass, and handed to histogram.c to render.
+ *
+ * Only stream mode output passes through here, which is read by a
+ * single thread, so there is no locking.
+ */
+
+#include "staprun.h"
+#include <elf.h>
+
+#define STAPSYM_PREFIX "<stapsym "
+#define STAPSYM_PREFIX_LEN (sizeof(STAPSYM_PREFIX) - 1)
+#define STAPSYM_HEADER_MAX 128
+#define STAPSYM_MAX (PATH_MAX + STAPSYM_HEADER_MAX)
+
+/* Same as in runtime/sym.h. */
+#define _STP_SYM_HEX_SYMBOL   2
+#define _STP_SYM_MODULE       4
+#define _STP_SYM_OFFSET       8
+#define _STP_SYM_SIZE        16
+#define _STP_SYM_INEXACT     32
+#define _STP_SYM_MODULE_BASENAME 512
+
+#ifndef NT_GNU_BUILD_ID
+#define NT_GNU_BUILD_ID 3
+#endif
+
+struct sym {
+	unsigned long long addr;
+	const char *name;
+};
+
+struct symfile {
+	char *path;
+	struct sym *syms;
+	size_t nsyms;
+	struct symfile *next;
+};
+
+static struct symfile *symfiles = NULL;
+
+/* The output of the last write that may be the start of a token. */
+static char pending[STAPSYM_MAX > HIST_RECORD_MAX ? STAPSYM_MAX : HIST_RECORD_MAX];
+static size_t npending = 0;
+
+
+/* A mapped ELF file of the host's byte order, with its headers read
+   into the 64-bit forms whatever its class.  */
+struct elf_file {
+	const unsigned char *data;
+	size_t size;
+	int is64;
+	Elf64_Ehdr eh;
+};
+
+static int elf_open(const char *path, struct elf_file *ef)
+{
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+
+	memset(ef, 0, sizeof(*ef));
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(Elf32_Ehdr)) {
+		close(fd);
+		return -1;
+	}
+	ef->size = st.st_size;
+	ef->data = mmap(NULL, ef->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (ef->data == MAP_FAILED) {
+		ef->data = NULL;
+		return -1;
+	}
+
+	if (memcmp(ef->data, ELFMAG, SELFMAG) != 0
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+	    || ef->data[EI_DATA] != ELFDATA2LSB
+#else
+	    || ef->data[EI_DATA] != ELFDATA2MSB
+#endif
+	    )
+		goto bad;
+
+	if (ef->data[EI_CLASS] == ELFCLASS64) {
+		if (ef->size < sizeof(Elf64_Ehdr))
+			goto bad;
+		ef->is64 = 1;
+		memcpy(&ef->eh, ef->data, sizeof(Elf64_Ehdr));
+	} else if (ef->data[EI_CLASS] == ELFCLASS32) {
+		Elf32_Ehdr eh;
+		memcpy(&eh, ef->data, sizeof(eh));
+		ef->eh.e_type = eh.e_type;
+		ef->eh.e_phoff = eh.e_phoff;
+		ef->eh.e_shoff = eh.e_shoff;
+		ef->eh.e_phnum = eh.e_phnum;
+		ef->eh.e_shnum = eh.e_shnum;
+		ef->eh.e_shstrndx = eh.e_shstrndx;
+	} else
+		goto bad;
+	return 0;
+
+bad:
+	munmap((void *)ef->data, ef->size);
+	ef->data = NULL;
+	return -1;
+}
+
+static int elf_in_bounds(const struct elf_file *ef, unsigned long long off,
+			 unsigned long long len)
+{
+	return off <= ef->size && len <= ef->size - off;
+}
+
+static int elf_shdr(const struct elf_file *ef, unsigned i, Elf64_Shdr *sh)
+{
+	if (ef->is64) {
+		unsigned long long off = ef->eh.e_shoff + i * sizeof(Elf64_Shdr);
+		if (!elf_in_bounds(ef, off, sizeof(Elf64_Shdr)))
+			return -1;
+		memcpy(sh, ef->data + off, sizeof(*sh));
+	} else {
+		Elf32_Shdr sh32;
+		unsigned long long off = ef->eh.e_shoff + i * sizeof(Elf32_Shdr);
+		if (!elf_in_bounds(ef, off, sizeof(Elf32_Shdr)))
+			return -1;
+		memcpy(&sh32, ef->data + off, sizeof(sh32));
+		sh->sh_type = sh32.sh_type;
+		sh->sh_flags = sh32.sh_flags;
+		sh->sh_offset = sh32.sh_offset;
+		sh->sh_size = sh32.sh_size;
+		sh->sh_link = sh32.sh_link;
+		sh->sh_entsize = sh32.sh_entsize;
+	}
+	return 0;
+}
+
+static int elf_phdr(const struct elf_file *ef, unsigned i, Elf64_Phdr *ph)
+{
+	if (ef->is64) {
+		unsigned long long off = ef->eh.e_phoff + i * sizeof(Elf64_Phdr);
+		if (!elf_in_bounds(ef, off, sizeof(Elf64_Phdr)))
+			return -1;
+		memcpy(ph, ef->data + off, sizeof(*ph));
+	} else {
+		Elf32_Phdr ph32;
+		unsigned long long off = ef->eh.e_phoff + i * sizeof(Elf32_Phdr);
+		if (!elf_in_bounds(ef, off, sizeof(Elf32_Phdr)))
+			return -1;
+		memcpy(&ph32, ef->data + off, sizeof(ph32));
+		ph->p_type = ph32.p_type;
+		ph->p_vaddr = ph32.p_vaddr;
+		ph->p_align = ph32.p_align;
+	}
+	return 0;
+}
+
+static int elf_sym(const struct elf_file *ef, const Elf64_Shdr *symtab,
+		   size_t i, Elf64_Sym *sym)
+{
+	if (ef->is64) {
+		unsigned long long off = symtab->sh_offset + i * sizeof(Elf64_Sym);
+		if (!elf_in_bounds(ef, off, sizeof(Elf64_Sym)))
+			return -1;
+		memcpy(sym, ef->data + off, sizeof(*sym));
+	} else {
+		Elf32_Sym sym32;
+		unsigned long long off = symtab->sh_offset + i * sizeof(Elf32_Sym);
+		if (!elf_in_bounds(ef, off, sizeof(Elf32_Sym)))
+			return -1;
+		memcpy(&sym32, ef->data + off, sizeof(sym32));
+		sym->st_name = sym32.st_name;
+		sym->st_info = sym32.st_info;
+		sym->st_shndx = sym32.st_shndx;
+		sym->st_value = sym32.st_value;
+	}
+	return 0;
+}
+
+/* Find the first section of the given type.  */
+static int elf_find_section(const struct elf_file *ef, unsigned type,
+			    Elf64_Shdr *sh)
+{
+	unsigned i;
+	for (i = 0; i < ef->eh.e_shnum; i++)
+		if (elf_shdr(ef, i, sh) == 0 && sh->sh_type == type)
+			return 0;
+	return -1;
+}
+
+/* The address the runtime relativizes a shared object's addresses to:
+   the start of its first mapping.  Executables use absolute addresses. */
+static unsigned long long elf_load_base(const struct elf_file *ef)
+{
+	unsigned i;
+
+	if (ef->eh.e_type != ET_DYN)
+		return 0;
+	for (i = 0; i < ef->eh.e_phnum; i++) {
+		Elf64_Phdr ph;
+		if (elf_phdr(ef, i, &ph) == 0 && ph.p_type == PT_LOAD)
+			return ph.p_align > 1 ? ph.p_vaddr & ~(ph.p_align - 1)
+					      : ph.p_vaddr;
+	}
+	return 0;
+}
+
+/* Find the path of the separate debuginfo of a file by its build-id.  */
+static int elf_debuginfo_path(const struct elf_file *ef, char *path, size_t max)
+{
+	unsigned i;
+
+	for (i = 0; i < ef->eh.e_shnum; i++) {
+		Elf64_Shdr sh;
+		unsigned long long off, end;
+
+		if (elf_shdr(ef, i, &sh) != 0 || sh.sh_type != SHT_NOTE
+		    || !elf_in_bounds(ef, sh.sh_offset, sh.sh_size))
+			continue;
+
+		/* Elf32_Nhdr and Elf64_Nhdr are the same.  */
+		off = sh.sh_offset;
+		end = sh.sh_offset + sh.sh_size;
+		while (off + sizeof(Elf32_Nhdr) <= end) {
+			Elf32_Nhdr nh;
+			const unsigned char *desc;
+			unsigned long long desc_off;
+			int n;
+			unsigned j;
+
+			memcpy(&nh, ef->data + off, sizeof(nh));
+			desc_off = off + sizeof(nh) + ((nh.n_namesz + 3) & ~3);
+			off = desc_off + ((nh.n_descsz + 3) & ~3);
+			if (off > end)
+				break;
+			if (nh.n_type != NT_GNU_BUILD_ID || nh.n_namesz != 4
+			    || memcmp(ef->data + desc_off - 4, "GNU", 4) != 0
+			    || nh.n_descsz < 2)
+				continue;
+
+			desc = ef->data + desc_off;
+			n = snprintf(path, max, "/usr/lib/debug/.build-id/%02x/",
+				     desc[0]);
+			for (j = 1; j < nh.n_descsz && n > 0 && (size_t)n < max; j++)
+				n += snprintf(path + n, max - n, "%02x", desc[j]);
+			if (n > 0 && (size_t)n < max)
+				n += snprintf(path + n, max - n, ".debug");
+			return (n > 0 && (size_t)n < max) ? 0 : -1;
+		}
+	}
+	return -1;
+}
+
+static int sym_compare(const void *a, const void *b)
+{
+	const struct sym *sa = a, *sb = b;
+	return (sa->addr > sb->addr) - (sa->addr < sb->addr);
+}
+
+/* Add the functions and data objects of a symbol table, like the ones
+   the translator would have compiled into the module.  The file stays
+   mapped, for the names.  */
+static int symfile_add(struct symfile *sf, const struct elf_file *ef,
+		       const Elf64_Shdr *symtab, unsigned long long base)
+{
+	Elf64_Shdr strtab;
+	size_t i, n;
+	struct sym *syms;
+
+	if (symtab->sh_entsize == 0
+	    || elf_shdr(ef, symtab->sh_link, &strtab) != 0
+	    || !elf_in_bounds(ef, strtab.sh_offset, strtab.sh_size))
+		return -1;
+
+	n = symtab->sh_size / symtab->sh_entsize;
+	syms = realloc(sf->syms, (sf->nsyms + n) * sizeof(struct sym));
+	if (syms == NULL)
+		return -1;
+	sf->syms = syms;
+
+	for (i = 0; i < n; i++) {
+		Elf64_Sym sym;
+		Elf64_Shdr sh;
+		int type;
+
+		if (elf_sym(ef, symtab, i, &sym) != 0)
+			break;
+		type = ELF64_ST_TYPE(sym.st_info);
+		if ((type != STT_FUNC && type != STT_OBJECT)
+		    || sym.st_shndx == SHN_UNDEF
+		    || sym.st_shndx >= ef->eh.e_shnum
+		    || elf_shdr(ef, sym.st_shndx, &sh) != 0
+		    || !(sh.sh_flags & SHF_ALLOC)
+		    || sym.st_name >= strtab.sh_size
+		    || sym.st_value < base)
+			continue;
+		if (memchr(ef->data + strtab.sh_offset + sym.st_name, '\0',
+			   strtab.sh_size - sym.st_name) == NULL)
+			continue;
+
+		sf->syms[sf->nsyms].addr = sym.st_value - base;
+		sf->syms[sf->nsyms].name = (const char *)
+			(ef->data + strtab.sh_offset + sym.st_name);
+		sf->nsyms++;
+	}
+	return 0;
+}
+
+static struct symfile *symfile_get(const char *path)
+{
+	struct symfile *sf;
+	struct elf_file ef, debug_ef;
+	Elf64_Shdr symtab;
+	char debug_path[PATH_MAX];
+	unsigned long long base;
+
+	for (sf = symfiles; sf; sf = sf->next)
+		if (strcmp(sf->path, path) == 0)
+			return sf;
+
+	/* A file that can't be read is remembered as having no symbols. */
+	sf = calloc(1, sizeof(*sf));
+	if (sf == NULL)
+		return NULL;
+	sf->path = strdup(path);
+	if (sf->path == NULL) {
+		free(sf);
+		return NULL;
+	}
+	sf->next = symfiles;
+	symfiles = sf;
+
+	if (elf_open(path, &ef) != 0) {
+		dbug(2, "no symbols for %s\n", path);
+		return sf;
+	}
+	base = elf_load_base(&ef);
+
+	/* Prefer the full symbol table, from the file itself or else its
+	   debuginfo; a stripped file without debuginfo still has its
+	   dynamic symbols.  */
+	if (elf_find_section(&ef, SHT_SYMTAB, &symtab) == 0)
+		symfile_add(sf, &ef, &symtab, base);
+	else if (elf_debuginfo_path(&ef, debug_path, sizeof(debug_path)) == 0
+		 && elf_open(debug_path, &debug_ef) == 0) {
+		if (elf_find_section(&debug_ef, SHT_SYMTAB, &symtab) == 0)
+			symfile_add(sf, &debug_ef, &symtab, base);
+		else
+			munmap((void *)debug_ef.data, debug_ef.size);
+	}
+	if (sf->nsyms == 0 && elf_find_section(&ef, SHT_DYNSYM, &symtab) == 0)
+		symfile_add(sf, &ef, &symtab, base);
+
+	qsort(sf->syms, sf->nsyms, sizeof(struct sym), sym_compare);
+	dbug(2, "read %zu symbols for %s\n", sf->nsyms, path);
+	return sf;
+}
+
+/* Find the symbol at or before addr, as _stp_kallsyms_lookup does.  */
+static const char *symfile_lookup(struct symfile *sf, unsigned long long addr,
+				  unsigned long long *offset,
+				  unsigned long long *size)
+{
+	size_t begin = 0, end = sf->nsyms;
+
+	if (end == 0 || addr < sf->syms[0].addr)
+		return NULL;
+	while (begin + 1 < end) {
+		size_t mid = (begin + end) / 2;
+		if (addr < sf->syms[mid].addr)
+			end = mid;
+		else
+			begin = mid;
+	}
+	*offset = addr - sf->syms[begin].addr;
+	*size = (begin + 1 < sf->nsyms)
+		? sf->syms[begin + 1].addr - sf->syms[begin].addr : 0;
+	return sf->syms[begin].name;
+}
+
+/* Format a parsed token the way _stp_snprint_addr() would have.  */
+static int render_symbol(char *out, size_t max, unsigned flags,
+			 unsigned long long addr, unsigned long long rel,
+			 unsigned long long mod_offset,
+			 unsigned long long mod_size, const char *path)
+{
+	struct symfile *sf = symfile_get(path);
+	const char *modname = path;
+	const char *name = NULL;
+	const char *exstr = (flags & _STP_SYM_INEXACT) ? " (inexact)" : "";
+	unsigned long long offset = 0, size = 0;
+
+	if (sf)
+		name = symfile_lookup(sf, rel, &offset, &size);
+	if (name && name[0] == '.')
+		name++;
+	if (flags & _STP_SYM_MODULE_BASENAME) {
+		const char *slash = strrchr(path, '/');
+		if (slash)
+			modname = slash + 1;
+	}
+
+	if (name) {
+		int n = 0;
+		if (flags & _STP_SYM_HEX_SYMBOL)
+			n += snprintf(out + n, max - n, "0x%llx : ", addr);
+		n += snprintf(out + n, max - n, "%s", name);
+		if (flags & _STP_SYM_OFFSET) {
+			n += snprintf(out + n, max - n, "+0x%llx", offset);
+			if (flags & _STP_SYM_SIZE)
+				n += snprintf(out + n, max - n, "/0x%llx", size);
+		}
+		if ((flags & _STP_SYM_MODULE) && *modname)
+			n += snprintf(out + n, max - n, " [%s]", modname);
+		return n + snprintf(out + n, max - n, "%s", exstr);
+	}
+
+	if ((flags & _STP_SYM_MODULE) && *modname) {
+		if (!(flags & _STP_SYM_OFFSET))
+			return snprintf(out, max, "0x%llx [%s]%s",
+					addr, modname, exstr);
+		if (!(flags & _STP_SYM_SIZE))
+			return snprintf(out, max, "0x%llx [%s+0x%llx]%s",
+					addr, modname, mod_offset, exstr);
+		return snprintf(out, max, "0x%llx [%s+0x%llx/0x%llx]%s",
+				addr, modname, mod_offset, mod_size, exstr);
+	}
+	return snprintf(out, max, "0x%llx%s", addr, exstr);
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t rc = write(fd, buf, len);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			return -1;
+		buf += rc;
+		len -= rc;
+	}
+	return 0;
+}
+
+/* Replace a token at buf[0..len) if it is a whole one.  Returns its
+   length, 0 if it may yet be completed by later output, or -1 if it
+   isn't a token after all.  */
+static ssize_t symbolize_token(const char *buf, size_t len,
+			       char *out, size_t max, size_t *nout)
+{
+	char header[STAPSYM_HEADER_MAX + 1], path[PATH_MAX];
+	const char *colon;
+	unsigned flags, pathlen;
+	unsigned long long addr, rel, offset, size;
+	int path_start = 0;
+	size_t toklen;
+
+	/* The header, up to the ':' before the path, has no ':' itself.  */
+	colon = memchr(buf, ':', len < STAPSYM_HEADER_MAX ? len : STAPSYM_HEADER_MAX);
+	if (colon == NULL)
+		return len < STAPSYM_HEADER_MAX ? 0 : -1;
+
+	memcpy(header, buf, colon - buf + 1);
+	header[colon - buf + 1] = '\0';
+	if (sscanf(header, STAPSYM_PREFIX "%x %llx %llx %llx %llx %u:%n",
+		   &flags, &addr, &rel, &offset, &size, &pathlen,
+		   &path_start) != 6
+	    || path_start != colon - buf + 1
+	    || pathlen == 0 || pathlen >= PATH_MAX)
+		return -1;
+
+	toklen = path_start + pathlen + 1;
+	if (len < toklen)
+		return 0;
+	if (buf[toklen - 1] != '>')
+		return -1;
+	memcpy(path, buf + path_start, pathlen);
+	path[pathlen] = '\0';
+
+	*nout = render_symbol(out, max, flags, addr, rel, offset, size, path);
+	if (*nout >= max)
+		*nout = max - 1;
+	return toklen;
+}
+
+/* Whether buf[0..len) starts with the prefix, or with the start of it
+   if shorter.  */
+static int prefix_match(const char *buf, size_t len,
+			const char *prefix, size_t plen)
+{
+	return memcmp(buf, prefix, len < plen ? len : plen) == 0;
+}
+
+/* Write output, looking up any symbols in it.  A token may be split
+   across reads, so the output from the start of a possible token is
+   held back until the rest of it comes.  Returns the number of bytes
+   written, or -1.  */
+ssize_t symbolize_write(int fd, const char *buf, size_t len)
+{
+	char *data;
+	size_t size, pos = 0, written = 0;
+
+	if (npending == 0 && memchr(buf, '<', len) == NULL)
+		return write_all(fd, buf, len) == 0 ? (ssize_t)len : -1;
+
+	size = npending + len;
+	data = malloc(size);
+	if (data == NULL)
+		return -1;
+	memcpy(data, pending, npending);
+	memcpy(data + npending, buf, len);
+	npending = 0;
+
+	while (pos < size) {
+		const char *lt = memchr(data + pos, '<', size - pos);
+		size_t rest, chunk;
+		char out[STAPSYM_MAX];
+		size_t nout = 0;
+		ssize_t toklen;
+
+		chunk = (lt ? (size_t)(lt - data) : size) - pos;
+		if (chunk && write_all(fd, data + pos, chunk) != 0)
+			goto err;
+		written += chunk;
+		pos += chunk;
+		if (lt == NULL)
+			break;
+
+		/* Hold back what may be the start of a token.  */
+		rest = size - pos;
+		toklen = -1;
+		if (symbolize_output
+		    && prefix_match(data + pos, rest, STAPSYM_PREFIX,
+				    STAPSYM_PREFIX_LEN)) {
+			if (rest < STAPSYM_PREFIX_LEN)
+				toklen = 0;
+			else
+				toklen = symbolize_token(data + pos, rest, out,
+							 sizeof(out), &nout);
+		} else if (hist_format
+			   && prefix_match(data + pos, rest, STP_HIST_PREFIX,
+					   STP_HIST_PREFIX_LEN)) {
+			char *hout = NULL;
+			toklen = hist_token(data + pos, rest, &hout, &nout);
+			if (toklen > 0) {
+				int rc = write_all(fd, hout, nout);
+				free(hout);
+				if (rc != 0)
+					goto err;
+				written += nout;
+				pos += toklen;
+				continue;
+			}
+		}
+
+		if (toklen == 0) {
+			memcpy(pending, data + pos, rest);
+			npending = rest;
+			break;
+		}
+		if (toklen < 0) {
+			/* Just a '<'.  */
+			if (write_all(fd, data + pos, 1) != 0)
+				goto err;
+			written++;
+			pos++;
+			continue;
+		}
+		if (write_all(fd, out, nout) != 0)
+			goto err;
+		written += nout;
+		pos += toklen;
+	}
+
+	free(data);
+	return written;
+
+err:
+	free(data);
+	return -1;
+}
+
+/* Write out whatever was held back, at the end of the output.  */
+int symbolize_flush(int fd)
+{
+	int rc = write_all(fd, pending, npending);
+	npending = 0;
+	return rc;
+}
@@ -31,6 +31,7 @@ static const string TOK_CONFIG("config");
 static const string TOK_SAMPLE("sample");
 static const string TOK_PROCESS("process");
 static const string TOK_COUNTER("counter");
+static const string TOK_BATCH("batch");
 
 
 // ------------------------------------------------------------------------
@@ -46,10 +47,12 @@ struct perf_derived_probe: public derived_probe
   int64_t interval;
   bool has_process;
   bool has_counter;
+  bool batch;
   string process_name;
   string counter;
   perf_derived_probe (probe* p, probe_point* l, int64_t type, int64_t config,
-		      int64_t i, bool pp, bool cp, string pn, string cv);
+		      int64_t i, bool pp, bool cp, string pn, string cv,
+		      bool b);
   virtual void join_group (systemtap_session& s);
 };
 
@@ -69,12 +72,13 @@ perf_derived_probe::perf_derived_probe (probe* p, probe_point* l,
 					bool process_p,
 					bool counter_p,
 					string process_n,
-					string counter):
+					string counter,
+					bool batch_p):
   
   derived_probe (p, l, true /* .components soon rewritten */),
   event_type (type), event_config (config), interval (i),
-  has_process (process_p), has_counter (counter_p), process_name (process_n),
-  counter (counter)
+  has_process (process_p), has_counter (counter_p), batch (batch_p),
+  process_name (process_n), counter (counter)
 {
   vector<probe_point::component*>& comps = this->sole_location()->components;
   comps.clear();
@@ -84,6 +88,8 @@ perf_derived_probe::perf_derived_probe (probe* p, probe_point* l,
   comps.push_back (new probe_point::component (TOK_SAMPLE, new literal_number (interval)));
   comps.push_back (new probe_point::component (TOK_PROCESS, new literal_string (process_name)));
   comps.push_back (new probe_point::component (TOK_COUNTER, new literal_string (counter)));
+  if (batch)
+    comps.push_back (new probe_point::component (TOK_BATCH));
 }
 
 
@@ -103,23 +109,29 @@ void
 perf_derived_probe_group::emit_module_decls (systemtap_session& s)
 {
   bool have_a_process_tag = false;
+  bool have_a_batch = false;
 
   for (unsigned i=0; i < probes.size(); i++)
-    if (probes[i]->has_process && !probes[i]->has_counter)
-      {
-	have_a_process_tag = true;
-	break;
-      }
+    {
+      if (probes[i]->has_process && !probes[i]->has_counter)
+        have_a_process_tag = true;
+      if (probes[i]->batch)
+        have_a_batch = true;
+    }
 
   if (probes.empty()) return;
 
   s.op->newline() << "/* ---- perf probes ---- */";
+  if (have_a_batch)
+    s.op->newline() << "#define STP_PERF_BATCH 1";
   s.op->newline() << "#include <linux/perf_event.h>";
   s.op->newline() << "#include \"linux/perf.h\"";
   s.op->newline();
 
   /* declarations */
   s.op->newline() << "static void handle_perf_probe (unsigned i, struct pt_regs *regs);";
+  if (have_a_batch)
+    s.op->newline() << "static void handle_perf_sample (unsigned i, const struct stap_perf_sample *sample);";
   for (unsigned i=0; i < probes.size(); i++)
     {
       s.op->newline() << "#ifdef STAPCONF_PERF_HANDLER_NMI";
@@ -219,7 +231,12 @@ perf_derived_probe_group::emit_module_decls (systemtap_session& s)
                       << "struct pt_regs *regs)";
       s.op->newline() << "#endif";
       s.op->newline() << "{";
-      s.op->newline(1) << "handle_perf_probe(" << i << ", regs);";
+      // Batched probes just queue the sample here, and their handler is
+      // run later from _stp_perf_batch_drain.
+      if (probes[i]->batch)
+        s.op->newline(1) << "_stp_perf_batch_add(" << i << ", regs);";
+      else
+        s.op->newline(1) << "handle_perf_probe(" << i << ", regs);";
       s.op->newline(-1) << "}";
     }
   s.op->newline();
@@ -240,6 +257,23 @@ perf_derived_probe_group::emit_module_decls (systemtap_session& s)
   common_probe_entryfn_epilogue (s, true);
   s.op->newline(-1) << "}";
   s.op->newline();
+
+  if (have_a_batch)
+    {
+      // The registers are long gone by the time a batched sample is
+      // handled, so only the sample itself is available to the script.
+      s.op->newline() << "static void handle_perf_sample (unsigned i, const struct stap_perf_sample *sample)";
+      s.op->newline() << "{";
+      s.op->newline(1) << "struct stap_perf_probe* stp = & stap_perf_probes [i];";
+      common_probe_entryfn_prologue (s, "STAP_SESSION_RUNNING", "stp->probe",
+                                     "stp_probe_type_perf");
+      s.op->newline() << "c->ips.perf_sample = sample;";
+      s.op->newline() << "c->user_mode_p = sample->user_mode;";
+      s.op->newline() << "(*stp->probe->ph) (c);";
+      common_probe_entryfn_epilogue (s, true);
+      s.op->newline(-1) << "}";
+      s.op->newline();
+    }
   s.op->newline() << "#include \"linux/perf.c\"";
   s.op->newline();
 }
@@ -259,6 +293,18 @@ perf_derived_probe_group::emit_module_init (systemtap_session& s)
 
   if (probes.empty()) return;
 
+  bool have_a_batch = false;
+  for (unsigned i=0; i < probes.size(); i++)
+    if (probes[i]->batch)
+      have_a_batch = true;
+
+  if (have_a_batch)
+    {
+      s.op->newline() << "rc = _stp_perf_batch_init();";
+      s.op->newline() << "if (rc == 0) {";
+      s.op->indent(1);
+    }
+
   s.op->newline() << "for (i=0; i<" << probes.size() << "; i++) {";
   s.op->newline(1) << "struct stap_perf_probe* stp = & stap_perf_probes [i];";
   s.op->newline() << "rc = _stp_perf_init(stp, 0);";
@@ -267,11 +313,16 @@ perf_derived_probe_group::emit_module_init (systemtap_session& s)
   s.op->newline() << "for (j=0; j<i; j++) {";
   s.op->newline(1) << "_stp_perf_del(& stap_perf_probes [j]);";
   s.op->newline(-1) << "}"; // for unwind loop
+  if (have_a_batch)
+    s.op->newline() << "_stp_perf_batch_exit();";
   s.op->newline() << "break;";
   s.op->newline(-1) << "}"; // if-error
   if (have_a_process_tag)
     s.op->newline() << "rc = stap_register_task_finder_target(&stp->e.t.tgt);";
   s.op->newline(-1) << "}"; // for loop
+
+  if (have_a_batch)
+    s.op->newline(-1) << "}";
 }
 
 
@@ -283,6 +334,14 @@ perf_derived_probe_group::emit_module_exit (systemtap_session& s)
   s.op->newline() << "for (i=0; i<" << probes.size() << "; i++) {";
   s.op->newline(1) << "_stp_perf_del(& stap_perf_probes [i]);";
   s.op->newline(-1) << "}"; // for loop
+
+  // Only once no more samples can come in.
+  for (unsigned i=0; i < probes.size(); i++)
+    if (probes[i]->batch)
+      {
+        s.op->newline() << "_stp_perf_batch_exit();";
+        break;
+      }
 }
 
 
@@ -324,6 +383,13 @@ perf_builder::build(systemtap_session & sess,
 		    literal_map_t const & parameters,
 		    vector<derived_probe *> & finished_results)
 {
+  // .process and .counter bind .batch only to get this error, rather
+  // than a generic probe point mismatch.
+  bool batch = has_null_param(parameters, TOK_BATCH);
+  if (batch && (parameters.find(TOK_PROCESS) != parameters.end()
+                || parameters.find(TOK_COUNTER) != parameters.end()))
+    throw semantic_error(_("perf probe batch component is only valid for systemwide sampling"));
+
   // XXX need additional version checks too?
   // --- perhaps look for export of perf_event_create_kernel_counter
   if (sess.kernel_exports.find("perf_event_create_kernel_counter") == sess.kernel_exports.end())
@@ -383,11 +449,12 @@ perf_builder::build(systemtap_session & sess,
     }
 
   if (sess.verbose > 1)
-    clog << _F("perf probe type=%" PRId64 " config=%" PRId64 " period=%" PRId64, type, config, period) << endl;
+    clog << _F("perf probe type=%" PRId64 " config=%" PRId64 " period=%" PRId64 "%s",
+               type, config, period, (batch ? " batch" : "")) << endl;
 
   finished_results.push_back
     (new perf_derived_probe(base, location, type, config, period, proc_p,
-			    has_counter, proc_n, var));
+			    has_counter, proc_n, var, batch));
   sess.perf_counters[var] = make_pair(proc_n,finished_results.back());
 }
 
@@ -403,9 +470,14 @@ register_tapset_perf(systemtap_session& s)
   match_node* event = perf->bind_num(TOK_TYPE)->bind_num(TOK_CONFIG);
   event->bind(builder);
   event->bind_num(TOK_SAMPLE)->bind(builder);
+  event->bind(TOK_BATCH)->bind(builder);
+  event->bind_num(TOK_SAMPLE)->bind(TOK_BATCH)->bind(builder);
   event->bind_str(TOK_PROCESS)->bind(builder);
+  event->bind_str(TOK_PROCESS)->bind(TOK_BATCH)->bind(builder);
   event->bind(TOK_PROCESS)->bind(builder);
+  event->bind(TOK_PROCESS)->bind(TOK_BATCH)->bind(builder);
   event->bind_str(TOK_COUNTER)->bind(builder);
+  event->bind_str(TOK_COUNTER)->bind(TOK_BATCH)->bind(builder);
   event->bind_str(TOK_PROCESS)->bind_str(TOK_COUNTER)->bind(builder);
 }
 
@@ -178,6 +178,10 @@ timer_derived_probe_group::emit_module_exit (systemtap_session& s)
 // 2.6.17, so we must check this kernel version before attempting to use
 // hrtimers.
 //
+// All the hrtimer probes share a single timer in the runtime (timer.c),
+// which runs each probe as it comes due, so probes due at the same time
+// are coalesced into one timer interrupt.
+//
 // * hrtimer_derived_probe: creates a probe point based on the hrtimer APIs.
 
 
@@ -238,6 +242,7 @@ hrtimer_derived_probe_group::emit_module_decls (systemtap_session& s)
   if (probes.empty()) return;
 
   s.op->newline() << "/* ---- hrtimer probes ---- */";
+  s.op->newline() << "#define STP_HRTIMER_NPROBES " << probes.size();
   s.op->newline() << "#include \"timer.c\"";
   s.op->newline() << "static struct stap_hrtimer_probe stap_hrtimer_probes [" << probes.size() << "] = {";
 
@@ -253,51 +258,14 @@ hrtimer_derived_probe_group::emit_module_decls (systemtap_session& s)
   s.op->newline(-1) << "};";
   s.op->newline();
 
-  if (!s.runtime_usermode_p())
-    {
-      s.op->newline() << "static hrtimer_return_t _stp_hrtimer_notify_function (struct hrtimer *timer) {";
-
-      s.op->newline(1) << "int rc = HRTIMER_NORESTART;";
-      s.op->newline() << "struct stap_hrtimer_probe *stp = container_of(timer, struct stap_hrtimer_probe, hrtimer);";
-
-      // Update the timer with the next trigger time
-      s.op->newline() << "if ((atomic_read (session_state()) == STAP_SESSION_STARTING) ||";
-      s.op->newline() << "    (atomic_read (session_state()) == STAP_SESSION_RUNNING)) {";
-      s.op->newline(1) << "_stp_hrtimer_update(stp);";
-      s.op->newline() << "rc = HRTIMER_RESTART;";
-      s.op->newline(-1) << "}";
-
-      s.op->newline() << "{";
-      s.op->indent(1);
-      common_probe_entryfn_prologue (s, "STAP_SESSION_RUNNING", "stp->probe",
-				     "stp_probe_type_hrtimer");
-      s.op->newline() << "(*stp->probe->ph) (c);";
-      common_probe_entryfn_epilogue (s, true);
-      s.op->newline(-1) << "}";
-      s.op->newline() << "return rc;";
-      s.op->newline(-1) << "}";
-    }
-  else
-    {
-      s.op->newline() << "static void _stp_hrtimer_notify_function (sigval_t value)";
-      s.op->newline(1) << "{";
-      s.op->newline() << "struct stap_hrtimer_probe *stp = value.sival_ptr;";
-
-      // Update the timer with the next trigger time
-      s.op->newline() << "if ((atomic_read (session_state()) == STAP_SESSION_STARTING) ||";
-      s.op->newline() << "    (atomic_read (session_state()) == STAP_SESSION_RUNNING)) {";
-      s.op->newline(1) << "_stp_hrtimer_update(stp);";
-      s.op->newline(-1) << "}";
-
-      s.op->newline() << "{";
-      s.op->indent(1);
-      common_probe_entryfn_prologue (s, "STAP_SESSION_RUNNING", "stp->probe",
-				     "stp_probe_type_hrtimer");
-      s.op->newline() << "(*stp->probe->ph) (c);";
-      common_probe_entryfn_epilogue (s, true);
-      s.op->newline(-1) << "}";
-      s.op->newline(-1) << "}";
-    }
+  // All the probes share one timer, which calls this for each of those due.
+  s.op->newline() << "static void _stp_hrtimer_probe_fire (struct stap_hrtimer_probe *stp) {";
+  s.op->indent(1);
+  common_probe_entryfn_prologue (s, "STAP_SESSION_RUNNING", "stp->probe",
+                                 "stp_probe_type_hrtimer");
+  s.op->newline() << "(*stp->probe->ph) (c);";
+  common_probe_entryfn_epilogue (s, true);
+  s.op->newline(-1) << "}";
 }
 
 
@@ -307,22 +275,17 @@ hrtimer_derived_probe_group::emit_module_init (systemtap_session& s)
   if (probes.empty()) return;
 
   s.op->newline() << "_stp_hrtimer_init();";
-  s.op->newline() << "for (i=0; i<" << probes.size() << "; i++) {";
-  s.op->newline(1) << "struct stap_hrtimer_probe* stp = & stap_hrtimer_probes [i];";
-  s.op->newline() << "probe_point = stp->probe->pp;";
+  s.op->newline() << "{";
+  s.op->newline(1) << "int64_t start = _stp_hrtimer_now();";
+  s.op->newline() << "for (i=0; i<" << probes.size() << "; i++)";
+  s.op->newline(1) << "_stp_hrtimer_add(& stap_hrtimer_probes [i], start);";
+  s.op->indent(-1);
+  s.op->newline() << "probe_point = stap_hrtimer_probes[0].probe->pp;";
 
-  // Note: no partial failure rollback is needed for kernel hrtimer
-  // probes (hrtimer_start only "fails" if the timer was already
-  // active, which cannot be). But, stapdyn timer probes need a
-  // rollback, and it won't hurt the kernel hrtimers.
-  s.op->newline() << "rc = _stp_hrtimer_create(stp, _stp_hrtimer_notify_function);";
-  s.op->newline() << "if (rc) {";
-  s.op->indent(1);
-  s.op->newline() << "for (j=i-1; j>=0; j--)"; // partial rollback
-  s.op->newline(1) << "_stp_hrtimer_cancel(& stap_hrtimer_probes[j]);";
-  s.op->newline(-1) << "break;"; // don't attempt to register any more
+  // Note: the kernel hrtimer can't fail to start, but the stapdyn
+  // timer thread can, in which case there's nothing to roll back.
+  s.op->newline() << "rc = _stp_hrtimer_start(_stp_hrtimer_probe_fire);";
   s.op->newline(-1) << "}";
-  s.op->newline(-1) << "}"; // for loop
 }
 
 
@@ -331,10 +294,7 @@ hrtimer_derived_probe_group::emit_module_exit (systemtap_session& s)
 {
   if (probes.empty()) return;
 
-  s.op->newline() << "for (i=0; i<" << probes.size() << "; i++)";
-  s.op->indent(1);
-  s.op->newline() << "_stp_hrtimer_cancel(& stap_hrtimer_probes[i]);";
-  s.op->indent(-1);
+  s.op->newline() << "_stp_hrtimer_stop();";
 }
 
 
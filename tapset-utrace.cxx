@@ -66,6 +66,7 @@ struct utrace_derived_probe: public derived_probe
   void emit_privilege_assertion (translator_output*);
   void print_dupe_stamp(ostream& o);
   void getargs (std::list<std::string> &arg_set) const;
+  bool prefilter_p () { return true; }
 };
 
 
@@ -54,6 +54,7 @@ extern "C" {
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <math.h>
 #include <regex.h>
 #include <unistd.h>
@@ -98,10 +99,19 @@ common_probe_entryfn_prologue (systemtap_session& s,
   s.op->newline() << "#ifdef STP_TIMING";
   s.op->newline() << "Stat stat = probe_timing(" << probe << "->index);";
   s.op->newline() << "#endif";
+  s.op->newline() << "#ifdef STP_PROBE_PROFILE";
+  s.op->newline() << "size_t profile_index = " << probe << "->index;";
+  s.op->newline() << "#endif";
+  if (overload_processing && !s.runtime_usermode_p())
+    {
+      s.op->newline() << "#if defined(STP_OVERLOAD) && defined(STP_OVERLOAD_SAMPLE)";
+      s.op->newline() << "size_t sample_index = " << probe << "->index;";
+      s.op->newline() << "#endif";
+    }
   if (overload_processing && !s.runtime_usermode_p())
-    s.op->newline() << "#if defined(STP_TIMING) || defined(STP_OVERLOAD)";
+    s.op->newline() << "#if defined(STP_TIMING) || defined(STP_PROBE_PROFILE) || defined(STP_OVERLOAD)";
   else
-    s.op->newline() << "#ifdef STP_TIMING";
+    s.op->newline() << "#if defined(STP_TIMING) || defined(STP_PROBE_PROFILE)";
 
   if (! s.runtime_usermode_p())
     s.op->newline() << "cycles_t cycles_atstart = get_cycles ();";
@@ -138,6 +148,32 @@ common_probe_entryfn_prologue (systemtap_session& s,
   s.op->newline(1) << "goto probe_epilogue;";
   s.op->indent(-1);
 
+  // A process-scoped probe may have a pre-handler filter on the current
+  // task, compiled from the top of its body; see prefilter_condition().
+  // Hits it rejects would have done nothing, so drop them here, before
+  // taking a context.
+  if (! s.runtime_usermode_p())
+    {
+      s.op->newline() << "#ifdef STP_PREFILTER";
+      s.op->newline() << "if (" << probe << "->prefilter && !(*" << probe << "->prefilter) ()) {";
+      s.op->newline(1) << "atomic_inc (probe_prefiltered(" << probe << "->index));";
+      s.op->newline() << "goto probe_epilogue;";
+      s.op->newline(-1) << "}";
+      s.op->newline() << "#endif";
+    }
+
+  // Under the sampling overload policy, drop this hit before taking a
+  // context if the probe has been throttled.  Dropped hits are counted
+  // separately from skipped_count(), so they don't trip MAXSKIPPED.
+  if (overload_processing && !s.runtime_usermode_p())
+    {
+      s.op->newline() << "#if defined(STP_OVERLOAD) && defined(STP_OVERLOAD_SAMPLE)";
+      s.op->newline() << "if (unlikely (_stp_probe_sample_skip (sample_index)))";
+      s.op->newline(1) << "goto probe_epilogue;";
+      s.op->indent(-1);
+      s.op->newline() << "#endif";
+    }
+
   s.op->newline() << "c = _stp_runtime_entryfn_get_context();";
   if (s.runtime_usermode_p())
     {
@@ -178,6 +214,7 @@ common_probe_entryfn_prologue (systemtap_session& s,
   s.op->newline() << "c->last_stmt = 0;";
   s.op->newline() << "c->last_error = 0;";
   s.op->newline() << "c->nesting = -1;"; // NB: PR10516 packs locals[] tighter
+  s.op->newline() << "c->next_frame = c->locals;";
   s.op->newline() << "c->uregs = 0;";
   s.op->newline() << "c->kregs = 0;";
   s.op->newline() << "#if defined __ia64__";
@@ -227,9 +264,9 @@ common_probe_entryfn_epilogue (systemtap_session& s,
                                bool overload_processing)
 {
   if (overload_processing && !s.runtime_usermode_p())
-    s.op->newline() << "#if defined(STP_TIMING) || defined(STP_OVERLOAD)";
+    s.op->newline() << "#if defined(STP_TIMING) || defined(STP_PROBE_PROFILE) || defined(STP_OVERLOAD)";
   else
-    s.op->newline() << "#ifdef STP_TIMING";
+    s.op->newline() << "#if defined(STP_TIMING) || defined(STP_PROBE_PROFILE)";
   s.op->newline() << "{";
   s.op->indent(1);
   if (! s.runtime_usermode_p())
@@ -256,6 +293,9 @@ common_probe_entryfn_epilogue (systemtap_session& s,
   s.op->newline() << "#ifdef STP_TIMING";
   s.op->newline() << "if (likely (stat)) _stp_stat_add(stat, cycles_elapsed);";
   s.op->newline() << "#endif";
+  s.op->newline() << "#ifdef STP_PROBE_PROFILE";
+  s.op->newline() << "_stp_probe_profile_add(profile_index, cycles_elapsed);";
+  s.op->newline() << "#endif";
 
   if (overload_processing && !s.runtime_usermode_p())
     {
@@ -268,6 +308,9 @@ common_probe_entryfn_epilogue (systemtap_session& s,
       s.op->newline(1) << "? (cycles_atend - c->cycles_base)";
       s.op->newline() << ": (STP_OVERLOAD_INTERVAL + 1);";
       s.op->newline(-1) << "c->cycles_sum += cycles_elapsed;";
+      s.op->newline() << "#ifdef STP_OVERLOAD_SAMPLE";
+      s.op->newline() << "_stp_probe_sample_charge (sample_index, cycles_elapsed);";
+      s.op->newline() << "#endif";
 
       // If we've spent more than STP_OVERLOAD_THRESHOLD cycles in a
       // probe during the last STP_OVERLOAD_INTERVAL cycles, the probe
@@ -275,12 +318,28 @@ common_probe_entryfn_epilogue (systemtap_session& s,
       // NB: this is not suppressible via --suppress-runtime-errors,
       // because this is a system safety metric that we cannot trust
       // unprivileged users to override.
+      // With STP_OVERLOAD_SAMPLE, the probes that spent the most of an
+      // overloaded interval on this cpu are throttled instead, and only
+      // once none of them can be throttled any further do we quit.  The
+      // probes that ran in a quiet interval get their rate progressively
+      // restored.
       s.op->newline() << "if (interval > STP_OVERLOAD_INTERVAL) {";
       s.op->newline(1) << "if (c->cycles_sum > STP_OVERLOAD_THRESHOLD) {";
+      s.op->newline(1) << "#ifdef STP_OVERLOAD_SAMPLE";
+      s.op->newline() << "if (! _stp_probe_sample_overload (c->cycles_sum))";
+      s.op->newline() << "#endif";
+      s.op->newline() << "{";
       s.op->newline(1) << "_stp_error (\"probe overhead exceeded threshold\");";
       s.op->newline() << "atomic_set (session_state(), STAP_SESSION_ERROR);";
       s.op->newline() << "atomic_inc (error_count());";
       s.op->newline(-1) << "}";
+      s.op->newline(-1) << "}";
+      s.op->newline() << "#ifdef STP_OVERLOAD_SAMPLE";
+      s.op->newline() << "else if (c->cycles_sum < STP_OVERLOAD_SAMPLE_RESTORE)";
+      s.op->newline(1) << "_stp_probe_sample_quiet ();";
+      s.op->indent(-1);
+      s.op->newline() << "_stp_probe_sample_next ();";
+      s.op->newline() << "#endif";
 
       s.op->newline() << "c->cycles_base = cycles_atend;";
       s.op->newline() << "c->cycles_sum = 0;";
@@ -552,6 +611,7 @@ struct uprobe_derived_probe: public dwarf_derived_probe
   void print_dupe_stamp(ostream& o) { print_dupe_stamp_unprivileged_process_owner (o); }
   void getargs(std::list<std::string> &arg_set) const;
   void saveargs(int nargs);
+  bool prefilter_p () { return true; }
 private:
   list<string> args;
 };
@@ -4782,9 +4842,9 @@ dwarf_derived_probe_group::emit_module_decls (systemtap_session& s)
   s.op->newline() << "static int enter_kretprobe_probe (struct kretprobe_instance *inst,";
   s.op->line() << " struct pt_regs *regs);";
 
-  // Emit an array of kprobe/kretprobe pointers
-  s.op->newline() << "#if defined(STAPCONF_UNREGISTER_KPROBES)";
-  s.op->newline() << "static void * stap_unreg_kprobes[" << probes_by_module.size() << "];";
+  // Emit an array of kprobe/kretprobe pointers, for the batch interfaces
+  s.op->newline() << "#if defined(STAPCONF_UNREGISTER_KPROBES) || defined(STAPCONF_REGISTER_KPROBES)";
+  s.op->newline() << "static void * stap_batch_kprobes[" << probes_by_module.size() << "];";
   s.op->newline() << "#endif";
 
   // Emit the actual probe list.
@@ -4969,20 +5029,11 @@ dwarf_derived_probe_group::emit_module_decls (systemtap_session& s)
   s.op->newline(1) << "return enter_kretprobe_common(inst, regs, 1);";
   s.op->newline(-1) << "}";
 
+  // Fill in a kprobe/kretprobe for the given address, ready to register.
   s.op->newline();
-}
-
-
-void
-dwarf_derived_probe_group::emit_module_init (systemtap_session& s)
-{
-  s.op->newline() << "for (i=0; i<" << probes_by_module.size() << "; i++) {";
-  s.op->newline(1) << "struct stap_dwarf_probe *sdp = & stap_dwarf_probes[i];";
-  s.op->newline() << "struct stap_dwarf_kprobe *kp = & stap_dwarf_kprobes[i];";
-  s.op->newline() << "unsigned long relocated_addr = _stp_kmodule_relocate (sdp->module, sdp->section, sdp->address);";
-  s.op->newline() << "if (relocated_addr == 0) continue;"; // quietly; assume module is absent
-  s.op->newline() << "probe_point = sdp->probe->pp;"; // for error messages
-  s.op->newline() << "if (sdp->return_p) {";
+  s.op->newline() << "static void stap_dwarf_kprobe_prepare (struct stap_dwarf_probe *sdp,";
+  s.op->line() << " struct stap_dwarf_kprobe *kp, unsigned long relocated_addr) {";
+  s.op->newline(1) << "if (sdp->return_p) {";
   s.op->newline(1) << "kp->u.krp.kp.addr = (void *) relocated_addr;";
   s.op->newline() << "if (sdp->maxactive_p) {";
   s.op->newline(1) << "kp->u.krp.maxactive = sdp->maxactive_val;";
@@ -4997,36 +5048,127 @@ dwarf_derived_probe_group::emit_module_init (systemtap_session& s)
   s.op->newline() << "                      sdp->saved_strings * MAXSTRINGLEN;";
   s.op->newline(-1) << "}";
   s.op->newline() << "#endif";
-  // to ensure safeness of bspcache, always use aggr_kprobe on ia64
-  s.op->newline() << "#ifdef __ia64__";
-  s.op->newline() << "kp->dummy.addr = kp->u.krp.kp.addr;";
-  s.op->newline() << "kp->dummy.pre_handler = NULL;";
-  s.op->newline() << "rc = register_kprobe (& kp->dummy);";
-  s.op->newline() << "if (rc == 0) {";
-  s.op->newline(1) << "rc = register_kretprobe (& kp->u.krp);";
-  s.op->newline() << "if (rc != 0)";
-  s.op->newline(1) << "unregister_kprobe (& kp->dummy);";
-  s.op->newline(-2) << "}";
-  s.op->newline() << "#else";
-  s.op->newline() << "rc = register_kretprobe (& kp->u.krp);";
-  s.op->newline() << "#endif";
   s.op->newline(-1) << "} else {";
-  // to ensure safeness of bspcache, always use aggr_kprobe on ia64
   s.op->newline(1) << "kp->u.kp.addr = (void *) relocated_addr;";
   s.op->newline() << "kp->u.kp.pre_handler = &enter_kprobe_probe;";
+  s.op->newline(-1) << "}";
+  // to ensure safeness of bspcache, always use aggr_kprobe on ia64
   s.op->newline() << "#ifdef __ia64__";
-  s.op->newline() << "kp->dummy.addr = kp->u.kp.addr;";
+  s.op->newline() << "kp->dummy.addr = (void *) relocated_addr;";
   s.op->newline() << "kp->dummy.pre_handler = NULL;";
+  s.op->newline() << "#endif";
+  s.op->newline(-1) << "}";
+
+  // Register a single prepared kprobe/kretprobe.
+  s.op->newline();
+  s.op->newline() << "static int stap_dwarf_kprobe_register (struct stap_dwarf_probe *sdp,";
+  s.op->line() << " struct stap_dwarf_kprobe *kp) {";
+  s.op->newline(1) << "int rc;";
+  s.op->newline() << "#ifdef __ia64__";
   s.op->newline() << "rc = register_kprobe (& kp->dummy);";
-  s.op->newline() << "if (rc == 0) {";
+  s.op->newline() << "if (rc != 0)";
+  s.op->newline(1) << "return rc;";
+  s.op->newline(-1) << "#endif";
+  s.op->newline() << "if (sdp->return_p)";
+  s.op->newline(1) << "rc = register_kretprobe (& kp->u.krp);";
+  s.op->newline(-1) << "else";
   s.op->newline(1) << "rc = register_kprobe (& kp->u.kp);";
+  s.op->newline(-1) << "#ifdef __ia64__";
   s.op->newline() << "if (rc != 0)";
   s.op->newline(1) << "unregister_kprobe (& kp->dummy);";
-  s.op->newline(-2) << "}";
-  s.op->newline() << "#else";
-  s.op->newline() << "rc = register_kprobe (& kp->u.kp);";
+  s.op->newline(-1) << "#endif";
+  s.op->newline() << "return rc;";
+  s.op->newline(-1) << "}";
+
+  // Register n prepared entries of stap_batch_kprobes[], which are
+  // either all kprobes or all kretprobes, with a single call.  The kernel
+  // rolls back the whole batch if any one of them fails, so then we
+  // register each half of it the same way, down to the entries that
+  // fail on their own, to still tolerate individual failures (PR6749)
+  // without losing the batching for the rest.  A failed call may leave
+  // its state in the structs, so they are prepared afresh before they
+  // are tried again.  Returns the number registered.
+  // NB: ia64 needs each probe paired with its dummy, so it can't batch.
+  // -DSTP_NO_KPROBE_BATCH registers them one by one anyway, for comparison.
+  s.op->newline();
+  s.op->newline() << "#if defined(STAPCONF_REGISTER_KPROBES) && !defined(__ia64__) && !defined(STP_NO_KPROBE_BATCH)";
+  s.op->newline() << "static unsigned stap_dwarf_kprobe_register_batch (int return_p, void **batch, unsigned n) {";
+  s.op->newline(1) << "unsigned k;";
+  s.op->newline() << "int rc;";
+  s.op->newline() << "if (n == 0)";
+  s.op->newline(1) << "return 0;";
+  s.op->newline(-1) << "if (return_p)";
+  s.op->newline(1) << "rc = register_kretprobes ((struct kretprobe **) batch, n);";
+  s.op->newline(-1) << "else";
+  s.op->newline(1) << "rc = register_kprobes ((struct kprobe **) batch, n);";
+  s.op->newline(-1) << "for (k = 0; k < n; k++) {";
+  // NB: same index arithmetic as enter_kprobe_probe; the kprobe and
+  // kretprobe both sit at the start of struct stap_dwarf_kprobe.
+  s.op->newline(1) << "int kprobe_idx = ((uintptr_t)batch[k]-(uintptr_t)stap_dwarf_kprobes)/sizeof(struct stap_dwarf_kprobe);";
+  s.op->newline() << "struct stap_dwarf_probe *sdp = & stap_dwarf_probes[kprobe_idx];";
+  s.op->newline() << "struct stap_dwarf_kprobe *kp = & stap_dwarf_kprobes[kprobe_idx];";
+  s.op->newline() << "unsigned long relocated_addr;";
+  s.op->newline() << "sdp->registered_p = (rc == 0);";
+  s.op->newline() << "if (rc == 0)";
+  s.op->newline(1) << "continue;";
+  s.op->newline(-1) << "relocated_addr = _stp_kmodule_relocate (sdp->module, sdp->section, sdp->address);";
+  s.op->newline() << "if (n == 1 && !sdp->optional_p)";
+  s.op->newline(1) << "_stp_warn (\"probe %s (address 0x%lx) registration error (rc %d)\", sdp->probe->pp, relocated_addr, rc);";
+  s.op->newline(-1) << "memset (kp, 0, sizeof (*kp));";
+  s.op->newline() << "stap_dwarf_kprobe_prepare (sdp, kp, relocated_addr);";
+  s.op->newline(-1) << "}";
+  s.op->newline() << "if (rc == 0)";
+  s.op->newline(1) << "return n;";
+  s.op->newline(-1) << "if (n == 1)";
+  s.op->newline(1) << "return 0;";
+  s.op->newline(-1) << "return stap_dwarf_kprobe_register_batch (return_p, batch, n / 2)";
+  s.op->newline(1) << "+ stap_dwarf_kprobe_register_batch (return_p, batch + n / 2, n - n / 2);";
+  s.op->indent(-1);
+  s.op->newline(-1) << "}";
   s.op->newline() << "#endif";
+
+  s.op->newline();
+}
+
+
+void
+dwarf_derived_probe_group::emit_module_init (systemtap_session& s)
+{
+  s.op->newline() << "{";
+  s.op->newline(1) << "unsigned registered = 0;";
+  s.op->newline() << "#ifdef STP_TIMING";
+  s.op->newline() << "unsigned long start_jiffies = jiffies;";
+  s.op->newline() << "#endif";
+
+  // With the batch interfaces, prepare all the plain kprobes and register
+  // them in one call, then the same for all the kretprobes.  This saves
+  // the per-call synchronization overhead, which dominates startup when
+  // there are thousands of probes.
+  s.op->newline() << "#if defined(STAPCONF_REGISTER_KPROBES) && !defined(__ia64__) && !defined(STP_NO_KPROBE_BATCH)";
+  s.op->newline() << "for (j=0; j<2; j++) {"; // 0: kprobes, 1: kretprobes
+  s.op->newline(1) << "unsigned n = 0;";
+  s.op->newline() << "for (i=0; i<" << probes_by_module.size() << "; i++) {";
+  s.op->newline(1) << "struct stap_dwarf_probe *sdp = & stap_dwarf_probes[i];";
+  s.op->newline() << "struct stap_dwarf_kprobe *kp = & stap_dwarf_kprobes[i];";
+  s.op->newline() << "unsigned long relocated_addr;";
+  s.op->newline() << "if (sdp->return_p != j) continue;";
+  s.op->newline() << "relocated_addr = _stp_kmodule_relocate (sdp->module, sdp->section, sdp->address);";
+  s.op->newline() << "if (relocated_addr == 0) continue;"; // quietly; assume module is absent
+  s.op->newline() << "stap_dwarf_kprobe_prepare (sdp, kp, relocated_addr);";
+  s.op->newline() << "stap_batch_kprobes[n++] = sdp->return_p ? (void *) &kp->u.krp : (void *) &kp->u.kp;";
+  s.op->newline(-1) << "}";
+  s.op->newline() << "registered += stap_dwarf_kprobe_register_batch (j, stap_batch_kprobes, n);";
   s.op->newline(-1) << "}";
+  s.op->newline() << "#else";
+
+  s.op->newline() << "for (i=0; i<" << probes_by_module.size() << "; i++) {";
+  s.op->newline(1) << "struct stap_dwarf_probe *sdp = & stap_dwarf_probes[i];";
+  s.op->newline() << "struct stap_dwarf_kprobe *kp = & stap_dwarf_kprobes[i];";
+  s.op->newline() << "unsigned long relocated_addr = _stp_kmodule_relocate (sdp->module, sdp->section, sdp->address);";
+  s.op->newline() << "if (relocated_addr == 0) continue;"; // quietly; assume module is absent
+  s.op->newline() << "probe_point = sdp->probe->pp;"; // for error messages
+  s.op->newline() << "stap_dwarf_kprobe_prepare (sdp, kp, relocated_addr);";
+  s.op->newline() << "rc = stap_dwarf_kprobe_register (sdp, kp);";
   s.op->newline() << "if (rc) {"; // PR6749: tolerate a failed register_*probe.
   s.op->newline(1) << "sdp->registered_p = 0;";
   s.op->newline() << "if (!sdp->optional_p)";
@@ -5051,8 +5193,21 @@ dwarf_derived_probe_group::emit_module_init (systemtap_session& s)
   s.op->newline(-1) << "}";
 #endif
 
-  s.op->newline() << "else sdp->registered_p = 1;";
+  s.op->newline() << "else {";
+  s.op->newline(1) << "sdp->registered_p = 1;";
+  s.op->newline() << "registered++;";
+  s.op->newline(-1) << "}";
   s.op->newline(-1) << "}"; // for loop
+  s.op->newline() << "#endif";
+
+  s.op->newline() << "#ifdef STP_TIMING";
+  s.op->newline() << "preempt_disable();";
+  s.op->newline() << "_stp_printf (\"dwarf kprobes: registered %u of %u in %u ms\\n\", registered, "
+                  << probes_by_module.size() << ", jiffies_to_msecs (jiffies - start_jiffies));";
+  s.op->newline() << "preempt_enable_no_resched();";
+  s.op->newline() << "#endif";
+  s.op->newline() << "(void) registered;";
+  s.op->newline(-1) << "}";
 }
 
 
@@ -5067,51 +5222,8 @@ dwarf_derived_probe_group::emit_module_refresh (systemtap_session& s)
 
   // new module arrived?
   s.op->newline() << "if (sdp->registered_p == 0 && relocated_addr != 0) {";
-  s.op->newline(1) << "if (sdp->return_p) {";
-  s.op->newline(1) << "kp->u.krp.kp.addr = (void *) relocated_addr;";
-  s.op->newline() << "if (sdp->maxactive_p) {";
-  s.op->newline(1) << "kp->u.krp.maxactive = sdp->maxactive_val;";
-  s.op->newline(-1) << "} else {";
-  s.op->newline(1) << "kp->u.krp.maxactive = KRETACTIVE;";
-  s.op->newline(-1) << "}";
-  s.op->newline() << "kp->u.krp.handler = &enter_kretprobe_probe;";
-  s.op->newline() << "#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,25)";
-  s.op->newline() << "if (sdp->entry_probe) {";
-  s.op->newline(1) << "kp->u.krp.entry_handler = &enter_kretprobe_entry_probe;";
-  s.op->newline() << "kp->u.krp.data_size = sdp->saved_longs * sizeof(int64_t) + ";
-  s.op->newline() << "                      sdp->saved_strings * MAXSTRINGLEN;";
-  s.op->newline(-1) << "}";
-  s.op->newline() << "#endif";
-  // to ensure safeness of bspcache, always use aggr_kprobe on ia64
-  s.op->newline() << "#ifdef __ia64__";
-  s.op->newline() << "kp->dummy.addr = kp->u.krp.kp.addr;";
-  s.op->newline() << "kp->dummy.pre_handler = NULL;";
-  s.op->newline() << "rc = register_kprobe (& kp->dummy);";
-  s.op->newline() << "if (rc == 0) {";
-  s.op->newline(1) << "rc = register_kretprobe (& kp->u.krp);";
-  s.op->newline() << "if (rc != 0)";
-  s.op->newline(1) << "unregister_kprobe (& kp->dummy);";
-  s.op->newline(-2) << "}";
-  s.op->newline() << "#else";
-  s.op->newline() << "rc = register_kretprobe (& kp->u.krp);";
-  s.op->newline() << "#endif";
-  s.op->newline(-1) << "} else {";
-  // to ensure safeness of bspcache, always use aggr_kprobe on ia64
-  s.op->newline(1) << "kp->u.kp.addr = (void *) relocated_addr;";
-  s.op->newline() << "kp->u.kp.pre_handler = &enter_kprobe_probe;";
-  s.op->newline() << "#ifdef __ia64__";
-  s.op->newline() << "kp->dummy.addr = kp->u.kp.addr;";
-  s.op->newline() << "kp->dummy.pre_handler = NULL;";
-  s.op->newline() << "rc = register_kprobe (& kp->dummy);";
-  s.op->newline() << "if (rc == 0) {";
-  s.op->newline(1) << "rc = register_kprobe (& kp->u.kp);";
-  s.op->newline() << "if (rc != 0)";
-  s.op->newline(1) << "unregister_kprobe (& kp->dummy);";
-  s.op->newline(-2) << "}";
-  s.op->newline() << "#else";
-  s.op->newline() << "rc = register_kprobe (& kp->u.kp);";
-  s.op->newline() << "#endif";
-  s.op->newline(-1) << "}";
+  s.op->newline(1) << "stap_dwarf_kprobe_prepare (sdp, kp, relocated_addr);";
+  s.op->newline() << "rc = stap_dwarf_kprobe_register (sdp, kp);";
   s.op->newline() << "if (rc == 0) sdp->registered_p = 1;";
 
   // old module disappeared?
@@ -5151,6 +5263,12 @@ dwarf_derived_probe_group::emit_module_refresh (systemtap_session& s)
 void
 dwarf_derived_probe_group::emit_module_exit (systemtap_session& s)
 {
+  s.op->newline() << "{";
+  s.op->newline(1) << "#ifdef STP_TIMING";
+  s.op->newline() << "unsigned long start_jiffies = jiffies;";
+  s.op->newline() << "unsigned unregistered = 0;";
+  s.op->newline() << "#endif";
+
   //Unregister kprobes by batch interfaces.
   s.op->newline() << "#if defined(STAPCONF_UNREGISTER_KPROBES)";
   s.op->newline() << "j = 0;";
@@ -5159,27 +5277,27 @@ dwarf_derived_probe_group::emit_module_exit (systemtap_session& s)
   s.op->newline() << "struct stap_dwarf_kprobe *kp = & stap_dwarf_kprobes[i];";
   s.op->newline() << "if (! sdp->registered_p) continue;";
   s.op->newline() << "if (!sdp->return_p)";
-  s.op->newline(1) << "stap_unreg_kprobes[j++] = &kp->u.kp;";
+  s.op->newline(1) << "stap_batch_kprobes[j++] = &kp->u.kp;";
   s.op->newline(-2) << "}";
-  s.op->newline() << "unregister_kprobes((struct kprobe **)stap_unreg_kprobes, j);";
+  s.op->newline() << "unregister_kprobes((struct kprobe **)stap_batch_kprobes, j);";
   s.op->newline() << "j = 0;";
   s.op->newline() << "for (i=0; i<" << probes_by_module.size() << "; i++) {";
   s.op->newline(1) << "struct stap_dwarf_probe *sdp = & stap_dwarf_probes[i];";
   s.op->newline() << "struct stap_dwarf_kprobe *kp = & stap_dwarf_kprobes[i];";
   s.op->newline() << "if (! sdp->registered_p) continue;";
   s.op->newline() << "if (sdp->return_p)";
-  s.op->newline(1) << "stap_unreg_kprobes[j++] = &kp->u.krp;";
+  s.op->newline(1) << "stap_batch_kprobes[j++] = &kp->u.krp;";
   s.op->newline(-2) << "}";
-  s.op->newline() << "unregister_kretprobes((struct kretprobe **)stap_unreg_kprobes, j);";
+  s.op->newline() << "unregister_kretprobes((struct kretprobe **)stap_batch_kprobes, j);";
   s.op->newline() << "#ifdef __ia64__";
   s.op->newline() << "j = 0;";
   s.op->newline() << "for (i=0; i<" << probes_by_module.size() << "; i++) {";
   s.op->newline(1) << "struct stap_dwarf_probe *sdp = & stap_dwarf_probes[i];";
   s.op->newline() << "struct stap_dwarf_kprobe *kp = & stap_dwarf_kprobes[i];";
   s.op->newline() << "if (! sdp->registered_p) continue;";
-  s.op->newline() << "stap_unreg_kprobes[j++] = &kp->dummy;";
+  s.op->newline() << "stap_batch_kprobes[j++] = &kp->dummy;";
   s.op->newline(-1) << "}";
-  s.op->newline() << "unregister_kprobes((struct kprobe **)stap_unreg_kprobes, j);";
+  s.op->newline() << "unregister_kprobes((struct kprobe **)stap_batch_kprobes, j);";
   s.op->newline() << "#endif";
   s.op->newline() << "#endif";
 
@@ -5215,6 +5333,17 @@ dwarf_derived_probe_group::emit_module_exit (systemtap_session& s)
   s.op->newline() << "unregister_kprobe (&kp->dummy);";
   s.op->newline() << "#endif";
   s.op->newline() << "sdp->registered_p = 0;";
+  s.op->newline() << "#ifdef STP_TIMING";
+  s.op->newline() << "unregistered++;";
+  s.op->newline() << "#endif";
+  s.op->newline(-1) << "}";
+
+  s.op->newline() << "#ifdef STP_TIMING";
+  s.op->newline() << "preempt_disable();";
+  s.op->newline() << "_stp_printf (\"dwarf kprobes: unregistered %u in %u ms\\n\", "
+                  << "unregistered, jiffies_to_msecs (jiffies - start_jiffies));";
+  s.op->newline() << "preempt_enable_no_resched();";
+  s.op->newline() << "#endif";
   s.op->newline(-1) << "}";
 }
 
@@ -6025,8 +6154,12 @@ private:
   void iterate_over_probe_entries();
   void handle_probe_entry();
 
-  static void setup_note_probe_entry_callback (void *object, int type, const char *data, size_t len);
-  void setup_note_probe_entry (int type, const char *data, size_t len);
+  static void index_note_probe_entry_callback (void *object, int type, const char *data, size_t len);
+  void index_note_probe_entry (int type, const char *data, size_t len);
+  const vector<sdt_note_entry>& get_sdt_notes();
+  bool read_sdt_index (const string& index_path);
+  void write_sdt_index (const string& index_path);
+  void handle_note_probe_entry (const sdt_note_entry& note);
 
   void convert_probe(probe *base);
   void record_semaphore(vector<derived_probe *> & results, unsigned start);
@@ -6197,7 +6330,9 @@ sdt_query::handle_query_module()
       else
 	base = semaphore_load_offset = 0;
 
-      dw.iterate_over_notes ((void*) this, &sdt_query::setup_note_probe_entry_callback);
+      const vector<sdt_note_entry>& notes = get_sdt_notes();
+      for (size_t i = 0; i < notes.size(); ++i)
+        handle_note_probe_entry (notes[i]);
     }
   else if (probe_loc == probe_section)
     iterate_over_probe_entries ();
@@ -6234,16 +6369,122 @@ sdt_query::init_probe_scn()
     return false;
 }
 
+// The SDT notes of a module are indexed once, and the index shared by all
+// the mark patterns of the session, including those of every process("*")
+// library query.  It is also kept in the cache under the module's
+// build-id, so later sessions needn't walk the notes at all.
+const vector<sdt_note_entry>&
+sdt_query::get_sdt_notes()
+{
+  module_info *mi = dw.mod_info;
+  if (mi->sdt_notes)
+    return *mi->sdt_notes;
+
+  mi->sdt_notes = new vector<sdt_note_entry>;
+
+  string build_id;
+  const unsigned char *bits;
+  GElf_Addr vaddr;
+  int bits_length = dwfl_module_build_id (mi->mod, &bits, &vaddr);
+  if (bits_length > 0)
+    build_id = hex_dump(bits, bits_length);
+
+  string index_path;
+  if (sess.use_cache)
+    index_path = find_sdt_index_hash (sess, mi->elf_path.empty() ?
+                                      dw.module_name : mi->elf_path,
+                                      build_id);
+
+  if (!index_path.empty() && !sess.poison_cache && read_sdt_index (index_path))
+    {
+      if (sess.verbose > 2)
+        clog << _F("using cached SDT index %s for %s, %zu probes",
+                   index_path.c_str(), dw.module_name.c_str(),
+                   mi->sdt_notes->size()) << endl;
+      return *mi->sdt_notes;
+    }
+
+  dw.iterate_over_notes ((void*) this, &sdt_query::index_note_probe_entry_callback);
+  if (sess.verbose > 2)
+    clog << _F("indexed %zu SDT probes in %s", mi->sdt_notes->size(),
+               dw.module_name.c_str()) << endl;
+
+  if (!index_path.empty())
+    write_sdt_index (index_path);
+  return *mi->sdt_notes;
+}
+
+
+// The index has one probe per line: the pc, .stapsdt.base reference and
+// semaphore in hex, then the provider, name and argument string, separated
+// by tabs.  Prelinking a binary again keeps its build-id, so the raw note
+// values are cached and only adjusted for the current base once used.
+bool
+sdt_query::read_sdt_index (const string& index_path)
+{
+  ifstream index(index_path.c_str());
+  if (!index)
+    return false;
+
+  vector<sdt_note_entry> notes;
+  string line;
+  while (getline(index, line))
+    {
+      istringstream fields(line);
+      sdt_note_entry note;
+      if (!(fields >> hex >> note.pc >> note.base_ref >> note.semaphore)
+          || fields.get() != '\t'
+          || !getline(fields, note.provider, '\t')
+          || !getline(fields, note.name, '\t'))
+        {
+          if (sess.verbose > 1)
+            clog << _F("ignoring malformed SDT index %s", index_path.c_str()) << endl;
+          return false;
+        }
+      getline(fields, note.args);
+      notes.push_back(note);
+    }
+
+  dw.mod_info->sdt_notes->swap(notes);
+  return true;
+}
+
+
 void
-sdt_query::setup_note_probe_entry_callback (void *object, int type, const char *data, size_t len)
+sdt_query::write_sdt_index (const string& index_path)
+{
+  const vector<sdt_note_entry>& notes = *dw.mod_info->sdt_notes;
+
+  // Write to a temporary name and rename, so that a concurrent stap never
+  // sees a partial index.
+  string tmp_path = index_path + "." + lex_cast(getpid());
+  ofstream index(tmp_path.c_str());
+  for (size_t i = 0; i < notes.size(); ++i)
+    index << hex << notes[i].pc << " " << notes[i].base_ref
+          << " " << notes[i].semaphore << dec
+          << "\t" << notes[i].provider << "\t" << notes[i].name
+          << "\t" << notes[i].args << endl;
+  index.close();
+
+  if (!index || rename(tmp_path.c_str(), index_path.c_str()) != 0)
+    {
+      if (sess.verbose > 1)
+        clog << _F("couldn't cache SDT index %s", index_path.c_str()) << endl;
+      (void) unlink(tmp_path.c_str());
+    }
+}
+
+
+void
+sdt_query::index_note_probe_entry_callback (void *object, int type, const char *data, size_t len)
 {
   sdt_query *me = (sdt_query*)object;
-  me->setup_note_probe_entry (type, data, len);
+  me->index_note_probe_entry (type, data, len);
 }
 
 
 void
-sdt_query::setup_note_probe_entry (int type, const char *data, size_t len)
+sdt_query::index_note_probe_entry (int type, const char *data, size_t len)
 {
   //  if (nhdr.n_namesz == sizeof _SDT_NOTE_NAME
   //      && !memcmp (data->d_buf + name_off,
@@ -6281,7 +6522,6 @@ sdt_query::setup_note_probe_entry (int type, const char *data, size_t len)
 		      elf_getident (elf, NULL)[EI_DATA]) == NULL)
     printf ("gelf_xlatetom: %s", elf_errmsg (-1));
 
-  probe_type = uprobe3_type;
   const char * provider = data + dst.d_size;
 
   const char *name = (const char*)memchr (provider, '\0', data + len - provider);
@@ -6292,42 +6532,56 @@ sdt_query::setup_note_probe_entry (int type, const char *data, size_t len)
   if (args++ == NULL || memchr (args, '\0', data + len - name) != data + len - 1)
     return;
 
-  provider_name = provider;
-  probe_name = name;
-  arg_string = args;
+  sdt_note_entry note;
+  note.provider = provider;
+  note.name = name;
+  note.args = args;
+
+  if (gelf_getclass (elf) == ELFCLASS32)
+    {
+      note.pc = buf.a32[0];
+      note.base_ref = buf.a32[1];
+      note.semaphore = buf.a32[2];
+    }
+  else
+    {
+      note.pc = buf.a64[0];
+      note.base_ref = buf.a64[1];
+      note.semaphore = buf.a64[2];
+    }
+
+  dw.mod_info->sdt_notes->push_back(note);
+}
+
 
+void
+sdt_query::handle_note_probe_entry (const sdt_note_entry& note)
+{
   // Did we find a matching probe?
-  if (! (dw.function_name_matches_pattern (probe_name, pp_mark)
+  if (! (dw.function_name_matches_pattern (note.name, pp_mark)
 	 && ((pp_provider == "")
-	     || dw.function_name_matches_pattern (provider_name, pp_provider))))
+	     || dw.function_name_matches_pattern (note.provider, pp_provider))))
     return;
 
+  probe_type = uprobe3_type;
+  provider_name = note.provider;
+  probe_name = note.name;
+  arg_string = note.args;
+
   // PR13934: Assembly probes are not forced to use the N@OP form.
   // If we have '@' then great, else count based on space-delimiters.
   arg_count = count(arg_string.begin(), arg_string.end(), '@');
   if (!arg_count && !arg_string.empty())
     arg_count = 1 + count(arg_string.begin(), arg_string.end(), ' ');
 
-  GElf_Addr base_ref;
-  if (gelf_getclass (elf) == ELFCLASS32)
-    {
-      pc = buf.a32[0];
-      base_ref = buf.a32[1];
-      semaphore = buf.a32[2];
-    }
-  else
-    {
-      pc = buf.a64[0];
-      base_ref = buf.a64[1];
-      semaphore = buf.a64[2];
-    }
-
-  semaphore += base - base_ref;
-  pc += base - base_ref;
+  // Adjust for prelink, by where .stapsdt.base is now.
+  pc = note.pc + base - note.base_ref;
 
   // The semaphore also needs the ELF bias added now, so
   // record_semaphore can properly relocate it later.
-  semaphore += bias;
+  Dwarf_Addr bias;
+  (void) dwfl_module_getelf (dw.mod_info->mod, &bias);
+  semaphore = note.semaphore + base - note.base_ref + bias;
 
   if (sess.verbose > 4)
     clog << _F(" saw .note.stapsdt %s%s ", probe_name.c_str(), (provider_name != "" ? _(" (provider ")+provider_name+") " : "").c_str()) << "@0x" << hex << pc << dec << endl;
@@ -6848,6 +7102,14 @@ dwarf_builder::build(systemtap_session & sess,
       return;
     }
 
+  // A single function looked up in many modules, such as
+  // module("*").function("foo"), may have their indexes built in
+  // parallel first.  See dwarf_query::query_module_dwarf.
+  if (q.has_function_str && q.spec_type == function_alone
+      && !dw->name_has_wildcard(q.function) && !startswith(q.function, "_Z")
+      && !q.has_library && !q.has_plt)
+    dw->cache_module_functions(q.module_val);
+
   dw->iterate_over_modules(&query_module, &q);
 
 
@@ -7228,6 +7490,7 @@ module_info::~module_info()
 {
   if (sym_table)
     delete sym_table;
+  delete sdt_notes;
 }
 
 // ------------------------------------------------------------------------
@@ -9702,23 +9965,35 @@ tracepoint_query::tracepoint_query_func (Dwarf_Die * func, base_query * query)
 struct tracepoint_builder: public derived_probe_builder
 {
 private:
-  dwflpp *dw;
+  // The tracepoints found in the tracequery modules, as (name, module)
+  // pairs in module order.  The debuginfo of a module is only loaded
+  // once a probe point matches one of its tracepoints, and the modules a
+  // probe point matches share one dwflpp, as all of them used to.
+  bool indexed;
+  vector<pair<string, string> > tracepoints;
+  vector<string> tracequery_modules;
+  map<vector<string>, dwflpp*> dws;
+
   bool init_dw(systemtap_session& s);
   void get_tracequery_modules(systemtap_session& s,
                               const vector<string>& headers,
                               vector<string>& modules);
+  bool read_tracepoint_index(systemtap_session& s, const string& index_path);
+  void write_tracepoint_index(systemtap_session& s, const string& index_path);
+  void index_tracepoints(systemtap_session& s);
+  dwflpp *get_dw(systemtap_session& s, const vector<string>& modules);
+  void delete_dws();
 
 public:
 
-  tracepoint_builder(): dw(0) {}
-  ~tracepoint_builder() { delete dw; }
+  tracepoint_builder(): indexed(false) {}
+  ~tracepoint_builder() { delete_dws(); }
 
   void build_no_more (systemtap_session& s)
   {
-    if (dw && s.verbose > 3)
+    if (!dws.empty() && s.verbose > 3)
       clog << _("tracepoint_builder releasing dwflpp") << endl;
-    delete dw;
-    dw = NULL;
+    delete_dws();
 
     delete_session_module_cache (s);
   }
@@ -9865,17 +10140,29 @@ tracepoint_builder::get_tracequery_modules(systemtap_session& s,
 
 
 
+static long
+tv_ms_since(const struct timeval& tv_before)
+{
+  struct timeval tv_after;
+  gettimeofday (&tv_after, NULL);
+  return (tv_after.tv_sec - tv_before.tv_sec) * 1000 +
+    ((long)tv_after.tv_usec - (long)tv_before.tv_usec) / 1000;
+}
+
+
 bool
 tracepoint_builder::init_dw(systemtap_session& s)
 {
-  if (dw != NULL)
+  if (indexed)
     return true;
 
-  vector<string> tracequery_modules;
   vector<string> system_headers;
+  struct timeval tv_before;
 
   glob_t trace_glob;
 
+  gettimeofday (&tv_before, NULL);
+
   // find kernel_source_tree
   if (s.kernel_source_tree == "")
     {
@@ -9956,16 +10243,184 @@ tracepoint_builder::init_dw(systemtap_session& s)
       globfree(&trace_glob);
     }
 
-  // Build tracequery modules
-  get_tracequery_modules(s, system_headers, tracequery_modules);
+  if (s.verbose > 0)
+    clog << _F("Pass 2: found %zu tracepoint headers in %ld ms",
+               system_headers.size(), tv_ms_since(tv_before)) << endl;
 
   // TODO: consider other sources of tracepoint headers too, like from
   // a command-line parameter or some environment or .systemtaprc
 
-  dw = new dwflpp(s, tracequery_modules, true);
+  // The index of a kernel's tracepoints is cached under its build-id, so
+  // once the tracequery modules are made, a later run needn't look at
+  // them (or even stat their headers' cache entries) before it knows
+  // which of them its probe points need.
+  string index_path = find_tracequery_index_hash(s, system_headers,
+                                                 get_kernel_build_id(s));
+  if (s.use_cache && !s.poison_cache && !index_path.empty()
+      && read_tracepoint_index(s, index_path))
+    {
+      if (s.verbose > 0)
+        clog << _F("Pass 2: using cached tracepoint index %s, %zu tracepoints",
+                   index_path.c_str(), tracepoints.size()) << endl;
+    }
+  else
+    {
+      // Build tracequery modules
+      gettimeofday (&tv_before, NULL);
+      get_tracequery_modules(s, system_headers, tracequery_modules);
+      if (s.verbose > 0)
+        clog << _F("Pass 2: got %zu tracequery modules in %ld ms",
+                   tracequery_modules.size(), tv_ms_since(tv_before)) << endl;
+
+      gettimeofday (&tv_before, NULL);
+      index_tracepoints(s);
+      if (s.verbose > 0)
+        clog << _F("Pass 2: indexed %zu tracepoints in %ld ms",
+                   tracepoints.size(), tv_ms_since(tv_before)) << endl;
+
+      if (s.use_cache && !index_path.empty())
+        write_tracepoint_index(s, index_path);
+    }
+
+  indexed = true;
+  return true;
+}
+
+
+// Read the cached index of tracepoints, one "name<TAB>module" per line.  It
+// is only good if all the modules it names are still in the cache.
+bool
+tracepoint_builder::read_tracepoint_index(systemtap_session& s,
+                                          const string& index_path)
+{
+  ifstream index(index_path.c_str());
+  if (!index)
+    return false;
+
+  vector<pair<string, string> > entries;
+  vector<string> modules;
+  string line;
+  while (getline(index, line))
+    {
+      size_t tab = line.find('\t');
+      if (tab == string::npos)
+        return false;
+      string name = line.substr(0, tab), module = line.substr(tab + 1);
+      if (modules.empty() || modules.back() != module)
+        {
+          if (!file_exists(module))
+            {
+              if (s.verbose > 2)
+                clog << _F("Pass 2: tracepoint index %s refers to missing %s",
+                           index_path.c_str(), module.c_str()) << endl;
+              return false;
+            }
+          modules.push_back(module);
+        }
+      entries.push_back(make_pair(name, module));
+    }
+  if (!index.eof())
+    return false;
+
+  tracepoints.swap(entries);
+  tracequery_modules.swap(modules);
   return true;
 }
 
+
+void
+tracepoint_builder::write_tracepoint_index(systemtap_session& s,
+                                           const string& index_path)
+{
+  // Write to a temporary name and rename, so that a concurrent stap never
+  // sees a partial index.
+  string tmp_path = index_path + "." + lex_cast(getpid());
+  ofstream index(tmp_path.c_str());
+  for (size_t i = 0; i < tracepoints.size(); ++i)
+    index << tracepoints[i].first << "\t" << tracepoints[i].second << endl;
+  index.close();
+
+  if (!index || rename(tmp_path.c_str(), index_path.c_str()) != 0)
+    {
+      if (s.verbose > 1)
+        clog << _F("Pass 2: couldn't cache tracepoint index %s",
+                   index_path.c_str()) << endl;
+      (void) unlink(tmp_path.c_str());
+    }
+}
+
+
+// List the tracepoints in each tracequery module from the names of its
+// stapprobe_* functions in the ELF symbol table, which is far cheaper
+// than walking the DWARF of every module.
+void
+tracepoint_builder::index_tracepoints(systemtap_session& s)
+{
+  (void) elf_version (EV_CURRENT);
+
+  for (size_t i = 0; i < tracequery_modules.size(); ++i)
+    {
+      assert_no_interrupts();
+
+      const string& module = tracequery_modules[i];
+      int fd = open(module.c_str(), O_RDONLY);
+      if (fd < 0)
+        continue;
+
+      Elf *elf = elf_begin (fd, ELF_C_READ_MMAP, NULL);
+      Elf_Scn *scn = NULL;
+      while (elf && (scn = elf_nextscn (elf, scn)) != NULL)
+        {
+          GElf_Shdr shdr_mem;
+          GElf_Shdr *shdr = gelf_getshdr (scn, &shdr_mem);
+          if (shdr == NULL || shdr->sh_type != SHT_SYMTAB)
+            continue;
+
+          Elf_Data *data = elf_getdata (scn, NULL);
+          size_t nsyms = shdr->sh_entsize ? shdr->sh_size / shdr->sh_entsize : 0;
+          for (size_t n = 0; data && n < nsyms; ++n)
+            {
+              GElf_Sym sym_mem;
+              GElf_Sym *sym = gelf_getsym (data, n, &sym_mem);
+              if (sym == NULL || GELF_ST_TYPE (sym->st_info) != STT_FUNC
+                  || sym->st_shndx == SHN_UNDEF)
+                continue;
+
+              const char *name = elf_strptr (elf, shdr->sh_link, sym->st_name);
+              if (name && startswith(name, "stapprobe_"))
+                tracepoints.push_back(make_pair(string(name + 10), module));
+            }
+        }
+
+      if (elf == NULL && s.verbose > 2)
+        clog << _F("Pass 2: couldn't read tracequery module %s: %s",
+                   module.c_str(), elf_errmsg (-1)) << endl;
+      elf_end (elf);
+      close (fd);
+    }
+}
+
+
+dwflpp *
+tracepoint_builder::get_dw(systemtap_session& s, const vector<string>& modules)
+{
+  dwflpp *&dw = dws[modules];
+  if (dw == NULL)
+    dw = new dwflpp(s, modules, true);
+  return dw;
+}
+
+
+void
+tracepoint_builder::delete_dws()
+{
+  for (map<vector<string>, dwflpp*>::iterator it = dws.begin();
+       it != dws.end(); ++it)
+    delete it->second;
+  dws.clear();
+}
+
+
 void
 tracepoint_builder::build(systemtap_session& s,
                           probe *base, probe_point *location,
@@ -9978,6 +10433,17 @@ tracepoint_builder::build(systemtap_session& s,
   string tracepoint;
   assert(get_param (parameters, TOK_TRACE, tracepoint));
 
+  // Only look in the modules that have a tracepoint matching the probe
+  // point, in module order, as a query over all of them would.
+  vector<string> modules;
+  for (size_t i = 0; i < tracepoints.size(); ++i)
+    if (fnmatch(tracepoint.c_str(), tracepoints[i].first.c_str(), 0) == 0
+        && (modules.empty() || modules.back() != tracepoints[i].second))
+      modules.push_back(tracepoints[i].second);
+  if (modules.empty())
+    return;
+
+  dwflpp *dw = get_dw(s, modules);
   tracepoint_query q(*dw, tracepoint, base, location, finished_results);
   dw->iterate_over_modules(&query_module, &q);
 }
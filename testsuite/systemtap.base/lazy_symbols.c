@@ -0,0 +1,11 @@
+#include <stdio.h>
+
+__attribute__((noinline)) int lazy_symbols_target(int i)
+{
+  return i + 1;
+}
+
+int main(void)
+{
+  return lazy_symbols_target(-1);
+}
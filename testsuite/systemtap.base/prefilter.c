@@ -0,0 +1,23 @@
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+__attribute__((noinline)) int prefilter_work(int i)
+{
+  return i + 1;
+}
+
+int main(void)
+{
+  int i;
+
+  /* Four other processes hit the probe, then the target does. */
+  for (i = 0; i < 4; i++) {
+    pid_t pid = fork();
+    if (pid == 0)
+      return prefilter_work(-1);
+    if (pid > 0)
+      waitpid(pid, NULL, 0);
+  }
+  return prefilter_work(-1);
+}
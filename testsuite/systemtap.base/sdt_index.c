@@ -0,0 +1,12 @@
+#include "sys/sdt.h"
+
+int
+main (int argc, char **argv)
+{
+  STAP_PROBE(sdt_index, first);
+  STAP_PROBE1(sdt_index, second, argc);
+#ifdef SDT_INDEX_EXTRA
+  STAP_PROBE2(sdt_index, extra, argc, argv);
+#endif
+  return 0;
+}
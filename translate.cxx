@@ -76,18 +76,28 @@ struct c_unparser: public unparser, public visitor
 
   varuse_collecting_visitor vcv_needs_global_locks;
 
-  map<string, string> probe_contents;
+  // The first probe with the same handler, for each duplicate one.
+  map<derived_probe*, derived_probe*> probe_dupes;
 
   map<pair<bool, string>, string> compiled_printfs;
 
+  unsigned maxnesting; // the default MAXNESTING
+  set<vardecl*> byref_args; // string arguments passed as pointers
+  size_t declared_size; // estimated size of variables from c_declare
+
   c_unparser (systemtap_session* ss):
     session (ss), o (ss->op), current_probe(0), current_function (0),
     tmpvar_counter (0), label_counter (0), action_counter(0),
-    vcv_needs_global_locks (*ss) {}
+    vcv_needs_global_locks (*ss), maxnesting (0), declared_size (0) {}
   ~c_unparser () {}
 
   void emit_map_type_instantiations ();
   void emit_common_header ();
+  void find_duplicate_probes ();
+  void emit_function_frames ();
+  size_t estimated_size (exp_type ty);
+  void find_byref_args ();
+  bool pass_by_pointer (functioncall* e, unsigned i);
   void emit_global (vardecl* v);
   void emit_global_init (vardecl* v);
   void emit_global_param (vardecl* v);
@@ -967,14 +977,146 @@ translator_output::line ()
 
 // ------------------------------------------------------------------------
 
+// An output stream buffer that only hashes what is written to it, with
+// 64-bit FNV-1a.
+class hashing_streambuf: public streambuf
+{
+public:
+  uint64_t hash;
+  hashing_streambuf (): hash (14695981039346656037ULL) {}
+
+protected:
+  int_type overflow (int_type c)
+  {
+    if (!traits_type::eq_int_type (c, traits_type::eof()))
+      add (traits_type::to_char_type (c));
+    return traits_type::not_eof (c);
+  }
+
+  streamsize xsputn (const char* s, streamsize n)
+  {
+    for (streamsize i = 0; i < n; i++)
+      add (s[i]);
+    return n;
+  }
+
+private:
+  void add (char c) { hash = (hash ^ (unsigned char) c) * 1099511628211ULL; }
+};
+
+
+// An output stream buffer that only compares what is written to it
+// with the given string.
+class comparing_streambuf: public streambuf
+{
+public:
+  comparing_streambuf (const string& s): expected (s), pos (0), differs (false) {}
+  bool equal () const { return !differs && pos == expected.size(); }
+
+protected:
+  int_type overflow (int_type c)
+  {
+    if (!traits_type::eq_int_type (c, traits_type::eof()))
+      {
+        char ch = traits_type::to_char_type (c);
+        xsputn (&ch, 1);
+      }
+    return traits_type::not_eof (c);
+  }
+
+  streamsize xsputn (const char* s, streamsize n)
+  {
+    if (!differs)
+      {
+        if ((size_t) n > expected.size() - pos
+            || expected.compare (pos, n, s, n) != 0)
+          differs = true;
+        else
+          pos += n;
+      }
+    return n;
+  }
+
+private:
+  const string& expected;
+  size_t pos;
+  bool differs;
+};
+
+
+// What makes the handlers of two probes the same; see c_unparser::emit_probe().
+static void
+print_probe_handler_key (ostream& o, derived_probe* dp)
+{
+  dp->print_dupe_stamp (o);
+  dp->body->print (o);
+
+  // Since the generated C changes based on whether or not the probe
+  // needs locks around global variables, this needs to be reflected
+  // here.  We don't want to treat as duplicate the handlers of
+  // begin/end and normal probes that differ only in need_global_locks.
+  o << "# needs_global_locks: " << dp->needs_global_locks () << endl;
+
+  // NB: dependent probe conditions *could* be listed here, but don't need to be.
+  // That's because they're only dependent on the probe body, which is already
+  // "hashed" in above.
+}
+
+
+// Find the probes whose handlers duplicate an earlier probe's.  Each
+// body is hashed as it prints, without building the string; only on a
+// hash match are the two compared in full, against the earlier one's
+// printed form, which is kept in case of further matches.
+void
+c_unparser::find_duplicate_probes ()
+{
+  map<uint64_t, vector<derived_probe*> > unique_probes;
+  map<derived_probe*, string> keys;
+
+  for (unsigned i=0; i<session->probes.size(); i++)
+    {
+      derived_probe* dp = session->probes[i];
+
+      hashing_streambuf hb;
+      ostream hs (&hb);
+      print_probe_handler_key (hs, dp);
+
+      vector<derived_probe*>& same_hash = unique_probes[hb.hash];
+      derived_probe* dupe = 0;
+      for (unsigned j=0; j<same_hash.size() && !dupe; j++)
+        {
+          if (keys.count (same_hash[j]) == 0)
+            {
+              ostringstream oss;
+              print_probe_handler_key (oss, same_hash[j]);
+              keys[same_hash[j]] = oss.str();
+            }
+
+          comparing_streambuf cb (keys[same_hash[j]]);
+          ostream cs (&cb);
+          print_probe_handler_key (cs, dp);
+          if (cb.equal ())
+            dupe = same_hash[j];
+        }
+
+      if (dupe)
+        probe_dupes[dp] = dupe;
+      else
+        same_hash.push_back (dp);
+    }
+}
+
+
 void
 c_unparser::emit_common_header ()
 {
+  emit_function_frames ();
+
   o->newline();
 
   // Per CPU context for probes. Includes common shared state held for
   // all probes (defined in common_probe_context), the probe locals (union)
-  // and the function locals (union).
+  // and the function locals (stacked frames).
   o->newline() << "struct context {";
 
   // Common state held shared by probes.
@@ -984,31 +1126,16 @@ c_unparser::emit_common_header ()
   o->newline() << "union {";
   o->indent(1);
 
-  // To elide context variables for probe handler functions that
-  // themselves are about to get duplicate-eliminated, we XXX
-  // duplicate the parse-tree-hash method from ::emit_probe().
-  map<string, string> tmp_probe_contents;
-  // The reason we don't use c_unparser::probe_contents itself
-  // for this is that we don't want to muck up the data for
-  // that later routine.
+  // Elide the context variables of probe handler functions that are
+  // about to get duplicate-eliminated in ::emit_probe().
+  find_duplicate_probes ();
 
   for (unsigned i=0; i<session->probes.size(); i++)
     {
       derived_probe* dp = session->probes[i];
 
-      // NB: see c_unparser::emit_probe() for original copy of duplicate-hashing logic.
-      ostringstream oss;
-      oss << "# needs_global_locks: " << dp->needs_global_locks () << endl;
-      dp->print_dupe_stamp (oss);
-      dp->body->print(oss);
-      // NB: dependent probe conditions *could* be listed here, but don't need to be.
-      // That's because they're only dependent on the probe body, which is already
-      // "hashed" in above.
-
-      if (tmp_probe_contents.count(oss.str()) == 0) // unique
+      if (probe_dupes.count(dp) == 0) // unique
         {
-          tmp_probe_contents[oss.str()] = dp->name; // save it
-
           o->newline() << "struct " << dp->name << "_locals {";
           o->indent(1);
           for (unsigned j=0; j<dp->locals.size(); j++)
@@ -1035,19 +1162,177 @@ c_unparser::emit_common_header ()
     }
   o->newline(-1) << "} probe_locals;";
 
-  // PR10516: function locals
-  o->newline() << "union {";
-  o->indent(1);
+  // PR10516: function locals, stacked by call depth; see
+  // c_unparser::emit_function_frames().
+  o->newline() << "char locals[STP_LOCALS_SIZE] __attribute__ ((aligned (8)));";
+
+  // Try to catch a crazy user dude passing in -DMAXNESTING=-1, leading to a [0]-sized
+  // locals[] array.
+  o->newline() << "#if MAXNESTING < 0";
+  o->newline() << "#error \"MAXNESTING must be positive\"";
+  o->newline() << "#endif";
+
+  // Use a separate union for compiled-printf locals, no nesting required.
+  emit_compiled_printf_locals ();
+
+  o->newline(-1) << "};\n"; // end of struct context
+
+  o->newline() << "#include \"runtime_context.h\"";
+
+  emit_map_type_instantiations ();
+
+  emit_compiled_printfs();
+
+  o->newline();
+}
+
+
+// The functions called directly from a function.
+struct callee_collector: public traversing_visitor
+{
+  set<string> callees;
+  void visit_functioncall (functioncall* e)
+  {
+    traversing_visitor::visit_functioncall (e); // for arguments
+    callees.insert (e->referent->name);
+  }
+};
+
+
+// Depth-first walk of the call graph from function f, listing functions
+// after all the functions they call.  Returns whether f may recurse or
+// call a function that may, adding those to the recursive set.
+static bool
+walk_call_graph (const string& f, map<string, set<string> >& callees,
+                 map<string, int>& state, set<string>& recursive,
+                 vector<string>& order)
+{
+  if (state[f] == 1) // still being walked: a cycle
+    return true;
+  if (state[f] == 2)
+    return recursive.count (f) != 0;
+
+  state[f] = 1;
+  bool rec = false;
+  for (set<string>::iterator it = callees[f].begin(); it != callees[f].end(); it++)
+    if (walk_call_graph (*it, callees, state, recursive, order))
+      rec = true;
+  state[f] = 2;
+
+  if (rec)
+    recursive.insert (f);
+  order.push_back (f);
+  return rec;
+}
+
+
+// Rough size of a variable of the given type, for -v reporting.
+size_t
+c_unparser::estimated_size (exp_type ty)
+{
+  if (ty != pe_string)
+    return 8;
+  for (unsigned i=0; i<session->c_macros.size(); i++)
+    if (startswith (session->c_macros[i], "MAXSTRINGLEN="))
+      return lex_cast<size_t> (session->c_macros[i].substr (13));
+  return 512; // as on 64-bit hosts
+}
+
+
+// Embedded-C expressions in a function body, which might write its
+// arguments through THIS.
+struct embedded_expr_finder: public traversing_visitor
+{
+  bool found;
+  embedded_expr_finder (): found (false) {}
+  void visit_embedded_expr (embedded_expr*) { found = true; }
+};
+
+
+// A string argument that a script function never writes is passed as a
+// pointer to the caller's string, rather than copied into its frame.
+// Embedded-C functions always get copies, since some (like str_replace)
+// write into theirs.
+void
+c_unparser::find_byref_args ()
+{
+  for (map<string,functiondecl*>::iterator it = session->functions.begin(); it != session->functions.end(); it++)
+    {
+      functiondecl* fd = it->second;
+      if (dynamic_cast<embeddedcode*> (fd->body))
+        continue;
+
+      embedded_expr_finder eef;
+      fd->body->visit (& eef);
+      if (eef.found)
+        continue;
+
+      varuse_collecting_visitor vut (*session);
+      vut.traversed.insert (fd);
+      vut.current_function = fd;
+      fd->body->visit (& vut);
+      for (unsigned j=0; j<fd->formal_args.size(); j++)
+        {
+          vardecl* v = fd->formal_args[j];
+          if (v->type == pe_string && vut.written.count (v) == 0)
+            byref_args.insert (v);
+        }
+    }
+}
+
+
+// Whether argument i of a call may be passed as a pointer straight to
+// the caller's variable, without even a temporary copy: a local, which
+// the callee can't reach, and which no argument assigns.
+bool
+c_unparser::pass_by_pointer (functioncall* e, unsigned i)
+{
+  if (byref_args.count (e->referent->formal_args[i]) == 0)
+    return false;
+
+  symbol* s = dynamic_cast<symbol*> (e->args[i]);
+  if (!s || find (session->globals.begin(), session->globals.end(),
+                  s->referent) != session->globals.end())
+    return false;
+
+  for (unsigned j=0; j<e->args.size(); j++)
+    {
+      varuse_collecting_visitor vut (*session);
+      e->args[j]->visit (& vut);
+      if (vut.written.count (s->referent))
+        return false;
+    }
+  return true;
+}
+
+
+// PR10516: function locals.  A function's locals and arguments form a
+// frame, which goes in c->locals just past its caller's frame; see
+// c_unparser::emit_function().  Rather than a MAXNESTING deep array of
+// frames each big enough for any function, c->locals is sized by the
+// call graph: a function's stack is its frame followed by the largest
+// stack of the functions it calls, and c->locals holds the largest of
+// all the stacks.  Only functions that may recurse, directly or through
+// their callees, get a stack of MAXNESTING+1 of the largest frames.
+void
+c_unparser::emit_function_frames ()
+{
+  map<string, size_t> frame_size;
+  size_t frame_size_max = 0;
+
+  find_byref_args ();
 
   for (map<string,functiondecl*>::iterator it = session->functions.begin(); it != session->functions.end(); it++)
     {
       functiondecl* fd = it->second;
+      size_t size = 0;
       o->newline()
         << "struct " << c_funcname (fd->name) << "_locals {";
       o->indent(1);
       for (unsigned j=0; j<fd->locals.size(); j++)
         {
 	  vardecl* v = fd->locals[j];
+          size += estimated_size (v->type);
 	  try
 	    {
               if (fd->mangle_oldstyle)
@@ -1073,20 +1358,23 @@ c_unparser::emit_common_header ()
       for (unsigned j=0; j<fd->formal_args.size(); j++)
         {
           vardecl* v = fd->formal_args[j];
+          // NB: not const, as few of the runtime's string parameters are.
+          string type = byref_args.count (v) ? "char *" : c_typename (v->type);
+          size += byref_args.count (v) ? sizeof (void*) : estimated_size (v->type);
 	  try
 	    {
               if (fd->mangle_oldstyle)
                 {
                   // PR14524: retain old way of referring to the locals
                   o->newline() << "union { "
-                               << c_typename (v->type) << " "
+                               << type << " "
                                << c_localname (v->name) << "; "
-                               << c_typename (v->type) << " "
+                               << type << " "
                                << c_localname (v->name, true) << "; };";
                 }
               else
                 {
-                  o->newline() << c_typename (v->type) << " "
+                  o->newline() << type << " "
                                << c_localname (v->name) << ";";
                 }
 	    } catch (const semantic_error& e) {
@@ -1095,44 +1383,112 @@ c_unparser::emit_common_header ()
 	      throw e2;
 	    }
         }
+      declared_size = 0;
       c_tmpcounter ct (this);
       fd->body->visit (& ct);
+      size += declared_size;
       if (fd->type == pe_unknown)
 	o->newline() << "/* no return value */";
       else
 	{
 	  o->newline() << c_typename (fd->type) << " __retvalue;";
+          size += estimated_size (fd->type);
 	}
-      o->newline(-1) << "} " << c_funcname (fd->name) << ";";
+      // Aligned, so that frames can be stacked end to end.
+      o->newline(-1) << "} __attribute__ ((aligned (8)));";
+      frame_size[fd->name] = size;
+      frame_size_max = max (frame_size_max, size);
     }
-  o->newline(-1) << "} locals [MAXNESTING+1];"; 
 
-  // NB: The +1 above for extra room for outgoing arguments of next nested function.
-  // If MAXNESTING is set too small, the args will be written, but the MAXNESTING
-  // check done at c_unparser::emit_function will reject.
-  //
-  // This policy wastes memory (one row of locals[] that cannot really
-  // be used), but trades that for smaller code (not having to check
-  // c->nesting against MAXNESTING at every call site).
-
-  // Try to catch a crazy user dude passing in -DMAXNESTING=-1, leading to a [0]-sized
-  // locals[] array.
-  o->newline() << "#if MAXNESTING < 0";
-  o->newline() << "#error \"MAXNESTING must be positive\"";
-  o->newline() << "#endif";
+  map<string, set<string> > callees;
+  for (map<string,functiondecl*>::iterator it = session->functions.begin(); it != session->functions.end(); it++)
+    {
+      callee_collector cc;
+      it->second->body->visit (& cc);
+      callees[it->first] = cc.callees;
+    }
 
-  // Use a separate union for compiled-printf locals, no nesting required.
-  emit_compiled_printf_locals ();
+  map<string, int> state;
+  set<string> recursive;
+  vector<string> order;
+  for (map<string,functiondecl*>::iterator it = session->functions.begin(); it != session->functions.end(); it++)
+    walk_call_graph (it->first, callees, state, recursive, order);
 
-  o->newline(-1) << "};\n"; // end of struct context
+  if (!recursive.empty())
+    {
+      o->newline() << "union stp_function_locals {";
+      o->indent(1);
+      for (map<string,functiondecl*>::iterator it = session->functions.begin(); it != session->functions.end(); it++)
+        o->newline() << "struct " << c_funcname (it->first) << "_locals "
+                     << c_funcname (it->first) << ";";
+      o->newline(-1) << "};";
+    }
 
-  o->newline() << "#include \"runtime_context.h\"";
+  // NB: order has every function after its callees.
+  map<string, size_t> stack_size;
+  size_t stack_size_max = 0;
+  for (unsigned i=0; i<order.size(); i++)
+    {
+      const string& f = order[i];
+      size_t size;
+      o->newline() << "struct " << c_funcname (f) << "_stack {";
+      o->indent(1);
+      if (recursive.count (f))
+        {
+          o->newline() << "char frames[(MAXNESTING+1) * sizeof (union stp_function_locals)];";
+          size = (maxnesting + 1) * frame_size_max;
+        }
+      else
+        {
+          o->newline() << "struct " << c_funcname (f) << "_locals frame;";
+          size_t next = 0;
+          if (!callees[f].empty())
+            {
+              o->newline() << "union {";
+              o->indent(1);
+              for (set<string>::iterator it = callees[f].begin(); it != callees[f].end(); it++)
+                {
+                  o->newline() << "struct " << c_funcname (*it) << "_stack "
+                               << c_funcname (*it) << ";";
+                  next = max (next, stack_size[*it]);
+                }
+              o->newline(-1) << "} next;";
+            }
+          size = frame_size[f] + next;
+        }
+      o->newline(-1) << "};";
+      stack_size[f] = size;
+      stack_size_max = max (stack_size_max, size);
+    }
 
-  emit_map_type_instantiations ();
+  o->newline() << "union stp_function_stacks {";
+  o->indent(1);
+  for (map<string,functiondecl*>::iterator it = session->functions.begin(); it != session->functions.end(); it++)
+    o->newline() << "struct " << c_funcname (it->first) << "_stack "
+                 << c_funcname (it->first) << ";";
+  o->newline(-1) << "};";
 
-  emit_compiled_printfs();
+  // Where recursion is involved, no path needs more than MAXNESTING+1 of
+  // the largest frames, even if a stack above says otherwise.  NB: the
+  // +1 is for the arguments of a call that then fails the MAXNESTING
+  // check in emit_function.
+  if (recursive.empty())
+    o->newline() << "#define STP_LOCALS_SIZE sizeof (union stp_function_stacks)";
+  else
+    {
+      o->newline() << "#define STP_LOCALS_SIZE "
+                   << "(sizeof (union stp_function_stacks) "
+                   << "< (MAXNESTING+1) * sizeof (union stp_function_locals) "
+                   << "? sizeof (union stp_function_stacks) "
+                   << ": (MAXNESTING+1) * sizeof (union stp_function_locals))";
+      stack_size_max = min (stack_size_max, (maxnesting + 1) * frame_size_max);
+    }
 
-  o->newline();
+  if (session->verbose > 0)
+    clog << _F("function locals: ~%zu bytes per context, rather than ~%zu "
+               "for %u levels of the largest frame (%zu recursive functions)",
+               stack_size_max, (maxnesting + 1) * frame_size_max,
+               maxnesting + 1, recursive.size()) << endl;
 }
 
 
@@ -1539,7 +1895,7 @@ c_unparser::emit_global (vardecl *v)
     o->newline() << type << " " << vn << ";";
 
   o->newline() << "rwlock_t " << vn << "_lock;";
-  o->newline() << "#ifdef STP_TIMING";
+  o->newline() << "#if defined(STP_TIMING) || defined(STP_PROBE_PROFILE)";
   o->newline() << "atomic_t " << vn << "_lock_skip_count;";
   o->newline() << "#endif\n";
 }
@@ -1700,6 +2056,36 @@ c_unparser::emit_module_init ()
   o->newline(1) << "goto out;";
   o->indent(-1);
 
+  o->newline() << "#ifdef STP_PROBE_PROFILE";
+  o->newline() << "rc = _stp_probe_profile_init();";
+  o->newline() << "if (rc != 0)";
+  o->newline(1) << "goto out;";
+  o->indent(-1);
+  o->newline() << "#endif";
+  if (!session->runtime_usermode_p())
+    {
+      o->newline() << "#if defined(STP_OVERLOAD) && defined(STP_OVERLOAD_SAMPLE)";
+      o->newline() << "rc = _stp_probe_sample_init();";
+      o->newline() << "if (rc != 0)";
+      o->newline(1) << "goto out;";
+      o->indent(-1);
+      o->newline() << "#endif";
+    }
+
+  // Under -t, report what the global arrays cost to set up.
+  bool have_global_maps = false;
+  for (unsigned i=0; i<session->globals.size(); i++)
+    if (session->globals[i]->index_types.size() > 0)
+      have_global_maps = true;
+  have_global_maps = have_global_maps && !session->runtime_usermode_p();
+
+  if (have_global_maps)
+    {
+      o->newline() << "#ifdef STP_TIMING";
+      o->newline() << "_stp_map_init_jiffies = jiffies;";
+      o->newline() << "#endif";
+    }
+
   for (unsigned i=0; i<session->globals.size(); i++)
     {
       vardecl* v = session->globals[i];
@@ -1718,11 +2104,20 @@ c_unparser::emit_module_init ()
       o->newline(-1) << "}";
 
       o->newline() << "global_lock_init(" << c_globalname (v->name) << ");";
-      o->newline() << "#ifdef STP_TIMING";
+      o->newline() << "#if defined(STP_TIMING) || defined(STP_PROBE_PROFILE)";
       o->newline() << "atomic_set(global_skipped(" << c_globalname (v->name) << "), 0);";
       o->newline() << "#endif";
     }
 
+  if (have_global_maps)
+    {
+      o->newline() << "#ifdef STP_TIMING";
+      o->newline() << "_stp_printf (\"maps: %lu kb of nodes preallocated in %u ms\\n\", "
+                   << "(unsigned long) _stp_map_init_bytes / 1024, "
+                   << "jiffies_to_msecs (jiffies - _stp_map_init_jiffies));";
+      o->newline() << "#endif";
+    }
+
   // Print a message to the kernel log about this module.  This is
   // intended to help debug problems with systemtap modules.
   if (! session->runtime_usermode_p())
@@ -1797,6 +2192,15 @@ c_unparser::emit_module_init ()
 
   // Free up the context memory after an error too
   o->newline() << "_stp_runtime_contexts_free();";
+  o->newline() << "#ifdef STP_PROBE_PROFILE";
+  o->newline() << "_stp_probe_profile_exit();";
+  o->newline() << "#endif";
+  if (!session->runtime_usermode_p())
+    {
+      o->newline() << "#if defined(STP_OVERLOAD) && defined(STP_OVERLOAD_SAMPLE)";
+      o->newline() << "_stp_probe_sample_exit();";
+      o->newline() << "#endif";
+    }
 
   o->newline() << "return rc;";
   o->newline(-1) << "}\n";
@@ -1881,8 +2285,11 @@ c_unparser::emit_module_exit ()
 	o->newline() << getvar (v).fini();
     }
 
-  // We're finished with the contexts.
+  // We're finished with the contexts, and with the probe profile.
   o->newline() << "_stp_runtime_contexts_free();";
+  o->newline() << "#ifdef STP_PROBE_PROFILE";
+  o->newline() << "_stp_probe_profile_exit();";
+  o->newline() << "#endif";
 
   // teardown gettimeofday (if needed)
   o->newline() << "#ifdef STAP_NEED_GETTIMEOFDAY";
@@ -1921,6 +2328,11 @@ c_unparser::emit_module_exit ()
   o->newline() << "_stp_stat_del (probe_timing(i));";
   o->newline(-1) << "}";
   o->newline() << "#endif"; // STP_TIMING
+  o->newline() << "#ifdef STP_PREFILTER";
+  o->newline() << "if (atomic_read (probe_prefiltered(i)))";
+  o->newline(1) << "_stp_printf (\"%s, (%s), filtered: %d, index: %d\\n\",";
+  o->newline(2) << "p->pp, p->location, atomic_read (probe_prefiltered(i)), i);";
+  o->newline(-3) << "#endif"; // STP_PREFILTER
   o->newline(-1) << "}";
   o->newline() << "_stp_print_flush();";
   o->newline() << "#endif";
@@ -1957,6 +2369,30 @@ c_unparser::emit_module_exit ()
   o->newline() << "_stp_print_flush();";
   o->newline(-1) << "}";
 
+  // print hits dropped by the sampling overload policy
+  if (!session->runtime_usermode_p())
+    {
+      o->newline() << "#if defined(STP_OVERLOAD) && defined(STP_OVERLOAD_SAMPLE)";
+      o->newline() << "{";
+      o->newline(1) << "unsigned long sampled = 0, probes = 0;";
+      o->newline() << "for (i = 0; i < ARRAY_SIZE(stap_probes); ++i) {";
+      o->newline(1) << "unsigned long ctr = _stp_probe_sample_sampled_out (i);";
+      o->newline() << "if (ctr) {";
+      o->newline(1) << "_stp_warn (\"Sampled out %s: %lu hits (final rate 1/%d)\\n\", "
+                   << "stap_probes[i].pp, ctr, 1 << atomic_read (probe_sample_shift(i)));";
+      o->newline() << "sampled += ctr;";
+      o->newline() << "probes++;";
+      o->newline(-1) << "}";
+      o->newline(-1) << "}";
+      o->newline() << "if (sampled)";
+      o->newline(1) << "_stp_warn (\"Number of sampled-out probe hits: %lu, in %lu probes\\n\", "
+                    << "sampled, probes);";
+      o->newline(-1) << "_stp_print_flush();";
+      o->newline() << "_stp_probe_sample_exit();";
+      o->newline(-1) << "}";
+      o->newline() << "#endif";
+    }
+
   // NB: PR13386 needs to restore preemption-blocking counts
   o->newline() << "preempt_enable_no_resched();";
 
@@ -1979,7 +2415,7 @@ c_unparser::emit_function (functiondecl* v)
   o->newline()
     << "struct " << c_funcname (v->name) << "_locals * "
     << " __restrict__ l = "
-    << "& c->locals[c->nesting+1]." << c_funcname (v->name) // NB: nesting+1
+    << "(struct " << c_funcname (v->name) << "_locals *) c->next_frame"
     << ";";
   o->newline() << "(void) l;"; // make sure "l" is marked used
   o->newline() << "#define CONTEXT c";
@@ -2000,7 +2436,8 @@ c_unparser::emit_function (functiondecl* v)
   // check/increment nesting level
   // NB: incoming c->nesting level will be -1 (if we're called directly from a probe),
   // or 0...N (if we're called from another function).  Incoming parameters are already
-  // stored in c->locals[c->nesting+1].  See also ::emit_common_header() for more.
+  // stored in the frame at c->next_frame, which is then pushed past this function's
+  // frame for its callees.  See also ::emit_function_frames() for more.
 
   o->newline() << "if (unlikely (c->nesting+1 >= MAXNESTING)) {";
   o->newline(1) << "c->last_error = ";
@@ -2008,6 +2445,7 @@ c_unparser::emit_function (functiondecl* v)
   o->newline() << "return;";
   o->newline(-1) << "} else {";
   o->newline(1) << "c->nesting ++;";
+  o->newline() << "c->next_frame += sizeof (*l);";
   o->newline(-1) << "}";
 
   // initialize locals
@@ -2040,7 +2478,8 @@ c_unparser::emit_function (functiondecl* v)
   o->newline(1) << "if (0) goto out;"; // make sure out: is marked used
 
   // Function prologue: this is why we redirect the "return" above.
-  // Decrement nesting level.
+  // Decrement nesting level, and pop our frame.
+  o->newline() << "c->next_frame -= sizeof (*l);";
   o->newline() << "c->nesting --;";
 
   o->newline() << "#undef CONTEXT";
@@ -2079,27 +2518,14 @@ c_unparser::emit_probe (derived_probe* v)
   //
   // which would make comparisons impossible.
   //
-  // --------------------------------------------------------------------------
-  // NB: see also c_unparser:emit_common_header(), which deliberately but sadly
-  // duplicates this calculation.
-  // --------------------------------------------------------------------------
+  // The duplicates were found by c_unparser::find_duplicate_probes(),
+  // for emit_common_header().
   //
-  ostringstream oss;
-
-  v->print_dupe_stamp (oss);
-  v->body->print(oss);
-
-  // Since the generated C changes based on whether or not the probe
-  // needs locks around global variables, this needs to be reflected
-  // here.  We don't want to treat as duplicate the handlers of
-  // begin/end and normal probes that differ only in need_global_locks.
-  oss << "# needs_global_locks: " << v->needs_global_locks () << endl;
-
   // If an identical probe has already been emitted, just call that
   // one.
-  if (probe_contents.count(oss.str()) != 0)
+  if (probe_dupes.count(v) != 0)
     {
-      string dupe = probe_contents[oss.str()];
+      string dupe = probe_dupes[v]->name;
 
       // NB: Elision of context variable structs is a separate
       // operation which has already taken place by now.
@@ -2135,8 +2561,6 @@ c_unparser::emit_probe (derived_probe* v)
       o->line () << "{";
       o->indent (1);
 
-      probe_contents[oss.str()] = v->name;
-
       o->newline() << "__label__ out;";
 
       // emit static read/write lock decls for global variables
@@ -2259,7 +2683,7 @@ c_unparser::emit_lock_decls(const varuse_collecting_visitor& vut)
       o->newline() << "{";
       o->newline(1) << ".lock = global_lock(" + c_globalname(v->name) + "),";
       o->newline() << ".write_p = " << (write_p ? 1 : 0) << ",";
-      o->newline() << "#ifdef STP_TIMING";
+      o->newline() << "#if defined(STP_TIMING) || defined(STP_PROBE_PROFILE)";
       o->newline() << ".skipped = global_skipped(" << c_globalname (v->name) << "),";
       o->newline() << "#endif";
       o->newline(-1) << "},";
@@ -2689,6 +3113,7 @@ void
 c_unparser::c_declare(exp_type ty, const string &ident)
 {
   o->newline() << c_typename (ty) << " " << ident << ";";
+  declared_size += estimated_size (ty);
 }
 
 
@@ -3999,13 +4424,33 @@ c_unparser::visit_comparison (comparison* e)
 }
 
 
+// Collect the operands of a chain of concatenations like a . b . c,
+// left to right, so that the whole chain is built in one temporary.
+static void
+flatten_concatenation (expression* e, vector<expression*>& operands)
+{
+  concatenation* c = dynamic_cast<concatenation*>(e);
+  if (c && c->op == ".")
+    {
+      flatten_concatenation (c->left, operands);
+      flatten_concatenation (c->right, operands);
+    }
+  else
+    operands.push_back (e);
+}
+
+
 void
 c_tmpcounter::visit_concatenation (concatenation* e)
 {
+  // NB: this must allocate tmps just as c_unparser::visit_concatenation
   tmpvar t = parent->gensym (e->type);
   t.declare (*parent);
-  e->left->visit (this);
-  e->right->visit (this);
+
+  vector<expression*> operands;
+  flatten_concatenation (e, operands);
+  for (unsigned i=0; i<operands.size(); i++)
+    operands[i]->visit (this);
 }
 
 
@@ -4015,18 +4460,29 @@ c_unparser::visit_concatenation (concatenation* e)
   if (e->op != ".")
     throw semantic_error (_("unexpected concatenation operator"), e->tok);
 
-  if (e->type != pe_string ||
-      e->left->type != pe_string ||
-      e->right->type != pe_string)
+  if (e->type != pe_string)
     throw semantic_error (_("expected string types"), e->tok);
 
+  vector<expression*> operands;
+  flatten_concatenation (e, operands);
+  for (unsigned i=0; i<operands.size(); i++)
+    if (operands[i]->type != pe_string)
+      throw semantic_error (_("expected string types"), operands[i]->tok);
+
   tmpvar t = gensym (e->type);
 
+  // Append each operand after the length so far, rather than strlcat
+  // each onto the growing result, which would rescan it every time.
   o->line() << "({ ";
   o->indent(1);
   // o->newline() << "c->last_stmt = " << lex_cast_qstring(*e->tok) << ";";
-  c_assign (t.value(), e->left, "assignment");
-  c_strcat (t.value(), e->right);
+  o->newline() << "size_t _len = 0;";
+  for (unsigned i=0; i<operands.size(); i++)
+    {
+      o->newline() << "_len = _stp_strlcat_at (" << t << ", _len, ";
+      operands[i]->visit (this);
+      o->line() << ");";
+    }
   o->newline() << t << ";";
   o->newline(-1) << "})";
 }
@@ -4730,12 +5186,14 @@ c_tmpcounter::visit_functioncall (functioncall *e)
 {
   assert (e->referent != 0);
   functiondecl* r = e->referent;
-  // one temporary per argument, unless literal numbers or strings
+  // one temporary per argument, unless literal numbers or strings,
+  // or locals passed by pointer
   for (unsigned i=0; i<r->formal_args.size(); i++)
     {
       tmpvar t = parent->gensym (r->formal_args[i]->type);
       if (e->args[i]->tok->type != tok_number
-	  && e->args[i]->tok->type != tok_string)
+	  && e->args[i]->tok->type != tok_string
+          && !parent->pass_by_pointer (e, i))
 	t.declare (*parent);
       e->args[i]->visit (this);
     }
@@ -4755,7 +5213,8 @@ c_unparser::visit_functioncall (functioncall* e)
 
   // NB: we store all actual arguments in temporary variables,
   // to avoid colliding sharing of context variables with
-  // nested function calls: f(f(f(1)))
+  // nested function calls: f(f(f(1))).  Strings passed by reference
+  // just point at them, or at literals and locals; see find_byref_args().
 
   // compute actual arguments
   vector<tmpvar> tmp;
@@ -4771,6 +5230,9 @@ c_unparser::visit_functioncall (functioncall* e)
       if (e->args[i]->tok->type == tok_number
 	  || e->args[i]->tok->type == tok_string)
 	t.override(c_expression(e->args[i]));
+      else if (pass_by_pointer (e, i))
+        t.override(getvar (static_cast<symbol*> (e->args[i])->referent,
+                           e->args[i]->tok).value());
       else
         {
 	  // o->newline() << "c->last_stmt = "
@@ -4788,13 +5250,13 @@ c_unparser::visit_functioncall (functioncall* e)
 	throw semantic_error (_("function argument type mismatch"),
 			      e->args[i]->tok, r->formal_args[i]->tok);
 
-      c_assign ("c->locals[c->nesting+1]." +
-		c_funcname (r->name) + "." +
-                c_localname (r->formal_args[i]->name),
-                tmp[i].value(),
-                e->args[i]->type,
-                "function actual argument copy",
-                e->args[i]->tok);
+      string arg = "((struct " + c_funcname (r->name) + "_locals *) c->next_frame)->" +
+                   c_localname (r->formal_args[i]->name);
+      if (byref_args.count (r->formal_args[i]))
+        o->newline() << arg << " = " << tmp[i].value() << ";";
+      else
+        c_assign (arg, tmp[i].value(), e->args[i]->type,
+                  "function actual argument copy", e->args[i]->tok);
     }
 
   // call function
@@ -4806,9 +5268,8 @@ c_unparser::visit_functioncall (functioncall* e)
     // If we passed typechecking, then nothing will use this return value
     o->newline() << "(void) 0;";
   else
-    o->newline() << "c->locals[c->nesting+1]"
-                 << "." << c_funcname (r->name)
-                 << ".__retvalue;";
+    o->newline() << "((struct " << c_funcname (r->name) << "_locals *) c->next_frame)"
+                 << "->__retvalue;";
 }
 
 
@@ -6231,9 +6692,13 @@ dump_unwindsyms (Dwfl_Module *m,
   // We always need to check the symbols of the kernel if we use it,
   // for the extra_offset (also used for build_ids) and possibly
   // stp_kretprobe_trampoline_addr for the dwarf unwinder.
+  // With --lazy-symbols, user-space modules only get their sections;
+  // stapio looks their symbols up in the binaries themselves.
+  bool lazy = (c->session.lazy_symbols && is_user_module (modname)
+               && ! c->session.runtime_usermode_p());
   c->addrmap.clear();
   if (res == DWARF_CB_OK
-      && (c->session.need_symbols || ! strcmp(name, "kernel")))
+      && ((c->session.need_symbols && ! lazy) || ! strcmp(name, "kernel")))
     res = dump_symbol_tables (m, c, name, base);
 
   c->debug_frame = NULL;
@@ -6541,6 +7006,180 @@ struct recursion_info: public traversing_visitor
 };
 
 
+// Pre-handler filters for process-scoped probes.  A probe body that
+// starts with "if (COND) next", or is just "if (COND) { ... }", where
+// COND only tests the current task through a few tapset functions, gets
+// COND compiled into a C predicate that the probe prologue checks before
+// taking a context.  The test is left in the body too, so hits that get
+// past the filter behave as before.
+
+struct prefilter_compiler: public throwing_visitor
+{
+  prefilter_compiler (systemtap_session& s):
+    throwing_visitor (_("unsupported prefilter element")), sess(s) {}
+  systemtap_session& sess;
+  ostringstream expr;
+
+  void visit_literal_number (literal_number* e)
+  {
+    if (e->value == -9223372036854775807LL-1) // PR 5023
+      expr << "((int64_t)" << (unsigned long long) e->value << "ULL)";
+    else
+      expr << "((int64_t)" << e->value << "LL)";
+  }
+
+  void visit_literal_string (literal_string* e)
+  {
+    // Escaped as c_unparser::visit_literal_string does.
+    const string& v = e->value;
+    expr << '"';
+    for (unsigned i=0; i<v.size(); i++)
+      if (v[i] == '"')
+        expr << '\\' << '"';
+      else
+        expr << v[i];
+    expr << '"';
+  }
+
+  void visit_functioncall (functioncall* e);
+
+  void visit_unary_expression (unary_expression* e)
+  {
+    if (e->op != "!" || e->operand->type != pe_long)
+      throwone (e->tok);
+    expr << "(!";
+    e->operand->visit (this);
+    expr << ")";
+  }
+
+  void visit_logical_or_expr (logical_or_expr* e) { logical (e); }
+  void visit_logical_and_expr (logical_and_expr* e) { logical (e); }
+
+  void logical (binary_expression* e)
+  {
+    if (e->left->type != pe_long || e->right->type != pe_long)
+      throwone (e->tok);
+    expr << "(";
+    e->left->visit (this);
+    expr << " " << e->op << " ";
+    e->right->visit (this);
+    expr << ")";
+  }
+
+  void visit_comparison (comparison* e)
+  {
+    if (e->left->type != e->right->type)
+      throwone (e->tok);
+    if (e->left->type == pe_string)
+      {
+        expr << "(strncmp (";
+        e->left->visit (this);
+        expr << ", ";
+        e->right->visit (this);
+        expr << ", MAXSTRINGLEN) " << e->op << " 0)";
+      }
+    else if (e->left->type == pe_long)
+      {
+        expr << "(";
+        e->left->visit (this);
+        expr << " " << e->op << " ";
+        e->right->visit (this);
+        expr << ")";
+      }
+    else
+      throwone (e->tok);
+  }
+};
+
+
+// The tapset functions a prefilter may call, recognized by their body
+// as well as their name, and what they read from the current task.
+static const struct {
+  const char *name;
+  const char *code;
+  const char *expr;
+} prefilter_functions[] = {
+  { "pid", "current->tgid", "((int64_t) current->tgid)" },
+  { "tid", "current->pid", "((int64_t) current->pid)" },
+  { "target", "_stp_target", "((int64_t) _stp_target)" },
+  { "execname", "current->comm", "current->comm" },
+};
+
+
+void
+prefilter_compiler::visit_functioncall (functioncall* e)
+{
+  functiondecl* fd = e->referent;
+  embeddedcode* ec = fd ? dynamic_cast<embeddedcode*>(fd->body) : NULL;
+  if (!ec || !e->args.empty() || fd->synthetic
+      || fd->tok->location.file->name == sess.user_file->name)
+    throwone (e->tok);
+
+  for (unsigned i=0; i<sizeof(prefilter_functions)/sizeof(prefilter_functions[0]); i++)
+    if (fd->name == prefilter_functions[i].name
+        && ec->code.find (prefilter_functions[i].code) != string::npos)
+      {
+        expr << prefilter_functions[i].expr;
+        return;
+      }
+  throwone (e->tok);
+}
+
+
+static bool
+is_next_statement (statement* s)
+{
+  block* b;
+  while ((b = dynamic_cast<block*>(s)) && b->statements.size() == 1)
+    s = b->statements[0];
+  return dynamic_cast<next_statement*>(s) != NULL;
+}
+
+
+// Returns the C predicate a hit of the probe must satisfy to run the
+// handler at all, or "" if the probe doesn't start with such a test.
+static string
+prefilter_condition (systemtap_session& s, derived_probe* p)
+{
+  if (s.runtime_usermode_p() || !p->prefilter_p())
+    return "";
+
+  // Find the first statement, and whether it's the only one.
+  statement* first = p->body;
+  bool sole = true;
+  block* b;
+  while ((b = dynamic_cast<block*>(first)) && !b->statements.empty())
+    {
+      if (b->statements.size() > 1)
+        sole = false;
+      first = b->statements[0];
+    }
+
+  if_statement* is = dynamic_cast<if_statement*>(first);
+  if (!is || is->elseblock || is->condition->type != pe_long)
+    return "";
+
+  bool negate;
+  if (is_next_statement (is->thenblock))
+    negate = true;
+  else if (sole)
+    negate = false;
+  else
+    return "";
+
+  prefilter_compiler pc (s);
+  try
+    {
+      is->condition->visit (&pc);
+    }
+  catch (const semantic_error&)
+    {
+      return "";
+    }
+  return negate ? ("!" + pc.expr.str()) : pc.expr.str();
+}
+
+
 void translate_runtime(systemtap_session& s)
 {
   s.op->newline() << "#define STAP_MSG_RUNTIME_H_01 "
@@ -6627,6 +7266,7 @@ translate_pass (systemtap_session& s)
                   (ri.recursive ? _(" recursive") : _(" non-recursive"))) << endl;
       unsigned nesting = ri.nesting_max + 1; /* to account for initial probe->function call */
       if (ri.recursive) nesting += 10;
+      cup.maxnesting = nesting;
 
       // This is at the very top of the file.
       // All "static" defines (not dependend on session state).
@@ -6659,9 +7299,30 @@ translate_pass (systemtap_session& s)
       if (s.timing)
 	s.op->newline() << "#define STP_TIMING";
 
+      // Pre-handler filters, which common_session_state.h needs to know
+      // about to count their hits.
+      vector<string> prefilters;
+      bool have_prefilters = false;
+      for (unsigned i=0; i<s.probes.size(); i++)
+        {
+          prefilters.push_back (prefilter_condition (s, s.probes[i]));
+          if (!prefilters.back().empty())
+            {
+              have_prefilters = true;
+              if (s.verbose > 1)
+                clog << _F("%s prefiltered by: %s", s.probes[i]->name.c_str(),
+                           prefilters.back().c_str()) << endl;
+            }
+        }
+      if (have_prefilters)
+	s.op->newline() << "#define STP_PREFILTER";
+
       if (s.need_unwind)
 	s.op->newline() << "#define STP_NEED_UNWIND_DATA 1";
 
+      if (s.lazy_symbols)
+	s.op->newline() << "#define STP_LAZY_SYMBOLS 1";
+
       // Emit the total number of probes (not regarding merged probe handlers)
       s.op->newline() << "#define STP_PROBE_COUNT " << s.probes.size();
 
@@ -6769,6 +7430,16 @@ translate_pass (systemtap_session& s)
         }
       s.op->assert_0_indent();
 
+      for (unsigned i=0; i<s.probes.size(); i++)
+        if (!prefilters[i].empty())
+          {
+            s.op->newline();
+            s.op->newline() << "static int stp_prefilter_" << i << " (void) {";
+            s.op->newline(1) << "return " << prefilters[i] << ";";
+            s.op->newline(-1) << "}";
+          }
+      s.op->assert_0_indent();
+
       // Let's find some stats for the embedded pp strings.  Maybe they
       // are small and uniform enough to justify putting char[MAX]'s into
       // the array instead of relocated char*'s.
@@ -6825,10 +7496,17 @@ translate_pass (systemtap_session& s)
       s.op->newline() << "#else";
       s.op->newline() << "#define STAP_PROBE_INIT_NAME(PN)";
       s.op->newline() << "#endif";
-      s.op->newline() << "#define STAP_PROBE_INIT(I, PH, PP, PN, L, D) "
+      s.op->newline() << "#ifdef STP_PREFILTER";
+      s.op->newline() << "int (* const prefilter) (void);";
+      s.op->newline() << "#define STAP_PROBE_INIT_PREFILTER(PF) .prefilter=(PF),";
+      s.op->newline() << "#else";
+      s.op->newline() << "#define STAP_PROBE_INIT_PREFILTER(PF)";
+      s.op->newline() << "#endif";
+      s.op->newline() << "#define STAP_PROBE_INIT(I, PH, PP, PN, L, D, PF) "
                       << "{ .index=(I), .ph=(PH), .pp=(PP), "
                       << "STAP_PROBE_INIT_NAME(PN) "
                       << "STAP_PROBE_INIT_TIMING(L, D) "
+                      << "STAP_PROBE_INIT_PREFILTER(PF) "
                       << "}";
       s.op->newline(-1) << "} static const stap_probes[] = {";
       s.op->indent(1);
@@ -6840,12 +7518,31 @@ translate_pass (systemtap_session& s)
                           << lex_cast_qstring (*p->sole_location()) << ", "
                           << lex_cast_qstring (*p->script_location()) << ", "
                           << lex_cast_qstring (p->tok->location) << ", "
-                          << lex_cast_qstring (p->derived_locations()) << "),";
+                          << lex_cast_qstring (p->derived_locations()) << ", "
+                          << (prefilters[i].empty() ? string ("NULL")
+                              : "&stp_prefilter_" + lex_cast (i)) << "),";
         }
       s.op->newline(-1) << "};";
       s.op->assert_0_indent();
 #undef CALCIT
 
+      // The live probe profile, which also reports each global's lock
+      // skip counter.
+      if (!s.runtime_usermode_p())
+        {
+          s.op->newline() << "#ifdef STP_PROBE_PROFILE";
+          s.op->newline() << "static const struct stp_global_lock_skip stp_global_lock_skips[] = {";
+          s.op->indent(1);
+          for (unsigned i=0; i<s.globals.size(); i++)
+            s.op->newline() << "{ " << lex_cast_qstring (s.globals[i]->name)
+                            << ", global_skipped(" << cup.c_globalname (s.globals[i]->name)
+                            << ") },";
+          s.op->newline(-1) << "};";
+          s.op->newline() << "#include \"linux/probe_profile.c\"";
+          s.op->newline() << "#endif";
+          s.op->assert_0_indent();
+        }
+
       if (s.runtime_usermode_p())
         {
           s.op->newline() << "static const char* stp_probe_point(size_t index) {";
@@ -39,6 +39,7 @@ extern "C" {
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
 #include <unistd.h>
 #include <regex.h>
 #include <stdarg.h>
@@ -868,6 +869,78 @@ kill_stap_spawn(int sig)
 }
 
 
+// Send strings over a socket as their count, then each one's length and
+// bytes.  MSG_NOSIGNAL keeps a peer that has gone away from raising
+// SIGPIPE, which our callers treat as an interrupt.
+bool
+write_string_vector(int fd, const vector<string>& strings)
+{
+  string buf;
+  uint32_t n = strings.size();
+  buf.append((const char *) &n, sizeof(n));
+  for (size_t i = 0; i < strings.size(); ++i)
+    {
+      n = strings[i].size();
+      buf.append((const char *) &n, sizeof(n));
+      buf.append(strings[i]);
+    }
+
+  size_t done = 0;
+  while (done < buf.size())
+    {
+      ssize_t rc = send(fd, buf.data() + done, buf.size() - done, MSG_NOSIGNAL);
+      if (rc < 0 && errno == EINTR)
+        continue;
+      if (rc <= 0)
+        return false;
+      done += rc;
+    }
+  return true;
+}
+
+
+static bool
+read_fully(int fd, void *buf, size_t size)
+{
+  size_t done = 0;
+  while (done < size)
+    {
+      ssize_t rc = read(fd, (char *) buf + done, size - done);
+      if (rc < 0 && errno == EINTR)
+        continue;
+      if (rc <= 0)
+        return false;
+      done += rc;
+    }
+  return true;
+}
+
+
+// Receive what write_string_vector() sent.  False at end of file, or
+// on anything malformed.
+bool
+read_string_vector(int fd, vector<string>& strings)
+{
+  const uint32_t max_size = 64 << 20;
+  uint32_t n;
+
+  strings.clear();
+  if (!read_fully(fd, &n, sizeof(n)) || n > max_size)
+    return false;
+  for (uint32_t i = 0; i < n; ++i)
+    {
+      uint32_t len;
+      if (!read_fully(fd, &len, sizeof(len)) || len > max_size)
+        return false;
+      string s(len, '\0');
+      if (len > 0 && !read_fully(fd, &s[0], len))
+        return false;
+      strings.push_back(s);
+    }
+  return true;
+}
+
+
 
 void assert_regexp_match (const string& name, const string& value, const string& re)
 {
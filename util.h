@@ -84,6 +84,8 @@ inline int stap_system(int verbose, const std::vector<std::string>& args,
 { return stap_system(verbose, args.front(), args, null_out, null_err); }
 int stap_system_read(int verbose, const std::vector<std::string>& args, std::ostream& out);
 int kill_stap_spawn(int sig);
+bool write_string_vector(int fd, const std::vector<std::string>& strings);
+bool read_string_vector(int fd, std::vector<std::string>& strings);
 void assert_regexp_match (const std::string& name, const std::string& value, const std::string& re);
 int regexp_match (const std::string& value, const std::string& re, std::vector<std::string>& matches);
 bool contains_glob_chars (const std::string &str);